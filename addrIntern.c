@@ -0,0 +1,298 @@
+/****************************************************************************
+ * Module:  addrIntern.c
+ *
+ ****************************************************************************/
+#include "addrIntern.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/** private interface ********************************************************/
+static ui32 hashAddress( const uchar *address );
+static ui32 findSlot( const struct addrIntern *ai, const uchar *address, ui32 *slot );
+static int  grow( struct addrIntern *ai );
+
+/** public interface *********************************************************/
+struct addrIntern *	aiCreate( ui32 capacity );
+void				aiDestroy( struct addrIntern *ai );
+void				aiReset( struct addrIntern *ai );
+ui32				aiIntern( struct addrIntern *ai, const uchar *address );
+ui32				aiFind( const struct addrIntern *ai, const uchar *address );
+void				aiRelease( struct addrIntern *ai, ui32 id );
+const uchar *		aiGet( const struct addrIntern *ai, ui32 id );
+ui32				aiCount( const struct addrIntern *ai );
+
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * aiCreate()
+ *---------------------------------------------------------------------------*/
+struct addrIntern * aiCreate( ui32 capacity )
+{
+	struct addrIntern  *ai;
+	
+	/* con una potencia de dos el hueco se calcula con una mscara */
+	if( capacity < 2  ||  ( capacity & ( capacity - 1 )) != 0  ||  capacity > AI_MAX_ADDRESSES )
+	{
+		printf( "aiCreate: capacity must be a power of two up to %d\n", AI_MAX_ADDRESSES );
+		return NULL;
+	}
+	
+	ai = calloc( 1, sizeof( *ai ));
+	if( ai == NULL )
+		return NULL;
+	
+	ai->capacity  = capacity;
+	ai->mask      = capacity * 2 - 1;
+	ai->addresses = malloc( (size_t)capacity * AI_ADDRESS_SIZE );
+	ai->refs      = calloc( capacity, sizeof( ui32 ));
+	ai->slots     = calloc( ai->mask + 1, sizeof( ui32 ));
+	if( ai->addresses == NULL  ||  ai->refs == NULL  ||  ai->slots == NULL )
+	{
+		aiDestroy( ai );
+		return NULL;
+	}
+	ai->count = 1;		/* el 0 es AI_NONE */
+	
+	return ai;
+}
+
+/*-----------------------------------------------------------------------------
+ * aiDestroy()
+ *---------------------------------------------------------------------------*/
+void aiDestroy( struct addrIntern *ai )
+{
+	if( ai == NULL )
+		return;
+	
+	free( ai->addresses );
+	free( ai->refs );
+	free( ai->slots );
+	free( ai );
+}
+
+/*-----------------------------------------------------------------------------
+ * aiReset()
+ *---------------------------------------------------------------------------*/
+void aiReset( struct addrIntern *ai )
+{
+	assert( ai != NULL );
+	
+	/* los identificadores dados dejan de valer; se conserva la memoria */
+	memset( ai->slots, 0, (size_t)( ai->mask + 1 ) * sizeof( ui32 ));
+	memset( ai->refs, 0, (size_t)ai->capacity * sizeof( ui32 ));
+	ai->count    = 1;
+	ai->freeList = AI_NONE;
+	ai->live     = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * aiIntern()
+ *---------------------------------------------------------------------------*/
+ui32 aiIntern( struct addrIntern *ai, const uchar *address )
+{
+	ui32  slot, id;
+	
+	assert( ai      != NULL );
+	assert( address != NULL );
+	
+	id = findSlot( ai, address, &slot );
+	if( id != AI_NONE )
+	{
+		ai->refs[id]++;
+		return id;
+	}
+	
+	/* no estaba: antes que estrenar uno se reutiliza uno soltado, que
+	   guarda en su direccin el siguiente de la lista */
+	if( ai->freeList != AI_NONE )
+	{
+		id = ai->freeList;
+		memcpy( &ai->freeList, ai->addresses[id], sizeof( ui32 ));
+	}
+	else if( ai->count == ai->capacity )
+	{
+		if( grow( ai ) != 0 )
+		{
+			ai->full++;
+			return AI_NONE;
+		}
+		return aiIntern( ai, address );
+	}
+	else
+		id = ai->count++;
+	
+	memcpy( ai->addresses[id], address, AI_ADDRESS_SIZE );
+	ai->slots[slot] = id;
+	ai->refs[id]    = 1;
+	ai->live++;
+	
+	return id;
+}
+
+/*-----------------------------------------------------------------------------
+ * aiFind()
+ *---------------------------------------------------------------------------*/
+ui32 aiFind( const struct addrIntern *ai, const uchar *address )
+{
+	ui32  slot;
+	
+	assert( ai      != NULL );
+	assert( address != NULL );
+	
+	/* solo busca: no toma referencia ni da identificadores */
+	return findSlot( ai, address, &slot );
+}
+
+/*-----------------------------------------------------------------------------
+ * aiRelease()
+ *---------------------------------------------------------------------------*/
+void aiRelease( struct addrIntern *ai, ui32 id )
+{
+	ui32  i, j, home;
+	
+	assert( ai != NULL );
+	assert( id != AI_NONE  &&  id < ai->count  &&  ai->refs[id] > 0 );
+	
+	if( --ai->refs[id] > 0 )
+		return;
+	
+	/* la quitamos del hash desplazando hacia atrs las que vienen detrs,
+	   para que ninguna cadena de sondeo quede cortada por el hueco */
+	for( i = hashAddress( ai->addresses[id] ) & ai->mask; ai->slots[i] != id; i = ( i + 1 ) & ai->mask )
+		;
+	for( j = ( i + 1 ) & ai->mask; ai->slots[j] != AI_NONE; j = ( j + 1 ) & ai->mask )
+	{
+		home = hashAddress( ai->addresses[ ai->slots[j] ] ) & ai->mask;
+		if((( j - home ) & ai->mask ) >= (( j - i ) & ai->mask ))
+		{
+			ai->slots[i] = ai->slots[j];
+			i = j;
+		}
+	}
+	ai->slots[i] = AI_NONE;
+	
+	/* y el identificador queda para la prxima direccin */
+	memcpy( ai->addresses[id], &ai->freeList, sizeof( ui32 ));
+	ai->freeList = id;
+	ai->live--;
+}
+
+/*-----------------------------------------------------------------------------
+ * aiGet()
+ *---------------------------------------------------------------------------*/
+const uchar * aiGet( const struct addrIntern *ai, ui32 id )
+{
+	assert( ai != NULL );
+	
+	if( id == AI_NONE  ||  id >= ai->count  ||  ai->refs[id] == 0 )
+		return NULL;
+	
+	return ai->addresses[id];
+}
+
+/*-----------------------------------------------------------------------------
+ * aiCount()
+ *---------------------------------------------------------------------------*/
+ui32 aiCount( const struct addrIntern *ai )
+{
+	assert( ai != NULL );
+	
+	return ai->live;
+}
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * hashAddress()
+ *---------------------------------------------------------------------------*/
+static ui32 hashAddress( const uchar *address )
+{
+	ui64  a, b;
+	
+	/* las dos mitades se juntan y se mezclan con el final de murmur3: una
+	   multiplicacin solo lleva los bits hacia arriba, as que sin los
+	   desplazamientos las direcciones que cambian en los ltimos bytes (que
+	   en memoria son los altos) daran todas los mismos bits bajos */
+	memcpy( &a, address, 8 );
+	memcpy( &b, address + 8, 8 );
+	a = ( a * 0x9e3779b97f4a7c15ULL ) ^ b;
+	a = ( a ^ ( a >> 33 )) * 0xff51afd7ed558ccdULL;
+	a = ( a ^ ( a >> 33 )) * 0xc4ceb9fe1a85ec53ULL;
+	a ^= a >> 33;
+	
+	return (ui32)a;
+}
+
+/*-----------------------------------------------------------------------------
+ * findSlot()
+ *---------------------------------------------------------------------------*/
+static ui32 findSlot( const struct addrIntern *ai, const uchar *address, ui32 *slot )
+{
+	ui32  i, id;
+	
+	/* sondeo lineal: como mucho la mitad de los huecos est ocupada; si no
+	   est, *slot es el hueco donde habra que meterla */
+	for( i = hashAddress( address ) & ai->mask; ( id = ai->slots[i] ) != AI_NONE; i = ( i + 1 ) & ai->mask )
+	{
+		if( memcmp( ai->addresses[id], address, AI_ADDRESS_SIZE ) == 0 )
+			break;
+	}
+	
+	*slot = i;
+	return id;
+}
+
+/*-----------------------------------------------------------------------------
+ * grow()
+ *---------------------------------------------------------------------------*/
+static int grow( struct addrIntern *ai )
+{
+	uchar	(*addresses)[AI_ADDRESS_SIZE];
+	ui32	*refs, *slots, mask, slot, id;
+	
+	if( ai->capacity >= AI_MAX_ADDRESSES )
+		return -1;
+	
+	addresses = realloc( ai->addresses, (size_t)ai->capacity * 2 * AI_ADDRESS_SIZE );
+	if( addresses == NULL )
+		return -1;
+	ai->addresses = addresses;
+	
+	refs = realloc( ai->refs, (size_t)ai->capacity * 2 * sizeof( ui32 ));
+	if( refs == NULL )
+		return -1;
+	memset( refs + ai->capacity, 0, (size_t)ai->capacity * sizeof( ui32 ));
+	ai->refs = refs;
+	
+	mask  = ai->mask * 2 + 1;
+	slots = calloc( mask + 1, sizeof( ui32 ));
+	if( slots == NULL )
+		return -1;
+	
+	/* los identificadores no cambian, solo su hueco; los soltados no
+	   estn en el hash */
+	for( id = 1; id < ai->count; id++ )
+	{
+		if( ai->refs[id] == 0 )
+			continue;
+		for( slot = hashAddress( ai->addresses[id] ) & mask; slots[slot] != AI_NONE; slot = ( slot + 1 ) & mask )
+			;
+		slots[slot] = id;
+	}
+	
+	free( ai->slots );
+	ai->slots     = slots;
+	ai->mask      = mask;
+	ai->capacity *= 2;
+	
+	return 0;
+}
+
+/****************************************************************************
+ * End of addrIntern.c
+ ****************************************************************************/
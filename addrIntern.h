@@ -0,0 +1,56 @@
+/****************************************************************************
+ * Module:  addrIntern
+ *
+ ****************************************************************************/
+#ifndef _ADDRINTERN_H_
+#define _ADDRINTERN_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define AI_ADDRESS_SIZE			16			/* direcciones IPv6 */
+#define AI_DEFAULT_ADDRESSES	1024		/* capacidad inicial, crece al doble */
+#define AI_MAX_ADDRESSES		( 1 << 25 )	/* dos por conexin con CNT_MAX_CONNECTIONS */
+#define AI_NONE					0			/* identificador que no es de nadie */
+
+/** public types *************************************************************/
+/*******
+ * addrIntern
+ *
+ * Guarda cada direccin larga una sola vez y le da un identificador de 32
+ * bits, que es lo que llevan las claves de las conexiones. Cada conexin
+ * que usa una direccin tiene una referencia; cuando se suelta la ltima el
+ * identificador vuelve a darse. Sin cerrojos propios: lo protege el de la
+ * tabla de conexiones que lo usa.
+ *******/
+struct addrIntern
+{
+	uchar				(*addresses)[AI_ADDRESS_SIZE];	/* por identificador; la 0 no se usa */
+	ui32				*refs;			/* referencias por identificador, 0 si libre */
+	ui32				 count;			/* identificadores estrenados, contando el 0 */
+	ui32				 capacity;		/* direcciones que caben en addresses */
+	ui32				 freeList;		/* identificadores soltados, AI_NONE si no hay */
+	ui32				 live;			/* identificadores con alguna referencia */
+	
+	ui32				*slots;			/* hash abierto de identificadores, 0 si libre */
+	ui32				 mask;			/* slots tiene mask + 1 huecos, siempre el doble de capacity */
+	
+	ui64				 full;			/* direcciones rechazadas por llegar a AI_MAX_ADDRESSES */
+};
+
+/** public interface *********************************************************/
+struct addrIntern *	aiCreate( ui32 capacity );
+void				aiDestroy( struct addrIntern *ai );
+void				aiReset( struct addrIntern *ai );
+
+ui32				aiIntern( struct addrIntern *ai, const uchar *address );
+ui32				aiFind( const struct addrIntern *ai, const uchar *address );
+void				aiRelease( struct addrIntern *ai, ui32 id );
+const uchar *		aiGet( const struct addrIntern *ai, ui32 id );
+ui32				aiCount( const struct addrIntern *ai );
+
+
+#endif  /* _ADDRINTERN_H_ */
+/****************************************************************************
+ * End of addrIntern.h
+ ****************************************************************************/
@@ -0,0 +1,1424 @@
+/****************************************************************************
+ * Module:  bpfFilter.c
+ *
+ ****************************************************************************/
+#include "bpfFilter.h"
+#include "packetStruct.h"
+#include "packetBuilder.h"
+#include "pcapFile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <netdb.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+
+/** defines ******************************************************************/
+#define MAX_NODES			128			/* nodos del rbol de la expresin */
+#define MAX_LABELS			(MAX_NODES * 4)
+#define MAX_TOKEN			64
+
+/* desplazamientos dentro de la cabecera IPv4; dnde empieza depende del enlace */
+#define OFF_IP_FRAG			6
+#define OFF_IP_PROTO		9
+#define OFF_IP_SRC			12
+#define OFF_IP_DST			16
+
+/* direcciones de las primitivas */
+#define DIR_SRC				1
+#define DIR_DST				2
+#define DIR_ANY				( DIR_SRC | DIR_DST )
+
+/* memoria del programa de reparto */
+#define FM_ADDR_A			0			/* extremos, sin ordenar */
+#define FM_ADDR_B			1
+#define FM_PORT_A			2
+#define FM_PORT_B			3
+#define FM_PROTO			4
+#define FM_VLAN				5
+#define FM_HASH				6
+#define FM_VLAN_SET			7			/* ya hay VLAN del flujo */
+#define FM_OFFSET			8			/* cabecera IPv6, para devolverla a X */
+#define FM_TEMP				9
+#define FM_FLAGS			10			/* de GRE o GENEVE */
+#define FM_INNER			11			/* protocolo de dentro del tnel */
+#define FANOUT_MAX_TAGS		8			/* etiquetas VLAN o MPLS, como DLL_MAX_TAGS */
+
+/* tneles que abre, los mismos que el decodificador */
+#define GRE_CHECKSUM		0x8000
+#define GRE_ROUTING			0x4000
+#define GRE_KEY				0x2000
+#define GRE_SEQUENCE		0x1000
+#define GRE_VERSION			0x0007
+#define VXLAN_PORT			4789
+#define VXLAN_VNI_VALID		0x08
+#define GENEVE_PORT			6081
+
+/** private types ************************************************************/
+/*******
+ * eNodeType
+ *******/
+enum eNodeType
+{
+	NT_AND,
+	NT_OR,
+	NT_NOT,
+	NT_HOST,		/* direccin IPv4 */
+	NT_NET,			/* red IPv4 con mscara */
+	NT_PORT,		/* puerto TCP o UDP */
+	NT_PROTO,		/* protocolo IP */
+	NT_ETHER		/* tipo de trama Ethernet */
+};
+
+/*******
+ * eLinkKind
+ *
+ * Cmo se sabe qu protocolo de red lleva la trama en cada tipo de enlace.
+ *******/
+enum eLinkKind
+{
+	LK_ETHERTYPE,	/* Ethernet y Linux cooked: ethertype en typeOffset */
+	LK_FAMILY,		/* loopback de BSD: familia de direcciones en 32 bits */
+	LK_VERSION		/* IP sin enlace: la versin en el primer byte */
+};
+
+/*******
+ * node
+ *******/
+struct node
+{
+	enum eNodeType		 type;
+	int					 left, right;	/* hijos de and/or/not */
+	uchar				 dir;			/* DIR_SRC o DIR_DST en las hojas */
+	ui32				 value;
+	ui32				 mask;
+};
+
+/*******
+ * insn
+ *******/
+struct insn
+{
+	ui16				 code;
+	ui32				 k;
+	int					 jt, jf;		/* etiquetas destino de los saltos condicionales */
+};
+
+/*******
+ * compiler
+ *******/
+struct compiler
+{
+	const char			*pos;			/* siguiente carcter de la expresin */
+	char				 token[ MAX_TOKEN ];
+
+	struct node			 nodes[ MAX_NODES ];
+	int					 nodeCount;
+
+	struct insn			 insns[ BPF_MAX_INSNS ];
+	int					 insnCount;
+	int					 labels[ MAX_LABELS ];	/* instruccin a la que apunta cada etiqueta */
+	int					 labelCount;
+
+	/* forma del enlace, de bpfCompile() */
+	enum eLinkKind		 linkKind;
+	ui32				 typeOffset;
+	ui32				 ipOffset;
+
+	char				*err;
+	int					 errLen;
+	uchar				 bError;
+};
+
+/** private interface ********************************************************/
+static void setError( struct compiler *c, const char *fmt, ... );
+static void nextToken( struct compiler *c );
+static int  isToken( struct compiler *c, const char *a, const char *b );
+static int  newNode( struct compiler *c, enum eNodeType type, int left, int right );
+static int  newLeaf( struct compiler *c, enum eNodeType type, uchar dir, ui32 value, ui32 mask );
+static int  parseHost( struct compiler *c, ui32 *addr );
+static int  parseNet( struct compiler *c, ui32 *net, ui32 *mask );
+static int  parsePort( struct compiler *c, ui32 *port );
+static int  parseProto( struct compiler *c, ui32 *proto );
+static int  parsePrimitive( struct compiler *c );
+static int  parseNot( struct compiler *c );
+static int  parseAnd( struct compiler *c );
+static int  parseOr( struct compiler *c );
+static int  newLabel( struct compiler *c );
+static void placeLabel( struct compiler *c, int label );
+static void emit( struct compiler *c, ui16 code, ui32 k );
+static void emitJump( struct compiler *c, ui16 code, ui32 k, int jt, int jf );
+static void emitJumpIf( struct compiler *c, ui16 code, ui32 k, int label );
+static void emitGoto( struct compiler *c, int label );
+static int  setLink( struct compiler *c, ui32 linkType );
+static void genNetwork( struct compiler *c, ui32 ethertype, int labelTrue, int labelFalse );
+static void genIpv4( struct compiler *c, int labelFalse );
+static void genLeaf( struct compiler *c, const struct node *n, int labelTrue, int labelFalse );
+static void gen( struct compiler *c, int idx, int labelTrue, int labelFalse );
+static void genFanoutSkip( struct compiler *c, ui32 bytes );
+static void genFanoutFold( struct compiler *c, ui32 offset );
+static void genFanoutTags( struct compiler *c, int labelIp4, int labelIp6 );
+static void genFanoutNetwork( struct compiler *c, int labelIp4, int labelIp6, int labelHash, int labelTunnels );
+static void genFanoutTunnels( struct compiler *c, int labelTunnels, int labelInner, int labelHash );
+static void genFanoutHash( struct compiler *c, int labelHash );
+static int  resolve( struct compiler *c, struct bpfProgram *prog );
+
+/** public interface *********************************************************/
+int		bpfCompile( const char *expr, ui32 snaplen, ui32 linkType, struct bpfProgram *prog, char *err, int errLen );
+int		bpfFanout( uchar bInnerTunnels, struct bpfProgram *prog, char *err, int errLen );
+ui32	bpfRun( const struct bpfProgram *prog, const uchar *data, ui32 caplen, ui32 len );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * setError()
+ *---------------------------------------------------------------------------*/
+static void setError( struct compiler *c, const char *fmt, ... )
+{
+	va_list  ap;
+
+	/* nos quedamos con el primer error */
+	if( c->bError )
+		return;
+	c->bError = TRUE;
+
+	va_start( ap, fmt );
+	vsnprintf( c->err, c->errLen, fmt, ap );
+	va_end( ap );
+}
+
+/*-----------------------------------------------------------------------------
+ * nextToken()
+ *---------------------------------------------------------------------------*/
+static void nextToken( struct compiler *c )
+{
+	int  len = 0;
+
+	while( *c->pos == ' '  ||  *c->pos == '\t' )
+		c->pos++;
+
+	/* operadores de uno y dos caracteres */
+	if( *c->pos == '('  ||  *c->pos == ')'  ||  *c->pos == '!' )
+	{
+		c->token[ len++ ] = *c->pos++;
+	}
+	else if(( c->pos[0] == '&'  &&  c->pos[1] == '&' )  ||  ( c->pos[0] == '|'  &&  c->pos[1] == '|' ))
+	{
+		c->token[ len++ ] = *c->pos++;
+		c->token[ len++ ] = *c->pos++;
+	}
+	else
+	{
+		while( *c->pos != '\0'  &&  strchr( " \t()!&|", *c->pos ) == NULL )
+		{
+			if( len == MAX_TOKEN - 1 )
+			{
+				setError( c, "token too long" );
+				break;
+			}
+			c->token[ len++ ] = *c->pos++;
+		}
+	}
+
+	c->token[ len ] = '\0';
+}
+
+/*-----------------------------------------------------------------------------
+ * isToken()
+ *---------------------------------------------------------------------------*/
+static int isToken( struct compiler *c, const char *a, const char *b )
+{
+	return  strcmp( c->token, a ) == 0  ||  ( b != NULL  &&  strcmp( c->token, b ) == 0 );
+}
+
+/*-----------------------------------------------------------------------------
+ * newNode()
+ *---------------------------------------------------------------------------*/
+static int newNode( struct compiler *c, enum eNodeType type, int left, int right )
+{
+	struct node  *n;
+
+	if( c->bError )
+		return -1;
+	if( c->nodeCount == MAX_NODES )
+	{
+		setError( c, "expression too long" );
+		return -1;
+	}
+
+	n = &c->nodes[ c->nodeCount ];
+	memset( n, 0, sizeof( *n ));
+	n->type  = type;
+	n->left  = left;
+	n->right = right;
+
+	return  c->nodeCount++;
+}
+
+/*-----------------------------------------------------------------------------
+ * newLeaf()
+ *---------------------------------------------------------------------------*/
+static int newLeaf( struct compiler *c, enum eNodeType type, uchar dir, ui32 value, ui32 mask )
+{
+	int  idx;
+
+	/* sin direccin es "src or dst" */
+	if( dir == DIR_ANY )
+		return  newNode( c, NT_OR, newLeaf( c, type, DIR_SRC, value, mask ),
+								   newLeaf( c, type, DIR_DST, value, mask ));
+
+	idx = newNode( c, type, -1, -1 );
+	if( idx >= 0 )
+	{
+		c->nodes[ idx ].dir   = dir;
+		c->nodes[ idx ].value = value;
+		c->nodes[ idx ].mask  = mask;
+	}
+
+	return  idx;
+}
+
+/*-----------------------------------------------------------------------------
+ * parseHost()
+ *---------------------------------------------------------------------------*/
+static int parseHost( struct compiler *c, ui32 *addr )
+{
+	struct in_addr  in;
+
+	if( inet_pton( AF_INET, c->token, &in ) != 1 )
+	{
+		setError( c, "invalid host '%s'", c->token );
+		return -1;
+	}
+
+	/* el BPF carga las palabras en orden de host */
+	*addr = ntohl( in.s_addr );
+	nextToken( c );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * parseNet()
+ *---------------------------------------------------------------------------*/
+static int parseNet( struct compiler *c, ui32 *net, ui32 *mask )
+{
+	const char  *p = c->token;
+	char        *end;
+	ui32         octet, bits = 0;
+	long         len = -1;
+
+	/* a.b.c.d/len, o solo los primeros octetos como en "net 10.1" */
+	*net = 0;
+	while( bits < 32 )
+	{
+		octet = strtoul( p, &end, 10 );
+		if( end == p  ||  octet > 255 )
+			break;
+		*net |= octet << ( 24 - bits );
+		bits += 8;
+		p     = end;
+		if( *p != '.' )
+			break;
+		p++;
+	}
+	if( *p == '/' )
+	{
+		len = strtol( p + 1, &end, 10 );
+		p   = end;
+	}
+
+	if( bits == 0  ||  *p != '\0'  ||  len > 32  ||  ( len < 0  &&  len != -1 ))
+	{
+		setError( c, "invalid net '%s'", c->token );
+		return -1;
+	}
+	if( len == -1 )
+		len = bits;
+
+	*mask = len == 0 ? 0 : 0xffffffff << ( 32 - len );
+	*net &= *mask;
+	nextToken( c );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * parsePort()
+ *---------------------------------------------------------------------------*/
+static int parsePort( struct compiler *c, ui32 *port )
+{
+	struct servent  *se;
+	char            *end;
+
+	*port = strtoul( c->token, &end, 10 );
+	if( end == c->token  ||  *end != '\0' )
+	{
+		/* tambin admitimos nombres de servicio */
+		se = getservbyname( c->token, NULL );
+		if( se == NULL )
+		{
+			setError( c, "invalid port '%s'", c->token );
+			return -1;
+		}
+		*port = ntohs( se->s_port );
+	}
+	if( *port > 65535 )
+	{
+		setError( c, "invalid port '%s'", c->token );
+		return -1;
+	}
+
+	nextToken( c );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * parseProto()
+ *---------------------------------------------------------------------------*/
+static int parseProto( struct compiler *c, ui32 *proto )
+{
+	struct protoent  *pe;
+	char             *end;
+
+	*proto = strtoul( c->token, &end, 10 );
+	if( end == c->token  ||  *end != '\0' )
+	{
+		pe = getprotobyname( c->token );
+		if( pe == NULL )
+		{
+			setError( c, "invalid protocol '%s'", c->token );
+			return -1;
+		}
+		*proto = pe->p_proto;
+	}
+	if( *proto > 255 )
+	{
+		setError( c, "invalid protocol '%s'", c->token );
+		return -1;
+	}
+
+	nextToken( c );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * parsePrimitive()
+ *---------------------------------------------------------------------------*/
+static int parsePrimitive( struct compiler *c )
+{
+	uchar  dir = DIR_ANY;
+	ui32   value, mask;
+
+	if( c->bError )
+		return -1;
+
+	/* direccin opcional */
+	if( isToken( c, "src", NULL ))
+	{
+		dir = DIR_SRC;
+		nextToken( c );
+	}
+	else if( isToken( c, "dst", NULL ))
+	{
+		dir = DIR_DST;
+		nextToken( c );
+	}
+
+	if( isToken( c, "host", NULL ))
+	{
+		nextToken( c );
+		if( parseHost( c, &value ) == -1 )
+			return -1;
+		return  newLeaf( c, NT_HOST, dir, value, 0xffffffff );
+	}
+	if( isToken( c, "net", NULL ))
+	{
+		nextToken( c );
+		if( parseNet( c, &value, &mask ) == -1 )
+			return -1;
+		return  newLeaf( c, NT_NET, dir, value, mask );
+	}
+	if( isToken( c, "port", NULL ))
+	{
+		nextToken( c );
+		if( parsePort( c, &value ) == -1 )
+			return -1;
+		return  newLeaf( c, NT_PORT, dir, value, 0 );
+	}
+	if( dir != DIR_ANY )
+	{
+		setError( c, "expected host, net or port after src/dst" );
+		return -1;
+	}
+
+	if( isToken( c, "proto", NULL ))
+	{
+		nextToken( c );
+		if( parseProto( c, &value ) == -1 )
+			return -1;
+		return  newLeaf( c, NT_PROTO, DIR_SRC, value, 0 );
+	}
+
+	/* atajos de protocolo */
+	value = isToken( c, "tcp",  NULL ) ? IPPROTO_TCP :
+			isToken( c, "udp",  NULL ) ? IPPROTO_UDP :
+			isToken( c, "icmp", NULL ) ? IPPROTO_ICMP : 0;
+	if( value != 0 )
+	{
+		nextToken( c );
+		return  newLeaf( c, NT_PROTO, DIR_SRC, value, 0 );
+	}
+
+	value = isToken( c, "ip",  NULL ) ? ETH_P_IP :
+			isToken( c, "arp", NULL ) ? ETH_P_ARP : 0;
+	if( value != 0 )
+	{
+		nextToken( c );
+		return  newLeaf( c, NT_ETHER, DIR_SRC, value, 0 );
+	}
+
+	if( c->token[0] == '\0' )
+		setError( c, "unexpected end of expression" );
+	else
+		setError( c, "unexpected '%s'", c->token );
+	return -1;
+}
+
+/*-----------------------------------------------------------------------------
+ * parseNot()
+ *---------------------------------------------------------------------------*/
+static int parseNot( struct compiler *c )
+{
+	int  n;
+
+	if( isToken( c, "not", "!" ))
+	{
+		nextToken( c );
+		return  newNode( c, NT_NOT, parseNot( c ), -1 );
+	}
+
+	if( isToken( c, "(", NULL ))
+	{
+		nextToken( c );
+		n = parseOr( c );
+		if( !isToken( c, ")", NULL ))
+		{
+			setError( c, "missing ')'" );
+			return -1;
+		}
+		nextToken( c );
+		return  n;
+	}
+
+	return  parsePrimitive( c );
+}
+
+/*-----------------------------------------------------------------------------
+ * parseAnd()
+ *---------------------------------------------------------------------------*/
+static int parseAnd( struct compiler *c )
+{
+	int  n;
+
+	n = parseNot( c );
+	while( !c->bError  &&  isToken( c, "and", "&&" ))
+	{
+		nextToken( c );
+		n = newNode( c, NT_AND, n, parseNot( c ));
+	}
+
+	return  n;
+}
+
+/*-----------------------------------------------------------------------------
+ * parseOr()
+ *---------------------------------------------------------------------------*/
+static int parseOr( struct compiler *c )
+{
+	int  n;
+
+	n = parseAnd( c );
+	while( !c->bError  &&  isToken( c, "or", "||" ))
+	{
+		nextToken( c );
+		n = newNode( c, NT_OR, n, parseAnd( c ));
+	}
+
+	return  n;
+}
+
+/*-----------------------------------------------------------------------------
+ * newLabel()
+ *---------------------------------------------------------------------------*/
+static int newLabel( struct compiler *c )
+{
+	if( c->labelCount == MAX_LABELS )
+	{
+		setError( c, "expression too long" );
+		return 0;
+	}
+
+	c->labels[ c->labelCount ] = -1;
+	return  c->labelCount++;
+}
+
+/*-----------------------------------------------------------------------------
+ * placeLabel()
+ *---------------------------------------------------------------------------*/
+static void placeLabel( struct compiler *c, int label )
+{
+	/* la etiqueta apunta a la siguiente instruccin que se genere */
+	c->labels[ label ] = c->insnCount;
+}
+
+/*-----------------------------------------------------------------------------
+ * emit()
+ *---------------------------------------------------------------------------*/
+static void emit( struct compiler *c, ui16 code, ui32 k )
+{
+	emitJump( c, code, k, -1, -1 );
+}
+
+/*-----------------------------------------------------------------------------
+ * emitJump()
+ *---------------------------------------------------------------------------*/
+static void emitJump( struct compiler *c, ui16 code, ui32 k, int jt, int jf )
+{
+	struct insn  *in;
+
+	if( c->insnCount == BPF_MAX_INSNS )
+	{
+		setError( c, "expression too long" );
+		return;
+	}
+
+	in = &c->insns[ c->insnCount++ ];
+	in->code = code;
+	in->k    = k;
+	in->jt   = jt;
+	in->jf   = jf;
+}
+
+/*-----------------------------------------------------------------------------
+ * emitJumpIf()
+ *---------------------------------------------------------------------------*/
+static void emitJumpIf( struct compiler *c, ui16 code, ui32 k, int label )
+{
+	int  next = newLabel( c );
+
+	/* si se cumple a label, si no a la siguiente instruccin */
+	emitJump( c, code, k, label, next );
+	placeLabel( c, next );
+}
+
+/*-----------------------------------------------------------------------------
+ * emitGoto()
+ *---------------------------------------------------------------------------*/
+static void emitGoto( struct compiler *c, int label )
+{
+	/* el salto incondicional lleva 32 bits y llega a donde no llegan los otros */
+	emitJump( c, BPF_JMP | BPF_JA, 0, label, label );
+}
+
+/*-----------------------------------------------------------------------------
+ * setLink()
+ *---------------------------------------------------------------------------*/
+static int setLink( struct compiler *c, ui32 linkType )
+{
+	/* los mismos tipos que entiende buildSetLinkType() */
+	switch( linkType )
+	{
+		case PCAP_LINKTYPE_ETHERNET:
+			c->linkKind = LK_ETHERTYPE;  c->typeOffset = 12;  c->ipOffset = ETHERII_HEADER_LENGTH;
+			break;
+		case PCAP_LINKTYPE_LINUX_SLL:
+			c->linkKind = LK_ETHERTYPE;  c->typeOffset = 14;  c->ipOffset = SLL_HEADER_LENGTH;
+			break;
+		case PCAP_LINKTYPE_LINUX_SLL2:
+			c->linkKind = LK_ETHERTYPE;  c->typeOffset = 0;   c->ipOffset = SLL2_HEADER_LENGTH;
+			break;
+		case PCAP_LINKTYPE_NULL:
+		case PCAP_LINKTYPE_LOOP:
+			c->linkKind = LK_FAMILY;     c->typeOffset = 0;   c->ipOffset = LOOPBACK_HEADER_LENGTH;
+			break;
+		case PCAP_LINKTYPE_RAW:
+		case PCAP_LINKTYPE_IPV4:
+		case PCAP_LINKTYPE_IPV6:
+			c->linkKind = LK_VERSION;    c->typeOffset = 0;   c->ipOffset = 0;
+			break;
+		default:
+			setError( c, "unsupported link type %u", linkType );
+			return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * genNetwork()
+ *---------------------------------------------------------------------------*/
+static void genNetwork( struct compiler *c, ui32 ethertype, int labelTrue, int labelFalse )
+{
+	static const ui32  families6[] = { 10, 24, 28, 30 };	/* AF_INET6 en Linux y los BSD */
+	int                i, next;
+
+	switch( c->linkKind )
+	{
+		case LK_ETHERTYPE:
+			emit( c, BPF_LD | BPF_H | BPF_ABS, c->typeOffset );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ethertype, labelTrue, labelFalse );
+			return;
+
+		case LK_VERSION:
+			if( ethertype != ETH_P_IP  &&  ethertype != ETH_P_IPV6 )
+				break;
+			emit( c, BPF_LD | BPF_B | BPF_ABS, c->ipOffset );
+			emit( c, BPF_ALU | BPF_AND | BPF_K, 0xf0 );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ethertype == ETH_P_IP ? 0x40 : 0x60, labelTrue, labelFalse );
+			return;
+
+		case LK_FAMILY:
+			/* la familia puede ir en cualquier orden de bytes */
+			if( ethertype != ETH_P_IP  &&  ethertype != ETH_P_IPV6 )
+				break;
+			emit( c, BPF_LD | BPF_W | BPF_ABS, c->typeOffset );
+			for( i = 0; i < ( ethertype == ETH_P_IP ? 1 : 4 ); i++ )
+			{
+				next = newLabel( c );
+				emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ethertype == ETH_P_IP ? 2 : families6[i], labelTrue, next );
+				placeLabel( c, next );
+				next = newLabel( c );
+				emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ( ethertype == ETH_P_IP ? 2 : families6[i] ) << 24, labelTrue, next );
+				placeLabel( c, next );
+			}
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, 0, labelFalse, labelFalse );
+			return;
+	}
+
+	/* ese protocolo no puede ir sobre este enlace: nunca se cumple */
+	emit( c, BPF_LD | BPF_IMM, 0 );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, 1, labelTrue, labelFalse );
+}
+
+/*-----------------------------------------------------------------------------
+ * genIpv4()
+ *---------------------------------------------------------------------------*/
+static void genIpv4( struct compiler *c, int labelFalse )
+{
+	int  next = newLabel( c );
+
+	genNetwork( c, ETH_P_IP, next, labelFalse );
+	placeLabel( c, next );
+}
+
+/*-----------------------------------------------------------------------------
+ * genLeaf()
+ *---------------------------------------------------------------------------*/
+static void genLeaf( struct compiler *c, const struct node *n, int labelTrue, int labelFalse )
+{
+	int  tcpOrUdp, notTcp, notFragment;
+
+	switch( n->type )
+	{
+		case NT_ETHER:
+			genNetwork( c, n->value, labelTrue, labelFalse );
+			break;
+
+		case NT_PROTO:
+			genIpv4( c, labelFalse );
+			emit( c, BPF_LD | BPF_B | BPF_ABS, c->ipOffset + OFF_IP_PROTO );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, n->value, labelTrue, labelFalse );
+			break;
+
+		case NT_HOST:
+		case NT_NET:
+			genIpv4( c, labelFalse );
+			emit( c, BPF_LD | BPF_W | BPF_ABS, c->ipOffset + ( n->dir == DIR_SRC ? OFF_IP_SRC : OFF_IP_DST ));
+			if( n->mask != 0xffffffff )
+				emit( c, BPF_ALU | BPF_AND | BPF_K, n->mask );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, n->value, labelTrue, labelFalse );
+			break;
+
+		case NT_PORT:
+			/* TCP o UDP, primer fragmento, y el puerto tras la cabecera IP de longitud variable */
+			tcpOrUdp    = newLabel( c );
+			notTcp      = newLabel( c );
+			notFragment = newLabel( c );
+			genIpv4( c, labelFalse );
+			emit( c, BPF_LD | BPF_B | BPF_ABS, c->ipOffset + OFF_IP_PROTO );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, tcpOrUdp, notTcp );
+			placeLabel( c, notTcp );
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, tcpOrUdp, labelFalse );
+			placeLabel( c, tcpOrUdp );
+			emit( c, BPF_LD | BPF_H | BPF_ABS, c->ipOffset + OFF_IP_FRAG );
+			emitJump( c, BPF_JMP | BPF_JSET | BPF_K, 0x1fff, labelFalse, notFragment );
+			placeLabel( c, notFragment );
+			emit( c, BPF_LDX | BPF_B | BPF_MSH, c->ipOffset );
+			emit( c, BPF_LD | BPF_H | BPF_IND, c->ipOffset + ( n->dir == DIR_SRC ? 0 : 2 ));
+			emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, n->value, labelTrue, labelFalse );
+			break;
+
+		default:
+			assert( FALSE );
+			break;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * gen()
+ *---------------------------------------------------------------------------*/
+static void gen( struct compiler *c, int idx, int labelTrue, int labelFalse )
+{
+	const struct node  *n = &c->nodes[ idx ];
+	int                 next;
+
+	if( c->bError )
+		return;
+
+	/* cada nodo salta a labelTrue o labelFalse, siempre hacia delante */
+	switch( n->type )
+	{
+		case NT_AND:
+			next = newLabel( c );
+			gen( c, n->left, next, labelFalse );
+			placeLabel( c, next );
+			gen( c, n->right, labelTrue, labelFalse );
+			break;
+
+		case NT_OR:
+			next = newLabel( c );
+			gen( c, n->left, labelTrue, next );
+			placeLabel( c, next );
+			gen( c, n->right, labelTrue, labelFalse );
+			break;
+
+		case NT_NOT:
+			gen( c, n->left, labelFalse, labelTrue );
+			break;
+
+		default:
+			genLeaf( c, n, labelTrue, labelFalse );
+			break;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutSkip()
+ *---------------------------------------------------------------------------*/
+static void genFanoutSkip( struct compiler *c, ui32 bytes )
+{
+	/* X avanza y A se conserva */
+	emit( c, BPF_ST, FM_TEMP );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_K, bytes );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_TEMP );
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutFold()
+ *---------------------------------------------------------------------------*/
+static void genFanoutFold( struct compiler *c, ui32 offset )
+{
+	int  i;
+
+	/* foldAddress() de los 16 bytes en offset + X; X es la cabecera, as
+	   que el acumulado va por memoria y X se recupera de FM_OFFSET */
+	emit( c, BPF_LD | BPF_W | BPF_IND, SKF_NET_OFF + offset );
+	for( i = 1; i < 4; i++ )
+	{
+		emit( c, BPF_ALU | BPF_MUL | BPF_K, FLOW_HASH_MUL );
+		emit( c, BPF_ST, FM_TEMP );
+		emit( c, BPF_LDX | BPF_MEM, FM_OFFSET );
+		emit( c, BPF_LD | BPF_W | BPF_IND, SKF_NET_OFF + offset + i * 4 );
+		emit( c, BPF_LDX | BPF_MEM, FM_TEMP );
+		emit( c, BPF_ALU | BPF_ADD | BPF_X, 0 );
+	}
+	emit( c, BPF_LDX | BPF_MEM, FM_OFFSET );
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutTags()
+ *---------------------------------------------------------------------------*/
+static void genFanoutTags( struct compiler *c, int labelIp4, int labelIp6 )
+{
+	int  i, vlan, mpls, known, bottom, ip4, ip6, next, done;
+
+	/* decodeTags() en BPF: A es el ethertype y X dnde empieza lo que
+	   describe. Sin bucles, cada etiqueta es una copia y los saltos largos
+	   son incondicionales; la primera VLAN es la del flujo si el kernel no
+	   quit ninguna */
+	done = newLabel( c );
+	for( i = 0; i < FANOUT_MAX_TAGS; i++ )
+	{
+		vlan   = newLabel( c );
+		mpls   = newLabel( c );
+		known  = newLabel( c );
+		bottom = newLabel( c );
+		ip4    = newLabel( c );
+		ip6    = newLabel( c );
+		next   = newLabel( c );
+
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021Q, vlan );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_8021AD, vlan );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_QINQ1, vlan );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_MPLS_UC, mpls );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_MPLS_MC, mpls );
+		emitGoto( c, done );
+
+		/* VLAN: TCI y el ethertype siguiente */
+		placeLabel( c, vlan );
+		emit( c, BPF_LD | BPF_MEM, FM_VLAN_SET );
+		emitJumpIf( c, BPF_JMP | BPF_JGT | BPF_K, 0, known );
+		emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF );
+		emit( c, BPF_ALU | BPF_AND | BPF_K, VLAN_ID_MASK );
+		emit( c, BPF_ST, FM_VLAN );
+		emit( c, BPF_LD | BPF_IMM, 1 );
+		emit( c, BPF_ST, FM_VLAN_SET );
+		placeLabel( c, known );
+		emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 2 );
+		genFanoutSkip( c, 4 );
+		emitGoto( c, next );
+
+		/* MPLS: la pila acaba en la etiqueta con S y lo de debajo se deduce
+		   de la versin IP */
+		placeLabel( c, mpls );
+		emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF + 2 );
+		genFanoutSkip( c, 4 );
+		emitJumpIf( c, BPF_JMP | BPF_JSET | BPF_K, 1, bottom );
+		emit( c, BPF_LD | BPF_IMM, ETH_P_MPLS_UC );
+		emitGoto( c, next );
+		placeLabel( c, bottom );
+		emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF );
+		emit( c, BPF_ALU | BPF_RSH | BPF_K, 4 );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, 4, ip4 );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, 6, ip6 );
+		emit( c, BPF_RET | BPF_K, 0 );
+		placeLabel( c, ip4 );
+		emitGoto( c, labelIp4 );
+		placeLabel( c, ip6 );
+		emitGoto( c, labelIp6 );
+
+		placeLabel( c, next );
+	}
+
+	/* lo que no es IP, o va tras demasiadas etiquetas, va todo al primero */
+	placeLabel( c, done );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, labelIp4 );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, labelIp6 );
+	emit( c, BPF_RET | BPF_K, 0 );
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutNetwork()
+ *---------------------------------------------------------------------------*/
+static void genFanoutNetwork( struct compiler *c, int labelIp4, int labelIp6, int labelHash, int labelTunnels )
+{
+	int  transport = newLabel( c );
+	int  ports     = newLabel( c );
+
+	/* IPv4: los puertos detrs de las opciones */
+	placeLabel( c, labelIp4 );
+	emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF + 9 );
+	emit( c, BPF_ST, FM_PROTO );
+	emit( c, BPF_LD | BPF_W | BPF_IND, SKF_NET_OFF + 12 );
+	emit( c, BPF_ST, FM_ADDR_A );
+	emit( c, BPF_LD | BPF_W | BPF_IND, SKF_NET_OFF + 16 );
+	emit( c, BPF_ST, FM_ADDR_B );
+	emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF );
+	emit( c, BPF_ALU | BPF_AND | BPF_K, 0xf );
+	emit( c, BPF_ALU | BPF_LSH | BPF_K, 2 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_X, 0 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emitGoto( c, transport );
+
+	/* IPv6, sin recorrer cabeceras de extensin */
+	placeLabel( c, labelIp6 );
+	emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF + 6 );
+	emit( c, BPF_ST, FM_PROTO );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ST, FM_OFFSET );
+	genFanoutFold( c, 8 );
+	emit( c, BPF_ST, FM_ADDR_A );
+	genFanoutFold( c, 24 );
+	emit( c, BPF_ST, FM_ADDR_B );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_K, 40 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+
+	/* X es ya la cabecera de transporte */
+	placeLabel( c, transport );
+	emit( c, BPF_LD | BPF_MEM, FM_PROTO );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, ports );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, ports );
+	if( labelTunnels >= 0 )
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_GRE, labelTunnels );
+	emitGoto( c, labelHash );
+	placeLabel( c, ports );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF );
+	emit( c, BPF_ST, FM_PORT_A );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 2 );
+	emit( c, BPF_ST, FM_PORT_B );
+	if( labelTunnels >= 0 )
+		emitGoto( c, labelTunnels );
+	else
+		emitGoto( c, labelHash );
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutTunnels()
+ *---------------------------------------------------------------------------*/
+static void genFanoutTunnels( struct compiler *c, int labelTunnels, int labelInner, int labelHash )
+{
+	static const ui32  greOptions[] = { GRE_CHECKSUM, GRE_KEY, GRE_SEQUENCE };
+	int                gre, udp, vxlan, geneve, outer, commit, known, next, i;
+
+	gre    = newLabel( c );
+	udp    = newLabel( c );
+	vxlan  = newLabel( c );
+	geneve = newLabel( c );
+	outer  = newLabel( c );
+	commit = newLabel( c );
+
+	/* decodeTunnel() con X en la cabecera de transporte; lo que no se abre
+	   se reparte por las cabeceras de fuera, como hace el decodificador */
+	placeLabel( c, labelTunnels );
+	emit( c, BPF_LD | BPF_MEM, FM_PROTO );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_GRE, gre );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, udp, outer );
+
+	/* GRE versin 0: las partes opcionales van en orden tras los flags */
+	placeLabel( c, gre );
+	known = newLabel( c );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF );
+	emit( c, BPF_ST, FM_FLAGS );
+	emitJumpIf( c, BPF_JMP | BPF_JSET | BPF_K, GRE_ROUTING | GRE_VERSION, outer );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 2 );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_TEB, known );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, known );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, known, outer );
+	placeLabel( c, known );
+	emit( c, BPF_ST, FM_INNER );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_K, 4 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	for( i = 0; i < (int)( sizeof( greOptions ) / sizeof( greOptions[0] )); i++ )
+	{
+		next = newLabel( c );
+		emit( c, BPF_LD | BPF_MEM, FM_FLAGS );
+		emit( c, BPF_ALU | BPF_AND | BPF_K, greOptions[i] );
+		emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, 0, next );
+		emit( c, BPF_MISC | BPF_TXA, 0 );
+		emit( c, BPF_ALU | BPF_ADD | BPF_K, 4 );
+		emit( c, BPF_MISC | BPF_TAX, 0 );
+		placeLabel( c, next );
+	}
+	emitGoto( c, commit );
+
+	/* por UDP, solo al puerto de destino conocido */
+	placeLabel( c, udp );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_B );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, VXLAN_PORT, vxlan );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, GENEVE_PORT, geneve, outer );
+
+	/* VXLAN: flags, VNI de 24 bits y siempre ethernet detrs */
+	placeLabel( c, vxlan );
+	emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF + 8 );
+	emit( c, BPF_ALU | BPF_AND | BPF_K, VXLAN_VNI_VALID );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, 0, outer );
+	emit( c, BPF_LD | BPF_IMM, ETH_P_TEB );
+	emit( c, BPF_ST, FM_INNER );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_K, 16 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emitGoto( c, commit );
+
+	/* GENEVE: como VXLAN pero con opciones y el protocolo de dentro */
+	placeLabel( c, geneve );
+	known = newLabel( c );
+	emit( c, BPF_LD | BPF_B | BPF_IND, SKF_NET_OFF + 8 );
+	emit( c, BPF_ST, FM_FLAGS );
+	emitJumpIf( c, BPF_JMP | BPF_JSET | BPF_K, 0xc0, outer );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 10 );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_TEB, known );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, known );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IPV6, known, outer );
+	placeLabel( c, known );
+	emit( c, BPF_ST, FM_INNER );
+	emit( c, BPF_LD | BPF_MEM, FM_FLAGS );
+	emit( c, BPF_ALU | BPF_AND | BPF_K, 0x3f );
+	emit( c, BPF_ALU | BPF_LSH | BPF_K, 2 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_K, 16 );
+	emit( c, BPF_ALU | BPF_ADD | BPF_X, 0 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emitGoto( c, commit );
+
+	placeLabel( c, outer );
+	emitGoto( c, labelHash );
+
+	/* decodeInner(): desde aqu manda el paquete de dentro, menos la VLAN */
+	placeLabel( c, commit );
+	next = newLabel( c );
+	emit( c, BPF_LD | BPF_IMM, 0 );
+	emit( c, BPF_ST, FM_PORT_A );
+	emit( c, BPF_ST, FM_PORT_B );
+	emit( c, BPF_LD | BPF_MEM, FM_INNER );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_K, ETH_P_TEB, next, labelInner );
+	placeLabel( c, next );
+	emit( c, BPF_LD | BPF_H | BPF_IND, SKF_NET_OFF + 12 );
+	genFanoutSkip( c, 14 );
+	placeLabel( c, labelInner );
+}
+
+/*-----------------------------------------------------------------------------
+ * genFanoutHash()
+ *---------------------------------------------------------------------------*/
+static void genFanoutHash( struct compiler *c, int labelHash )
+{
+	int  ports = newLabel( c );
+	int  swap  = newLabel( c );
+	int  mix   = newLabel( c );
+
+	/* el extremo menor primero, por direccin y luego por puerto */
+	placeLabel( c, labelHash );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_B );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_A );
+	emitJumpIf( c, BPF_JMP | BPF_JGT | BPF_X, 0, swap );
+	emitJump( c, BPF_JMP | BPF_JEQ | BPF_X, 0, ports, mix );
+	placeLabel( c, ports );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_B );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_A );
+	emitJump( c, BPF_JMP | BPF_JGT | BPF_X, 0, swap, mix );
+	placeLabel( c, swap );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_A );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_B );
+	emit( c, BPF_ST, FM_ADDR_A );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ST, FM_ADDR_B );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_A );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_B );
+	emit( c, BPF_ST, FM_PORT_A );
+	emit( c, BPF_MISC | BPF_TXA, 0 );
+	emit( c, BPF_ST, FM_PORT_B );
+
+	/* h = a * MUL ^ b, luego los puertos y luego protocolo y VLAN */
+	placeLabel( c, mix );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_A );
+	emit( c, BPF_ALU | BPF_MUL | BPF_K, FLOW_HASH_MUL );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_ADDR_B );
+	emit( c, BPF_ALU | BPF_XOR | BPF_X, 0 );
+	emit( c, BPF_ALU | BPF_MUL | BPF_K, FLOW_HASH_MUL );
+	emit( c, BPF_ST, FM_HASH );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_A );
+	emit( c, BPF_ALU | BPF_LSH | BPF_K, 16 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_PORT_B );
+	emit( c, BPF_ALU | BPF_OR | BPF_X, 0 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_HASH );
+	emit( c, BPF_ALU | BPF_XOR | BPF_X, 0 );
+	emit( c, BPF_ALU | BPF_MUL | BPF_K, FLOW_HASH_MUL );
+	emit( c, BPF_ST, FM_HASH );
+	emit( c, BPF_LD | BPF_MEM, FM_PROTO );
+	emit( c, BPF_ALU | BPF_LSH | BPF_K, 16 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_VLAN );
+	emit( c, BPF_ALU | BPF_OR | BPF_X, 0 );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_LD | BPF_MEM, FM_HASH );
+	emit( c, BPF_ALU | BPF_XOR | BPF_X, 0 );
+
+	/* mezcla final */
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_ALU | BPF_RSH | BPF_K, 15 );
+	emit( c, BPF_ALU | BPF_XOR | BPF_X, 0 );
+	emit( c, BPF_ALU | BPF_MUL | BPF_K, FLOW_HASH_FINAL );
+	emit( c, BPF_MISC | BPF_TAX, 0 );
+	emit( c, BPF_ALU | BPF_RSH | BPF_K, 13 );
+	emit( c, BPF_ALU | BPF_XOR | BPF_X, 0 );
+	emit( c, BPF_RET | BPF_A, 0 );
+}
+
+/*-----------------------------------------------------------------------------
+ * resolve()
+ *---------------------------------------------------------------------------*/
+static int resolve( struct compiler *c, struct bpfProgram *prog )
+{
+	struct insn  *in;
+	int           i, jt, jf;
+
+	for( i = 0; i < c->insnCount; i++ )
+	{
+		in = &c->insns[i];
+		prog->insns[i].code = in->code;
+		prog->insns[i].k    = in->k;
+		prog->insns[i].jt   = 0;
+		prog->insns[i].jf   = 0;
+
+		if( in->jt < 0 )
+			continue;
+		if( BPF_OP( in->code ) == BPF_JA  &&  BPF_CLASS( in->code ) == BPF_JMP )
+		{
+			prog->insns[i].k = c->labels[ in->jt ] - ( i + 1 );
+			continue;
+		}
+
+		/* los saltos condicionales del BPF clsico son de 8 bits */
+		jt = c->labels[ in->jt ] - ( i + 1 );
+		jf = c->labels[ in->jf ] - ( i + 1 );
+		if( jt < 0  ||  jt > 255  ||  jf < 0  ||  jf > 255 )
+		{
+			setError( c, "expression too complex" );
+			return -1;
+		}
+		prog->insns[i].jt = jt;
+		prog->insns[i].jf = jf;
+	}
+
+	prog->len = c->insnCount;
+	return 0;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * bpfCompile()
+ *---------------------------------------------------------------------------*/
+int bpfCompile( const char *expr, ui32 snaplen, ui32 linkType, struct bpfProgram *prog, char *err, int errLen )
+{
+	struct compiler  *c;
+	int               root, accept, reject, res;
+
+	assert( expr != NULL );
+	assert( prog != NULL );
+
+	c = calloc( 1, sizeof( *c ));
+	if( c == NULL )
+	{
+		snprintf( err, errLen, "out of memory" );
+		return -1;
+	}
+	c->pos    = expr;
+	c->err    = err;
+	c->errLen = errLen;
+	if( setLink( c, linkType ) == -1 )
+	{
+		free( c );
+		return -1;
+	}
+
+	/* una expresin vaca lo acepta todo */
+	nextToken( c );
+	root = -1;
+	if( c->token[0] != '\0' )
+	{
+		root = parseOr( c );
+		if( !c->bError  &&  c->token[0] != '\0' )
+			setError( c, "unexpected '%s'", c->token );
+	}
+
+	accept = newLabel( c );
+	reject = newLabel( c );
+	if( root >= 0 )
+		gen( c, root, accept, reject );
+
+	/* lo que devuelve el programa es lo que se copia de cada trama: el snaplen */
+	placeLabel( c, accept );
+	emit( c, BPF_RET | BPF_K, snaplen != 0 ? snaplen : BPF_ACCEPT_LEN );
+	if( root >= 0 )
+	{
+		placeLabel( c, reject );
+		emit( c, BPF_RET | BPF_K, 0 );
+	}
+
+	res = c->bError ? -1 : resolve( c, prog );
+
+	free( c );
+	return  res;
+}
+
+/*-----------------------------------------------------------------------------
+ * bpfFanout()
+ *---------------------------------------------------------------------------*/
+int bpfFanout( uchar bInnerTunnels, struct bpfProgram *prog, char *err, int errLen )
+{
+	struct compiler  *c;
+	int               ip4, ip6, innerIp4, innerIp6, inner, tunnels, hash, novlan, res;
+
+	assert( prog != NULL );
+
+	c = calloc( 1, sizeof( *c ));
+	if( c == NULL )
+	{
+		snprintf( err, errLen, "out of memory" );
+		return -1;
+	}
+	c->err    = err;
+	c->errLen = errLen;
+
+	/* buildFlowHash() en BPF clsico: el kernel da cada trama al socket
+	   hash % sockets, as el hilo de un flujo sale del mismo hash con el que
+	   luego se busca en su tabla. Las cargas son relativas a la cabecera de
+	   red (SKF_NET_OFF), que vale para cualquier enlace y en los dos
+	   sentidos, y X recorre las etiquetas y los tneles que haya encima */
+	ip4     = newLabel( c );
+	ip6     = newLabel( c );
+	hash    = newLabel( c );
+	novlan  = newLabel( c );
+	tunnels = bInnerTunnels ? newLabel( c ) : -1;
+
+	/* VLAN que quit el kernel, 0 si no haba */
+	emit( c, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT );
+	emit( c, BPF_ST, FM_VLAN_SET );
+	emitJumpIf( c, BPF_JMP | BPF_JEQ | BPF_K, 0, novlan );
+	emit( c, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG );
+	emit( c, BPF_ALU | BPF_AND | BPF_K, VLAN_ID_MASK );
+	placeLabel( c, novlan );
+	emit( c, BPF_ST, FM_VLAN );
+	emit( c, BPF_LD | BPF_IMM, 0 );
+	emit( c, BPF_ST, FM_PORT_A );
+	emit( c, BPF_ST, FM_PORT_B );
+	emit( c, BPF_LDX | BPF_IMM, 0 );
+	emit( c, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL );
+
+	genFanoutTags( c, ip4, ip6 );
+	genFanoutNetwork( c, ip4, ip6, hash, tunnels );
+
+	/* lo de dentro del tnel se recorre con una segunda copia, que ya no
+	   abre tneles: el decodificador solo baja un nivel */
+	if( bInnerTunnels )
+	{
+		inner    = newLabel( c );
+		innerIp4 = newLabel( c );
+		innerIp6 = newLabel( c );
+		genFanoutTunnels( c, tunnels, inner, hash );
+		genFanoutTags( c, innerIp4, innerIp6 );
+		genFanoutNetwork( c, innerIp4, innerIp6, hash, -1 );
+	}
+	genFanoutHash( c, hash );
+
+	res = c->bError ? -1 : resolve( c, prog );
+
+	free( c );
+	return  res;
+}
+
+/*-----------------------------------------------------------------------------
+ * bpfRun()
+ *---------------------------------------------------------------------------*/
+ui32 bpfRun( const struct bpfProgram *prog, const uchar *data, ui32 caplen, ui32 len )
+{
+	const struct sock_filter  *in;
+	ui32                       a = 0, x = 0, mem[ BPF_MEMWORDS ];
+	ui32                       pc, off, size;
+
+	assert( prog != NULL );
+
+	/* intrprete del BPF clsico, para los motores sin filtro en el kernel */
+	memset( mem, 0, sizeof( mem ));
+	for( pc = 0; pc < prog->len; pc++ )
+	{
+		in = &prog->insns[ pc ];
+
+		switch( BPF_CLASS( in->code ))
+		{
+			case BPF_LD:
+			case BPF_LDX:
+				if( BPF_MODE( in->code ) == BPF_IMM )
+					off = in->k;
+				else if( BPF_MODE( in->code ) == BPF_LEN )
+					off = len;
+				else if( BPF_MODE( in->code ) == BPF_MEM )
+					off = mem[ in->k & ( BPF_MEMWORDS - 1 ) ];
+				else
+				{
+					/* carga de la trama: fuera de lo capturado se descarta */
+					off  = in->k;
+					if( BPF_MODE( in->code ) == BPF_IND )
+						off += x;
+					size = BPF_SIZE( in->code ) == BPF_W ? 4 : BPF_SIZE( in->code ) == BPF_H ? 2 : 1;
+					if( off < in->k  ||  off + size > caplen  ||  off + size < off )
+						return 0;
+
+					if( BPF_MODE( in->code ) == BPF_MSH )
+						off = ( data[ off ] & 0xf ) << 2;
+					else if( size == 4 )
+						off = (ui32)data[off] << 24 | (ui32)data[off + 1] << 16 | (ui32)data[off + 2] << 8 | data[off + 3];
+					else if( size == 2 )
+						off = (ui32)data[off] << 8 | data[off + 1];
+					else
+						off = data[off];
+				}
+
+				if( BPF_CLASS( in->code ) == BPF_LD )
+					a = off;
+				else
+					x = off;
+				break;
+
+			case BPF_ST:
+				mem[ in->k & ( BPF_MEMWORDS - 1 ) ] = a;
+				break;
+
+			case BPF_STX:
+				mem[ in->k & ( BPF_MEMWORDS - 1 ) ] = x;
+				break;
+
+			case BPF_ALU:
+				off = BPF_SRC( in->code ) == BPF_X ? x : in->k;
+				switch( BPF_OP( in->code ))
+				{
+					case BPF_ADD:	a += off;									break;
+					case BPF_SUB:	a -= off;									break;
+					case BPF_MUL:	a *= off;									break;
+					case BPF_DIV:	if( off == 0 ) return 0;  a /= off;			break;
+					case BPF_MOD:	if( off == 0 ) return 0;  a %= off;			break;
+					case BPF_AND:	a &= off;									break;
+					case BPF_OR:	a |= off;									break;
+					case BPF_XOR:	a ^= off;									break;
+					case BPF_LSH:	a = off < 32 ? a << off : 0;				break;
+					case BPF_RSH:	a = off < 32 ? a >> off : 0;				break;
+					case BPF_NEG:	a = -a;										break;
+					default:		return 0;
+				}
+				break;
+
+			case BPF_JMP:
+				off = BPF_SRC( in->code ) == BPF_X ? x : in->k;
+				switch( BPF_OP( in->code ))
+				{
+					case BPF_JA:	pc += in->k;								break;
+					case BPF_JEQ:	pc += a == off ? in->jt : in->jf;			break;
+					case BPF_JGT:	pc += a >  off ? in->jt : in->jf;			break;
+					case BPF_JGE:	pc += a >= off ? in->jt : in->jf;			break;
+					case BPF_JSET:	pc += ( a & off ) ? in->jt : in->jf;		break;
+					default:		return 0;
+				}
+				break;
+
+			case BPF_RET:
+				return  BPF_RVAL( in->code ) == BPF_A ? a : in->k;
+
+			case BPF_MISC:
+				if( BPF_MISCOP( in->code ) == BPF_TAX )
+					x = a;
+				else
+					a = x;
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/****************************************************************************
+ * End of bpfFilter.c
+ ****************************************************************************/
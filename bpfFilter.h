@@ -0,0 +1,34 @@
+/****************************************************************************
+ * Module:  bpfFilter
+ *
+ ****************************************************************************/
+#ifndef _BPFFILTER_H_
+#define _BPFFILTER_H_
+
+#include <linux/filter.h>
+#include "types.h"
+
+/** defines ******************************************************************/
+#define BPF_MAX_INSNS			1024		/* instrucciones por programa */
+#define BPF_ACCEPT_LEN			262144		/* bytes que devolvemos al aceptar sin snaplen */
+
+/** public types *************************************************************/
+/*******
+ * bpfProgram
+ *******/
+struct bpfProgram
+{
+	ui16				 len;			/* instrucciones usadas, 1 si no filtra nada */
+	struct sock_filter	 insns[ BPF_MAX_INSNS ];
+};
+
+/** public interface *********************************************************/
+int		bpfCompile( const char *expr, ui32 snaplen, ui32 linkType, struct bpfProgram *prog, char *err, int errLen );
+int		bpfFanout( uchar bInnerTunnels, struct bpfProgram *prog, char *err, int errLen );
+ui32	bpfRun( const struct bpfProgram *prog, const uchar *data, ui32 caplen, ui32 len );
+
+
+#endif  /* _BPFFILTER_H_ */
+/****************************************************************************
+ * End of bpfFilter.h
+ ****************************************************************************/
@@ -0,0 +1,1009 @@
+/****************************************************************************
+ * Module:  capture.c
+ *
+ ****************************************************************************/
+#define _GNU_SOURCE
+#include "capture.h"
+#include "xdpCapture.h"
+#include "uringCapture.h"
+#include "pcapFile.h"
+#include "bpfFilter.h"
+#include "devConfig.h"
+#include "packetStruct.h"
+#include "packetBuilder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/virtio_net.h>
+
+/** defines ******************************************************************/
+#define RING_RETIRE_TIMEOUT		60		/* ms antes de que el kernel cierre un bloque a medias */
+#ifndef ARPHRD_RAWIP
+#define ARPHRD_RAWIP			519		/* IP sin cabecera, como ARPHRD_NONE */
+#endif
+
+/** private interface ********************************************************/
+static int  openSocket( struct capture *cap );
+static int  bindSocket( struct capture *cap, const char *device );
+static int  joinFanout( struct capture *cap, ui32 group, uchar bInnerTunnels );
+static void enableVnetHeader( struct capture *cap );
+static void enableAuxData( struct capture *cap );
+static ui32 getBufferSize( struct capture *cap, const struct captureConfig *cfg );
+static void readVnetHeader( struct frame *f, const struct virtio_net_hdr *vh );
+static void stripVnetHeader( struct capture *cap, struct frame *frames, int count );
+static void addCookedHeader( struct frame *f, const struct sockaddr_ll *sll );
+static int  filterBurst( struct capture *cap, struct frame *frames, int count );
+static int  setupRing( struct capture *cap, const struct captureConfig *cfg );
+static int  setupBurst( struct capture *cap, const struct captureConfig *cfg );
+static int  readPacketSocket( struct capture *cap, struct frame *frames, int maxFrames );
+static int  readRing( struct capture *cap, struct frame *frames, int maxFrames );
+static void releaseRing( struct capture *cap );
+
+static struct tpacket_block_desc * getBlock( struct capture *cap, ui32 idx );
+
+/** public interface *********************************************************/
+int		capProbeLink( struct captureConfig *cfg );
+int		capOpen( struct capture *cap, const struct captureConfig *cfg, const struct capture *master );
+void	capClose( struct capture *cap );
+int		capWait( struct capture *cap, int timeoutMs );
+int		capReadBurst( struct capture *cap, struct frame *frames, int maxFrames );
+void	capReleaseBurst( struct capture *cap );
+void	capUpdateStats( struct capture *cap );
+int		capSetFilter( struct capture *cap, const struct bpfProgram *prog );
+void	capReadAuxData( const struct msghdr *msg, struct frame *frame );
+ui64	capGetTime();
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * openSocket()
+ *---------------------------------------------------------------------------*/
+static int openSocket( struct capture *cap )
+{
+	/* en modo cooked el kernel quita la cabecera de enlace y nos da la de red */
+	cap->sd = socket( PF_PACKET, cap->bCooked ? SOCK_DGRAM : SOCK_RAW, htons( ETH_P_ALL ));
+	if( cap->sd < 0 )
+	{
+		printf( "socket err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * bindSocket()
+ *---------------------------------------------------------------------------*/
+static int bindSocket( struct capture *cap, const char *device )
+{
+	struct sockaddr_ll  sll;
+
+	/* atamos el socket a la interfaz, si no recibiriamos de todas; con
+	   "any" es justo lo que queremos */
+	memset( &sll, 0, sizeof( sll ));
+	sll.sll_family   = AF_PACKET;
+	sll.sll_protocol = htons( ETH_P_ALL );
+	if( strcmp( device, CAP_ANY_DEVICE ) == 0 )
+		sll.sll_ifindex = 0;
+	else if(( sll.sll_ifindex = if_nametoindex( device )) == 0 )
+	{
+		printf( "unknown interface %s\n", device );
+		return -1;
+	}
+
+	if( bind( cap->sd, (struct sockaddr *)&sll, sizeof( sll )) < 0 )
+	{
+		printf( "bind err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * joinFanout()
+ *---------------------------------------------------------------------------*/
+static int joinFanout( struct capture *cap, ui32 group, uchar bInnerTunnels )
+{
+	struct bpfProgram  hash;
+	struct sock_fprog  prog;
+	char               err[ 128 ];
+	int                arg;
+
+	/* el programa que reparte es buildFlowHash() en BPF clsico */
+	if( bpfFanout( bInnerTunnels, &hash, err, sizeof( err )) == -1 )
+	{
+		printf( "fanout: %s\n", err );
+		return -1;
+	}
+	prog.len    = hash.len;
+	prog.filter = hash.insns;
+
+	/* DEFRAG reensambla antes de repartir, as los fragmentos llevan puertos
+	   y van con el resto de su flujo */
+	arg = ( group & 0xffff ) | (( PACKET_FANOUT_CBPF | PACKET_FANOUT_FLAG_DEFRAG ) << 16 );
+	if( setsockopt( cap->sd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof( arg )) < 0  ||
+		setsockopt( cap->sd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof( prog )) < 0 )
+	{
+		printf( "PACKET_FANOUT err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * enableVnetHeader()
+ *---------------------------------------------------------------------------*/
+static void enableVnetHeader( struct capture *cap )
+{
+	int  on = 1;
+
+	/* con la cabecera virtio_net el kernel nos dice si la trama es un
+	   supersegmento GRO/TSO y de qu tamao eran los segmentos; si no se
+	   puede seguimos sin ella, las tramas llegan igual pero sin esa cuenta */
+	cap->vnetHdrLen = 0;
+	if( setsockopt( cap->sd, SOL_PACKET, PACKET_VNET_HDR, &on, sizeof( on )) == 0 )
+		cap->vnetHdrLen = sizeof( struct virtio_net_hdr );
+}
+
+/*-----------------------------------------------------------------------------
+ * enableAuxData()
+ *---------------------------------------------------------------------------*/
+static void enableAuxData( struct capture *cap )
+{
+	int  on = 1;
+
+	/* con la VLAN quitada por la tarjeta, recvmsg() solo la da en el cmsg
+	   PACKET_AUXDATA; el anillo la trae en la cabecera de cada trama */
+	if( setsockopt( cap->sd, SOL_PACKET, PACKET_AUXDATA, &on, sizeof( on )) < 0 )
+		printf( "PACKET_AUXDATA err: %s, VLANs removed by the NIC will be merged\n", strerror( errno ));
+}
+
+/*-----------------------------------------------------------------------------
+ * getBufferSize()
+ *---------------------------------------------------------------------------*/
+static ui32 getBufferSize( struct capture *cap, const struct captureConfig *cfg )
+{
+	ui32  size;
+
+	/* la trama ms grande que puede dar la interfaz, supersegmentos incluidos */
+	size = getMaxFrameSize( cfg->device, cap->sd );
+	if( size > CAP_MAX_FRAME_SIZE )
+		size = CAP_MAX_FRAME_SIZE;
+
+	/* con snaplen los buffers son solo del tamao de las cabeceras */
+	if( cfg->snaplen != 0  &&  cfg->snaplen < size )
+		size = cfg->snaplen;
+
+	return  size + cap->vnetHdrLen;
+}
+
+/*-----------------------------------------------------------------------------
+ * readVnetHeader()
+ *---------------------------------------------------------------------------*/
+static void readVnetHeader( struct frame *f, const struct virtio_net_hdr *vh )
+{
+	if(( vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN ) != VIRTIO_NET_HDR_GSO_NONE )
+		f->gsoSize = vh->gso_size;
+	else
+		f->gsoSize = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * stripVnetHeader()
+ *---------------------------------------------------------------------------*/
+static void stripVnetHeader( struct capture *cap, struct frame *frames, int count )
+{
+	int  i;
+
+	/* recv() deja la cabecera virtio_net delante de la trama y la cuenta en la longitud */
+	for( i = 0; i < count; i++ )
+	{
+		readVnetHeader( &frames[i], (const struct virtio_net_hdr *)frames[i].data );
+		frames[i].data   += cap->vnetHdrLen;
+		frames[i].caplen -= cap->vnetHdrLen;
+		frames[i].len    -= cap->vnetHdrLen;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * addCookedHeader()
+ *---------------------------------------------------------------------------*/
+static void addCookedHeader( struct frame *f, const struct sockaddr_ll *sll )
+{
+	struct sllHeader  *h;
+
+	/* como libpcap: la cabecera LINKTYPE_LINUX_SLL va en el hueco que se
+	   dej delante de la trama, con lo que el kernel dice de ella */
+	h = (struct sllHeader *)( f->data - SLL_HEADER_LENGTH );
+	h->pkttype  = htons( sll->sll_pkttype );
+	h->hatype   = htons( sll->sll_hatype );
+	h->halen    = htons( sll->sll_halen );
+	memcpy( h->addr, sll->sll_addr, SLL_ADDR_SIZE );
+	h->protocol = sll->sll_protocol;
+
+	f->data   -= SLL_HEADER_LENGTH;
+	f->caplen += SLL_HEADER_LENGTH;
+	f->len    += SLL_HEADER_LENGTH;
+}
+
+/*-----------------------------------------------------------------------------
+ * filterBurst()
+ *---------------------------------------------------------------------------*/
+static int filterBurst( struct capture *cap, struct frame *frames, int count )
+{
+	ui32  res;
+	int   i, n = 0;
+
+	/* compactamos la rfaga dejando solo las tramas que pasan el filtro y,
+	   como hace el kernel, recortamos cada una a lo que devuelve el programa */
+	pthread_mutex_lock( &cap->filterLock );
+	if( cap->filter != NULL )
+	{
+		for( i = 0; i < count; i++ )
+		{
+			res = bpfRun( cap->filter, frames[i].data, frames[i].caplen, frames[i].len );
+			if( res == 0 )
+				continue;
+			frames[n] = frames[i];
+			if( res < frames[n].caplen )
+				frames[n].caplen = res;
+			n++;
+		}
+	}
+	else
+		n = count;
+	pthread_mutex_unlock( &cap->filterLock );
+
+	return  n;
+}
+
+/*-----------------------------------------------------------------------------
+ * setupRing()
+ *---------------------------------------------------------------------------*/
+static int setupRing( struct capture *cap, const struct captureConfig *cfg )
+{
+	struct tpacket_req3  req;
+	int                  version = TPACKET_V3;
+	unsigned int         reserve = SLL_HEADER_LENGTH;
+	long                 pageSize = sysconf( _SC_PAGESIZE );
+	ui64                 ringSize, memory;
+
+	/* el kernel exige bloques multiplos de pagina y tramas alineadas */
+	if( cfg->blockSize == 0  ||  cfg->blockSize % pageSize != 0 )
+	{
+		printf( "block size must be a multiple of %ld\n", pageSize );
+		return -1;
+	}
+	if( cfg->frameSize < TPACKET3_HDRLEN  ||  cfg->frameSize % TPACKET_ALIGNMENT != 0  ||
+		cfg->frameSize > cfg->blockSize )
+	{
+		printf( "frame size must be a multiple of %d between %d and the block size\n",
+				TPACKET_ALIGNMENT, (int)TPACKET3_HDRLEN );
+		return -1;
+	}
+	if( cfg->blockCount == 0 )
+	{
+		printf( "block count must be greater than 0\n" );
+		return -1;
+	}
+
+	/* el producto se hace en 64 bits: con bloques grandes no cabe en 32, y
+	   un anillo mayor que la memoria no se puede fijar con MAP_POPULATE */
+	ringSize = (ui64)cfg->blockSize * cfg->blockCount;
+	memory   = (ui64)sysconf( _SC_PHYS_PAGES ) * pageSize;
+	if( ringSize > memory  ||  ringSize > SIZE_MAX  ||
+		(ui64)( cfg->blockSize / cfg->frameSize ) * cfg->blockCount > UINT_MAX )
+	{
+		printf( "ring of %u blocks of %u bytes is too big\n", cfg->blockCount, cfg->blockSize );
+		return -1;
+	}
+
+	if( setsockopt( cap->sd, SOL_PACKET, PACKET_VERSION, &version, sizeof( version )) < 0 )
+	{
+		printf( "PACKET_VERSION err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	/* hueco delante de cada trama para escribir la cabecera cooked */
+	if( cap->bCooked  &&  setsockopt( cap->sd, SOL_PACKET, PACKET_RESERVE, &reserve, sizeof( reserve )) < 0 )
+	{
+		printf( "PACKET_RESERVE err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	memset( &req, 0, sizeof( req ));
+	req.tp_block_size       = cfg->blockSize;
+	req.tp_block_nr         = cfg->blockCount;
+	req.tp_frame_size       = cfg->frameSize;
+	req.tp_frame_nr         = ( cfg->blockSize / cfg->frameSize ) * cfg->blockCount;
+	req.tp_retire_blk_tov   = RING_RETIRE_TIMEOUT;
+	req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+
+	if( setsockopt( cap->sd, SOL_PACKET, PACKET_RX_RING, &req, sizeof( req )) < 0 )
+	{
+		printf( "PACKET_RX_RING err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	cap->blockSize  = cfg->blockSize;
+	cap->blockCount = cfg->blockCount;
+	cap->ringSize   = ringSize;
+	cap->ring       = mmap( NULL, cap->ringSize, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, cap->sd, 0 );
+	if( cap->ring == MAP_FAILED )
+	{
+		cap->ring = NULL;
+		printf( "mmap err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	cap->curBlock      = 0;
+	cap->curFrame      = 0;
+	cap->curPtr        = NULL;
+	cap->releaseBlock  = 0;
+	cap->pendingBlocks = 0;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * getBlock()
+ *---------------------------------------------------------------------------*/
+static struct tpacket_block_desc * getBlock( struct capture *cap, ui32 idx )
+{
+	return  (struct tpacket_block_desc *)( cap->ring + idx * cap->blockSize );
+}
+
+/*-----------------------------------------------------------------------------
+ * setupBurst()
+ *---------------------------------------------------------------------------*/
+static int setupBurst( struct capture *cap, const struct captureConfig *cfg )
+{
+	ui32  i;
+
+	if( cfg->burst == 0  ||  cfg->burst > CAP_MAX_BURST )
+	{
+		printf( "burst size must be between 1 and %d\n", CAP_MAX_BURST );
+		return -1;
+	}
+
+	/* reservamos de una vez los buffers y cabeceras de toda la rfaga */
+	cap->burst      = cfg->burst;
+	cap->bufferSize = getBufferSize( cap, cfg );
+	cap->buffer     = malloc( cap->burst * ( cap->bufferSize + SLL_HEADER_LENGTH ));
+	cap->msgs       = calloc( cap->burst, sizeof( struct mmsghdr ));
+	cap->iovs       = calloc( cap->burst, sizeof( struct iovec ));
+	cap->addrs      = calloc( cap->burst, sizeof( struct sockaddr_ll ));
+	cap->controlSize = CMSG_SPACE( sizeof( struct tpacket_auxdata ));
+	cap->controls   = calloc( cap->burst, cap->controlSize );
+	if( cap->buffer == NULL  ||  cap->msgs == NULL  ||  cap->iovs == NULL  ||  cap->addrs == NULL  ||
+		cap->controls == NULL )
+	{
+		printf( "not enough memory for %u receive buffers\n", cap->burst );
+		return -1;
+	}
+
+	/* cada buffer deja sitio delante para la cabecera cooked, por si hace falta */
+	for( i = 0; i < cap->burst; i++ )
+	{
+		cap->iovs[i].iov_base           = cap->buffer + i * ( cap->bufferSize + SLL_HEADER_LENGTH ) + SLL_HEADER_LENGTH;
+		cap->iovs[i].iov_len            = cap->bufferSize;
+		cap->msgs[i].msg_hdr.msg_iov    = &cap->iovs[i];
+		cap->msgs[i].msg_hdr.msg_iovlen = 1;
+		cap->msgs[i].msg_hdr.msg_control = cap->controls + i * cap->controlSize;
+		if( cap->bCooked )
+		{
+			cap->msgs[i].msg_hdr.msg_name    = &cap->addrs[i];
+			cap->msgs[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_ll );
+		}
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * readPacketSocket()
+ *---------------------------------------------------------------------------*/
+static int readPacketSocket( struct capture *cap, struct frame *frames, int maxFrames )
+{
+	ui64  now;
+	int   i, n;
+
+	if( (ui32)maxFrames > cap->burst )
+		maxFrames = cap->burst;
+
+	/* el kernel deja en msg_controllen lo que escribi, hay que reponerlo */
+	for( i = 0; i < maxFrames; i++ )
+		cap->msgs[i].msg_hdr.msg_controllen = cap->controlSize;
+
+	/* hasta maxFrames tramas con una sola llamada al sistema; con MSG_TRUNC
+	   msg_len es la longitud real de la trama aunque no quepa en el buffer */
+	n = recvmmsg( cap->sd, cap->msgs, maxFrames, MSG_DONTWAIT | MSG_TRUNC, NULL );
+	if( n <= 0 )
+		return 0;
+
+	/* la interfaz lee estos contadores desde su hilo; solo los escribe este */
+	__atomic_store_n( &cap->stats.reads,  cap->stats.reads + 1,  __ATOMIC_RELAXED );
+	__atomic_store_n( &cap->stats.frames, cap->stats.frames + n, __ATOMIC_RELAXED );
+
+	/* una sola marca de tiempo para toda la rafaga */
+	now = capGetTime();
+	for( i = 0; i < n; i++ )
+	{
+		frames[i].data   = cap->iovs[i].iov_base;
+		frames[i].caplen = cap->msgs[i].msg_len < cap->bufferSize ? cap->msgs[i].msg_len : cap->bufferSize;
+		frames[i].len    = cap->msgs[i].msg_len;
+		frames[i].tstamp = now;
+		frames[i].gsoSize = 0;
+		capReadAuxData( &cap->msgs[i].msg_hdr, &frames[i] );
+	}
+	if( cap->vnetHdrLen != 0 )
+		stripVnetHeader( cap, frames, n );
+	for( i = 0; cap->bCooked  &&  i < n; i++ )
+		addCookedHeader( &frames[i], &cap->addrs[i] );
+
+	return n;
+}
+
+/*-----------------------------------------------------------------------------
+ * readRing()
+ *---------------------------------------------------------------------------*/
+static int readRing( struct capture *cap, struct frame *frames, int maxFrames )
+{
+	struct tpacket_block_desc  *bd;
+	struct tpacket3_hdr        *hdr;
+	int                         n = 0;
+
+	while( n < maxFrames )
+	{
+		bd = getBlock( cap, cap->curBlock );
+
+		/* si el bloque todavia es del kernel, no hay mas tramas */
+		if(( __atomic_load_n( &bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE ) & TP_STATUS_USER ) == 0 )
+			break;
+
+		/* empezamos un bloque nuevo */
+		if( cap->curPtr == NULL )
+		{
+			cap->curPtr   = (uchar *)bd + bd->hdr.bh1.offset_to_first_pkt;
+			cap->curFrame = 0;
+		}
+
+		/* las tramas se leen en el sitio, sin copiarlas */
+		while( n < maxFrames  &&  cap->curFrame < bd->hdr.bh1.num_pkts )
+		{
+			hdr = (struct tpacket3_hdr *)cap->curPtr;
+
+			frames[n].data   = cap->curPtr + hdr->tp_mac;
+			frames[n].caplen = hdr->tp_snaplen;
+			frames[n].len    = hdr->tp_len;
+			frames[n].tstamp = (ui64)hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+			frames[n].gsoSize = 0;
+
+			/* la etiqueta VLAN exterior la quita el kernel (o la tarjeta) y la deja aqu */
+			frames[n].bVlan   = ( hdr->tp_status & TP_STATUS_VLAN_VALID ) != 0;
+			frames[n].vlanTci = hdr->hv1.tp_vlan_tci;
+
+			/* en el anillo la cabecera virtio_net va justo antes de la trama */
+			if( cap->vnetHdrLen != 0 )
+				readVnetHeader( &frames[n], (const struct virtio_net_hdr *)( frames[n].data - cap->vnetHdrLen ));
+
+			/* y la sockaddr_ll tras la cabecera tpacket; la cooked pisa la
+			   virtio_net, que ya est leda */
+			if( cap->bCooked )
+				addCookedHeader( &frames[n], (const struct sockaddr_ll *)( cap->curPtr + TPACKET_ALIGN( sizeof( *hdr ))));
+			n++;
+
+			cap->curPtr += hdr->tp_next_offset;
+			cap->curFrame++;
+		}
+
+		/* si hemos agotado el bloque pasamos al siguiente, se devolvera en capReleaseBurst() */
+		if( cap->curFrame == bd->hdr.bh1.num_pkts )
+		{
+			cap->curBlock = ( cap->curBlock + 1 ) % cap->blockCount;
+			cap->curPtr   = NULL;
+			cap->pendingBlocks++;
+
+			/* no damos la vuelta completa al anillo sin devolver bloques */
+			if( cap->pendingBlocks == cap->blockCount )
+				break;
+		}
+	}
+
+	return n;
+}
+
+/*-----------------------------------------------------------------------------
+ * releaseRing()
+ *---------------------------------------------------------------------------*/
+static void releaseRing( struct capture *cap )
+{
+	struct tpacket_block_desc  *bd;
+
+	/* devolvemos de golpe todos los bloques ya procesados */
+	while( cap->pendingBlocks > 0 )
+	{
+		bd = getBlock( cap, cap->releaseBlock );
+		__atomic_store_n( &bd->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE );
+
+		cap->releaseBlock = ( cap->releaseBlock + 1 ) % cap->blockCount;
+		cap->pendingBlocks--;
+	}
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * capProbeLink()
+ *---------------------------------------------------------------------------*/
+int capProbeLink( struct captureConfig *cfg )
+{
+	struct pcapFile  *pf;
+	int               sd, type;
+
+	assert( cfg != NULL );
+
+	/* un fichero dice su tipo de enlace en la cabecera */
+	cfg->bCooked = FALSE;
+	if( cfg->engine == CE_FILE )
+	{
+		pf = pcapOpen( cfg->file, cfg->speed );
+		if( pf == NULL )
+			return -1;
+		cfg->linkType       = pf->linkType;
+		cfg->filterLinkType = pf->linkType;
+		pcapClose( pf );
+		return 0;
+	}
+
+	/* en vivo lo dice el tipo de hardware de la interfaz; "any" mezcla
+	   interfaces de todo tipo y va siempre en modo cooked */
+	type = -1;
+	if( strcmp( cfg->device, CAP_ANY_DEVICE ) != 0 )
+	{
+		sd = socket( AF_INET, SOCK_DGRAM, 0 );
+		if( sd < 0 )
+			return -1;
+		type = getHardwareType( cfg->device, sd );
+		close( sd );
+		if( type == -1 )
+			return -1;
+	}
+
+	switch( type )
+	{
+		case ARPHRD_ETHER:
+		case ARPHRD_LOOPBACK:
+			cfg->linkType = PCAP_LINKTYPE_ETHERNET;
+			break;
+		case ARPHRD_NONE:
+		case ARPHRD_RAWIP:
+			cfg->linkType = PCAP_LINKTYPE_RAW;		/* tun, wireguard... */
+			break;
+		default:
+			cfg->linkType = PCAP_LINKTYPE_LINUX_SLL;
+			cfg->bCooked  = TRUE;
+			break;
+	}
+
+	/* el filtro del kernel ve la trama tal cual llega al socket: sin la
+	   cabecera cooked, que la ponemos despus */
+	cfg->filterLinkType = cfg->bCooked ? PCAP_LINKTYPE_RAW : cfg->linkType;
+
+	/* AF_XDP no tiene modo cooked e io_uring no nos da la sockaddr_ll */
+	if( cfg->bCooked  &&  cfg->engine != CE_PACKET  &&  cfg->engine != CE_MMAP )
+	{
+		printf( "%s: this link type needs the packet or mmap engine\n", cfg->device );
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * capOpen()
+ *---------------------------------------------------------------------------*/
+int capOpen( struct capture *cap, const struct captureConfig *cfg, const struct capture *master )
+{
+	ui32  count;
+
+	assert( cap != NULL );
+	assert( cfg != NULL );
+
+	memset( cap, 0, sizeof( *cap ));
+	cap->engine  = cfg->engine;
+	cap->bCooked = cfg->bCooked;
+	cap->sd     = -1;
+	cap->ctlSd  = -1;
+	pthread_mutex_init( &cap->filterLock, NULL );
+
+	/* los ficheros no tienen socket ni interfaz */
+	if( cap->engine == CE_FILE )
+	{
+		cap->pcap = pcapOpen( cfg->file, cfg->speed );
+		if( cap->pcap == NULL )
+			return -1;
+		return  capSetFilter( cap, cfg->filter );
+	}
+
+	/* AF_XDP no pasa por el socket PF_PACKET */
+	if( cap->engine == CE_XDP )
+	{
+		cap->xsk = xdpOpen( cfg->device, cfg->queue, XDP_DEFAULT_FRAME_COUNT,
+							master != NULL ? master->xsk : NULL );
+		if( cap->xsk == NULL )
+			return -1;
+		cap->sd = cap->xsk->fd;
+
+		/* el socket AF_XDP no admite ioctl de interfaz, usamos uno aparte */
+		cap->ctlSd = socket( AF_INET, SOCK_DGRAM, 0 );
+		if( cap->ctlSd < 0 )
+		{
+			capClose( cap );
+			return -1;
+		}
+		return  capSetFilter( cap, cfg->filter );
+	}
+
+	if( openSocket( cap ) == -1 )
+		return -1;
+	enableVnetHeader( cap );
+	enableAuxData( cap );
+
+	/* el filtro va antes del bind(), as no se cuela ninguna trama sin filtrar */
+	if( cfg->filter != NULL  &&  capSetFilter( cap, cfg->filter ) == -1 )
+	{
+		capClose( cap );
+		return -1;
+	}
+
+	/* el anillo se configura antes del bind(); si no se puede usamos
+	   recvmmsg(), salvo que se haya pedido el anillo o su geometra */
+	if( cap->engine == CE_MMAP  &&  setupRing( cap, cfg ) == -1 )
+	{
+		capClose( cap );
+		if( cfg->bRingRequired )
+			return -1;
+		printf( "mmap ring not available, falling back to recvmmsg()\n" );
+		cap->engine = CE_PACKET;
+		if( openSocket( cap ) == -1 )
+			return -1;
+		enableVnetHeader( cap );
+		enableAuxData( cap );
+		if( cfg->filter != NULL  &&  capSetFilter( cap, cfg->filter ) == -1 )
+		{
+			capClose( cap );
+			return -1;
+		}
+	}
+
+	if( cap->engine == CE_PACKET  &&  setupBurst( cap, cfg ) == -1 )
+	{
+		capClose( cap );
+		return -1;
+	}
+
+	if( bindSocket( cap, cfg->device ) == -1 )
+	{
+		capClose( cap );
+		return -1;
+	}
+
+	/* con varios hilos el kernel reparte los flujos entre los sockets del grupo */
+	if( cfg->fanoutGroup != 0  &&  joinFanout( cap, cfg->fanoutGroup, cfg->bInnerTunnels ) == -1 )
+	{
+		capClose( cap );
+		return -1;
+	}
+
+	/* io_uring recibe del socket ya atado; con supersegmentos hay menos
+	   buffers, pero ms grandes, para no pasar de CAP_URING_MEMORY */
+	if( cap->engine == CE_URING )
+	{
+		cap->bufferSize = getBufferSize( cap, cfg );
+		for( count = URING_DEFAULT_BUFFERS; count > URING_MIN_BUFFERS; count /= 2 )
+			if( (ui64)count * cap->bufferSize <= CAP_URING_MEMORY )
+				break;
+		cap->uring = uringOpen( cap->sd, count, cap->bufferSize );
+		if( cap->uring == NULL )
+		{
+			capClose( cap );
+			return -1;
+		}
+	}
+
+	cap->ctlSd = cap->sd;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * capClose()
+ *---------------------------------------------------------------------------*/
+void capClose( struct capture *cap )
+{
+	assert( cap != NULL );
+
+	if( cap->ring != NULL )
+	{
+		munmap( cap->ring, cap->ringSize );
+		cap->ring = NULL;
+	}
+	if( cap->buffer != NULL )
+	{
+		free( cap->buffer );
+		cap->buffer = NULL;
+	}
+	if( cap->msgs != NULL )
+	{
+		free( cap->msgs );
+		cap->msgs = NULL;
+	}
+	if( cap->iovs != NULL )
+	{
+		free( cap->iovs );
+		cap->iovs = NULL;
+	}
+	if( cap->addrs != NULL )
+	{
+		free( cap->addrs );
+		cap->addrs = NULL;
+	}
+	if( cap->controls != NULL )
+	{
+		free( cap->controls );
+		cap->controls = NULL;
+	}
+	if( cap->ctlSd >= 0  &&  cap->ctlSd != cap->sd )
+		close( cap->ctlSd );
+	cap->ctlSd = -1;
+
+	if( cap->pcap != NULL )
+	{
+		pcapClose( cap->pcap );
+		cap->pcap = NULL;
+	}
+	if( cap->filter != NULL )
+	{
+		free( cap->filter );
+		cap->filter = NULL;
+	}
+
+	/* el anillo de io_uring se cierra antes que su socket */
+	if( cap->uring != NULL )
+	{
+		uringClose( cap->uring );
+		cap->uring = NULL;
+	}
+
+	/* el socket AF_XDP lo cierra su modulo */
+	if( cap->xsk != NULL )
+	{
+		xdpClose( cap->xsk );
+		cap->xsk = NULL;
+		cap->sd  = -1;
+	}
+	if( cap->sd >= 0 )
+	{
+		close( cap->sd );
+		cap->sd = -1;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * capWait()
+ *---------------------------------------------------------------------------*/
+int capWait( struct capture *cap, int timeoutMs )
+{
+	ui64  enters;
+	int   ret;
+
+	assert( cap != NULL );
+
+	/* solo io_uring espera por su cuenta, el resto se vigila con epoll */
+	if( cap->engine != CE_URING )
+		return 0;
+
+	enters = cap->uring->enters;
+	ret    = uringWait( cap->uring, timeoutMs );
+	__atomic_store_n( &cap->stats.reads, cap->stats.reads + ( cap->uring->enters - enters ), __ATOMIC_RELAXED );
+
+	return ret;
+}
+
+/*-----------------------------------------------------------------------------
+ * capReadBurst()
+ *---------------------------------------------------------------------------*/
+int capReadBurst( struct capture *cap, struct frame *frames, int maxFrames )
+{
+	int  n;
+
+	assert( cap    != NULL );
+	assert( frames != NULL );
+
+	switch( cap->engine )
+	{
+		case CE_PACKET:	return  readPacketSocket( cap, frames, maxFrames );
+		case CE_MMAP:	return  readRing( cap, frames, maxFrames );
+		case CE_URING:	n = uringReadBurst( cap->uring, frames, maxFrames );
+						__atomic_store_n( &cap->stats.frames, cap->stats.frames + n, __ATOMIC_RELAXED );
+						if( cap->vnetHdrLen != 0 )
+							stripVnetHeader( cap, frames, n );
+						return  n;
+		case CE_XDP:	n = xdpReadBurst( cap->xsk, frames, maxFrames );
+						return  cap->filter != NULL ? filterBurst( cap, frames, n ) : n;
+		case CE_FILE:	n = pcapReadBurst( cap->pcap, frames, maxFrames );
+						cap->bEof = cap->pcap->bEof;
+						return  cap->filter != NULL ? filterBurst( cap, frames, n ) : n;
+		default:		assert( FALSE ); return 0;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * capReleaseBurst()
+ *---------------------------------------------------------------------------*/
+void capReleaseBurst( struct capture *cap )
+{
+	assert( cap != NULL );
+
+	/* las tramas de la ultima rafaga dejan de ser validas */
+	if( cap->engine == CE_MMAP )
+		releaseRing( cap );
+	else if( cap->engine == CE_XDP )
+		xdpReleaseBurst( cap->xsk );
+	else if( cap->engine == CE_URING )
+		uringReleaseBurst( cap->uring );
+}
+
+/*-----------------------------------------------------------------------------
+ * capUpdateStats()
+ *---------------------------------------------------------------------------*/
+void capUpdateStats( struct capture *cap )
+{
+	struct tpacket_stats_v3  st;
+	socklen_t                len = sizeof( st );
+
+	assert( cap != NULL );
+
+	if( cap->engine == CE_XDP )
+	{
+		xdpUpdateStats( cap->xsk, &cap->stats );
+		return;
+	}
+
+	/* de un fichero no se pierde nada */
+	if( cap->engine == CE_FILE )
+	{
+		cap->stats.packets = __atomic_load_n( &cap->pcap->records, __ATOMIC_RELAXED );
+		return;
+	}
+
+	/* el kernel pone a cero los contadores en cada lectura, los acumulamos */
+	memset( &st, 0, sizeof( st ));
+	if( getsockopt( cap->sd, SOL_PACKET, PACKET_STATISTICS, &st, &len ) < 0 )
+		return;
+
+	cap->stats.packets += st.tp_packets;
+	cap->stats.drops   += st.tp_drops;
+	if( cap->engine == CE_MMAP )
+		cap->stats.freezes += st.tp_freeze_q_cnt;
+}
+
+/*-----------------------------------------------------------------------------
+ * capSetFilter()
+ *---------------------------------------------------------------------------*/
+int capSetFilter( struct capture *cap, const struct bpfProgram *prog )
+{
+	struct sock_fprog   fprog;
+	struct bpfProgram  *copy = NULL, *old;
+	struct bpfProgram   full;
+	int                 i;
+
+	assert( cap != NULL );
+
+	/* si el kernel recorta la trama, recvmmsg() e io_uring ya no saben la longitud del cable;
+	   el buffer recorta igual, as que aceptamos la trama entera */
+	if(( cap->engine == CE_PACKET  ||  cap->engine == CE_URING )  &&  prog != NULL )
+	{
+		full = *prog;
+		for( i = 0; i < full.len; i++ )
+			if( full.insns[i].code == ( BPF_RET | BPF_K )  &&  full.insns[i].k != 0 )
+				full.insns[i].k = BPF_ACCEPT_LEN;
+		prog = full.len > 1 ? &full : NULL;
+	}
+
+	/* en los sockets PF_PACKET lo filtra el kernel, y se sustituye de forma atmica */
+	if( cap->engine == CE_PACKET  ||  cap->engine == CE_MMAP  ||  cap->engine == CE_URING )
+	{
+		if( prog == NULL )
+		{
+			setsockopt( cap->sd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0 );
+			return 0;
+		}
+
+		fprog.len    = prog->len;
+		fprog.filter = (struct sock_filter *)prog->insns;
+		if( setsockopt( cap->sd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof( fprog )) < 0 )
+		{
+			printf( "SO_ATTACH_FILTER err: %s\n", strerror( errno ));
+			return -1;
+		}
+		return 0;
+	}
+
+	/* AF_XDP y los ficheros pasan el mismo programa por el intrprete */
+	if( prog != NULL )
+	{
+		copy = malloc( sizeof( *copy ));
+		if( copy == NULL )
+			return -1;
+		*copy = *prog;
+	}
+
+	pthread_mutex_lock( &cap->filterLock );
+	old         = cap->filter;
+	cap->filter = copy;
+	pthread_mutex_unlock( &cap->filterLock );
+
+	free( old );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * capReadAuxData()
+ *---------------------------------------------------------------------------*/
+void capReadAuxData( const struct msghdr *msg, struct frame *frame )
+{
+	const struct cmsghdr          *cmsg;
+	const struct tpacket_auxdata  *aux;
+
+	assert( msg   != NULL );
+	assert( frame != NULL );
+
+	/* la etiqueta VLAN que quit la tarjeta viene en el cmsg PACKET_AUXDATA */
+	frame->bVlan = FALSE;
+	for( cmsg = CMSG_FIRSTHDR( (struct msghdr *)msg ); cmsg != NULL; cmsg = CMSG_NXTHDR( (struct msghdr *)msg, (struct cmsghdr *)cmsg ))
+	{
+		if( cmsg->cmsg_level != SOL_PACKET  ||  cmsg->cmsg_type != PACKET_AUXDATA  ||
+			cmsg->cmsg_len < CMSG_LEN( sizeof( *aux )))
+			continue;
+		aux = (const struct tpacket_auxdata *)CMSG_DATA( cmsg );
+		if( aux->tp_status & TP_STATUS_VLAN_VALID )
+		{
+			frame->bVlan   = TRUE;
+			frame->vlanTci = aux->tp_vlan_tci;
+		}
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * capGetTime()
+ *---------------------------------------------------------------------------*/
+ui64 capGetTime()
+{
+	struct timespec  ts;
+
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return  (ui64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/****************************************************************************
+ * End of capture.c
+ ****************************************************************************/
@@ -0,0 +1,181 @@
+/****************************************************************************
+ * Module:  capture
+ *
+ ****************************************************************************/
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <pthread.h>
+#include "types.h"
+
+/** forward declarations *****************************************************/
+struct mmsghdr;
+struct msghdr;
+struct iovec;
+struct xdpSocket;
+struct uringSocket;
+struct pcapFile;
+struct bpfProgram;
+struct sockaddr_ll;
+
+/** defines ******************************************************************/
+#define CAP_DEFAULT_BLOCK_SIZE		(1 << 20)	/* 1 MB por bloque del anillo */
+#define CAP_DEFAULT_BLOCK_COUNT		64
+#define CAP_DEFAULT_FRAME_SIZE		2048
+#define CAP_DEFAULT_BURST			64			/* tramas por llamada a recvmmsg() */
+#define CAP_MAX_BURST				256			/* tramas mximas por rfaga */
+#define CAP_MAX_FRAME_SIZE			262144		/* tope de los supersegmentos GRO/TSO (BIG TCP) */
+#define CAP_URING_MEMORY			(16 << 20)	/* bytes de buffers provistos de io_uring */
+#define CAP_ANY_DEVICE				"any"		/* todas las interfaces, en modo cooked */
+
+/** public types *************************************************************/
+/*******
+ * eCaptureEngine
+ *******/
+enum eCaptureEngine
+{
+	CE_PACKET,		/* socket PF_PACKET, varias tramas por llamada con recvmmsg() */
+	CE_MMAP,		/* anillo PACKET_RX_RING (TPACKET_V3) mapeado en memoria */
+	CE_XDP,			/* socket AF_XDP con UMEM, atado a una cola de la interfaz */
+	CE_URING,		/* socket PF_PACKET con recv multishot de io_uring y buffers provistos */
+	CE_FILE,		/* fichero pcap o pcapng, sin interfaz */
+
+	CE_UNKNOWN
+};
+
+/*******
+ * captureConfig
+ *******/
+struct captureConfig
+{
+	const char			*device;		/* interfaz de red */
+	const char			*file;			/* fichero de captura (motor CE_FILE) */
+	enum eCaptureEngine	 engine;		/* motor de captura */
+
+	/* configuracin del anillo TPACKET_V3 */
+	ui32				 blockSize;		/* tamao de bloque en bytes (mltiplo de pgina) */
+	ui32				 blockCount;	/* nmero de bloques */
+	ui32				 frameSize;		/* tamao de trama en bytes */
+	uchar				 bRingRequired;	/* pedido a mano: sin anillo no se cambia de motor */
+
+	/* configuracin de recvmmsg() */
+	ui32				 burst;			/* tramas por llamada */
+
+	/* bytes que se capturan de cada trama, 0 = completas */
+	ui32				 snaplen;
+
+	/* configuracin de AF_XDP */
+	ui32				 queue;			/* cola de recepcin de la interfaz */
+
+	/* reproduccin de ficheros */
+	float				 speed;			/* 0 = lo ms rpido posible, 1 = tiempo original */
+
+	/* reparto entre hilos */
+	ui32				 fanoutGroup;	/* grupo PACKET_FANOUT (0 = un solo socket) */
+	uchar				 bInnerTunnels;	/* repartir por lo de dentro de los tneles, como --tunnels=inner */
+
+	/* filtro inicial, NULL para no filtrar */
+	const struct bpfProgram *filter;
+
+	/* enlace, lo rellena capProbeLink() */
+	ui32				 linkType;		/* LINKTYPE_* de las tramas que da capReadBurst() */
+	ui32				 filterLinkType;	/* el que ve el filtro, que en el kernel va sin cabecera cooked */
+	uchar				 bCooked;		/* socket SOCK_DGRAM: la cabecera cooked la ponemos nosotros */
+};
+
+/*******
+ * frame
+ *******/
+struct frame
+{
+	const uchar			*data;			/* comienzo de la trama (en el anillo o en el buffer) */
+	ui32				 caplen;		/* bytes capturados */
+	ui32				 len;			/* bytes en el cable */
+	ui64				 tstamp;		/* nanosegundos desde 1970 */
+	ui16				 gsoSize;		/* tamao de segmento si es un supersegmento GRO/TSO, 0 si no */
+	ui16				 vlanTci;		/* etiqueta VLAN que quit el kernel, si bVlan */
+	uchar				 bVlan;
+};
+
+/*******
+ * captureStats
+ *******/
+struct captureStats
+{
+	ui32				 packets;		/* paquetes vistos por el kernel */
+	ui32				 drops;			/* paquetes descartados por el kernel */
+	ui32				 freezes;		/* veces que se congel la cola del anillo */
+
+	ui64				 frames;		/* tramas ledas con llamadas al sistema */
+	ui64				 reads;			/* llamadas al sistema que devolvieron tramas */
+};
+
+/*******
+ * capture
+ *******/
+struct capture
+{
+	enum eCaptureEngine	 engine;
+	int					 sd;			/* socket del que leemos (PF_PACKET o AF_XDP) */
+	int					 ctlSd;			/* socket para los ioctl de la interfaz */
+	ui32				 vnetHdrLen;	/* cabecera virtio_net delante de cada trama (PACKET_VNET_HDR) */
+	uchar				 bCooked;		/* SOCK_DGRAM con cabecera Linux cooked delante */
+
+	/* motor CE_PACKET */
+	uchar				*buffer;		/* buffers de recepcin de la rfaga */
+	ui32				 bufferSize;	/* tamao de cada buffer */
+	ui32				 burst;			/* tramas por llamada */
+	struct mmsghdr		*msgs;
+	struct iovec		*iovs;
+	struct sockaddr_ll	*addrs;			/* de dnde vino cada trama, en modo cooked */
+	uchar				*controls;		/* cmsg PACKET_AUXDATA de cada trama */
+	ui32				 controlSize;
+
+	/* motor CE_MMAP */
+	uchar				*ring;			/* zona mapeada */
+	size_t				 ringSize;
+	ui32				 blockSize;
+	ui32				 blockCount;
+	ui32				 curBlock;		/* bloque que estamos leyendo */
+	ui32				 curFrame;		/* tramas ya ledas del bloque actual */
+	uchar				*curPtr;		/* siguiente trama del bloque actual */
+	ui32				 releaseBlock;	/* primer bloque pendiente de devolver al kernel */
+	ui32				 pendingBlocks;	/* bloques ledos y an no devueltos */
+
+	/* motor CE_XDP */
+	struct xdpSocket	*xsk;
+
+	/* motor CE_URING */
+	struct uringSocket	*uring;
+
+	/* motor CE_FILE */
+	struct pcapFile		*pcap;
+	uchar				 bEof;			/* se ha terminado el fichero */
+
+	/* filtro en espacio de usuario, para los motores sin SO_ATTACH_FILTER */
+	pthread_mutex_t		 filterLock;
+	struct bpfProgram	*filter;
+
+	struct captureStats	 stats;			/* contadores acumulados del kernel */
+};
+
+/** public interface *********************************************************/
+int		capProbeLink( struct captureConfig *cfg );
+int		capOpen( struct capture *cap, const struct captureConfig *cfg, const struct capture *master );
+void	capClose( struct capture *cap );
+
+int		capWait( struct capture *cap, int timeoutMs );
+int		capReadBurst( struct capture *cap, struct frame *frames, int maxFrames );
+void	capReleaseBurst( struct capture *cap );
+
+void	capUpdateStats( struct capture *cap );
+int		capSetFilter( struct capture *cap, const struct bpfProgram *prog );
+
+void	capReadAuxData( const struct msghdr *msg, struct frame *frame );
+ui64	capGetTime();
+
+
+#endif  /* _CAPTURE_H_ */
+/****************************************************************************
+ * End of capture.h
+ ****************************************************************************/
@@ -4,263 +4,1071 @@
  ****************************************************************************/
 #include "connections.h"
 #include "packetStruct.h"
+#include "packetBuilder.h"
+#include "addrIntern.h"
+#include "fragTable.h"
+#include "timerWheel.h"
+#include "slabArena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <pthread.h>
 #include <assert.h>
 
 /** defines ******************************************************************/
-#define MAX_CONNECTIONS		128
+#define NO_CONNECTION		0xFFFFFFFF
+#define NO_TIMER			0xFFFFFFFFFFFFFFFFULL
+#define SECONDS( s )		( (ui64)(s) * 1000000000ULL )
+#define CONNECTION( t, idx )	( (struct internalConnection *)SLAB_OBJECT( (t)->pool, idx ))
+#define RATE_SHIFT			8				/* bits de fraccin de las medias del caudal */
+#define RATE_ONE			65536			/* 1,0 en los pesos de las medias */
+#define RATE_DECAY_STEPS	64				/* segundos sin trfico que se descuentan de una vez */
+#define SEQ_LT( a, b )		( (int)( (ui32)(a) - (ui32)(b) ) < 0 )	/* con la vuelta de los nmeros de secuencia */
+#define SEQ_GEQ( a, b )		( !SEQ_LT( a, b ))
+#define TCP_REORDER_US		3000			/* sin RTT, lo que puede llegar un segmento atrasado sin ser retransmisin */
+
+/* tcpSide.flags */
+#define TS_SEQ				0x01			/* nextSeq vale */
+#define TS_ACK				0x02			/* lastAck y window valen */
+#define TS_TIMING			0x04			/* hay un segmento cronometrado */
+#define TS_ZERO_WINDOW		0x08			/* la ltima ventana anunciada fue 0 */
+#define TS_SYN				0x10			/* mand el SYN de la negociacin en curso */
 
 /** private types ************************************************************/
+/* el caudal se junta por segundos y cada segundo terminado entra en las
+   medias; as cada paquete solo suma, y las medias se ponen al da con el
+   primer paquete del segundo siguiente o al pedirlas */
+struct rateState
+{
+	ui32			   second;		/* segundo del reloj de la tabla que se est juntando */
+	ui32			   packets;		/* lo que va de ese segundo */
+	ui64			   bytes;
+};
+
+struct rateAverages
+{
+	ui64			   bytes[ CNT_RATE_WINDOWS ];	/* por segundo, con RATE_SHIFT bits de fraccin */
+	ui64			   packets[ CNT_RATE_WINDOWS ];
+};
+
+/* lo que hace falta de cada lado de una conexin TCP para analizarla; se
+   cronometra un segmento cada vez, como hace el propio TCP sin marcas de
+   tiempo, y las horas van en microsegundos que dan la vuelta */
+struct tcpSide
+{
+	ui32			   nextSeq;		/* el mayor seq + longitud que ha mandado */
+	ui32			   lastAck;		/* el ltimo ACK que ha mandado */
+	ui32			   timedSeq;	/* fin del segmento cronometrado */
+	ui32			   timedAt;		/* y cundo pas */
+	ui32			   advancedAt;	/* cundo pas el ltimo segmento que hizo avanzar nextSeq */
+	ui16			   window;		/* ltima ventana anunciada, sin escalar */
+	uchar			   flags;		/* TS_* */
+	uchar			   reserved;
+};
+
+/* lo que se toca con cada paquete va al principio, y la parte pblica
+   empieza por sus contadores: todo ello cabe en las dos primeras lneas
+   de cach, que se traen juntas. El anlisis TCP, pblico y privado, cae
+   en las dos siguientes, y las medias, que solo se tocan una vez por
+   segundo, van al final */
 struct internalConnection
 {
-	uchar  			   free;	/* distinto de 0 si est libre */
+	struct flowKey	   canonical;	/* extremos ordenados: la misma en los dos sentidos */
+	ui32			   hash;		/* el del paquete que la cre, igual en los dos sentidos */
+	ui32			   position;	/* sitio en active, el ndice que ve la interfaz */
+	ui64			   expires;		/* para cundo est su temporizador, NO_TIMER si no tiene */
+	struct rateState   rate;
+	ui32			   synTime;		/* cundo pas el SYN, en microsegundos */
+	uchar			   finSeen;		/* FIN vistos: bit 0 en el sentido de la clave, bit 1 en el otro */
+	uchar			   bSwapped;	/* canonical va al revs que la clave pblica */
 	
-	struct connection  c;		/* parte pblica */
+	struct connection  c;			/* parte pblica */
+	struct tcpSide	   tcp[2];		/* por sentido, como c.dirPackets */
+	struct rateAverages average;
 };
 
+/* el hash va en el hueco para descartar casi todas las colisiones sin
+   tocar la conexin; idx es NO_CONNECTION si el hueco est vaco */
+struct hashSlot
+{
+	ui32			   hash;
+	ui32			   idx;
+};
+
+struct connectionTable
+{
+	pthread_mutex_t					  lock;			/* protege la tabla frente a la interfaz */
+	ui32              				  nConnections;
+	ui32							  capacity;
+	struct slabArena				 *arena;		/* las conexiones; su ndice en la arena es el de todo lo dems */
+	int								  cls;			/* clase de la arena para internalConnection */
+	struct slabClass				 *pool;			/* la misma clase, para llegar antes a cada conexin */
+	ui32							 *active;		/* las ocupadas, seguidas, en nConnections */
+	struct hashSlot					 *slots;		/* hash abierto con sondeo lineal */
+	ui32							  mask;			/* slots tiene mask + 1, al menos el doble de capacity */
+	struct timerWheel				 *timers;		/* caducidad, uno por conexin */
+	cntRecordFn						  recordFn;		/* a quin se dan las que salen */
+	void							 *recordCtx;
+	struct cntStats					  stats;
+	struct addrIntern				 *addresses;	/* direcciones IPv6 de las claves */
+	ui64							  decapsulated[ ENCAP_COUNT ];	/* paquetes sacados de cada tipo de tnel */
+	struct fragTable				 *fragments;	/* datagramas IPv4 a medias */
+	ui64							  now;			/* hora del ltimo paquete o rfaga, para las medias */
+};
+
+/** private data *************************************************************/
+static ui32  fragMemory     = FRAG_DEFAULT_MEMORY;		/* tope de cada tabla de fragmentos */
+static ui32  maxConnections = CNT_DEFAULT_CONNECTIONS;	/* capacidad de cada tabla */
+
+/* peso de cada segundo nuevo en las medias de 1, 10 y 60 segundos,
+   1 - e^(-1/ventana) sobre RATE_ONE, y lo que queda de la media tras
+   n segundos sin trfico; lo rellena cntCreateTable() */
+static const ui32  rateWeight[ CNT_RATE_WINDOWS ] = { 41427, 6237, 1083 };
+static ui32        rateDecay[ CNT_RATE_WINDOWS ][ RATE_DECAY_STEPS ];
+
 /** private interface ********************************************************/
-static uchar belongToConnection( struct connection *c, struct packet *p );
-static uchar buildConnection( struct internalConnection *c, struct packet *p );
-static void  computeStatistics( struct internalConnection *c, struct packet *p );
+static uchar makeFlowKey( struct connectionTable *t, struct packet *p, const struct fragInfo *frag, struct flowKey *key );
+static int   canonicalKey( const struct flowKey *key, struct flowKey *canonical );
+static struct internalConnection * lookup( struct connectionTable *t, const struct flowKey *canonical, ui32 hash, ui32 *slot );
+static struct internalConnection * buildConnection( struct connectionTable *t, struct packet *p, struct flowKey *key,
+													ui32 hash, ui32 slot, ui64 now );
+static void  computeStatistics( struct internalConnection *c, struct packet *p, int dir, ui64 now );
+static void  updateTcpState( struct internalConnection *c, const struct packet *p, int dir );
+static void  analyzeTcp( struct internalConnection *c, const struct packet *p, int dir, ui64 now );
+static void  buildRateDecay();
+static void  closeRateSecond( struct rateState *r, struct rateAverages *avg, ui32 second );
+static ui64  idleTimeout( const struct internalConnection *c );
+static void  removeConnection( struct connectionTable *t, ui32 idx, enum eExpireReason reason );
+static ui64  expireConnection( void *ctx, ui32 idx, ui64 now );
 
 /** public interface *********************************************************/
-void				cntInitConnections();
-ui32				cntGetConnectionsCount();
-struct connection *	cntGetConnection( ui32 idx );
-struct connection *	cntProcessPacket( struct packet *p );
+struct connectionTable *	cntCreateTable();
+void				cntDestroyTable( struct connectionTable *t );
+void				cntLock( struct connectionTable *t );
+void				cntUnlock( struct connectionTable *t );
+void				cntInitConnections( struct connectionTable *t );
+void				cntSetRecordHandler( struct connectionTable *t, cntRecordFn fn, void *ctx );
+void				cntExportConnections( struct connectionTable *t, enum eExpireReason reason );
+ui32				cntGetConnectionsCount( struct connectionTable *t );
+struct connection *	cntGetConnection( struct connectionTable *t, ui32 idx );
+void				cntGetRates( struct connectionTable *t, const struct connection *c, struct cntRates *rates );
+void				cntFormatEndpoint( struct connectionTable *t, const struct connection *c, uchar bDst, char *buffer, int size );
+ui64				cntGetDecapsulated( struct connectionTable *t, enum eEncapsulation encap );
+void				cntGetFragmentStats( struct connectionTable *t, struct fragStats *stats );
+int					cntSetFragmentMemory( ui32 bytes );
+int					cntSetMaxConnections( ui32 count );
+void				cntGetStats( struct connectionTable *t, struct cntStats *stats );
+struct connection *	cntProcessPacket( struct connectionTable *t, struct packet *p, ui64 now );
+void				cntProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, cntHandle *handles, int count, ui64 now );
 	
-/** private data *************************************************************/
-static int	              		  nConnections;
-static struct internalConnection  connections[ MAX_CONNECTIONS ];
-
 /*****************************************************************************
  * Private interface implementation
  *****************************************************************************/
 /*-----------------------------------------------------------------------------
- * belongToConnection()
+ * makeFlowKey()
  *---------------------------------------------------------------------------*/
-uchar belongToConnection( struct connection *c, struct packet *p )
+uchar makeFlowKey( struct connectionTable *t, struct packet *p, const struct fragInfo *frag, struct flowKey *key )
 {
-	ui16  src_port, dst_port;
+	const struct ip6Header  *ip6;
 	
-	/* solo soportamos conexiones de IP */
-	if( p->nl.type != NT_IP )
+	/* solo soportamos conexiones de IP, con puertos de UDP o TCP; los
+	   fragmentos posteriores no los llevan y usan los del primero */
+	if( p->tl != TT_UDP  &&  p->tl != TT_TCP  &&  frag == NULL )
 		return FALSE;
 	
-	
-	/* calculamos el puerto origen y el destino segn la capa de transporte */
-	switch( p->tl.type )
+	memset( key, 0, sizeof( *key ));
+	switch( p->nl )
 	{
-		//----------------------------------------------------------------
-		case TT_UDP:
-			src_port = p->tl.udp->src_port;
-			dst_port = p->tl.udp->dst_port;
+		case NT_IP:
+			key->src = p->srcAddr;
+			key->dst = p->dstAddr;
 			break;
-		//----------------------------------------------------------------
-		case TT_TCP:
-			src_port = p->tl.tcp->src_port;
-			dst_port = p->tl.tcp->dst_port;
+		case NT_IPV6:
+			/* las direcciones largas se guardan una vez y la clave lleva su
+			   identificador; aqu solo se buscan, y una que no est da AI_NONE,
+			   que no lo lleva ninguna conexin: se crea en buildConnection() */
+			ip6      = PKT_IP6( p );
+			key->src = aiFind( t->addresses, ip6->IPv6_src );
+			key->dst = aiFind( t->addresses, ip6->IPv6_dst );
 			break;
-		//----------------------------------------------------------------
 		default:
 			return FALSE;
-			break;
 	}
+	key->family  = p->nl;
+	key->proto   = p->ipProto;
+	key->srcPort = frag != NULL ? frag->srcPort : p->srcPort;
+	key->dstPort = frag != NULL ? frag->dstPort : p->dstPort;
+	key->vlan    = p->vlanId;		/* cada VLAN es su propio espacio de direcciones */
+	key->encap   = p->encap;		/* y cada tnel tambin */
+	key->tunnel  = p->tunnelId;
 	
-	if( c->ap_protocol == AP_MSN &&
-	  ( src_port == 1863 || dst_port == 1863 ))
-		 return TRUE;
-		
-	
-	/* realizamos las comprobaciones por pares */
-	if( strncmp( c->src_addr, p->nl.ip->IPv4_src, 4 ) == 0  &&
-		strncmp( c->dst_addr, p->nl.ip->IPv4_dst, 4 ) == 0 )
+	return TRUE;
+}
+
+/*-----------------------------------------------------------------------------
+ * canonicalKey()
+ *---------------------------------------------------------------------------*/
+int canonicalKey( const struct flowKey *key, struct flowKey *canonical )
+{
+	/* el extremo menor va primero, as los dos sentidos dan la misma clave;
+	   devuelve 1 si ha tenido que darles la vuelta */
+	*canonical = *key;
+	if( key->src > key->dst  ||  ( key->src == key->dst  &&  key->srcPort > key->dstPort ))
 	{
-		if( src_port == c->src_port &&
-			dst_port == c->dst_port )
-			return TRUE;
-		else
-			return FALSE;
+		canonical->src     = key->dst;
+		canonical->dst     = key->src;
+		canonical->srcPort = key->dstPort;
+		canonical->dstPort = key->srcPort;
+		return 1;
 	}
-	else if( strncmp( c->src_addr, p->nl.ip->IPv4_dst, 4 ) == 0  &&
-		     strncmp( c->dst_addr, p->nl.ip->IPv4_src, 4 ) == 0 )
+	
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * lookup()
+ *---------------------------------------------------------------------------*/
+struct internalConnection * lookup( struct connectionTable *t, const struct flowKey *canonical, ui32 hash, ui32 *slot )
+{
+	struct internalConnection  *c;
+	ui32                        i;
+	
+	/* sondeo lineal: la tabla nunca pasa de la mitad, as que las cadenas
+	   son cortas y siempre acaban en un hueco vaco; si no est, *slot es
+	   el hueco donde habra que meterla */
+	for( i = hash & t->mask; t->slots[i].idx != NO_CONNECTION; i = ( i + 1 ) & t->mask )
 	{
-		if( src_port == c->dst_port &&
-			dst_port == c->src_port )
-			return TRUE;
-		else
-			return FALSE;
+		if( t->slots[i].hash != hash )
+			continue;
+		
+		c = CONNECTION( t, t->slots[i].idx );
+		if( memcmp( &c->canonical, canonical, sizeof( *canonical )) == 0 )
+			return c;
 	}
-	else
-		return FALSE;
+	
+	*slot = i;
+	return NULL;
 }
 
 /*-----------------------------------------------------------------------------
  * buildConnection()
  *---------------------------------------------------------------------------*/
-uchar  buildConnection( struct internalConnection *c, struct packet *p )
+struct internalConnection * buildConnection( struct connectionTable *t, struct packet *p, struct flowKey *key,
+											 ui32 hash, ui32 slot, ui64 now )
 {
-	int  i;
+	struct internalConnection  *c;
+	const struct ip6Header     *ip6;
+	cntHandle                   handle;
 	
-	/* solo soportamos estadsticas de IP */
-	if( p->nl.type != NT_IP )
-		return FALSE;
+	/* no tenemos espacio libre para procesar ms conexiones; la arena
+	   tiene sitio para todas, as que su ndice siempre es menor que capacity */
+	if( t->nConnections == t->capacity  ||
+	  ( handle = slabAlloc( t->arena, t->cls, (void **)&c )) == SLAB_NO_HANDLE )
+	{
+		t->stats.full++;
+		return NULL;
+	}
 	
-	c->c.nt_protocol = NT_IP;
-
-	/* comprobamos la capa de transporte y si est soportada rellenamos los datos */
-	switch( p->tl.type )
+	/* la conexin se queda una referencia de cada direccin IPv6, que suelta
+	   removeConnection(); la clave trae las de la bsqueda y puede que alguna
+	   an no tuviera identificador, as que el orden cannico se rehace */
+	if( key->family == NT_IPV6 )
 	{
-		//----------------------------------------------------------------
-		case TT_UDP:
-			c->free          = FALSE;
-			c->c.src_port    = p->tl.udp->src_port;
-			c->c.dst_port    = p->tl.udp->dst_port;
-			c->c.tp_protocol = TT_UDP;
-			break;
-		//----------------------------------------------------------------
-		case TT_TCP:
-			c->free          = FALSE;
-			c->c.src_port    = p->tl.tcp->src_port;
-			c->c.dst_port    = p->tl.tcp->dst_port;
-			c->c.tp_protocol = TT_TCP;
-			break;
-		//----------------------------------------------------------------
-		default:
-			return FALSE;
-			break;
+		ip6      = PKT_IP6( p );
+		key->src = aiIntern( t->addresses, ip6->IPv6_src );
+		key->dst = aiIntern( t->addresses, ip6->IPv6_dst );
+		if( key->src == AI_NONE  ||  key->dst == AI_NONE )
+		{
+			if( key->src != AI_NONE )
+				aiRelease( t->addresses, key->src );
+			if( key->dst != AI_NONE )
+				aiRelease( t->addresses, key->dst );
+			slabFree( t->arena, handle );
+			t->stats.full++;
+			return NULL;
+		}
 	}
 	
-	/* rellenamos la capa de red */
-	memcpy( c->c.src_addr, p->nl.ip->IPv4_src, 4 );
-	memcpy( c->c.dst_addr, p->nl.ip->IPv4_dst, 4 );
+	/* la clave pblica conserva el sentido del primer paquete */
+	c->c.handle      = handle;
+	c->hash          = hash;
+	c->bSwapped      = canonicalKey( key, &c->canonical );
+	c->finSeen       = 0;
+	c->synTime       = 0;
+	c->expires       = NO_TIMER;		/* lo programa el primer paquete */
+	c->c.key         = *key;
+	c->c.nt_protocol = p->nl;
+	c->c.tp_protocol = key->proto == IPPROTO_TCP ? TT_TCP : TT_UDP;
+	c->c.tcpState    = TCPS_NONE;
 	
 	/* intentamos encontrar el tipo de conextin que tenemos */
 	filterConnection( p, &(c->c) );
 			
-	/* inicializamos el contador de paquetes */
-	c->c.packetsCount = 0;
+	/* inicializamos los contadores */
+	memset( c->c.dirPackets, 0, sizeof( c->c.dirPackets ));
+	memset( c->c.dirBytes, 0, sizeof( c->c.dirBytes ));
+	c->c.firstSeen    = now;
+	c->c.lastSeen     = now;
+	memset( &c->rate, 0, sizeof( c->rate ));
+	memset( &c->average, 0, sizeof( c->average ));
+	memset( &c->c.tcp, 0, sizeof( c->c.tcp ));
+	memset( c->tcp, 0, sizeof( c->tcp ));
+	c->rate.second    = (ui32)( now / SECONDS( 1 ));
 	
-	/* contabilizamos la nueva conexion */
-	nConnections++;
+	/* la enlazamos en el hash y al final de las ocupadas */
+	t->slots[ slot ].hash = hash;
+	t->slots[ slot ].idx  = SLAB_HANDLE_INDEX( handle );
+	c->position = t->nConnections;
+	t->active[ t->nConnections++ ] = SLAB_HANDLE_INDEX( handle );
+	t->stats.created++;
 	
-	return  TRUE;
+	return  c;
 }
 
 /*-----------------------------------------------------------------------------
  * computeStatistics()
  *---------------------------------------------------------------------------*/
-void  computeStatistics( struct internalConnection *c, struct packet *p )
+void  computeStatistics( struct internalConnection *c, struct packet *p, int dir, ui64 now )
 {
-	/* incrementa el nmero de paquetes recibidos */
-	c->c.packetsCount++;
+	ui32  second = (ui32)( now / SECONDS( 1 ));
+	
+	/* incrementa el nmero de paquetes recibidos en su sentido */
+	c->c.dirPackets[ dir ] += p->segments;
+	
+	/* con snaplen la longitud capturada no sirve para contar bytes, y un
+	   supersegmento GRO/TSO cuenta como los paquetes que eran en el cable */
+	c->c.dirBytes[ dir ] += p->wireBytes;
+	
+	/* el caudal se suma al segundo en curso; al empezar otro, el que
+	   acaba entra en las medias */
+	if( second > c->rate.second )
+		closeRateSecond( &c->rate, &c->average, second );
+	c->rate.packets += p->segments;
+	c->rate.bytes   += p->wireBytes;
 }	
+
+/*-----------------------------------------------------------------------------
+ * updateTcpState()
+ *---------------------------------------------------------------------------*/
+void  updateTcpState( struct internalConnection *c, const struct packet *p, int dir )
+{
+	uchar  flags = p->tcpFlags;
+	
+	/* los fragmentos posteriores no traen cabecera TCP */
+	if( c->c.tp_protocol != TT_TCP  ||  p->tl != TT_TCP )
+		return;
+	
+	if( flags & TCP_RST )
+	{
+		c->c.tcpState = TCPS_CLOSED;
+		return;
+	}
+	
+	/* un SYN empieza la conexin, tambin si reutiliza los puertos de una cerrada */
+	if(( flags & ( TCP_SYN | TCP_ACK )) == TCP_SYN )
+	{
+		if( c->c.tcpState == TCPS_NONE  ||  c->c.tcpState == TCPS_CLOSED )
+		{
+			c->c.tcpState = TCPS_SYN_SENT;
+			c->finSeen    = 0;
+		}
+		return;
+	}
+	if(( flags & ( TCP_SYN | TCP_ACK )) == ( TCP_SYN | TCP_ACK ))
+	{
+		if( c->c.tcpState == TCPS_NONE  ||  c->c.tcpState == TCPS_SYN_SENT )
+			c->c.tcpState = TCPS_SYN_RECV;
+		return;
+	}
+	
+	/* lo que llega tras cerrar no la revive */
+	if( c->c.tcpState == TCPS_CLOSED )
+		return;
+	
+	/* el ACK que termina la negociacin, o una conexin cogida empezada */
+	if( c->c.tcpState == TCPS_NONE  ||  c->c.tcpState == TCPS_SYN_RECV  ||
+	  ( c->c.tcpState == TCPS_SYN_SENT  &&  ( flags & TCP_ACK )))
+		c->c.tcpState = TCPS_ESTABLISHED;
+	
+	/* se cierra cuando los dos lados han mandado su FIN */
+	if( flags & TCP_FIN )
+	{
+		c->finSeen   |= 1 << dir;
+		c->c.tcpState = c->finSeen == 3 ? TCPS_CLOSED : TCPS_FIN_WAIT;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * analyzeTcp()
+ *---------------------------------------------------------------------------*/
+void  analyzeTcp( struct internalConnection *c, const struct packet *p, int dir, ui64 now )
+{
+	const struct tcpHeader  *tcp;
+	struct tcpSide          *s = &c->tcp[ dir ], *o = &c->tcp[ dir ^ 1 ];
+	struct cntTcpStats      *st = &c->c.tcp;
+	ui32                     seq, ack, len, us, sample, *rtt;
+	ui16                     window;
+	uchar                    flags = p->tcpFlags;
+	
+	/* los fragmentos posteriores no traen cabecera TCP, y un RST no
+	   anuncia nada que valga la pena */
+	if( c->c.tp_protocol != TT_TCP  ||  p->tl != TT_TCP  ||  ( flags & TCP_RST ))
+		return;
+	
+	tcp    = PKT_TCP( p );
+	seq    = ntohl( tcp->seq_num );
+	ack    = ntohl( tcp->ack_num );
+	window = ntohs( tcp->window );
+	len    = p->payloadLen + (( flags & TCP_SYN ) ? 1 : 0 ) + (( flags & TCP_FIN ) ? 1 : 0 );
+	us     = (ui32)( now / 1000 );
+	
+	/* un SYN que abre otra vez los puertos de una conexin cerrada empieza
+	   de cero; se llama antes que updateTcpState() para verlo */
+	if(( flags & ( TCP_SYN | TCP_ACK )) == TCP_SYN )
+	{
+		if( c->c.tcpState == TCPS_NONE  ||  c->c.tcpState == TCPS_CLOSED )
+			memset( c->tcp, 0, sizeof( c->tcp ));
+		c->synTime = us;
+		s->flags  |= TS_SYN;
+	}
+	
+	/* datos de este lado: lo que no avanza es una retransmisin, salvo si
+	   llega justo tras los siguientes, que es que se han desordenado */
+	if( len > 0 )
+	{
+		if( !( s->flags & TS_SEQ )  ||  SEQ_GEQ( seq, s->nextSeq ))
+		{
+			s->nextSeq    = seq + len;
+			s->advancedAt = us;
+			s->flags     |= TS_SEQ;
+			if( !( s->flags & TS_TIMING ))
+			{
+				s->timedSeq = s->nextSeq;
+				s->timedAt  = us;
+				s->flags   |= TS_TIMING;
+			}
+		}
+		else if( len > 1  ||  seq != s->nextSeq - 1  ||  ( flags & ( TCP_SYN | TCP_FIN )))
+		{
+			/* los keepalive, un byte ya confirmado, no cuentan */
+			if( us - s->advancedAt < ( st->rtt[ dir ] != 0 ? st->rtt[ dir ] : TCP_REORDER_US ))
+				st->outOfOrder[ dir ]++;
+			else
+				st->retransmissions[ dir ]++;
+			
+			/* Karn: si se repite lo cronometrado no se sabe a cul responde el ACK */
+			if(( s->flags & TS_TIMING )  &&  SEQ_LT( seq, s->timedSeq ))
+				s->flags &= ~TS_TIMING;
+			if( SEQ_LT( s->nextSeq, seq + len ))
+				s->nextSeq = seq + len;
+		}
+	}
+	
+	if( flags & TCP_ACK )
+	{
+		/* el ACK que cubre el segmento cronometrado del otro lado da una muestra */
+		if(( o->flags & TS_TIMING )  &&  SEQ_GEQ( ack, o->timedSeq ))
+		{
+			sample   = us - o->timedAt != 0 ? us - o->timedAt : 1;
+			rtt      = &st->rtt[ dir ^ 1 ];
+			*rtt     = *rtt == 0 ? sample : (ui32)(( 7ULL * *rtt + sample ) / 8 );
+			o->flags &= ~TS_TIMING;
+		}
+		
+		/* el que termina la negociacin, del mismo lado que el SYN */
+		if(( s->flags & TS_SYN )  &&  !( flags & TCP_SYN )  &&  ( o->flags & TS_SEQ )  &&  ack == o->nextSeq )
+		{
+			st->handshakeRtt = us - c->synTime != 0 ? us - c->synTime : 1;
+			s->flags &= ~TS_SYN;
+		}
+		
+		/* repetido: el mismo ACK y la misma ventana, sin datos, y con datos
+		   del otro lado an por confirmar */
+		if( len == 0  &&  ( s->flags & TS_ACK )  &&  ack == s->lastAck  &&  window == s->window  &&
+		  ( o->flags & TS_SEQ )  &&  ack != o->nextSeq )
+			st->dupAcks[ dir ]++;
+		s->lastAck = ack;
+		s->flags  |= TS_ACK;
+	}
+	
+	/* cada vez que se queda sin ventana */
+	if( window == 0  &&  !( s->flags & TS_ZERO_WINDOW ))
+	{
+		st->zeroWindows[ dir ]++;
+		s->flags |= TS_ZERO_WINDOW;
+	}
+	else if( window != 0 )
+		s->flags &= ~TS_ZERO_WINDOW;
+	s->window = window;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildRateDecay()
+ *---------------------------------------------------------------------------*/
+void  buildRateDecay()
+{
+	int  w, n;
+	
+	/* (1 - peso)^n en enteros, para no ir segundo a segundo */
+	for( w = 0; w < CNT_RATE_WINDOWS; w++ )
+	{
+		rateDecay[w][0] = RATE_ONE;
+		for( n = 1; n < RATE_DECAY_STEPS; n++ )
+			rateDecay[w][n] = (ui32)( ( (ui64)rateDecay[w][n - 1] * ( RATE_ONE - rateWeight[w] )) >> 16 );
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * closeRateSecond()
+ *---------------------------------------------------------------------------*/
+void  closeRateSecond( struct rateState *r, struct rateAverages *avg, ui32 second )
+{
+	ui64  bytes   = r->bytes << RATE_SHIFT;
+	ui64  packets = (ui64)r->packets << RATE_SHIFT;
+	ui32  idle, n, decay;
+	int   w;
+	
+	/* los segundos sin trfico entre el que se cierra y el nuevo */
+	idle = second - r->second - 1;
+	
+	/* media = peso * muestra + ( 1 - peso ) * media */
+	for( w = 0; w < CNT_RATE_WINDOWS; w++ )
+	{
+		avg->bytes[w]   = ( bytes * rateWeight[w] + avg->bytes[w] * ( RATE_ONE - rateWeight[w] )) >> 16;
+		avg->packets[w] = ( packets * rateWeight[w] + avg->packets[w] * ( RATE_ONE - rateWeight[w] )) >> 16;
+	}
+	
+	/* y cada segundo vaco es una muestra a cero; casi siempre son menos
+	   de RATE_DECAY_STEPS y basta una vuelta */
+	for( n = idle; n > 0; n -= decay )
+	{
+		decay = n < RATE_DECAY_STEPS ? n : RATE_DECAY_STEPS - 1;
+		for( w = 0; w < CNT_RATE_WINDOWS; w++ )
+		{
+			avg->bytes[w]   = ( avg->bytes[w] * rateDecay[w][ decay ] ) >> 16;
+			avg->packets[w] = ( avg->packets[w] * rateDecay[w][ decay ] ) >> 16;
+		}
+	}
+	
+	r->second  = second;
+	r->packets = 0;
+	r->bytes   = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * idleTimeout()
+ *---------------------------------------------------------------------------*/
+ui64  idleTimeout( const struct internalConnection *c )
+{
+	switch( c->c.tcpState )
+	{
+		case TCPS_SYN_SENT:
+		case TCPS_SYN_RECV:		return SECONDS( CNT_TIMEOUT_TCP_SYN );
+		case TCPS_ESTABLISHED:	return SECONDS( CNT_TIMEOUT_TCP_EST );
+		case TCPS_FIN_WAIT:		return SECONDS( CNT_TIMEOUT_TCP_FIN );
+		case TCPS_CLOSED:		return SECONDS( CNT_TIMEOUT_TCP_CLOSED );
+		default:				return SECONDS( CNT_TIMEOUT_UDP );
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * removeConnection()
+ *---------------------------------------------------------------------------*/
+void  removeConnection( struct connectionTable *t, ui32 idx, enum eExpireReason reason )
+{
+	struct internalConnection  *c = CONNECTION( t, idx );
+	ui32                        i, j, home, last;
+	
+	/* lo ltimo que se ve de ella */
+	if( t->recordFn != NULL )
+		t->recordFn( t->recordCtx, t, &c->c, reason );
+	
+	/* se saca del hash corriendo hacia atrs las que venan detrs en la
+	   misma racha, para no dejar huecos que corten una bsqueda; una puede
+	   ocupar el hueco i si su sitio natural no est entre i y ella */
+	for( i = c->hash & t->mask; t->slots[i].idx != idx; i = ( i + 1 ) & t->mask )
+		;
+	for( j = ( i + 1 ) & t->mask; t->slots[j].idx != NO_CONNECTION; j = ( j + 1 ) & t->mask )
+	{
+		home = t->slots[j].hash & t->mask;
+		if((( j - home ) & t->mask ) >= (( j - i ) & t->mask ))
+		{
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+	t->slots[i].idx = NO_CONNECTION;
+	
+	/* la ltima ocupada pasa a su sitio */
+	last = t->active[ --t->nConnections ];
+	t->active[ c->position ] = last;
+	CONNECTION( t, last )->position = c->position;
+	
+	/* suelta sus direcciones IPv6, que vuelven a darse si nadie ms las usa */
+	if( c->c.key.family == NT_IPV6 )
+	{
+		aiRelease( t->addresses, c->c.key.src );
+		aiRelease( t->addresses, c->c.key.dst );
+	}
+	
+	/* su memoria vuelve a la arena y su manejador deja de valer */
+	twCancel( t->timers, idx );
+	slabFree( t->arena, c->c.handle );
+	t->stats.expired++;
+}
+
+/*-----------------------------------------------------------------------------
+ * expireConnection()
+ *---------------------------------------------------------------------------*/
+ui64  expireConnection( void *ctx, ui32 idx, ui64 now )
+{
+	struct connectionTable     *t = ctx;
+	struct internalConnection  *c = CONNECTION( t, idx );
+	ui64                        deadline;
+	
+	/* el temporizador no se mueve con cada paquete: al vencer se mira si de
+	   verdad lleva su tiempo parada y, si no, se vuelve a programar */
+	deadline = c->c.lastSeen + idleTimeout( c );
+	if( deadline > now )
+	{
+		c->expires = deadline;
+		return deadline;
+	}
+	
+	removeConnection( t, idx, c->c.tcpState == TCPS_CLOSED ? EXPIRE_CLOSED : EXPIRE_IDLE );
+	return 0;
+}
 			
 /*****************************************************************************
  * Public interface implementation
  *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * cntCreateTable()
+ *---------------------------------------------------------------------------*/
+struct connectionTable * cntCreateTable()
+{
+	struct connectionTable  *t;
+	
+	t = calloc( 1, sizeof( struct connectionTable ));
+	if( t == NULL )
+		return NULL;
+	pthread_mutex_init( &t->lock, NULL );
+	
+	/* todo se reserva ahora: con la tabla llena no se pide ms memoria */
+	for( t->mask = 1; t->mask < maxConnections * 2; t->mask *= 2 )
+		;
+	t->mask--;
+	t->capacity    = maxConnections;
+	t->arena       = slabCreate( (ui64)t->capacity * slabClassSize( sizeof( struct internalConnection )));
+	t->cls         = t->arena != NULL ? slabAddClass( t->arena, sizeof( struct internalConnection )) : -1;
+	t->pool        = t->cls != -1 ? &t->arena->classes[ t->cls ] : NULL;
+	t->active      = malloc( (size_t)t->capacity * sizeof( ui32 ));
+	t->slots       = malloc( ( (size_t)t->mask + 1 ) * sizeof( struct hashSlot ));
+	t->timers      = twCreate( t->capacity );
+	t->addresses   = aiCreate( AI_DEFAULT_ADDRESSES );
+	t->fragments   = fragCreate( fragMemory );
+	if( t->cls == -1  ||  t->active == NULL  ||  t->slots == NULL  ||
+		t->timers == NULL  ||  t->addresses == NULL  ||  t->fragments == NULL )
+	{
+		printf( "cntCreateTable: not enough memory for %u connections\n", t->capacity );
+		cntDestroyTable( t );
+		return NULL;
+	}
+	
+	cntInitConnections( t );
+	if( rateDecay[0][0] == 0 )
+		buildRateDecay();
+	
+	return  t;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntDestroyTable()
+ *---------------------------------------------------------------------------*/
+void cntDestroyTable( struct connectionTable *t )
+{
+	if( t == NULL )
+		return;
+	
+	/* tambin la llama cntCreateTable() con la tabla a medio crear */
+	pthread_mutex_destroy( &t->lock );
+	slabDestroy( t->arena );
+	free( t->active );
+	free( t->slots );
+	twDestroy( t->timers );
+	aiDestroy( t->addresses );
+	fragDestroy( t->fragments );
+	free( t );
+}
+
+/*-----------------------------------------------------------------------------
+ * cntLock()
+ *---------------------------------------------------------------------------*/
+void cntLock( struct connectionTable *t )
+{
+	pthread_mutex_lock( &t->lock );
+}
+
+/*-----------------------------------------------------------------------------
+ * cntUnlock()
+ *---------------------------------------------------------------------------*/
+void cntUnlock( struct connectionTable *t )
+{
+	pthread_mutex_unlock( &t->lock );
+}
+
 /*-----------------------------------------------------------------------------
  * cntInitConnections()
  *---------------------------------------------------------------------------*/
-void cntInitConnections()
+void cntInitConnections( struct connectionTable *t )
 {
-	int  i;
+	ui32  i;
+	
+	assert( t != NULL );
+	
+	/* lo que haba se da como registros antes de borrarlo */
+	cntExportConnections( t, EXPIRE_RESET );
+	
+	/* todas las conexiones vuelven a la arena, con generacin nueva: los
+	   manejadores que tenga la interfaz ya no encuentran nada */
+	for( i = 0; i < t->nConnections; i++ )
+		slabFree( t->arena, CONNECTION( t, t->active[i] )->c.handle );
+	
+	for( i = 0; i <= t->mask; i++ )
+		t->slots[ i ].idx = NO_CONNECTION;
+	twReset( t->timers );
+	
+	/* sin conexiones ninguna direccin IPv6 sigue en uso */
+	aiReset( t->addresses );
+	fragReset( t->fragments );
+	t->nConnections = 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntSetRecordHandler()
+ *---------------------------------------------------------------------------*/
+void cntSetRecordHandler( struct connectionTable *t, cntRecordFn fn, void *ctx )
+{
+	assert( t != NULL );
 	
-	/* marcamos todas las conexiones como libres */
-	for( i = 0; i < MAX_CONNECTIONS; i++ )
-		connections[ i ].free = 1;
+	t->recordFn  = fn;
+	t->recordCtx = ctx;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntExportConnections()
+ *---------------------------------------------------------------------------*/
+void cntExportConnections( struct connectionTable *t, enum eExpireReason reason )
+{
+	ui32  i;
+	
+	assert( t != NULL );
 	
-	nConnections = 0;
+	/* las conexiones siguen en la tabla: es quien llama el que decide */
+	if( t->recordFn == NULL )
+		return;
+	for( i = 0; i < t->nConnections; i++ )
+		t->recordFn( t->recordCtx, t, &CONNECTION( t, t->active[i] )->c, reason );
 }
 
 /*-----------------------------------------------------------------------------
  * cntGetConnectionsCount()
  *---------------------------------------------------------------------------*/
-ui32 cntGetConnectionsCount()
+ui32 cntGetConnectionsCount( struct connectionTable *t )
 {
-	return  nConnections;
+	return  t->nConnections;
 }
 
 /*-----------------------------------------------------------------------------
  * cntGetConnection()
  *---------------------------------------------------------------------------*/
-struct connection *	cntGetConnection( ui32 idx )
+struct connection *	cntGetConnection( struct connectionTable *t, ui32 idx )
 {
-	if( idx >= nConnections )
+	if( idx >= t->nConnections )
 	{
 		assert( FALSE );
 		return NULL;
 	}
 	
-	return  &connections[ idx ].c;
+	/* las posiciones cambian cuando caduca alguna: no sirven de una vez a otra */
+	return  &CONNECTION( t, t->active[ idx ])->c;
 }
 
 /*-----------------------------------------------------------------------------
- * cntProcessPacket()
+ * cntLookup()
  *---------------------------------------------------------------------------*/
-struct connection *	cntProcessPacket( struct packet *p )
+struct connection *	cntLookup( struct connectionTable *t, cntHandle h )
 {
-	int    i;
-	int    connectionIdx;
-	uchar  bFound;
+	struct internalConnection  *c;
 	
-	assert( p != NULL );
+	assert( t != NULL );
+	
+	/* NULL si ya no est, aunque su memoria sea ahora de otra */
+	c = slabGet( t->arena, h );
+	if( c == NULL )
+		return  NULL;
 	
-	/* comprobamos si es un paquete de una conexin que ya procesamos */
-	bFound = FALSE;
-	for( i = 0; i < MAX_CONNECTIONS  &&  bFound == FALSE; i++ )
+	return  &c->c;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntGetIndex()
+ *---------------------------------------------------------------------------*/
+int cntGetIndex( struct connectionTable *t, cntHandle h )
+{
+	struct internalConnection  *c;
+	
+	assert( t != NULL );
+	
+	/* la posicin que tiene ahora para cntGetConnection(), -1 si ya no est */
+	c = slabGet( t->arena, h );
+	if( c == NULL )
+		return  -1;
+	
+	return  c->position;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntGetRates()
+ *---------------------------------------------------------------------------*/
+void cntGetRates( struct connectionTable *t, const struct connection *c, struct cntRates *rates )
+{
+	struct internalConnection  *ic;
+	struct rateState            r;
+	struct rateAverages         avg;
+	ui32                        second;
+	int                         w;
+	
+	assert( t != NULL  &&  c != NULL  &&  rates != NULL );
+	
+	memset( rates, 0, sizeof( *rates ));
+	ic = slabGet( t->arena, c->handle );
+	if( ic == NULL )
+		return;
+	
+	/* sobre una copia, se cierra el segundo que se estaba juntando si
+	   ya ha terminado y se descuentan los que lleva sin trfico; el
+	   segundo en curso an no cuenta */
+	r      = ic->rate;
+	avg    = ic->average;
+	second = (ui32)( t->now / SECONDS( 1 ));
+	if( second > r.second )
+		closeRateSecond( &r, &avg, second );
+	
+	for( w = 0; w < CNT_RATE_WINDOWS; w++ )
 	{
-		/* comprobamos que el par origen-destino coincide */
-		if( belongToConnection( &(connections[i].c), p ) == TRUE )
-		{
-			connectionIdx = i;
-			bFound        = TRUE;
-		}
+		rates->bitsPerSec[w]    = (double)avg.bytes[w] * 8 / ( 1 << RATE_SHIFT );
+		rates->packetsPerSec[w] = (double)avg.packets[w] / ( 1 << RATE_SHIFT );
 	}
+}
+
+/*-----------------------------------------------------------------------------
+ * cntFormatEndpoint()
+ *---------------------------------------------------------------------------*/
+void cntFormatEndpoint( struct connectionTable *t, const struct connection *c, uchar bDst, char *buffer, int size )
+{
+	char         address[ INET6_ADDRSTRLEN ];
+	ui32         addr = bDst ? c->key.dst : c->key.src;
+	const uchar *addr6;
+	
+	assert( t != NULL  &&  c != NULL );
 	
-	/* si ya existe, lo contabilizamos en las estadsticas */
-	if( bFound == TRUE )
+	/* "1.2.3.4:80" o "[2001:db8::1]:80" */
+	if( c->key.family == NT_IPV6 )
 	{
-		/* calculamos estadsticas */
-		computeStatistics( &connections[connectionIdx], p );
-		
-		/* devolvemos la conexcin asociada */
-		return  &(connections[connectionIdx].c);
+		addr6 = aiGet( t->addresses, addr );
+		if( addr6 == NULL  ||  inet_ntop( AF_INET6, addr6, address, sizeof( address )) == NULL )
+			strcpy( address, "?" );
+		snprintf( buffer, size, "[%s]:%d", address, ntohs( bDst ? c->key.dstPort : c->key.srcPort ));
 	}
-	/* si no pertenece a ninguno */
 	else
 	{
-		/* buscamos el primer slot libre */
-		for( i = 0; i < MAX_CONNECTIONS && bFound == FALSE; i++ )
-		{
-			if( connections[i].free == TRUE )
-			{
-				connectionIdx = i;
-				bFound        = TRUE;
-			}
-		}
-		
-		if( bFound == TRUE )
-		{
-			/* creamos una nueva conexin */
-			if( buildConnection( &connections[connectionIdx], p ) == TRUE )
-			{
-				/* contabilizamos las primeras estadsticas */
-				computeStatistics( &connections[connectionIdx], p );
-			
-				/* devolvemos la conexcin asociada */
-				return  &(connections[connectionIdx].c);
-			}
-			else
-			{
-				return  NULL;
-			}
-		}
-		else
-		{
-			/* no tenemos espacio libre para procesar ms conexiones */
+		inet_ntop( AF_INET, &addr, address, sizeof( address ));
+		snprintf( buffer, size, "%s:%d", address, ntohs( bDst ? c->key.dstPort : c->key.srcPort ));
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * cntGetDecapsulated()
+ *---------------------------------------------------------------------------*/
+ui64 cntGetDecapsulated( struct connectionTable *t, enum eEncapsulation encap )
+{
+	assert( t != NULL  &&  encap < ENCAP_COUNT );
+	
+	return  t->decapsulated[ encap ];
+}
+
+/*-----------------------------------------------------------------------------
+ * cntGetFragmentStats()
+ *---------------------------------------------------------------------------*/
+void cntGetFragmentStats( struct connectionTable *t, struct fragStats *stats )
+{
+	assert( t != NULL );
+	
+	fragGetStats( t->fragments, stats );
+}
+
+/*-----------------------------------------------------------------------------
+ * cntSetFragmentMemory()
+ *---------------------------------------------------------------------------*/
+int cntSetFragmentMemory( ui32 bytes )
+{
+	/* vale para las tablas que se creen a partir de ahora */
+	if( bytes < FRAG_MIN_MEMORY )
+	{
+		printf( "cntSetFragmentMemory: at least %d bytes are needed\n", FRAG_MIN_MEMORY );
+		return -1;
+	}
+	
+	fragMemory = bytes;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntSetMaxConnections()
+ *---------------------------------------------------------------------------*/
+int cntSetMaxConnections( ui32 count )
+{
+	/* vale para las tablas que se creen a partir de ahora */
+	if( count == 0  ||  count > CNT_MAX_CONNECTIONS )
+	{
+		printf( "cntSetMaxConnections: between 1 and %d connections\n", CNT_MAX_CONNECTIONS );
+		return -1;
+	}
+	
+	maxConnections = count;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntGetStats()
+ *---------------------------------------------------------------------------*/
+void cntGetStats( struct connectionTable *t, struct cntStats *stats )
+{
+	struct slabStats  arena;
+	ui64              index;
+	
+	assert( t != NULL  &&  stats != NULL );
+	
+	*stats          = t->stats;
+	stats->active   = t->nConnections;
+	stats->capacity = t->capacity;
+	
+	/* los ndices se reservan enteros al crear la tabla */
+	slabGetStats( t->arena, &arena );
+	index = (ui64)t->capacity * sizeof( ui32 ) + ( (ui64)t->mask + 1 ) * sizeof( struct hashSlot );
+	stats->memoryUsed      = arena.used;
+	stats->memoryCommitted = arena.committed + index;
+	stats->memoryReserved  = arena.reserved + index;
+	stats->bHugePages      = arena.bHugePages;
+}
+
+/*-----------------------------------------------------------------------------
+ * cntProcessPacket()
+ *---------------------------------------------------------------------------*/
+struct connection *	cntProcessPacket( struct connectionTable *t, struct packet *p, ui64 now )
+{
+	struct internalConnection  *c;
+	struct flowKey              key, canonical;
+	struct fragInfo             frag;
+	enum eFragResult            fragResult;
+	ui32                        hash, slot;
+	ui64                        deadline;
+	int                         swapped, dir;
+	
+	assert( t != NULL );
+	assert( p != NULL );
+	
+	if( now > t->now )
+		t->now = now;
+	
+	/* contamos lo que sale de los tneles aunque luego no se siga */
+	if( p->encap != ENCAP_NONE )
+		t->decapsulated[ p->encap ]++;
+	
+	/* los fragmentos sin cabecera de transporte van a la conexin de su
+	   datagrama; los que se adelantan al primero se cuentan cuando llegue */
+	fragResult = fragProcess( t->fragments, p, now, &frag );
+	if( fragResult == FRAG_HELD )
+		return NULL;
+	
+	/* la clave se calcula una vez por paquete, no una por conexin */
+	if( makeFlowKey( t, p, fragResult == FRAG_ATTRIBUTED ? &frag : NULL, &key ) == FALSE )
+		return NULL;
+	
+	/* comprobamos si es un paquete de una conexin que ya procesamos; si
+	   no, la creamos en el hueco que ha dejado la bsqueda. El hash es el
+	   que calcul el decodificador y con el que el kernel eligi el hilo,
+	   salvo en los fragmentos que usan los puertos del primero */
+	swapped = canonicalKey( &key, &canonical );
+	hash = fragResult == FRAG_ATTRIBUTED ? buildFlowHash( p, frag.srcPort, frag.dstPort ) : p->flowHash;
+	c    = lookup( t, &canonical, hash, &slot );
+	if( c == NULL )
+	{
+		c = buildConnection( t, p, &key, hash, slot, now );
+		if( c == NULL )
 			return  NULL;
-		}
+		swapped = c->bSwapped;
+	}
+	
+	/* el temporizador solo se adelanta, si el estado nuevo caduca antes;
+	   si se atrasa ya se ver cuando venza */
+	/* el sentido sale de la clave cannica, sin mirar la pblica */
+	dir = swapped ^ c->bSwapped ? CNT_DIR_REVERSE : CNT_DIR_FORWARD;
+	analyzeTcp( c, p, dir, now );
+	updateTcpState( c, p, dir );
+	if( now > c->c.lastSeen )
+		c->c.lastSeen = now;
+	deadline = c->c.lastSeen + idleTimeout( c );
+	if( deadline < c->expires )
+	{
+		c->expires = deadline;
+		twSchedule( t->timers, SLAB_HANDLE_INDEX( c->c.handle ), deadline );
+	}
+	
+	/* calculamos estadsticas */
+	computeStatistics( c, p, dir, now );
+	if( fragResult == FRAG_FIRST )
+	{
+		c->c.dirPackets[ dir ] += frag.pendingPackets;
+		c->c.dirBytes[ dir ]   += frag.pendingBytes;
+		c->rate.packets        += frag.pendingPackets;
+		c->rate.bytes          += frag.pendingBytes;
+	}
+	
+	/* devolvemos la conexcin asociada */
+	return  &(c->c);
+}
+
+/*-----------------------------------------------------------------------------
+ * cntProcessBurst()
+ *---------------------------------------------------------------------------*/
+void cntProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, cntHandle *handles, int count, ui64 now )
+{
+	struct connection  *c;
+	int  i;
+	
+	assert( packets != NULL );
+	assert( handles != NULL );
+	
+	/* procesamos la rfaga entera, handles[i] es la conexin del paquete i;
+	   now es el instante de la rfaga y times, si lo hay, el de cada
+	   paquete, que es el que necesitan los tiempos de ida y vuelta TCP */
+	for( i = 0; i < count; i++ )
+	{
+		c          = cntProcessPacket( t, &packets[i], times != NULL ? times[i] : now );
+		handles[i] = c != NULL ? c->handle : CNT_NO_HANDLE;
 	}
+	
+	/* despus salen las que han caducado. Con times, al reproducir, una
+	   conexin de esta rfaga puede llevar callada ms que su plazo a la
+	   hora now y salir aqu mismo: por eso se devuelven manejadores y no
+	   punteros, que quedaran colgando. Con count a 0 solo se hace esto,
+	   para que el reloj avance sin trfico y con l bajen las medias */
+	if( now > t->now )
+		t->now = now;
+	twAdvance( t->timers, now, expireConnection, t );
 }
 
 /****************************************************************************
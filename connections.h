@@ -7,8 +7,36 @@
 
 #include "types.h"
 #include "packetStruct.h"
+#include "fragTable.h"
+
+/** defines ******************************************************************/
+#define CNT_DEFAULT_CONNECTIONS	( 1 << 16 )		/* conexiones por hilo */
+#define CNT_MAX_CONNECTIONS		( 1 << 24 )
+
+/* segundos sin trfico hasta que una conexin caduca, segn su estado */
+#define CNT_TIMEOUT_UDP			60
+#define CNT_TIMEOUT_TCP_SYN		30				/* negociacin a medias */
+#define CNT_TIMEOUT_TCP_EST		300
+#define CNT_TIMEOUT_TCP_FIN		30				/* un FIN, falta el del otro lado */
+#define CNT_TIMEOUT_TCP_CLOSED	10				/* los dos FIN o un RST */
+
+#define CNT_NO_HANDLE			0				/* no es de ninguna conexin */
+
+/* sentidos de una conexin: el de su clave, que es el del primer paquete, y el contrario */
+#define CNT_DIR_FORWARD			0
+#define CNT_DIR_REVERSE			1
+
+/* medias del caudal de cada conexin: 1, 10 y 60 segundos */
+#define CNT_RATE_WINDOWS		3
+
+/** forward declarations *****************************************************/
+struct connectionTable;
 
 /** public types *************************************************************/
+/* identifica una conexin aunque cambie de posicin; deja de valer cuando
+   la conexin sale de la tabla, aunque otra ocupe luego su memoria */
+typedef ui64  cntHandle;
+
 /*******
  * eApplicationProtocol
  *******/
@@ -22,32 +50,152 @@ enum  eApplicationProtocol
 	AP_UNKNOWN
 };
 
+/*******
+ * eTcpState
+ *******/
+enum eTcpState
+{
+	TCPS_NONE,				/* no es TCP */
+	TCPS_SYN_SENT,
+	TCPS_SYN_RECV,
+	TCPS_ESTABLISHED,		/* tambin las que cogemos empezadas */
+	TCPS_FIN_WAIT,
+	TCPS_CLOSED
+};
+
+/*******
+ * eExpireReason
+ *******/
+enum eExpireReason
+{
+	EXPIRE_IDLE,			/* pas su tiempo sin trfico */
+	EXPIRE_CLOSED,			/* TCP cerrada con FIN o RST */
+	EXPIRE_RESET,			/* el usuario vaci la tabla */
+	EXPIRE_END				/* segua viva al salir */
+};
+
+/*******
+ * flowKey
+ *
+ * Clave de una conexin, igual para IPv4 que para IPv6: las direcciones
+ * IPv6 se guardan aparte (addrIntern) y aqu va su identificador. Con los
+ * tneles abiertos, la 5-tupla es la de dentro y el tnel forma parte de ella.
+ *******/
+struct flowKey
+{
+	ui32						src;			/* direccin IPv4 en orden de red o identificador IPv6 */
+	ui32						dst;
+	ui16						srcPort;		/* en orden de red */
+	ui16						dstPort;
+	ui32						tunnel;			/* VNI o clave GRE si encap no es ENCAP_NONE */
+	ui16						vlan;			/* VLAN exterior, 0 si no va etiquetada */
+	uchar						family;			/* NT_IP o NT_IPV6 */
+	uchar						proto;			/* IPPROTO_TCP o IPPROTO_UDP */
+	uchar						encap;			/* enum eEncapsulation */
+	uchar						reserved[3];	/* a cero, para poder comparar y mezclar la clave entera */
+};
+
+/*******
+ * cntTcpStats
+ *
+ * Anlisis de una conexin TCP tal como se ve desde el punto de captura.
+ * Los tiempos van en microsegundos, 0 si an no hay muestra, y cada par
+ * es por sentido: el del lado que manda los datos, los ACK o la ventana.
+ *******/
+struct cntTcpStats
+{
+	ui32						handshakeRtt;	/* del SYN al ACK que termina la negociacin */
+	ui32						rtt[2];			/* media de lo que tarda en confirmarse un segmento de ese sentido */
+	ui32						retransmissions[2];
+	ui32						outOfOrder[2];	/* segmentos atrasados que llegan justo tras los siguientes */
+	ui32						dupAcks[2];
+	ui32						zeroWindows[2];	/* veces que se queda sin ventana */
+};
+
 /*******
  * connection
  *******/
 struct connection
 {
-	uchar						src_addr[4];	/* direccin origen */
-	uchar						dst_addr[4];	/* direccin destino */
-	ui16						src_port;		/* puerto origen */
-	ui16						dst_port;		/* puerto destino */
+	/* lo que cambia con cada paquete va primero: junto con la parte
+	   privada de la tabla cae en las dos primeras lneas de cach */
+	ui32						dirPackets[2];	/* paquetes en cada sentido, CNT_DIR_FORWARD o CNT_DIR_REVERSE */
+	ui64						dirBytes[2];	/* bytes en el cable, aunque capturemos menos */
+	ui64						lastSeen;		/* hora del ltimo paquete, en ns */
+	enum eTcpState				tcpState;		/* TCPS_NONE si no es TCP */
+	enum eTransportProtocol		tp_protocol;	/* tipo de protocolo de transporte */
 	
 	/* estadsticas generales */
 	enum eNetworkProtocol		nt_protocol;	/* tipo de protocolo de red */
-	enum eTransportProtocol		tp_protocol;	/* tipo de protocolo de transporte */
 	enum eApplicationProtocol	ap_protocol;	/* protocolo de aplicacin */
+	ui64						firstSeen;		/* hora del primer paquete */
+	struct cntTcpStats			tcp;			/* a cero si no es TCP */
+	struct flowKey				key;			/* direcciones, puertos y VLAN */
+	cntHandle					handle;			/* para volver a encontrarla */
+};
+
+/*******
+ * cntRates
+ *
+ * Caudal de una conexin con media exponencial en cada ventana; solo se
+ * calcula al pedirlo, con los segundos ya terminados segn el reloj de la tabla.
+ *******/
+struct cntRates
+{
+	double						bitsPerSec[ CNT_RATE_WINDOWS ];
+	double						packetsPerSec[ CNT_RATE_WINDOWS ];
+};
+
+/*******
+ * cntStats
+ *******/
+struct cntStats
+{
+	ui32						active;			/* conexiones en la tabla */
+	ui32						capacity;
+	ui64						created;
+	ui64						expired;		/* caducadas o cerradas y ya fuera */
+	ui64						full;			/* paquetes de conexiones nuevas sin sitio */
 	
-	/* estadsiticas detalladas */
-	ui32						packetsCount;	/* nmero de paquetes de la conexin */
+	/* memoria de la tabla, en bytes */
+	ui64						memoryUsed;		/* en conexiones vivas */
+	ui64						memoryCommitted;	/* losas ya repartidas e ndices */
+	ui64						memoryReserved;	/* lo ms que puede llegar a ocupar */
+	uchar						bHugePages;		/* las conexiones van en pginas enormes */
 };
 
+/*******
+ * cntRecordFn
+ *
+ * Se llama con cada conexin que sale de la tabla, justo antes de borrarla,
+ * con la tabla bloqueada: es la ltima ocasin de ver sus contadores.
+ *******/
+typedef void (*cntRecordFn)( void *ctx, struct connectionTable *t, const struct connection *c, enum eExpireReason reason );
+
 /** public interface *********************************************************/
-void				cntInitConnections();
+struct connectionTable *	cntCreateTable();
+void				cntDestroyTable( struct connectionTable *t );
+void				cntLock( struct connectionTable *t );
+void				cntUnlock( struct connectionTable *t );
+
+void				cntInitConnections( struct connectionTable *t );
+void				cntSetRecordHandler( struct connectionTable *t, cntRecordFn fn, void *ctx );
+void				cntExportConnections( struct connectionTable *t, enum eExpireReason reason );
 
-ui32				cntGetConnectionsCount();
-struct connection *	cntGetConnection( ui32 idx );
+ui32				cntGetConnectionsCount( struct connectionTable *t );
+struct connection *	cntGetConnection( struct connectionTable *t, ui32 idx );
+struct connection *	cntLookup( struct connectionTable *t, cntHandle h );
+int					cntGetIndex( struct connectionTable *t, cntHandle h );
+void				cntGetRates( struct connectionTable *t, const struct connection *c, struct cntRates *rates );
+void				cntFormatEndpoint( struct connectionTable *t, const struct connection *c, uchar bDst, char *buffer, int size );
+ui64				cntGetDecapsulated( struct connectionTable *t, enum eEncapsulation encap );
+void				cntGetFragmentStats( struct connectionTable *t, struct fragStats *stats );
+int					cntSetFragmentMemory( ui32 bytes );
+int					cntSetMaxConnections( ui32 count );
+void				cntGetStats( struct connectionTable *t, struct cntStats *stats );
 
-struct connection *	cntProcessPacket( struct packet *p );
+struct connection *	cntProcessPacket( struct connectionTable *t, struct packet *p, ui64 now );
+void				cntProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, cntHandle *handles, int count, ui64 now );
 	
 
 #endif  /* _CONNECTIONS_H_ */
@@ -3,15 +3,132 @@
  *
  ****************************************************************************/
 #include "devConfig.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <net/if.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+/** defines ******************************************************************/
+#define VLAN_TAG_LEN		4		/* hasta dos etiquetas 802.1Q sobre la MTU */
+#define OFFLOAD_DEFAULT_MAX	65536	/* GRO_LEGACY_MAX_SIZE, si el kernel no lo dice */
+
+/** private interface ********************************************************/
+static ui32 getOffloadMaxSize( const char *interface );
 
 /** public interface *********************************************************/
 int setPromisc( const char *interface, int sock, ui16 state );
+ui32 getMaxFrameSize( const char *interface, int sock );
+int getHardwareType( const char *interface, int sock );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * getOffloadMaxSize()
+ *---------------------------------------------------------------------------*/
+static ui32 getOffloadMaxSize( const char *interface )
+{
+	struct
+	{
+		struct nlmsghdr   nh;
+		struct ifinfomsg  ifi;
+	} req;
+	char              reply[ 16384 ];
+	struct nlmsghdr  *nh;
+	struct rtattr    *rta;
+	int               sd, len, attrLen;
+	ui32              size, max = 0;
+
+	/* GRO junta las tramas recibidas y GSO/TSO deja salir supersegmentos:
+	   preguntamos a rtnetlink el tamao mximo de los dos */
+	sd = socket( AF_NETLINK, SOCK_RAW, NETLINK_ROUTE );
+	if( sd < 0 )
+		return  OFFLOAD_DEFAULT_MAX;
+
+	memset( &req, 0, sizeof( req ));
+	req.nh.nlmsg_len    = sizeof( req );
+	req.nh.nlmsg_type   = RTM_GETLINK;
+	req.nh.nlmsg_flags  = NLM_F_REQUEST;
+	req.ifi.ifi_family  = AF_UNSPEC;
+	req.ifi.ifi_index   = if_nametoindex( interface );
+	if( req.ifi.ifi_index == 0  ||  send( sd, &req, sizeof( req ), 0 ) < 0 )
+	{
+		close( sd );
+		return  OFFLOAD_DEFAULT_MAX;
+	}
+
+	len = recv( sd, reply, sizeof( reply ), 0 );
+	close( sd );
+
+	nh = (struct nlmsghdr *)reply;
+	if( len < 0  ||  !NLMSG_OK( nh, len )  ||  nh->nlmsg_type != RTM_NEWLINK )
+		return  OFFLOAD_DEFAULT_MAX;
+
+	attrLen = IFLA_PAYLOAD( nh );
+	for( rta = IFLA_RTA( NLMSG_DATA( nh )); RTA_OK( rta, attrLen ); rta = RTA_NEXT( rta, attrLen ))
+	{
+		if( rta->rta_type != IFLA_GRO_MAX_SIZE  &&  rta->rta_type != IFLA_GSO_MAX_SIZE )
+			continue;
+		memcpy( &size, RTA_DATA( rta ), sizeof( size ));
+		if( size > max )
+			max = size;
+	}
+
+	return  max != 0 ? max : OFFLOAD_DEFAULT_MAX;
+}
 
 /*****************************************************************************
  * Public interface implementation
  *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * getMaxFrameSize()
+ *---------------------------------------------------------------------------*/
+ui32 getMaxFrameSize( const char *interface, int sock )
+{
+	struct ifreq  iface;
+	ui32          size = 0, offload;
+
+	/* la trama ms grande sin offloads: MTU ms cabecera ethernet y VLANs */
+	memset( &iface, 0, sizeof( iface ));
+	strncpy( iface.ifr_name, interface, IFNAMSIZ - 1 );
+	if( ioctl( sock, SIOCGIFMTU, &iface ) == 0 )
+		size = iface.ifr_mtu + ETH_HLEN + 2 * VLAN_TAG_LEN;
+
+	/* con GRO o TSO pueden llegar supersegmentos mayores que la MTU */
+	offload = getOffloadMaxSize( interface ) + ETH_HLEN;
+	if( offload > size )
+		size = offload;
+
+	return  size;
+}
+
+/*-----------------------------------------------------------------------------
+ * getHardwareType()
+ *---------------------------------------------------------------------------*/
+int getHardwareType( const char *interface, int sock )
+{
+	struct ifreq  iface;
+
+	/* ARPHRD_* de la interfaz: dice qu cabecera de enlace llevan sus tramas */
+	memset( &iface, 0, sizeof( iface ));
+	strncpy( iface.ifr_name, interface, IFNAMSIZ - 1 );
+	if( ioctl( sock, SIOCGIFHWADDR, &iface ) == -1 )
+	{
+		printf( "error getting %s hardware type\n", interface );
+		return -1;
+	}
+
+	return  iface.ifr_hwaddr.sa_family;
+}
+
+/*-----------------------------------------------------------------------------
+ * setPromisc()
+ *---------------------------------------------------------------------------*/
 int setPromisc( const char *interface, int sock, ui16 state )
 {
     struct ifreq iface;
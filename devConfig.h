@@ -9,6 +9,8 @@
 
 /** public interface *********************************************************/
 int setPromisc ( const char *interface, int sock, ui16 state );
+ui32 getMaxFrameSize( const char *interface, int sock );
+int getHardwareType( const char *interface, int sock );
 	
 
 #endif  /* _DEVCONFIG_H_ */
@@ -31,24 +31,24 @@ void filterConnection( struct packet *p, struct connection *c )
 	c->ap_protocol = AP_UNKNOWN;
 	
 	/* comprobamos si es protocolo FTP */
-	if(   p->tl.type == TT_TCP &&
-		( ntohs( p->tl.tcp->src_port ) == PORT_FTP ||
-		  ntohs( p->tl.tcp->dst_port ) == PORT_FTP   ))
+	if(   p->tl == TT_TCP &&
+		( ntohs( p->srcPort ) == PORT_FTP ||
+		  ntohs( p->dstPort ) == PORT_FTP   ))
 		c->ap_protocol = AP_FTP;
 	/* comprobamos si es protocolo SSH */
-	if(   p->tl.type == TT_TCP &&
-		( ntohs( p->tl.tcp->src_port ) == PORT_SSH ||
-		  ntohs( p->tl.tcp->dst_port ) == PORT_SSH   ))
+	if(   p->tl == TT_TCP &&
+		( ntohs( p->srcPort ) == PORT_SSH ||
+		  ntohs( p->dstPort ) == PORT_SSH   ))
 		c->ap_protocol = AP_SSH;
 	/* comprobamos si es protocolo HTTP */
-	if(   p->tl.type == TT_TCP &&
-		( ntohs( p->tl.tcp->src_port ) == PORT_HTTP ||
-		  ntohs( p->tl.tcp->dst_port ) == PORT_HTTP   ))
+	if(   p->tl == TT_TCP &&
+		( ntohs( p->srcPort ) == PORT_HTTP ||
+		  ntohs( p->dstPort ) == PORT_HTTP   ))
 		c->ap_protocol = AP_HTTP;
 	/* comprobamos si es protocolo MSN */
-	if(   p->tl.type == TT_TCP &&
-		( ntohs( p->tl.tcp->src_port ) == PORT_MSN ||
-		  ntohs( p->tl.tcp->dst_port ) == PORT_MSN   ))
+	if(   p->tl == TT_TCP &&
+		( ntohs( p->srcPort ) == PORT_MSN ||
+		  ntohs( p->dstPort ) == PORT_MSN   ))
 		c->ap_protocol = AP_MSN;	
 }
 
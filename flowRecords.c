@@ -0,0 +1,327 @@
+/****************************************************************************
+ * Module:  flowRecords.c
+ *
+ ****************************************************************************/
+#include "flowRecords.h"
+#include "packetStruct.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+
+/** private data *************************************************************/
+static const char  *reasonNames[] = { "idle", "closed", "reset", "end" };
+static const char  *stateNames[]  = { "-", "syn_sent", "syn_recv", "established", "fin_wait", "closed" };
+static const char  *encapNames[ ENCAP_COUNT ] = { "-", "gre", "vxlan", "geneve" };
+
+/** private interface ********************************************************/
+static void   printRecord( struct flowRecords *fr, const struct frRecord *rec );
+static ui32   drainRings( struct flowRecords *fr );
+static void * writerThread( void *arg );
+
+/** public interface *********************************************************/
+struct flowRecords *	frOpen( const char *path, int ringCount );
+int						frClose( struct flowRecords *fr );
+void					frWrite( struct flowRecords *fr, int ring, struct connectionTable *t, const struct connection *c, enum eExpireReason reason );
+void					frSetLossless( struct flowRecords *fr );
+void					frFlush( struct flowRecords *fr );
+ui64					frGetCount( struct flowRecords *fr );
+ui64					frGetDrops( struct flowRecords *fr );
+int						frGetError( struct flowRecords *fr );
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * frOpen()
+ *---------------------------------------------------------------------------*/
+struct flowRecords * frOpen( const char *path, int ringCount )
+{
+	struct flowRecords  *fr;
+	assert( path != NULL  &&  ringCount > 0 );
+
+	fr = calloc( 1, sizeof( *fr ));
+	if( fr == NULL )
+		return NULL;
+
+	fr->file   = fopen( path, "w" );
+	fr->buffer = malloc( FR_BUFFER_SIZE );
+	if( fr->file == NULL  ||  fr->buffer == NULL )
+	{
+		printf( "frOpen: cannot open %s: %s\n", path, strerror( errno ));
+		if( fr->file != NULL )
+			fclose( fr->file );
+		free( fr->buffer );
+		free( fr );
+		return NULL;
+	}
+
+	/* solo escribe el hilo de los registros, en bloques grandes */
+	setvbuf( fr->file, fr->buffer, _IOFBF, FR_BUFFER_SIZE );
+	if( fprintf( fr->file, "reason,proto,src,dst,vlan,encap,tunnel,state,packets,bytes,"
+					   "fwd_packets,fwd_bytes,rev_packets,rev_bytes,first,last,"
+					   "handshake_rtt_us,fwd_rtt_us,rev_rtt_us,fwd_retrans,rev_retrans,fwd_ooo,rev_ooo,"
+					   "fwd_dupack,rev_dupack,fwd_zerowin,rev_zerowin\n" ) < 0 )
+		fr->error = errno;
+
+	fr->rings = calloc( ringCount, sizeof( struct spscRing * ));
+	if( fr->rings == NULL )
+	{
+		frClose( fr );
+		return NULL;
+	}
+	for( fr->ringCount = 0; fr->ringCount < ringCount; fr->ringCount++ )
+	{
+		fr->rings[ fr->ringCount ] = ringCreate( FR_RING_RECORDS, sizeof( struct frRecord ));
+		if( fr->rings[ fr->ringCount ] == NULL )
+		{
+			frClose( fr );
+			return NULL;
+		}
+	}
+
+	if( pthread_create( &fr->thread, NULL, writerThread, fr ) != 0 )
+	{
+		frClose( fr );
+		return NULL;
+	}
+	fr->bRunning = TRUE;
+
+	return fr;
+}
+
+/*-----------------------------------------------------------------------------
+ * frClose()
+ *---------------------------------------------------------------------------*/
+int frClose( struct flowRecords *fr )
+{
+	int  i, res = 0;
+
+	if( fr == NULL )
+		return 0;
+
+	/* el hilo vaca las colas antes de terminar */
+	if( fr->bRunning )
+	{
+		__atomic_store_n( &fr->bQuit, TRUE, __ATOMIC_RELEASE );
+		pthread_join( fr->thread, NULL );
+	}
+
+	for( i = 0; i < fr->ringCount; i++ )
+		ringDestroy( fr->rings[i] );
+	free( fr->rings );
+
+	/* lo que quede en el buffer de stdio se escribe aqu: un disco lleno
+	   puede no notarse hasta ahora */
+	if( fclose( fr->file ) == EOF  &&  fr->error == 0 )
+		fr->error = errno;
+	if( fr->error != 0 )
+	{
+		errno = fr->error;
+		res   = -1;
+	}
+	free( fr->buffer );
+	free( fr );
+
+	return res;
+}
+
+/*-----------------------------------------------------------------------------
+ * frWrite()
+ *---------------------------------------------------------------------------*/
+void frWrite( struct flowRecords *fr, int ring, struct connectionTable *t, const struct connection *c, enum eExpireReason reason )
+{
+	struct spscRing  *r;
+	struct frRecord  *rec;
+	struct timespec   ts;
+
+	assert( fr != NULL  &&  c != NULL );
+	assert( ring >= 0  &&  ring < fr->ringCount );
+
+	/* cada cola tiene un solo productor a la vez: la tabla solo se toca
+	   con su cerrojo, o cuando ya no quedan hilos de captura */
+	r = fr->rings[ ring ];
+	if( fr->bLossless )
+	{
+		ts.tv_sec  = 0;
+		ts.tv_nsec = FR_IDLE_SLEEP_MS * 1000000L;
+		while( ringOccupancy( r ) == ringSize( r ))
+			nanosleep( &ts, NULL );
+	}
+
+	/* con la cola llena el registro se pierde y lo cuenta la cola */
+	rec = ringReserve( r );
+	if( rec == NULL )
+		return;
+
+	rec->c      = *c;
+	rec->reason = reason;
+	cntFormatEndpoint( t, c, FALSE, rec->src, sizeof( rec->src ));
+	cntFormatEndpoint( t, c, TRUE,  rec->dst, sizeof( rec->dst ));
+	ringCommit( r );
+}
+
+/*-----------------------------------------------------------------------------
+ * frSetLossless()
+ *---------------------------------------------------------------------------*/
+void frSetLossless( struct flowRecords *fr )
+{
+	assert( fr != NULL );
+
+	/* para volcar las tablas al terminar, con la captura ya parada: no hay
+	   paquetes que perder por esperar al escritor */
+	fr->bLossless = TRUE;
+}
+
+/*-----------------------------------------------------------------------------
+ * frFlush()
+ *---------------------------------------------------------------------------*/
+void frFlush( struct flowRecords *fr )
+{
+	struct timespec  ts;
+	int              i;
+
+	assert( fr != NULL );
+
+	/* espera a que el escritor haya sacado todo lo encolado; el contador
+	   de lneas se actualiza antes de liberar cada registro */
+	ts.tv_sec  = 0;
+	ts.tv_nsec = FR_IDLE_SLEEP_MS * 1000000L;
+	for( i = 0; i < fr->ringCount; i++ )
+	{
+		while( ringOccupancy( fr->rings[i] ) > 0 )
+			nanosleep( &ts, NULL );
+	}
+
+	/* con las colas vacas el escritor ya no toca el fichero */
+	if( fflush( fr->file ) == EOF  &&  fr->error == 0 )
+		__atomic_store_n( &fr->error, errno, __ATOMIC_RELAXED );
+}
+
+/*-----------------------------------------------------------------------------
+ * frGetCount()
+ *---------------------------------------------------------------------------*/
+ui64 frGetCount( struct flowRecords *fr )
+{
+	assert( fr != NULL );
+
+	return __atomic_load_n( &fr->records, __ATOMIC_RELAXED );
+}
+
+/*-----------------------------------------------------------------------------
+ * frGetDrops()
+ *---------------------------------------------------------------------------*/
+ui64 frGetDrops( struct flowRecords *fr )
+{
+	ui64  drops;
+	int   i;
+
+	assert( fr != NULL );
+
+	for( i = 0, drops = 0; i < fr->ringCount; i++ )
+		drops += ringOverflows( fr->rings[i] );
+
+	return drops;
+}
+
+/*-----------------------------------------------------------------------------
+ * frGetError()
+ *---------------------------------------------------------------------------*/
+int frGetError( struct flowRecords *fr )
+{
+	assert( fr != NULL );
+
+	return __atomic_load_n( &fr->error, __ATOMIC_RELAXED );
+}
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * printRecord()
+ *---------------------------------------------------------------------------*/
+static void printRecord( struct flowRecords *fr, const struct frRecord *rec )
+{
+	const struct connection   *c   = &rec->c;
+	const struct cntTcpStats  *tcp = &c->tcp;
+
+	/* los sentidos son el del primer paquete y el contrario; las horas, en
+	   segundos con nanosegundos; el anlisis TCP, a cero en UDP */
+	if( fprintf( fr->file, "%s,%s,%s,%s,%u,%s,%u,%s,%u,%llu,%u,%llu,%u,%llu,%llu.%09llu,%llu.%09llu,"
+						   "%u,%u,%u,%u,%u,%u,%u,%u,%u,%u,%u\n",
+				 reasonNames[ rec->reason ], c->tp_protocol == TT_TCP ? "tcp" : "udp", rec->src, rec->dst,
+				 c->key.vlan, encapNames[ c->key.encap ], c->key.tunnel, stateNames[ c->tcpState ],
+				 c->dirPackets[ CNT_DIR_FORWARD ] + c->dirPackets[ CNT_DIR_REVERSE ],
+				 (unsigned long long)( c->dirBytes[ CNT_DIR_FORWARD ] + c->dirBytes[ CNT_DIR_REVERSE ] ),
+				 c->dirPackets[ CNT_DIR_FORWARD ], (unsigned long long)c->dirBytes[ CNT_DIR_FORWARD ],
+				 c->dirPackets[ CNT_DIR_REVERSE ], (unsigned long long)c->dirBytes[ CNT_DIR_REVERSE ],
+				 c->firstSeen / 1000000000ULL, c->firstSeen % 1000000000ULL,
+				 c->lastSeen / 1000000000ULL, c->lastSeen % 1000000000ULL,
+				 tcp->handshakeRtt, tcp->rtt[ CNT_DIR_FORWARD ], tcp->rtt[ CNT_DIR_REVERSE ],
+				 tcp->retransmissions[ CNT_DIR_FORWARD ], tcp->retransmissions[ CNT_DIR_REVERSE ],
+				 tcp->outOfOrder[ CNT_DIR_FORWARD ], tcp->outOfOrder[ CNT_DIR_REVERSE ],
+				 tcp->dupAcks[ CNT_DIR_FORWARD ], tcp->dupAcks[ CNT_DIR_REVERSE ],
+				 tcp->zeroWindows[ CNT_DIR_FORWARD ], tcp->zeroWindows[ CNT_DIR_REVERSE ] ) < 0 )
+	{
+		/* solo cuenta lo que lleg al fichero */
+		if( fr->error == 0 )
+			__atomic_store_n( &fr->error, errno, __ATOMIC_RELAXED );
+		return;
+	}
+	__atomic_store_n( &fr->records, fr->records + 1, __ATOMIC_RELAXED );
+}
+
+/*-----------------------------------------------------------------------------
+ * drainRings()
+ *---------------------------------------------------------------------------*/
+static ui32 drainRings( struct flowRecords *fr )
+{
+	const struct frRecord  *rec;
+	ui32                    count;
+	int                     i;
+
+	/* una pasada por todas las colas, cada una hasta vaciarla */
+	for( i = 0, count = 0; i < fr->ringCount; i++ )
+	{
+		while(( rec = ringPeek( fr->rings[i] )) != NULL )
+		{
+			printRecord( fr, rec );
+			ringRelease( fr->rings[i] );
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*-----------------------------------------------------------------------------
+ * writerThread()
+ *---------------------------------------------------------------------------*/
+static void * writerThread( void *arg )
+{
+	struct flowRecords  *fr = arg;
+	struct timespec      ts;
+	uchar                bQuit;
+
+	ts.tv_sec  = 0;
+	ts.tv_nsec = FR_IDLE_SLEEP_MS * 1000000L;
+
+	/* al salir se da una ltima pasada: lo que se encol antes de pedirlo
+	   se ve seguro despus de leer bQuit */
+	for( ;; )
+	{
+		bQuit = __atomic_load_n( &fr->bQuit, __ATOMIC_ACQUIRE );
+		if( drainRings( fr ) > 0 )
+			continue;
+		if( bQuit )
+			break;
+		nanosleep( &ts, NULL );
+	}
+
+	return NULL;
+}
+
+/****************************************************************************
+ * End of flowRecords.c
+ ****************************************************************************/
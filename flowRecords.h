@@ -0,0 +1,75 @@
+/****************************************************************************
+ * Module:  flowRecords
+ *
+ ****************************************************************************/
+#ifndef _FLOWRECORDS_H_
+#define _FLOWRECORDS_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include "types.h"
+#include "connections.h"
+#include "spscRing.h"
+
+/** defines ******************************************************************/
+#define FR_BUFFER_SIZE			(1 << 20)	/* buffer de stdio, las lneas son cortas */
+#define FR_RING_RECORDS			(1 << 13)	/* registros en cola por hilo de captura */
+#define FR_ENDPOINT_SIZE		56			/* "[direccin IPv6]:puerto" */
+#define FR_IDLE_SLEEP_MS		1			/* espera del escritor con las colas vacas */
+
+/** public types *************************************************************/
+/*******
+ * frRecord
+ *
+ * Copia de la conexin tal como sali de la tabla. Los extremos van ya
+ * escritos: el identificador de una direccin IPv6 se reutiliza en cuanto
+ * la tabla suelta la conexin.
+ *******/
+struct frRecord
+{
+	struct connection	 c;
+	char				 src[ FR_ENDPOINT_SIZE ];
+	char				 dst[ FR_ENDPOINT_SIZE ];
+	enum eExpireReason	 reason;
+};
+
+/*******
+ * flowRecords
+ *
+ * Fichero de texto con una lnea por conexin que sale de una tabla. Cada
+ * tabla deja sus registros en su propia cola y un hilo aparte los escribe,
+ * as la captura no espera nunca al disco ni a stdio; si una cola se llena
+ * el registro se pierde y se cuenta.
+ *******/
+struct flowRecords
+{
+	pthread_t			 thread;		/* hilo que vaca las colas en el fichero */
+	uchar				 bRunning;
+	uchar				 bQuit;
+	uchar				 bLossless;		/* frWrite() espera en vez de perder registros */
+
+	struct spscRing	   **rings;			/* una por tabla, de 0 a ringCount - 1 */
+	int					 ringCount;
+
+	FILE				*file;
+	char				*buffer;
+	ui64				 records;		/* lneas escritas */
+	int					 error;			/* errno de la primera escritura fallida, 0 si ninguna */
+};
+
+/** public interface *********************************************************/
+struct flowRecords *	frOpen( const char *path, int ringCount );
+int						frClose( struct flowRecords *fr );
+
+void					frWrite( struct flowRecords *fr, int ring, struct connectionTable *t, const struct connection *c, enum eExpireReason reason );
+void					frSetLossless( struct flowRecords *fr );
+void					frFlush( struct flowRecords *fr );
+ui64					frGetCount( struct flowRecords *fr );
+ui64					frGetDrops( struct flowRecords *fr );
+int						frGetError( struct flowRecords *fr );
+
+
+#endif  /* _FLOWRECORDS_H_ */
+/****************************************************************************
+ * End of flowRecords.h
+ ****************************************************************************/
@@ -0,0 +1,422 @@
+/****************************************************************************
+ * Module:  fragTable.c
+ *
+ ****************************************************************************/
+#include "fragTable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+/** defines ******************************************************************/
+#define FRAG_NIL				0xffffffff		/* ndice que no apunta a nada */
+#define FRAG_TIMEOUT_NS			( (ui64)FRAG_TIMEOUT * 1000000000ULL )
+#define FRAG_MAX_RANGES			4				/* trozos sueltos por datagrama */
+
+/** private types ************************************************************/
+/*******
+ * fragRange
+ *******/
+struct fragRange
+{
+	ui16				 start;			/* en unidades de 8 bytes, como el offset IP */
+	ui16				 end;
+};
+
+/*******
+ * fragDatagram
+ *
+ * Un datagrama a medias. No se guardan los datos, solo qu trozos han
+ * llegado y cunto mide, que es lo que hace falta para saber cundo est
+ * completo y a qu conexin van sus fragmentos. Se guardan trozos y no
+ * una suma de bytes porque un fragmento repetido lo dara por completo
+ * antes de tiempo.
+ *******/
+struct fragDatagram
+{
+	/* clave: la del kernel, ms la VLAN y el tnel */
+	ui32				 src;
+	ui32				 dst;
+	ui32				 tunnel;
+	ui16				 id;
+	ui16				 vlan;
+	uchar				 proto;
+	uchar				 encap;
+
+	uchar				 bFirst;		/* ya vimos el fragmento 0 y sus puertos */
+	ui16				 srcPort;
+	ui16				 dstPort;
+	struct fragRange	 ranges[ FRAG_MAX_RANGES ];	/* carga IP recibida, sin solapes */
+	uchar				 rangeCount;
+	ui16				 total;			/* carga IP completa en unidades de 8, 0 hasta ver el ltimo */
+	ui32				 pendingPackets;	/* llegados antes que el primero */
+	ui64				 pendingBytes;
+	ui64				 expires;
+
+	ui32				 next;			/* cadena del hash o lista libre */
+	ui32				 older;			/* lista por antigedad */
+	ui32				 newer;
+};
+
+/*******
+ * fragTable
+ *
+ * Reserva fija de datagramas reservada en fragCreate(): un hash encadenado
+ * por ndices y una lista por antigedad. Como todos caducan a los mismos
+ * segundos, el ms antiguo es tambin el primero en caducar y el que se
+ * expulsa cuando no queda sitio; nunca se pide ms memoria.
+ *******/
+struct fragTable
+{
+	struct fragDatagram	*datagrams;
+	ui32				 capacity;
+	ui32				*buckets;		/* primer datagrama de cada cadena */
+	ui32				 mask;
+	ui32				 freeList;
+	ui32				 oldest;
+	ui32				 newest;
+
+	struct fragStats	 stats;
+};
+
+/** private interface ********************************************************/
+static ui32 hashKey( ui32 src, ui32 dst, ui16 id, uchar proto );
+static struct fragDatagram * lookup( struct fragTable *ft, const struct fragDatagram *key, ui32 bucket );
+static struct fragDatagram * allocate( struct fragTable *ft, const struct fragDatagram *key, ui32 bucket, ui64 now );
+static void release( struct fragTable *ft, ui32 idx );
+static void expire( struct fragTable *ft, ui64 now );
+static void addRange( struct fragDatagram *d, ui32 start, ui32 end );
+
+/** public interface *********************************************************/
+struct fragTable *	fragCreate( ui32 memory );
+void				fragDestroy( struct fragTable *ft );
+void				fragReset( struct fragTable *ft );
+enum eFragResult	fragProcess( struct fragTable *ft, const struct packet *p, ui64 now, struct fragInfo *info );
+void				fragGetStats( const struct fragTable *ft, struct fragStats *stats );
+
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * hashKey()
+ *---------------------------------------------------------------------------*/
+ui32 hashKey( ui32 src, ui32 dst, ui16 id, uchar proto )
+{
+	ui64  h;
+
+	/* la VLAN y el tnel casi nunca cambian entre datagramas: solo desempatan */
+	h  = ( (ui64)src << 32 | dst ) * 0x9e3779b97f4a7c15ULL;
+	h ^= ( (ui64)id << 8 | proto ) * 0xc2b2ae3d27d4eb4fULL;
+
+	return  (ui32)( h >> 32 );
+}
+
+/*-----------------------------------------------------------------------------
+ * lookup()
+ *---------------------------------------------------------------------------*/
+struct fragDatagram * lookup( struct fragTable *ft, const struct fragDatagram *key, ui32 bucket )
+{
+	struct fragDatagram  *d;
+	ui32                  idx;
+
+	for( idx = ft->buckets[ bucket ]; idx != FRAG_NIL; idx = d->next )
+	{
+		d = &ft->datagrams[ idx ];
+		if( d->src == key->src  &&  d->dst == key->dst  &&  d->id == key->id  &&  d->proto == key->proto  &&
+			d->vlan == key->vlan  &&  d->encap == key->encap  &&  d->tunnel == key->tunnel )
+			return d;
+	}
+
+	return NULL;
+}
+
+/*-----------------------------------------------------------------------------
+ * allocate()
+ *---------------------------------------------------------------------------*/
+struct fragDatagram * allocate( struct fragTable *ft, const struct fragDatagram *key, ui32 bucket, ui64 now )
+{
+	struct fragDatagram  *d;
+	ui32                  idx;
+
+	/* sin sitio se sacrifica el ms antiguo, que es el que menos va a completarse */
+	if( ft->freeList == FRAG_NIL )
+	{
+		release( ft, ft->oldest );
+		ft->stats.evictions++;
+	}
+
+	idx          = ft->freeList;
+	d            = &ft->datagrams[ idx ];
+	ft->freeList = d->next;
+
+	*d         = *key;
+	d->expires = now + FRAG_TIMEOUT_NS;
+
+	/* entra por la cabeza de su cadena y por el final de la lista de antigedad */
+	d->next               = ft->buckets[ bucket ];
+	ft->buckets[ bucket ] = idx;
+	d->older              = ft->newest;
+	d->newer              = FRAG_NIL;
+	if( ft->newest != FRAG_NIL )
+		ft->datagrams[ ft->newest ].newer = idx;
+	else
+		ft->oldest = idx;
+	ft->newest = idx;
+
+	ft->stats.inUse++;
+
+	return d;
+}
+
+/*-----------------------------------------------------------------------------
+ * release()
+ *---------------------------------------------------------------------------*/
+void release( struct fragTable *ft, ui32 idx )
+{
+	struct fragDatagram  *d = &ft->datagrams[ idx ];
+	ui32                 *link;
+
+	/* fuera de su cadena, que es corta */
+	link = &ft->buckets[ hashKey( d->src, d->dst, d->id, d->proto ) & ft->mask ];
+	while( *link != idx )
+		link = &ft->datagrams[ *link ].next;
+	*link = d->next;
+
+	/* fuera de la lista de antigedad */
+	if( d->older != FRAG_NIL )
+		ft->datagrams[ d->older ].newer = d->newer;
+	else
+		ft->oldest = d->newer;
+	if( d->newer != FRAG_NIL )
+		ft->datagrams[ d->newer ].older = d->older;
+	else
+		ft->newest = d->older;
+
+	d->next      = ft->freeList;
+	ft->freeList = idx;
+	ft->stats.inUse--;
+}
+
+/*-----------------------------------------------------------------------------
+ * expire()
+ *---------------------------------------------------------------------------*/
+void expire( struct fragTable *ft, ui64 now )
+{
+	/* la lista va por antigedad: se para en el primero que sigue vivo */
+	while( ft->oldest != FRAG_NIL  &&  ft->datagrams[ ft->oldest ].expires <= now )
+	{
+		release( ft, ft->oldest );
+		ft->stats.timeouts++;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * addRange()
+ *---------------------------------------------------------------------------*/
+void addRange( struct fragDatagram *d, ui32 start, ui32 end )
+{
+	ui32  i = 0;
+
+	/* se funde con los trozos que pisa o toca; un repetido no aade nada */
+	while( i < d->rangeCount )
+	{
+		if( end < d->ranges[i].start  ||  start > d->ranges[i].end )
+		{
+			i++;
+			continue;
+		}
+		if( d->ranges[i].start < start )
+			start = d->ranges[i].start;
+		if( d->ranges[i].end > end )
+			end = d->ranges[i].end;
+		d->ranges[i] = d->ranges[ --d->rangeCount ];
+	}
+
+	/* demasiados huecos: el trozo se olvida y el datagrama acabar
+	   caducando, que es mejor que darlo por completo sin estarlo */
+	if( d->rangeCount < FRAG_MAX_RANGES )
+	{
+		d->ranges[ d->rangeCount ].start = start;
+		d->ranges[ d->rangeCount ].end   = end;
+		d->rangeCount++;
+	}
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * fragCreate()
+ *---------------------------------------------------------------------------*/
+struct fragTable * fragCreate( ui32 memory )
+{
+	struct fragTable  *ft;
+	ui32               capacity, buckets;
+
+	if( memory < FRAG_MIN_MEMORY )
+	{
+		printf( "fragCreate: at least %d bytes are needed\n", FRAG_MIN_MEMORY );
+		return NULL;
+	}
+
+	/* el tope cubre los datagramas y sus cadenas: una por datagrama como mucho */
+	capacity = memory / ( sizeof( struct fragDatagram ) + sizeof( ui32 ));
+	for( buckets = 1; buckets * 2 <= capacity; buckets *= 2 )
+		;
+
+	ft = calloc( 1, sizeof( *ft ));
+	if( ft == NULL )
+		return NULL;
+
+	ft->capacity  = capacity;
+	ft->mask      = buckets - 1;
+	ft->datagrams = malloc( (size_t)capacity * sizeof( struct fragDatagram ));
+	ft->buckets   = malloc( (size_t)buckets * sizeof( ui32 ));
+	if( ft->datagrams == NULL  ||  ft->buckets == NULL )
+	{
+		fragDestroy( ft );
+		return NULL;
+	}
+
+	fragReset( ft );
+
+	return ft;
+}
+
+/*-----------------------------------------------------------------------------
+ * fragDestroy()
+ *---------------------------------------------------------------------------*/
+void fragDestroy( struct fragTable *ft )
+{
+	if( ft == NULL )
+		return;
+
+	free( ft->datagrams );
+	free( ft->buckets );
+	free( ft );
+}
+
+/*-----------------------------------------------------------------------------
+ * fragReset()
+ *---------------------------------------------------------------------------*/
+void fragReset( struct fragTable *ft )
+{
+	ui32  i;
+
+	assert( ft != NULL );
+
+	/* todos los datagramas a la lista libre y las cadenas vacas */
+	memset( ft->buckets, 0xff, (size_t)( ft->mask + 1 ) * sizeof( ui32 ));
+	for( i = 0; i < ft->capacity; i++ )
+		ft->datagrams[i].next = i + 1 < ft->capacity ? i + 1 : FRAG_NIL;
+	ft->freeList = 0;
+	ft->oldest   = FRAG_NIL;
+	ft->newest   = FRAG_NIL;
+
+	memset( &ft->stats, 0, sizeof( ft->stats ));
+	ft->stats.capacity = ft->capacity;
+}
+
+/*-----------------------------------------------------------------------------
+ * fragProcess()
+ *---------------------------------------------------------------------------*/
+enum eFragResult fragProcess( struct fragTable *ft, const struct packet *p, ui64 now, struct fragInfo *info )
+{
+	const struct ipHeader  *ip;
+	struct fragDatagram     key, *d;
+	enum eFragResult        result;
+	ui32                    bucket, offset, length, end;
+	ui16                    frag;
+
+	assert( ft != NULL  &&  p != NULL  &&  info != NULL );
+
+	/* solo nos interesan los fragmentos que acaban siendo una conexin */
+	if( !( p->flags & PKT_F_FRAGMENT )  ||  p->nl != NT_IP  ||
+		( p->ipProto != IPPROTO_TCP  &&  p->ipProto != IPPROTO_UDP ))
+		return FRAG_NOT_FRAGMENT;
+
+	ip     = PKT_IP( p );
+	frag   = ntohs( ip->frag );
+	offset = ( frag & IP_FRAG_OFFSET ) * 8;
+	if( ntohs( ip->packet_len ) < IP_HEADER_LEN( ip ))
+		return FRAG_NOT_FRAGMENT;
+	length = ntohs( ip->packet_len ) - IP_HEADER_LEN( ip );
+
+	/* un primer fragmento sin puertos no sirve para atribuir los dems */
+	if( offset == 0  &&  p->tl != TT_TCP  &&  p->tl != TT_UDP )
+		return FRAG_NOT_FRAGMENT;
+
+	expire( ft, now );
+
+	memset( &key, 0, sizeof( key ));
+	key.src    = p->srcAddr;
+	key.dst    = p->dstAddr;
+	key.id     = ntohs( ip->ID );
+	key.proto  = p->ipProto;
+	key.vlan   = p->vlanId;
+	key.encap  = p->encap;
+	key.tunnel = p->tunnelId;
+	bucket     = hashKey( key.src, key.dst, key.id, key.proto ) & ft->mask;
+
+	d = lookup( ft, &key, bucket );
+	if( d == NULL )
+		d = allocate( ft, &key, bucket, now );
+
+	if( offset == 0 )
+	{
+		/* el primero trae los puertos y se lleva lo que se le adelant */
+		d->bFirst            = TRUE;
+		d->srcPort           = p->srcPort;
+		d->dstPort           = p->dstPort;
+		info->pendingPackets = d->pendingPackets;
+		info->pendingBytes   = d->pendingBytes;
+		d->pendingPackets    = 0;
+		d->pendingBytes      = 0;
+		result               = FRAG_FIRST;
+	}
+	else if( d->bFirst )
+	{
+		info->srcPort = d->srcPort;
+		info->dstPort = d->dstPort;
+		result        = FRAG_ATTRIBUTED;
+	}
+	else
+	{
+		d->pendingPackets += p->segments;
+		d->pendingBytes   += p->wireBytes;
+		result             = FRAG_HELD;
+	}
+
+	/* el ltimo dice cunto mide el datagrama; cuando un solo trozo lo
+	   cubre entero se libera. Solo el ltimo puede no ser mltiplo de 8 */
+	end = ( offset + length + 7 ) / 8;
+	if( !( frag & IP_MORE_FRAGS ))
+		d->total = end;
+	if( length > 0 )
+		addRange( d, offset / 8, end );
+	if( d->total != 0  &&  d->bFirst  &&  d->rangeCount == 1  &&
+		d->ranges[0].start == 0  &&  d->ranges[0].end >= d->total )
+	{
+		release( ft, d - ft->datagrams );
+		ft->stats.completed++;
+	}
+
+	return result;
+}
+
+/*-----------------------------------------------------------------------------
+ * fragGetStats()
+ *---------------------------------------------------------------------------*/
+void fragGetStats( const struct fragTable *ft, struct fragStats *stats )
+{
+	assert( ft != NULL  &&  stats != NULL );
+
+	*stats = ft->stats;
+}
+
+/****************************************************************************
+ * End of fragTable.c
+ ****************************************************************************/
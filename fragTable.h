@@ -0,0 +1,69 @@
+/****************************************************************************
+ * Module:  fragTable
+ *
+ ****************************************************************************/
+#ifndef _FRAGTABLE_H_
+#define _FRAGTABLE_H_
+
+#include "types.h"
+#include "packetStruct.h"
+
+/** defines ******************************************************************/
+#define FRAG_DEFAULT_MEMORY		( 256 << 10 )	/* bytes por tabla de conexiones */
+#define FRAG_MIN_MEMORY			( 4 << 10 )
+#define FRAG_TIMEOUT			30				/* segundos, como ipfrag_time de Linux */
+
+/** forward declarations *****************************************************/
+struct fragTable;
+
+/** public types *************************************************************/
+/*******
+ * eFragResult
+ *******/
+enum eFragResult
+{
+	FRAG_NOT_FRAGMENT,		/* no es un fragmento IPv4 de TCP o UDP: se trata como siempre */
+	FRAG_FIRST,				/* primer fragmento, con los puertos; puede traer pendientes */
+	FRAG_ATTRIBUTED,		/* fragmento posterior de un datagrama cuyo primero ya vimos */
+	FRAG_HELD				/* lleg antes que el primero: se cuenta cuando aparezca */
+};
+
+/*******
+ * fragInfo
+ *
+ * Lo que fragProcess() sabe del datagrama: los puertos del primer
+ * fragmento y, cuando este llega, lo que se adelant y an no se cont.
+ *******/
+struct fragInfo
+{
+	ui16				 srcPort;		/* en orden de red */
+	ui16				 dstPort;
+	ui32				 pendingPackets;
+	ui64				 pendingBytes;
+};
+
+/*******
+ * fragStats
+ *******/
+struct fragStats
+{
+	ui32				 inUse;			/* datagramas a medias */
+	ui32				 capacity;		/* datagramas que caben en la reserva */
+	ui64				 completed;		/* datagramas con todos sus fragmentos */
+	ui64				 timeouts;		/* caducados sin completar */
+	ui64				 evictions;		/* expulsados por falta de sitio */
+};
+
+/** public interface *********************************************************/
+struct fragTable *	fragCreate( ui32 memory );
+void				fragDestroy( struct fragTable *ft );
+void				fragReset( struct fragTable *ft );
+
+enum eFragResult	fragProcess( struct fragTable *ft, const struct packet *p, ui64 now, struct fragInfo *info );
+void				fragGetStats( const struct fragTable *ft, struct fragStats *stats );
+
+
+#endif  /* _FRAGTABLE_H_ */
+/****************************************************************************
+ * End of fragTable.h
+ ****************************************************************************/
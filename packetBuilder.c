@@ -4,133 +4,1145 @@
  ****************************************************************************/
 #include "packetBuilder.h"
 #include "packetStruct.h"
+#include "capture.h"
+#include "pcapFile.h"
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include <netinet/in.h>
+#if defined( __x86_64__ )
+#include <immintrin.h>
+#endif
 
 /** defines ******************************************************************/
 #define ETHER_IP    0x0800      /* Identificador de trama Eth IP  */
 #define ETHER_ARP	0x0806      /* Identificador de trama Eth ARP */
 #define ETHER_IPX   0x8137      /* Identificador de trama Eth IPX  */
 #define ETHERII_TOP 0x0600      /* Hasta aqui, EthernetII, en teora el limite es 0x05DC */
+#define ETHER_IPV6  0x86dd
+#define ETHER_VLAN  0x8100      /* 802.1Q */
+#define ETHER_QINQ  0x88a8      /* 802.1ad, la etiqueta exterior del proveedor */
+#define ETHER_QINQ_OLD 0x9100   /* QinQ antes de 802.1ad */
+#define ETHER_MPLS  0x8847      /* MPLS unicast */
+#define ETHER_MPLS_MC 0x8848    /* MPLS multicast */
+
+#define DLL_MAX_TAGS		8			/* etiquetas VLAN ms MPLS que quitamos como mucho */
+#define TAG_LENGTH			4			/* tanto VLAN como MPLS */
+#define MPLS_BOTTOM			0x00000100	/* ltima etiqueta de la pila */
+
+#define IP6_MAX_EXTENSIONS	8			/* cabeceras de extensin que recorremos como mucho */
+
+/* tneles */
+#define ETHER_TEB			0x6558		/* Ethernet dentro de GRE o GENEVE */
+#define GRE_HEADER_LENGTH	4
+#define GRE_CHECKSUM		0x8000
+#define GRE_ROUTING			0x4000
+#define GRE_KEY				0x2000
+#define GRE_SEQUENCE		0x1000
+#define GRE_VERSION			0x0007
+#define VXLAN_PORT			4789
+#define VXLAN_HEADER_LENGTH	8
+#define VXLAN_VNI_VALID		0x08
+#define GENEVE_PORT			6081
+#define GENEVE_HEADER_LENGTH 8
+
+/* clasificacin por lotes: solo Ethernet II + IPv4 sin opciones ni
+   fragmentar + TCP o UDP va por el camino rpido, el resto por buildPacket() */
+#define BATCH_FRAMES		32
+#define FAST_L4_OFFSET		( ETHERII_HEADER_LENGTH + IP_HEADER_LENGTH_WITHOUT_OPTIONS )
+#define FAST_MIN_CAPLEN		( FAST_L4_OFFSET + TCP_HEADER_LENGTH )	/* tambin para UDP */
+#define FAST_ETH_IP			0x00450008	/* ethertype 0x0800 y versin/IHL 0x45, en little endian */
+
+/** private types ************************************************************/
+/*******
+ * classifyBatch
+ *
+ * Los campos que deciden el camino rpido de un lote de tramas, uno tras
+ * otro por campo para compararlos de 4 en 4 (SSE) o de 8 en 8 (AVX2).
+ * Cada palabra son 4 bytes de la trama tal cual, en little endian.
+ *******/
+struct classifyBatch
+{
+	int					 caplen[BATCH_FRAMES];
+	int					 len[BATCH_FRAMES];
+	ui32				 ethIp[BATCH_FRAMES];	/* bytes 12-15: ethertype, versin/IHL, TOS */
+	ui32				 ipLen[BATCH_FRAMES];	/* bytes 16-19: longitud total, ID */
+	ui32				 ipFrag[BATCH_FRAMES];	/* bytes 20-23: fragmento, TTL, protocolo */
+	ui32				 udpLen[BATCH_FRAMES];	/* bytes 38-41: longitud UDP o ack TCP */
+	ui32				 tcpOff[BATCH_FRAMES];	/* bytes 46-49: data offset, flags y ventana TCP */
+} __attribute__(( aligned( 32 )));
+
+typedef ui32 (*classifyFn)( const struct classifyBatch *b, int count );
+typedef void (*decodeLinkFn)( struct packet *packet );
 
 /** private interface ********************************************************/
-static void analizeRAW( const void *buffer, struct dataLinkLayer *dll );
-static void analizeDLL( const struct dataLinkLayer *dll, struct networkLayer *nl );
-static void analizeNL( const struct networkLayer *nl, struct transportLayer *tl );
+static void decodeFrame( const void *buffer, ui32 caplen, ui32 len, struct packet *packet );
+static ui32 foldAddress( const uchar *addr );
+static void decodeEthernet( struct packet *packet );
+static void decodeCooked( struct packet *packet );
+static void decodeCooked2( struct packet *packet );
+static void decodeLoopback( struct packet *packet );
+static void decodeRawIP( struct packet *packet );
+static int  decodeTags( struct packet *packet, ui32 ethertype, ui32 *offset );
+static void decodeNetwork( struct packet *packet, ui32 offset, ui32 ethertype );
+static void decodeTunnel( struct packet *packet, ui32 end );
+static void decodeInner( struct packet *packet, uchar encap, ui32 tunnelId, ui32 offset, ui32 protocol );
+static void decodeIP( struct packet *packet );
+static void decodeIPv6( struct packet *packet );
+static void decodeTransport( struct packet *packet, ui32 end );
+static void countSegments( struct packet *packet, ui16 gsoSize );
+static void gatherBatch( const struct frame *frames, int count, struct classifyBatch *b );
+static void fillFastPacket( const struct frame *f, const struct classifyBatch *b, int i, struct packet *packet );
+static ui32 classifyScalar( const struct classifyBatch *b, int count );
+#if defined( __x86_64__ )
+static ui32 classifySSE( const struct classifyBatch *b, int count );
+static ui32 classifyAVX2( const struct classifyBatch *b, int count );
+#endif
+
+/** private data *************************************************************/
+static classifyFn             classify       = NULL;	/* NULL hasta buildSetClassifier() */
+static enum eClassifier       classifierType = CLS_SCALAR;
+static uchar                  bInnerTunnels  = FALSE;	/* analizar lo que va dentro de los tneles */
+static decodeLinkFn           decodeLink     = decodeEthernet;	/* segn el tipo de enlace de la captura */
 
 /** public interface *********************************************************/
-int buildPacket( const void *buffer, struct packet *packet );
+int  buildPacket( const void *buffer, ui32 caplen, ui32 len, struct packet *packet );
+void buildPacketBurst( const struct frame *frames, struct packet *packets, int count );
+int  buildSetClassifier( enum eClassifier type );
+const char * buildGetClassifierName();
+void buildSetTunnelMode( uchar bInner );
+int  buildSetLinkType( ui32 linkType );
+ui32 buildFlowHash( const struct packet *packet, ui16 srcPort, ui16 dstPort );
 	
 
 /*****************************************************************************
  * Public interface implementation
  *****************************************************************************/
-int buildPacket( const void *buffer, struct packet *packet )
+int buildPacket( const void *buffer, ui32 caplen, ui32 len, struct packet *packet )
+{
+	assert( buffer != NULL );
+	assert( packet != NULL );
+	
+	decodeFrame( buffer, caplen, len, packet );
+	packet->flowHash = buildFlowHash( packet, packet->srcPort, packet->dstPort );
+	
+	return packet->errors;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildPacketBurst()
+ *---------------------------------------------------------------------------*/
+void buildPacketBurst( const struct frame *frames, struct packet *packets, int count )
+{
+	struct classifyBatch  batch;
+	ui32                  fast;
+	int                   i, base, n;
+	
+	assert( frames  != NULL );
+	assert( packets != NULL );
+	
+	if( classify == NULL )
+		buildSetClassifier( CLS_AUTO );
+	
+	/* clasificamos la rfaga por lotes: las tramas corrientes se rellenan sin
+	   ramas por protocolo y las dems pasan por el anlisis completo */
+	for( base = 0; base < count; base += BATCH_FRAMES )
+	{
+		n    = count - base < BATCH_FRAMES ? count - base : BATCH_FRAMES;
+		fast = 0;
+		if( decodeLink == decodeEthernet )
+		{
+			gatherBatch( frames + base, n, &batch );
+			fast = classify( &batch, n );
+		}
+		
+		for( i = 0; i < n; i++ )
+		{
+			if( fast & ( 1u << i ))
+			{
+				fillFastPacket( &frames[base + i], &batch, i, &packets[base + i] );
+				if( bInnerTunnels )
+					decodeTunnel( &packets[base + i], packets[base + i].payloadOffset + packets[base + i].payloadLen );
+			}
+			else
+				decodeFrame( frames[base + i].data, frames[base + i].caplen, frames[base + i].len, &packets[base + i] );
+			if( frames[base + i].gsoSize != 0 )
+				countSegments( &packets[base + i], frames[base + i].gsoSize );
+			if( frames[base + i].bVlan )
+			{
+				/* el kernel quit la etiqueta exterior; las que quedan en la trama son interiores */
+				packets[base + i].vlanId = frames[base + i].vlanTci & VLAN_ID_MASK;
+				packets[base + i].flags |= PKT_F_VLAN;
+			}
+			
+			/* con la VLAN ya puesta, que tambin entra en el hash */
+			packets[base + i].flowHash = buildFlowHash( &packets[base + i], packets[base + i].srcPort, packets[base + i].dstPort );
+		}
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * buildSetClassifier()
+ *---------------------------------------------------------------------------*/
+int buildSetClassifier( enum eClassifier type )
+{
+#if defined( __x86_64__ )
+	__builtin_cpu_init();
+	if( type == CLS_AUTO )
+		type = __builtin_cpu_supports( "avx2" ) ? CLS_AVX2 : CLS_SSE;
+	
+	switch( type )
+	{
+		case CLS_SCALAR:	classify = classifyScalar;	break;
+		case CLS_SSE:		classify = classifySSE;		break;	/* SSE2 siempre est en x86-64 */
+		case CLS_AVX2:
+			if( !__builtin_cpu_supports( "avx2" ))
+			{
+				printf( "buildSetClassifier: this CPU has no AVX2\n" );
+				return -1;
+			}
+			classify = classifyAVX2;
+			break;
+		default:
+			return -1;
+	}
+#else
+	if( type != CLS_AUTO  &&  type != CLS_SCALAR )
+	{
+		printf( "buildSetClassifier: SIMD classifiers are only built for x86-64\n" );
+		return -1;
+	}
+	type     = CLS_SCALAR;
+	classify = classifyScalar;
+#endif
+	
+	classifierType = type;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildSetTunnelMode()
+ *---------------------------------------------------------------------------*/
+void buildSetTunnelMode( uchar bInner )
 {
-	analizeRAW( buffer, &( packet->dll ));
-	analizeDLL( &( packet->dll ), &( packet->nl ));
-	analizeNL( &( packet->nl ), &( packet->tl ));
+	/* se fija al arrancar, antes de que lean los hilos de captura */
+	bInnerTunnels = bInner;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildSetLinkType()
+ *---------------------------------------------------------------------------*/
+int buildSetLinkType( ui32 linkType )
+{
+	/* se elige una vez al arrancar, no en cada trama; el camino rpido de
+	   buildPacketBurst() es solo para Ethernet */
+	switch( linkType )
+	{
+		case PCAP_LINKTYPE_ETHERNET:	decodeLink = decodeEthernet;	break;
+		case PCAP_LINKTYPE_LINUX_SLL:	decodeLink = decodeCooked;		break;
+		case PCAP_LINKTYPE_LINUX_SLL2:	decodeLink = decodeCooked2;		break;
+		case PCAP_LINKTYPE_NULL:
+		case PCAP_LINKTYPE_LOOP:		decodeLink = decodeLoopback;	break;
+		case PCAP_LINKTYPE_RAW:
+		case PCAP_LINKTYPE_IPV4:
+		case PCAP_LINKTYPE_IPV6:		decodeLink = decodeRawIP;		break;
+		default:
+			printf( "buildSetLinkType: unsupported link type %u\n", linkType );
+			return -1;
+	}
+	
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildFlowHash()
+ *---------------------------------------------------------------------------*/
+ui32 buildFlowHash( const struct packet *packet, ui16 srcPort, ui16 dstPort )
+{
+	ui32  a, b, pa, pb, h;
+	
+	assert( packet != NULL );
+	
+	/* los puertos se pasan aparte porque los fragmentos sin cabecera de
+	   transporte usan los del primero, que solo conoce la tabla de fragmentos */
+	switch( packet->nl )
+	{
+		case NT_IP:
+			a = ntohl( packet->srcAddr );
+			b = ntohl( packet->dstAddr );
+			break;
+		case NT_IPV6:
+			a = foldAddress( PKT_IP6( packet )->IPv6_src );
+			b = foldAddress( PKT_IP6( packet )->IPv6_dst );
+			break;
+		default:
+			return 0;
+	}
+	pa = ntohs( srcPort );
+	pb = ntohs( dstPort );
+	
+	/* el extremo menor primero: los dos sentidos mezclan lo mismo */
+	if( a > b  ||  ( a == b  &&  pa > pb ))
+	{
+		h = a;  a  = b;  b  = h;
+		h = pa; pa = pb; pb = h;
+	}
+	
+	/* solo multiplicaciones, desplazamientos y xor de 32 bits, que el BPF
+	   clsico del reparto del kernel tambin tiene */
+	h  = ( a * FLOW_HASH_MUL ) ^ b;
+	h  = ( h * FLOW_HASH_MUL ) ^ ( pa << 16 | pb );
+	h  = ( h * FLOW_HASH_MUL ) ^ ( (ui32)packet->ipProto << 16 | packet->vlanId );
+	h ^= h >> 15;
+	h *= FLOW_HASH_FINAL;
+	h ^= h >> 13;
+	
+	return h;
+}
+
+/*-----------------------------------------------------------------------------
+ * buildGetClassifierName()
+ *---------------------------------------------------------------------------*/
+const char * buildGetClassifierName()
+{
+	static const char *names[] = { "auto", "scalar", "sse", "avx2" };
+	
+	return names[classifierType];
 }
 	
 /*****************************************************************************
  * Private interface implementation
  *****************************************************************************/
 /*-----------------------------------------------------------------------------
- * analizeRAW()
+ * decodeFrame()
  *---------------------------------------------------------------------------*/
-static void analizeRAW( const void *buffer, struct dataLinkLayer *dll )
+static void decodeFrame( const void *buffer, ui32 caplen, ui32 len, struct packet *packet )
 {
-	assert( buffer != NULL );
-	assert( dll    != NULL );
+	/* todo el descriptor en una lnea de cach; lo que no se rellene queda a cero */
+	memset( packet, 0, sizeof( *packet ));
+	packet->data      = buffer;
+	packet->len       = len;
+	packet->caplen    = caplen;
+	packet->segments  = 1;
+	packet->wireBytes = len;
+	packet->dll       = DLL_UNKNOWN;
+	packet->nl        = NT_UNKNOWN;
+	packet->tl        = TT_UNKNOWN;
+	if( caplen < len )
+		packet->flags |= PKT_F_TRUNCATED;
+	
+	/* el decodificador del enlace se eligi al arrancar, con buildSetLinkType() */
+	decodeLink( packet );
+}
+
+/*-----------------------------------------------------------------------------
+ * foldAddress()
+ *---------------------------------------------------------------------------*/
+static ui32 foldAddress( const uchar *addr )
+{
+	ui32  w[4];
 	
-	dll->rawPtr = (void *)(buffer);
-	/* comprobamos el tipo de trama recibida */
-	if( ntohs(dll->ethII->ethertype) > ETHERII_TOP )
+	/* una direccin IPv6 en 32 bits, palabra a palabra como las lee el kernel */
+	memcpy( w, addr, sizeof( w ));
+	
+	return (( ntohl( w[0] ) * FLOW_HASH_MUL + ntohl( w[1] )) * FLOW_HASH_MUL + ntohl( w[2] )) * FLOW_HASH_MUL + ntohl( w[3] );
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeEthernet()
+ *---------------------------------------------------------------------------*/
+static void decodeEthernet( struct packet *packet )
+{
+	/* sin la cabecera ethernet entera no seguimos */
+	if( packet->caplen < ETHERII_HEADER_LENGTH )
 	{
-		/* la trama recibida es ethernet II */
-		dll->type = DLL_ETHERNET_II;
+		packet->errors |= PKT_E_SHORT_L2;
+		return;
 	}
-	else
-		/* trama desconocida */
-		dll->type = DLL_UNKNOWN;
+	packet->ethertype = ntohs( PKT_ETH( packet )->ethertype );
+	if( packet->ethertype <= ETHERII_TOP )
+		return;		/* 802.3, no lo analizamos */
+	packet->dll = DLL_ETHERNET_II;
+	
+	decodeNetwork( packet, ETHERII_HEADER_LENGTH, packet->ethertype );
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeCooked()
+ *---------------------------------------------------------------------------*/
+static void decodeCooked( struct packet *packet )
+{
+	/* "any" y las interfaces sin cabecera conocida: el ethertype va al final */
+	if( packet->caplen < SLL_HEADER_LENGTH )
+	{
+		packet->errors |= PKT_E_SHORT_L2;
+		return;
+	}
+	packet->ethertype = ntohs( PKT_SLL( packet )->protocol );
+	packet->dll       = DLL_LINUX_SLL;
+	if( packet->ethertype <= ETHERII_TOP )
+		return;		/* 802.2, CAN y otros pseudo-protocolos */
+	
+	decodeNetwork( packet, SLL_HEADER_LENGTH, packet->ethertype );
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeCooked2()
+ *---------------------------------------------------------------------------*/
+static void decodeCooked2( struct packet *packet )
+{
+	/* como la versin 1 pero con el ethertype al principio */
+	if( packet->caplen < SLL2_HEADER_LENGTH )
+	{
+		packet->errors |= PKT_E_SHORT_L2;
+		return;
+	}
+	packet->ethertype = ntohs( PKT_SLL2( packet )->protocol );
+	packet->dll       = DLL_LINUX_SLL2;
+	if( packet->ethertype <= ETHERII_TOP )
+		return;
+	
+	decodeNetwork( packet, SLL2_HEADER_LENGTH, packet->ethertype );
 }
 
 /*-----------------------------------------------------------------------------
- * analizeDLL()
+ * decodeLoopback()
  *---------------------------------------------------------------------------*/
-static void analizeDLL( const struct dataLinkLayer *dll, struct networkLayer *nl )
+static void decodeLoopback( struct packet *packet )
 {
-	assert( dll != NULL );
-	assert( nl  != NULL );
+	uchar  family;
 	
-	/* comprobamos el tipo de trama de enlace de datos pasada */
-	switch( dll->type )
+	if( packet->caplen < LOOPBACK_HEADER_LENGTH )
 	{
-		case DLL_ETHERNET_II:
-		{
-			/* si es ethernet II, rellenamos los datos y el tipo adecuadamente */
-			nl->rawPtr = (void *)(dll->ethII->data);
-			switch( ntohs( dll->ethII->ethertype ))
-			{
-				case ETHER_IP:   nl->type = NT_IP;       break;
-				case ETHER_ARP:	 nl->type = NT_ARP;      break;
-				case ETHER_IPX:	 nl->type = NT_IPX;      break;
-				default:		 nl->type = NT_UNKNOWN;  break;
-			}
+		packet->errors |= PKT_E_SHORT_L2;
+		return;
+	}
+	packet->dll = DLL_LOOPBACK;
+	
+	/* la familia va en 32 bits en el orden de quien captur (NULL) o en el
+	   de red (LOOP); cabe en un byte, as que est al principio o al final */
+	family = packet->data[0] != 0 ? packet->data[0] : packet->data[3];
+	switch( family )
+	{
+		case 2:												/* AF_INET en todos */
+			decodeNetwork( packet, LOOPBACK_HEADER_LENGTH, ETHER_IP );
 			break;
-		}
-		case DLL_UNKNOWN:
-			/* si no conocemos el tipo de trama de enlace de datos... como vamos a saber el tipo el paquete de red? :P */
-			nl->type = NT_UNKNOWN;
+		case 10: case 24: case 28: case 30:					/* AF_INET6 en Linux y los BSD */
+			decodeNetwork( packet, LOOPBACK_HEADER_LENGTH, ETHER_IPV6 );
 			break;
 		default:
-			nl->type = NT_UNKNOWN;
-			assert( FALSE );	/* no se debera llegar nunca aqu, pero por si acaso la estructura esta corrupta... */
 			break;
 	}
 }
 
 /*-----------------------------------------------------------------------------
- * analizeNL()
+ * decodeRawIP()
  *---------------------------------------------------------------------------*/
-static void analizeNL( const struct networkLayer *nl, struct transportLayer *tl )
+static void decodeRawIP( struct packet *packet )
 {
-	assert( nl != NULL );
-	assert( tl != NULL );
+	/* tun, wireguard y dems: solo la versin dice qu es */
+	if( packet->caplen < 1 )
+	{
+		packet->errors |= PKT_E_SHORT_L2;
+		return;
+	}
+	packet->dll = DLL_RAW_IP;
 	
-	/* comprobamos el tipo del paquete de red pasado */
-	switch( nl->type )
+	switch( packet->data[0] >> 4 )
 	{
-		case NT_IP:
-			/* si es un paquete IP, rellenamos los datos y el tipo de la capa de tranporte */
-			tl->rawPtr = (uchar *)(nl->ip) + ( nl->ip->header_len * 4 );
-			switch( nl->ip->protocol )
+		case 4:		decodeNetwork( packet, 0, ETHER_IP );	break;
+		case 6:		decodeNetwork( packet, 0, ETHER_IPV6 );	break;
+		default:	break;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeTags()
+ *---------------------------------------------------------------------------*/
+static int decodeTags( struct packet *packet, ui32 ethertype, ui32 *offset )
+{
+	ui32  tag, tags;
+	
+	/* devuelve el ethertype de lo que va debajo de las etiquetas, o -1 si
+	   no caben; el nmero de etiquetas est acotado para no recorrer basura */
+	for( tags = 0; ; tags++ )
+	{
+		if( ethertype != ETHER_VLAN  &&  ethertype != ETHER_QINQ  &&  ethertype != ETHER_QINQ_OLD  &&
+			ethertype != ETHER_MPLS  &&  ethertype != ETHER_MPLS_MC )
+			return ethertype;
+		
+		if( tags == DLL_MAX_TAGS )
+		{
+			packet->errors |= PKT_E_BAD_L2;
+			return -1;
+		}
+		if( packet->caplen < *offset + TAG_LENGTH )
+		{
+			packet->errors |= PKT_E_SHORT_L2;
+			return -1;
+		}
+		memcpy( &tag, packet->data + *offset, TAG_LENGTH );
+		tag      = ntohl( tag );
+		*offset += TAG_LENGTH;
+		
+		if( ethertype == ETHER_MPLS  ||  ethertype == ETHER_MPLS_MC )
+		{
+			packet->flags |= PKT_F_MPLS;
+			if(( tag & MPLS_BOTTOM ) == 0 )
+				continue;
+			
+			/* MPLS no dice qu lleva dentro: lo deducimos de la versin IP */
+			if( packet->caplen < *offset + 1 )
 			{
-				case IPPROTO_ICMP:	tl->type = TT_ICMP;    break;
-				case IPPROTO_UDP:   tl->type = TT_UDP;     break;
-				case IPPROTO_TCP:   tl->type = TT_TCP;     
-									tl->data_size = (ntohs (nl->ip->packet_len) - 
-														   (nl->ip->header_len)*4); //bufff... vete a averiguar esto :), el tamao de datos				
-									break;
-				default:			tl->type = TT_UNKNOWN; break;
+				packet->errors |= PKT_E_SHORT_L2;
+				return -1;
 			}
+			switch( packet->data[*offset] >> 4 )
+			{
+				case 4:		return ETHER_IP;
+				case 6:		return ETHER_IPV6;
+				default:	return 0;
+			}
+		}
+		
+		/* VLAN: TCI y el ethertype siguiente; nos quedamos con la exterior */
+		if(( packet->flags & PKT_F_VLAN ) == 0 )
+		{
+			packet->vlanId = ( tag >> 16 ) & VLAN_ID_MASK;
+			packet->flags |= PKT_F_VLAN;
+		}
+		ethertype = tag & 0xffff;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeNetwork()
+ *---------------------------------------------------------------------------*/
+static void decodeNetwork( struct packet *packet, ui32 offset, ui32 ethertype )
+{
+	int  type;
+	
+	/* etiquetas VLAN y MPLS entre la cabecera ethernet y la de red */
+	type = decodeTags( packet, ethertype, &offset );
+	if( type < 0 )
+		return;
+	packet->ethertype = type;
+	packet->l3Offset  = offset;
+	
+	/* red */
+	switch( packet->ethertype )
+	{
+		case ETHER_IP:   decodeIP( packet );     break;
+		case ETHER_IPV6: decodeIPv6( packet );   break;
+		case ETHER_ARP:	 packet->nl = NT_ARP;    break;
+		case ETHER_IPX:	 packet->nl = NT_IPX;    break;
+		default:		 break;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeIP()
+ *---------------------------------------------------------------------------*/
+static void decodeIP( struct packet *packet )
+{
+	const struct ipHeader  *ip;
+	ui32                    hdrLen, totalLen, end;
+	
+	/* la cabecera fija tiene que estar capturada entera */
+	if( packet->caplen < (ui32)packet->l3Offset + IP_HEADER_LENGTH_WITHOUT_OPTIONS )
+	{
+		packet->errors |= PKT_E_SHORT_L3;
+		return;
+	}
+	ip     = PKT_IP( packet );
+	hdrLen = IP_HEADER_LEN( ip );
+	if( IP_VERSION( ip ) != 4  ||  hdrLen < IP_HEADER_LENGTH_WITHOUT_OPTIONS )
+	{
+		packet->errors |= PKT_E_BAD_L3;
+		return;
+	}
+	if( packet->caplen < packet->l3Offset + hdrLen )
+	{
+		packet->errors |= PKT_E_SHORT_L3;
+		return;
+	}
+	
+	/* la longitud total manda sobre el relleno ethernet; a cero en los
+	   supersegmentos TSO, que pueden pasar de 64 KB */
+	totalLen = ntohs( ip->packet_len );
+	if( totalLen == 0 )
+	{
+		/* la longitud del cable tiene que cubrir al menos la cabecera */
+		if( packet->len < packet->l3Offset + hdrLen )
+		{
+			packet->errors |= PKT_E_BAD_L3;
+			return;
+		}
+		totalLen = packet->len - packet->l3Offset;
+	}
+	else if( totalLen < hdrLen )
+	{
+		packet->errors |= PKT_E_BAD_L3;
+		return;
+	}
+	end = packet->l3Offset + totalLen;
+	if( end > packet->len )
+	{
+		/* dice ser ms largo de lo que lleg por el cable */
+		packet->errors |= PKT_E_BAD_L3;
+		end = packet->len;
+	}
+	
+	packet->nl       = NT_IP;
+	packet->ipProto  = ip->protocol;
+	memcpy( &packet->srcAddr, ip->IPv4_src, 4 );	/* la cabecera no tiene por qu estar alineada */
+	memcpy( &packet->dstAddr, ip->IPv4_dst, 4 );
+	packet->l4Offset = packet->l3Offset + hdrLen;
+	if( hdrLen > IP_HEADER_LENGTH_WITHOUT_OPTIONS )
+		packet->flags |= PKT_F_IP_OPTIONS;
+	
+	/* solo el primer fragmento lleva la cabecera de transporte */
+	if( ntohs( ip->frag ) & ( IP_MORE_FRAGS | IP_FRAG_OFFSET ))
+	{
+		packet->flags |= PKT_F_FRAGMENT;
+		if( ntohs( ip->frag ) & IP_FRAG_OFFSET )
+		{
+			packet->payloadOffset = packet->l4Offset;
+			packet->payloadLen    = end > packet->l4Offset ? end - packet->l4Offset : 0;
+			return;
+		}
+	}
+	
+	decodeTransport( packet, end );
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeIPv6()
+ *---------------------------------------------------------------------------*/
+static void decodeIPv6( struct packet *packet )
+{
+	const struct ip6Header     *ip6;
+	const struct ip6FragHeader *frag;
+	ui32                        payloadLen, end, offset, hdrLen, n;
+	uchar                       next;
+	
+	if( packet->caplen < (ui32)packet->l3Offset + IP6_HEADER_LENGTH )
+	{
+		packet->errors |= PKT_E_SHORT_L3;
+		return;
+	}
+	ip6 = PKT_IP6( packet );
+	if( IP6_VERSION( ip6 ) != 6 )
+	{
+		packet->errors |= PKT_E_BAD_L3;
+		return;
+	}
+	
+	/* a cero en los jumbogramas y en los supersegmentos TSO */
+	payloadLen = ntohs( ip6->payload_len );
+	if( payloadLen == 0 )
+	{
+		if( packet->len < (ui32)packet->l3Offset + IP6_HEADER_LENGTH )
+		{
+			packet->errors |= PKT_E_BAD_L3;
+			return;
+		}
+		payloadLen = packet->len - packet->l3Offset - IP6_HEADER_LENGTH;
+	}
+	end = packet->l3Offset + IP6_HEADER_LENGTH + payloadLen;
+	if( end > packet->len )
+	{
+		packet->errors |= PKT_E_BAD_L3;
+		end = packet->len;
+	}
+	packet->nl = NT_IPV6;
+	
+	/* recorremos las extensiones hasta el transporte, con un lmite */
+	offset = packet->l3Offset + IP6_HEADER_LENGTH;
+	next   = ip6->next_header;
+	for( n = 0; ; n++ )
+	{
+		switch( next )
+		{
+			case IPPROTO_HOPOPTS:
+			case IPPROTO_ROUTING:
+			case IPPROTO_DSTOPTS:
+			case IPPROTO_MH:
+			case IPPROTO_AH:
+			case IPPROTO_FRAGMENT:
+				break;
+			default:
+				/* transporte, o algo que no sabemos saltar (ESP, sin siguiente...) */
+				packet->ipProto  = next;
+				packet->l4Offset = offset;
+				if( n > 0 )
+					packet->flags |= PKT_F_IP_OPTIONS;
+				decodeTransport( packet, end );
+				return;
+		}
+		
+		if( n == IP6_MAX_EXTENSIONS )
+		{
+			packet->errors |= PKT_E_BAD_L3;
+			return;
+		}
+		if( packet->caplen < offset + sizeof( struct ip6FragHeader ))
+		{
+			/* todas miden al menos 8 bytes */
+			packet->errors |= PKT_E_SHORT_L3;
+			return;
+		}
+		
+		if( next == IPPROTO_FRAGMENT )
+		{
+			/* solo el primer fragmento lleva las cabeceras siguientes */
+			frag           = (const struct ip6FragHeader *)( packet->data + offset );
+			packet->flags |= PKT_F_FRAGMENT;
+			if( ntohs( frag->frag ) & IP6_FRAG_OFFSET )
+			{
+				packet->ipProto       = frag->next_header;
+				packet->l4Offset      = offset + sizeof( struct ip6FragHeader );
+				packet->payloadOffset = packet->l4Offset;
+				packet->payloadLen    = end > packet->l4Offset ? end - packet->l4Offset : 0;
+				return;
+			}
+			hdrLen = sizeof( struct ip6FragHeader );
+		}
+		else if( next == IPPROTO_AH )
+			hdrLen = ( ((const struct ip6ExtHeader *)( packet->data + offset ))->length + 2 ) * 4;
+		else
+			hdrLen = ( ((const struct ip6ExtHeader *)( packet->data + offset ))->length + 1 ) * 8;
+		
+		if( offset + hdrLen > end )
+		{
+			packet->errors |= PKT_E_BAD_L3;
+			return;
+		}
+		next    = ((const struct ip6ExtHeader *)( packet->data + offset ))->next_header;
+		offset += hdrLen;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeTransport()
+ *---------------------------------------------------------------------------*/
+static void decodeTransport( struct packet *packet, ui32 end )
+{
+	const struct tcpHeader  *tcp;
+	const struct udpHeader  *udp;
+	ui32                     hdrLen, l4 = packet->l4Offset;
+	
+	/* end es donde acaba el paquete IP, capturado o no */
+	switch( packet->ipProto )
+	{
+		case IPPROTO_ICMP:
+		case IPPROTO_ICMPV6:
+			hdrLen = ICMP_HEADER_LENGTH;
+			if( packet->caplen < l4 + hdrLen )
+				goto shortHeader;
+			packet->tl = TT_ICMP;
 			break;
-		case NT_ARP:
-			tl->type = TT_UNKNOWN;
-			break;
-		case NT_IPX:
-			tl->type = TT_UNKNOWN;
+			
+		case IPPROTO_UDP:
+			hdrLen = UDP_HEADER_LENGTH;
+			if( packet->caplen < l4 + hdrLen )
+				goto shortHeader;
+			udp = PKT_UDP( packet );
+			if( ntohs( udp->length ) < UDP_HEADER_LENGTH )
+			{
+				packet->errors |= PKT_E_BAD_L4;
+				return;
+			}
+			packet->tl      = TT_UDP;
+			packet->srcPort = udp->src_port;
+			packet->dstPort = udp->dst_port;
 			break;
-		case NT_UNKNOWN:
-			tl->type = TT_UNKNOWN;
+			
+		case IPPROTO_TCP:
+			if( packet->caplen < l4 + TCP_HEADER_LENGTH )
+				goto shortHeader;
+			tcp    = PKT_TCP( packet );
+			hdrLen = TCP_HEADER_LEN( tcp );
+			if( hdrLen < TCP_HEADER_LENGTH  ||  l4 + hdrLen > end )
+			{
+				packet->errors |= PKT_E_BAD_L4;
+				return;
+			}
+			/* las opciones pueden haberse quedado fuera con snaplen; los
+			   puertos y los flags s los tenemos */
+			packet->tl       = TT_TCP;
+			packet->srcPort  = tcp->src_port;
+			packet->dstPort  = tcp->dst_port;
+			packet->tcpFlags = tcp->flags;
 			break;
+			
+		case IPPROTO_GRE:
+			if( bInnerTunnels )
+				decodeTunnel( packet, end );
+			return;
+			
 		default:
-			tl->type = TT_UNKNOWN;
-			assert( FALSE );
-			break;
+			return;
+	}
+	
+	if( l4 + hdrLen > end )
+	{
+		packet->errors |= PKT_E_BAD_L4;
+		packet->tl      = TT_UNKNOWN;
+		return;
+	}
+	packet->payloadOffset = l4 + hdrLen;
+	packet->payloadLen    = end - packet->payloadOffset;
+	
+	if( bInnerTunnels  &&  packet->tl == TT_UDP )
+		decodeTunnel( packet, end );
+	return;
+	
+shortHeader:
+	packet->errors |= PKT_E_SHORT_L4;
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeTunnel()
+ *---------------------------------------------------------------------------*/
+static void decodeTunnel( struct packet *packet, ui32 end )
+{
+	const uchar  *h;
+	ui32          offset, flags, tunnelId = 0;
+	
+	/* un solo nivel: lo de dentro de un tnel interior se queda sin abrir */
+	if( packet->encap != ENCAP_NONE )
+		return;
+	
+	if( packet->ipProto == IPPROTO_GRE  &&  packet->tl == TT_UNKNOWN )
+	{
+		/* GRE versin 0: las partes opcionales van en orden tras los flags */
+		offset = packet->l4Offset;
+		if( packet->caplen < offset + GRE_HEADER_LENGTH )
+			return;
+		h     = packet->data + offset;
+		flags = ( h[0] << 8 ) | h[1];
+		if(( flags & ( GRE_ROUTING | GRE_VERSION )) != 0 )
+			return;
+		offset += GRE_HEADER_LENGTH;
+		if( flags & GRE_CHECKSUM )
+			offset += 4;
+		if( flags & GRE_KEY )
+		{
+			if( packet->caplen < offset + 4 )
+				return;
+			tunnelId = ( packet->data[offset] << 24 ) | ( packet->data[offset + 1] << 16 ) |
+					   ( packet->data[offset + 2] << 8 ) | packet->data[offset + 3];
+			offset  += 4;
+		}
+		if( flags & GRE_SEQUENCE )
+			offset += 4;
+		if( offset > end )
+			return;
+		decodeInner( packet, ENCAP_GRE, tunnelId, offset, ( h[2] << 8 ) | h[3] );
+	}
+	else if( packet->tl == TT_UDP  &&  ntohs( packet->dstPort ) == VXLAN_PORT )
+	{
+		/* VXLAN: flags, VNI de 24 bits y siempre ethernet detrs */
+		offset = packet->payloadOffset;
+		if( packet->caplen < offset + VXLAN_HEADER_LENGTH  ||  offset + VXLAN_HEADER_LENGTH > end )
+			return;
+		h = packet->data + offset;
+		if(( h[0] & VXLAN_VNI_VALID ) == 0 )
+			return;
+		decodeInner( packet, ENCAP_VXLAN, ( h[4] << 16 ) | ( h[5] << 8 ) | h[6],
+					 offset + VXLAN_HEADER_LENGTH, ETHER_TEB );
+	}
+	else if( packet->tl == TT_UDP  &&  ntohs( packet->dstPort ) == GENEVE_PORT )
+	{
+		/* GENEVE: como VXLAN pero con opciones y el protocolo de dentro */
+		offset = packet->payloadOffset;
+		if( packet->caplen < offset + GENEVE_HEADER_LENGTH )
+			return;
+		h = packet->data + offset;
+		if(( h[0] >> 6 ) != 0 )
+			return;
+		offset += GENEVE_HEADER_LENGTH + ( h[0] & 0x3f ) * 4;
+		if( offset > end )
+			return;
+		decodeInner( packet, ENCAP_GENEVE, ( h[4] << 16 ) | ( h[5] << 8 ) | h[6], offset, ( h[2] << 8 ) | h[3] );
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * decodeInner()
+ *---------------------------------------------------------------------------*/
+static void decodeInner( struct packet *packet, uchar encap, ui32 tunnelId, ui32 offset, ui32 protocol )
+{
+	/* solo abrimos lo que sabemos analizar */
+	if( protocol != ETHER_TEB  &&  protocol != ETHER_IP  &&  protocol != ETHER_IPV6 )
+		return;
+	
+	/* a partir de aqu el descriptor describe el paquete de dentro; de
+	   fuera quedan el enlace, la VLAN y el tnel */
+	packet->encap         = encap;
+	packet->tunnelId      = tunnelId;
+	packet->nl            = NT_UNKNOWN;
+	packet->tl            = TT_UNKNOWN;
+	packet->ipProto       = 0;
+	packet->tcpFlags      = 0;
+	packet->srcAddr       = 0;
+	packet->dstAddr       = 0;
+	packet->srcPort       = 0;
+	packet->dstPort       = 0;
+	packet->l4Offset      = 0;
+	packet->payloadOffset = 0;
+	packet->payloadLen    = 0;
+	packet->flags        &= ~( PKT_F_FRAGMENT | PKT_F_IP_OPTIONS );
+	
+	if( protocol == ETHER_TEB )
+	{
+		if( packet->caplen < offset + ETHERII_HEADER_LENGTH )
+		{
+			packet->errors |= PKT_E_SHORT_L2;
+			return;
+		}
+		protocol = ( packet->data[offset + 12] << 8 ) | packet->data[offset + 13];
+		offset  += ETHERII_HEADER_LENGTH;
+	}
+	
+	decodeNetwork( packet, offset, protocol );
+}
+
+/*-----------------------------------------------------------------------------
+ * countSegments()
+ *---------------------------------------------------------------------------*/
+static void countSegments( struct packet *packet, ui16 gsoSize )
+{
+	ui32  hdrLen, payload, segments;
+	
+	/* un supersegmento GRO/TSO son varios paquetes en el cable, cada uno con
+	   sus propias cabeceras; sin la capa de transporte no sabemos partirlo */
+	if( packet->tl != TT_TCP  &&  packet->tl != TT_UDP )
+		return;
+	hdrLen = packet->payloadOffset;
+	if( packet->len <= hdrLen )
+		return;
+	
+	payload             = packet->len - hdrLen;
+	segments            = ( payload + gsoSize - 1 ) / gsoSize;
+	packet->segments    = segments > 0xffff ? 0xffff : segments;
+	packet->wireBytes   = packet->len + ( packet->segments - 1 ) * hdrLen;
+}
+
+/*-----------------------------------------------------------------------------
+ * gatherBatch()
+ *---------------------------------------------------------------------------*/
+static void gatherBatch( const struct frame *frames, int count, struct classifyBatch *b )
+{
+	const uchar  *d;
+	int           i;
+	
+	/* las tramas estn dispersas por el anillo o los buffers, as que las
+	   palabras se recogen una a una; las cortas quedan a cero y no pasan */
+	for( i = 0; i < count; i++ )
+	{
+		b->caplen[i] = frames[i].caplen;
+		b->len[i]    = frames[i].len;
+		if( frames[i].caplen < FAST_MIN_CAPLEN )
+		{
+			b->ethIp[i] = 0;
+			continue;
+		}
+		
+		d = frames[i].data;
+		memcpy( &b->ethIp[i],  d + 12, 4 );
+		memcpy( &b->ipLen[i],  d + 16, 4 );
+		memcpy( &b->ipFrag[i], d + 20, 4 );
+		memcpy( &b->udpLen[i], d + FAST_L4_OFFSET + 4,  4 );
+		memcpy( &b->tcpOff[i], d + FAST_L4_OFFSET + 12, 4 );
 	}
+	
+	/* el hueco hasta completar el ltimo vector tampoco pasa */
+	for( ; i < BATCH_FRAMES  &&  ( i & 7 ) != 0; i++ )
+	{
+		b->caplen[i] = 0;
+		b->ethIp[i]  = 0;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * fillFastPacket()
+ *---------------------------------------------------------------------------*/
+static void fillFastPacket( const struct frame *f, const struct classifyBatch *b, int i, struct packet *packet )
+{
+	const uchar  *d = f->data;
+	ui32          end;
+	
+	/* lo mismo que dejara buildPacket() para una trama que ya sabemos buena */
+	memset( packet, 0, sizeof( *packet ));
+	packet->data      = d;
+	packet->len       = f->len;
+	packet->caplen    = f->caplen;
+	packet->segments  = 1;
+	packet->wireBytes = f->len;
+	if( f->caplen < f->len )
+		packet->flags |= PKT_F_TRUNCATED;
+	
+	packet->dll       = DLL_ETHERNET_II;
+	packet->ethertype = ETHER_IP;
+	packet->l3Offset  = ETHERII_HEADER_LENGTH;
+	packet->nl        = NT_IP;
+	packet->ipProto   = b->ipFrag[i] >> 24;
+	packet->l4Offset  = FAST_L4_OFFSET;
+	memcpy( &packet->srcAddr, d + 26, 4 );
+	memcpy( &packet->dstAddr, d + 30, 4 );
+	memcpy( &packet->srcPort, d + FAST_L4_OFFSET,     2 );
+	memcpy( &packet->dstPort, d + FAST_L4_OFFSET + 2, 2 );
+	
+	end = ETHERII_HEADER_LENGTH + ntohs( (ui16)b->ipLen[i] );
+	if( packet->ipProto == IPPROTO_TCP )
+	{
+		packet->tl            = TT_TCP;
+		packet->tcpFlags      = b->tcpOff[i] >> 8;
+		packet->payloadOffset = FAST_L4_OFFSET + ( b->tcpOff[i] & 0xf0 ) / 4;
+	}
+	else
+	{
+		packet->tl            = TT_UDP;
+		packet->payloadOffset = FAST_L4_OFFSET + UDP_HEADER_LENGTH;
+	}
+	packet->payloadLen = end - packet->payloadOffset;
+}
+
+/*-----------------------------------------------------------------------------
+ * classifyScalar()
+ *---------------------------------------------------------------------------*/
+static ui32 classifyScalar( const struct classifyBatch *b, int count )
+{
+	ui32  fast = 0, ipLen, end, tcpLen, udpLen, proto;
+	int   i;
+	
+	/* las mismas condiciones que las versiones SIMD, trama a trama */
+	for( i = 0; i < count; i++ )
+	{
+		ipLen  = ntohs( (ui16)b->ipLen[i] );
+		end    = ETHERII_HEADER_LENGTH + ipLen;
+		proto  = b->ipFrag[i] >> 24;
+		tcpLen = ( b->tcpOff[i] & 0xf0 ) / 4;
+		udpLen = ntohs( (ui16)b->udpLen[i] );
+		
+		if( b->caplen[i] >= FAST_MIN_CAPLEN  &&
+			( b->ethIp[i] & 0x00ffffff ) == FAST_ETH_IP  &&
+			( b->ipFrag[i] & 0x0000ff3f ) == 0  &&
+			ipLen >= IP_HEADER_LENGTH_WITHOUT_OPTIONS  &&  end <= (ui32)b->len[i]  &&
+			(( proto == IPPROTO_TCP  &&  tcpLen >= TCP_HEADER_LENGTH  &&  FAST_L4_OFFSET + tcpLen <= end )  ||
+			 ( proto == IPPROTO_UDP  &&  udpLen >= UDP_HEADER_LENGTH  &&  FAST_L4_OFFSET + UDP_HEADER_LENGTH <= end )))
+			fast |= 1u << i;
+	}
+	
+	return fast;
+}
+
+#if defined( __x86_64__ )
+/*-----------------------------------------------------------------------------
+ * classifySSE()
+ *---------------------------------------------------------------------------*/
+static ui32 classifySSE( const struct classifyBatch *b, int count )
+{
+	const __m128i  ethIp  = _mm_set1_epi32( FAST_ETH_IP ),   ethMask  = _mm_set1_epi32( 0x00ffffff );
+	const __m128i  fragMk = _mm_set1_epi32( 0x0000ff3f ),    low16    = _mm_set1_epi32( 0xffff );
+	const __m128i  tcp    = _mm_set1_epi32( IPPROTO_TCP ),   udp      = _mm_set1_epi32( IPPROTO_UDP );
+	const __m128i  offMk  = _mm_set1_epi32( 0xf0 ),          zero     = _mm_setzero_si128();
+	__m128i        caplen, len, ip, frag, ipLen, end, proto, tcpLen, udpLen, ok, tcpOk, udpOk;
+	ui32           fast = 0;
+	int            i;
+	
+	/* 4 tramas por vuelta; los huecos del final tienen caplen 0 y no pasan.
+	   Todas las cantidades caben en 31 bits, as que valen las comparaciones con signo */
+	for( i = 0; i < count; i += 4 )
+	{
+		caplen = _mm_load_si128( (const __m128i *)&b->caplen[i] );
+		len    = _mm_load_si128( (const __m128i *)&b->len[i] );
+		ip     = _mm_load_si128( (const __m128i *)&b->ethIp[i] );
+		frag   = _mm_load_si128( (const __m128i *)&b->ipFrag[i] );
+		
+		/* longitud total IP y UDP: los dos bytes bajos, en orden de red */
+		ipLen  = _mm_load_si128( (const __m128i *)&b->ipLen[i] );
+		ipLen  = _mm_or_si128( _mm_srli_epi32( _mm_and_si128( ipLen, _mm_set1_epi32( 0xff00 )), 8 ),
+							   _mm_and_si128( _mm_slli_epi32( ipLen, 8 ), low16 ));
+		udpLen = _mm_load_si128( (const __m128i *)&b->udpLen[i] );
+		udpLen = _mm_or_si128( _mm_srli_epi32( _mm_and_si128( udpLen, _mm_set1_epi32( 0xff00 )), 8 ),
+							   _mm_and_si128( _mm_slli_epi32( udpLen, 8 ), low16 ));
+		end    = _mm_add_epi32( ipLen, _mm_set1_epi32( ETHERII_HEADER_LENGTH ));
+		proto  = _mm_srli_epi32( frag, 24 );
+		tcpLen = _mm_srli_epi32( _mm_and_si128( _mm_load_si128( (const __m128i *)&b->tcpOff[i] ), offMk ), 2 );
+		
+		ok = _mm_cmpgt_epi32( caplen, _mm_set1_epi32( FAST_MIN_CAPLEN - 1 ));
+		ok = _mm_and_si128( ok, _mm_cmpeq_epi32( _mm_and_si128( ip, ethMask ), ethIp ));
+		ok = _mm_and_si128( ok, _mm_cmpeq_epi32( _mm_and_si128( frag, fragMk ), zero ));
+		ok = _mm_and_si128( ok, _mm_cmpgt_epi32( ipLen, _mm_set1_epi32( IP_HEADER_LENGTH_WITHOUT_OPTIONS - 1 )));
+		ok = _mm_andnot_si128( _mm_cmpgt_epi32( end, len ), ok );
+		
+		tcpOk = _mm_cmpeq_epi32( proto, tcp );
+		tcpOk = _mm_and_si128( tcpOk, _mm_cmpgt_epi32( tcpLen, _mm_set1_epi32( TCP_HEADER_LENGTH - 1 )));
+		tcpOk = _mm_andnot_si128( _mm_cmpgt_epi32( _mm_add_epi32( tcpLen, _mm_set1_epi32( FAST_L4_OFFSET )), end ), tcpOk );
+		udpOk = _mm_cmpeq_epi32( proto, udp );
+		udpOk = _mm_and_si128( udpOk, _mm_cmpgt_epi32( udpLen, _mm_set1_epi32( UDP_HEADER_LENGTH - 1 )));
+		udpOk = _mm_andnot_si128( _mm_cmpgt_epi32( _mm_set1_epi32( FAST_L4_OFFSET + UDP_HEADER_LENGTH ), end ), udpOk );
+		ok    = _mm_and_si128( ok, _mm_or_si128( tcpOk, udpOk ));
+		
+		fast |= (ui32)_mm_movemask_ps( _mm_castsi128_ps( ok )) << i;
+	}
+	
+	return fast;
+}
+
+/*-----------------------------------------------------------------------------
+ * classifyAVX2()
+ *---------------------------------------------------------------------------*/
+__attribute__(( target( "avx2" )))
+static ui32 classifyAVX2( const struct classifyBatch *b, int count )
+{
+	const __m256i  ethIp  = _mm256_set1_epi32( FAST_ETH_IP ),   ethMask  = _mm256_set1_epi32( 0x00ffffff );
+	const __m256i  fragMk = _mm256_set1_epi32( 0x0000ff3f ),    zero     = _mm256_setzero_si256();
+	const __m256i  tcp    = _mm256_set1_epi32( IPPROTO_TCP ),   udp      = _mm256_set1_epi32( IPPROTO_UDP );
+	const __m256i  offMk  = _mm256_set1_epi32( 0xf0 );
+	/* intercambia los dos bytes bajos de cada palabra y borra los altos */
+	const __m256i  swap16 = _mm256_setr_epi8( 1, 0, -1, -1, 5, 4, -1, -1, 9, 8, -1, -1, 13, 12, -1, -1,
+											  1, 0, -1, -1, 5, 4, -1, -1, 9, 8, -1, -1, 13, 12, -1, -1 );
+	__m256i        caplen, len, ip, frag, ipLen, end, proto, tcpLen, udpLen, ok, tcpOk, udpOk;
+	ui32           fast = 0;
+	int            i;
+	
+	/* 8 tramas por vuelta, las mismas condiciones que classifySSE() */
+	for( i = 0; i < count; i += 8 )
+	{
+		caplen = _mm256_load_si256( (const __m256i *)&b->caplen[i] );
+		len    = _mm256_load_si256( (const __m256i *)&b->len[i] );
+		ip     = _mm256_load_si256( (const __m256i *)&b->ethIp[i] );
+		frag   = _mm256_load_si256( (const __m256i *)&b->ipFrag[i] );
+		ipLen  = _mm256_shuffle_epi8( _mm256_load_si256( (const __m256i *)&b->ipLen[i] ), swap16 );
+		udpLen = _mm256_shuffle_epi8( _mm256_load_si256( (const __m256i *)&b->udpLen[i] ), swap16 );
+		end    = _mm256_add_epi32( ipLen, _mm256_set1_epi32( ETHERII_HEADER_LENGTH ));
+		proto  = _mm256_srli_epi32( frag, 24 );
+		tcpLen = _mm256_srli_epi32( _mm256_and_si256( _mm256_load_si256( (const __m256i *)&b->tcpOff[i] ), offMk ), 2 );
+		
+		ok = _mm256_cmpgt_epi32( caplen, _mm256_set1_epi32( FAST_MIN_CAPLEN - 1 ));
+		ok = _mm256_and_si256( ok, _mm256_cmpeq_epi32( _mm256_and_si256( ip, ethMask ), ethIp ));
+		ok = _mm256_and_si256( ok, _mm256_cmpeq_epi32( _mm256_and_si256( frag, fragMk ), zero ));
+		ok = _mm256_and_si256( ok, _mm256_cmpgt_epi32( ipLen, _mm256_set1_epi32( IP_HEADER_LENGTH_WITHOUT_OPTIONS - 1 )));
+		ok = _mm256_andnot_si256( _mm256_cmpgt_epi32( end, len ), ok );
+		
+		tcpOk = _mm256_cmpeq_epi32( proto, tcp );
+		tcpOk = _mm256_and_si256( tcpOk, _mm256_cmpgt_epi32( tcpLen, _mm256_set1_epi32( TCP_HEADER_LENGTH - 1 )));
+		tcpOk = _mm256_andnot_si256( _mm256_cmpgt_epi32( _mm256_add_epi32( tcpLen, _mm256_set1_epi32( FAST_L4_OFFSET )), end ), tcpOk );
+		udpOk = _mm256_cmpeq_epi32( proto, udp );
+		udpOk = _mm256_and_si256( udpOk, _mm256_cmpgt_epi32( udpLen, _mm256_set1_epi32( UDP_HEADER_LENGTH - 1 )));
+		udpOk = _mm256_andnot_si256( _mm256_cmpgt_epi32( _mm256_set1_epi32( FAST_L4_OFFSET + UDP_HEADER_LENGTH ), end ), udpOk );
+		ok    = _mm256_and_si256( ok, _mm256_or_si256( tcpOk, udpOk ));
+		
+		fast |= (ui32)_mm256_movemask_ps( _mm256_castsi256_ps( ok )) << i;
+	}
+	
+	return fast;
 }
+#endif
 
 /****************************************************************************
  * End of packetBuilder.c
@@ -5,11 +5,37 @@
 #ifndef _PACKETBUILDER_H_
 #define _PACKETBUILDER_H_
 
+#include "types.h"
+
+/** defines ******************************************************************/
+/* constantes de buildFlowHash(); el programa de reparto del kernel, que
+   genera bpfFanout() en bpfFilter.c, hace las mismas cuentas y tiene que
+   cambiar con ellas */
+#define FLOW_HASH_MUL		0x9e3779b1
+#define FLOW_HASH_FINAL		0x85ebca6b
+
+/** public types *************************************************************/
+/* implementacin del clasificador por lotes de buildPacketBurst() */
+enum eClassifier
+{
+	CLS_AUTO,		/* la mejor que tenga la CPU */
+	CLS_SCALAR,
+	CLS_SSE,
+	CLS_AVX2
+};
+
 /** forward declarations *****************************************************/
 struct packet;
+struct frame;
 
 /** public interface *********************************************************/
-int buildPacket( const void *buffer, struct packet *packet );
+int  buildPacket( const void *buffer, ui32 caplen, ui32 len, struct packet *packet );
+void buildPacketBurst( const struct frame *frames, struct packet *packets, int count );
+int  buildSetClassifier( enum eClassifier type );
+const char * buildGetClassifierName();
+void buildSetTunnelMode( uchar bInner );
+int  buildSetLinkType( ui32 linkType );
+ui32 buildFlowHash( const struct packet *packet, ui16 srcPort, ui16 dstPort );
 	
 
 #endif  /* _PACKETBUILDER_H_ */
@@ -11,218 +11,252 @@
 #define IP_SIZE  4
 #define ETH_SIZE 6
 
-/** data link layer ****************************/
-/* forward declarations */
-struct ethernetII;
+#define ETHERII_HEADER_LENGTH              14       /* direcciones MAC y ethertype */
+#define SLL_HEADER_LENGTH                  16       /* Linux cooked, "any" */
+#define SLL2_HEADER_LENGTH                 20
+#define SLL_ADDR_SIZE                      8
+#define LOOPBACK_HEADER_LENGTH             4        /* familia de direcciones de BSD */
+#define IP_HEADER_LENGTH_WITHOUT_OPTIONS   (5*4)
+#define UDP_HEADER_LENGTH                  8
+#define TCP_HEADER_LENGTH                  (5*4)    /* sin opciones */
+#define ICMP_HEADER_LENGTH                 4
+#define IP6_HEADER_LENGTH                  40
+#define IP6_ADDR_SIZE                      16
 
-/* enums */
+/** enums ***************************************/
 enum eDataLinkProtocol
 { 
 	DLL_ETHERNET_II, 
+	DLL_LINUX_SLL,		/* cabecera cooked de Linux, versin 1 */
+	DLL_LINUX_SLL2,		/* y versin 2 */
+	DLL_LOOPBACK,		/* loopback de BSD: solo la familia de direcciones */
+	DLL_RAW_IP,			/* sin enlace, empieza en la cabecera IP */
 	DLL_UNKNOWN
 };
 
-/* dataLinkLayer */
-struct dataLinkLayer
-{
-    union
-	{
-		struct ethernetII  	*ethII;
-		   
-	    void   				*rawPtr;
-	};
-	
-	enum eDataLinkProtocol	type;
-};
-
-/* trama ethernet II */
-#define MAX_ETHII_DATA_LENGTH 1500
-
-
-struct ethernetII
-{   
-    uchar dst_eth[ETH_SIZE];  				/* origen MAC      */
-    uchar src_eth[ETH_SIZE];  				/* destino MAC   */
-	ui16  ethertype;		  				/* Ethertype         */
-	union
-	{
-		uchar data[MAX_ETHII_DATA_LENGTH+4];  /* raw data           */
-		uchar fcs[4];			  		      /*Frame Check Secuence */ //que hacer con estos ultimos 4 bytes
-	};		
-};     
-
-
-/** network layer ******************************/
-/* forward declarations */
-struct ipPacket;
-struct arpPacket;
-struct ipxPacket;
-	
-/* enums */
 enum eNetworkProtocol
 {
 	NT_IP,
 	NT_ARP,
 	NT_IPX,
+	NT_IPV6,
 	NT_UNKNOWN
 };
 
-/* networkLayer */
-struct networkLayer
+enum eEncapsulation
 {
-	union
-	{
-		struct ipPacket		*ip;
-		struct arpPacket	*arp;
-		struct ipxPacket	*ipx;
-			
-		void				*rawPtr;
-	};
-	
-	enum eNetworkProtocol   type;
+	ENCAP_NONE,
+	ENCAP_GRE,
+	ENCAP_VXLAN,
+	ENCAP_GENEVE,
+	ENCAP_COUNT
 };
 
-/** IP Packet **/
-#define MAX_IP_PACKET_LENGTH               65535
-#define IP_HEADER_LENGTH_WITHOUT_OPTIONS   (5*4)
-#define MAX_IP_PACKET_DATA_SIZE            (MAX_IP_PACKET_LENGTH - IP_HEADER_LENGTH_WITHOUT_OPTIONS)
-#define MAX_IP_PACKET_OPTIONS_SIZE         (10*4)
-
-struct ipPacket
-{ 
-	#if __BYTE_ORDER == __LITTLE_ENDIAN
-    unsigned header_len:4;         /* tamao de la cabecera en "palabras"32bit 	*/
-	unsigned version:4;            /* Versin                                  				*/
-	#endif
-	#if __BYTE_ORDER == __BIG_ENDIAN
-	unsigned version:4;            /* Versin                                  				*/
-	unsigned header_len:4;         /* tamao de la cabecera en "palabras"32bit 	*/
-	#endif
-	unsigned serve_type:8;         /* TOS                                      				*/
-    unsigned packet_len:16;        /* tamao total del paquete en bytes        		*/
-    unsigned ID:16;                /* numero de secuencia?                    		*/
-    unsigned frag_offset:13;       /* desplazamiento                           			*/
-    unsigned more_frags:1;         /* flag for "more frags to follow"          		*/
-    unsigned dont_frag:1;          /* flag de no fragmentar                    			*/
-    unsigned __reserved:1;         /* reservado, siempre a cero                		*/
-    unsigned time_to_live:8;       /* maximo de saltos                         			*/
-    unsigned protocol:8;           /* ICMP, UDP, TCP ...                       			*/
-    unsigned hdr_chksum:16;        /* checksum                                 				*/
-    uchar    IPv4_src[IP_SIZE];    /* direccion IP origen                      			*/
-    uchar    IPv4_dst[IP_SIZE];    /* direccion IP destino                     			*/
-    union
-    {
-		uchar  options[MAX_IP_PACKET_OPTIONS_SIZE];
-		uchar  data[MAX_IP_PACKET_DATA_SIZE];  /* max data size = 64KB - header (w/o options) */
-    };
+enum eTransportProtocol
+{
+	TT_ICMP,
+	TT_UDP,
+	TT_TCP,
+	TT_UNKNOWN
 };
 
-struct arpPacket
+/** cabeceras en el cable ***********************
+ * Solo la parte fija de cada cabecera, sin datos ni campos de bits. El
+ * decodificador ya ha comprobado que caben en lo capturado antes de dar
+ * su desplazamiento, as que se pueden superponer con PKT_ETH() y dems.
+ */
+/* trama ethernet II */
+struct ethHeader
+{   
+    uchar dst_eth[ETH_SIZE];  				/* destino MAC      */
+    uchar src_eth[ETH_SIZE];  				/* origen MAC       */
+	ui16  ethertype;		  				/* Ethertype        */
+} __attribute__(( packed ));
+
+/* Linux cooked (LINKTYPE_LINUX_SLL), la que dan los sockets SOCK_DGRAM */
+struct sllHeader
 {
-};
+	ui16  pkttype;							/* PACKET_HOST, PACKET_OUTGOING... */
+	ui16  hatype;							/* ARPHRD_* de la interfaz */
+	ui16  halen;							/* bytes tiles de addr */
+	uchar addr[SLL_ADDR_SIZE];				/* direccin de enlace del origen */
+	ui16  protocol;							/* ethertype */
+} __attribute__(( packed ));
 
-struct ipxPacket
+/* Linux cooked versin 2 (LINKTYPE_LINUX_SLL2), con la interfaz */
+struct sll2Header
 {
-};
+	ui16  protocol;							/* ethertype */
+	ui16  reserved;
+	ui32  ifindex;							/* interfaz por la que pas */
+	ui16  hatype;
+	uchar pkttype;
+	uchar halen;
+	uchar addr[SLL_ADDR_SIZE];
+} __attribute__(( packed ));
 
+/* IPv4 */
+#define IP_VERSION( ip )      ( (ip)->version_ihl >> 4 )
+#define IP_HEADER_LEN( ip )   ( ( (ip)->version_ihl & 0x0f ) * 4 )	/* en bytes */
+#define IP_MORE_FRAGS         0x2000
+#define IP_FRAG_OFFSET        0x1fff
 
-/** Transport protocol ******************************/
-/* forward declarations */
-struct icmpPacket;
-struct udpPacket;
-struct tcpPacket;
-	
-/* enums */
-enum eTransportProtocol
+struct ipHeader
+{ 
+	uchar    version_ihl;          /* versin y tamao de la cabecera en palabras de 32 bits */
+	uchar    serve_type;           /* TOS                                      */
+    ui16     packet_len;           /* tamao total del paquete en bytes        */
+    ui16     ID;                   /* identificador para los fragmentos        */
+    ui16     frag;                 /* flags y desplazamiento del fragmento     */
+    uchar    time_to_live;         /* maximo de saltos                         */
+    uchar    protocol;             /* ICMP, UDP, TCP ...                       */
+    ui16     hdr_chksum;           /* checksum                                 */
+    uchar    IPv4_src[IP_SIZE];    /* direccion IP origen                      */
+    uchar    IPv4_dst[IP_SIZE];    /* direccion IP destino                     */
+} __attribute__(( packed ));
+
+/* IPv6 */
+#define IP6_VERSION( ip6 )    ( (ip6)->vtc_flow[0] >> 4 )
+#define IP6_FRAG_OFFSET       0xfff8
+
+struct ip6Header
 {
-	TT_ICMP,
-	TT_UDP,
-	TT_TCP,
-	TT_UNKNOWN
-};
+	uchar    vtc_flow[4];                /* versin, clase de trfico y etiqueta de flujo */
+	ui16     payload_len;                /* lo que va detrs de esta cabecera         */
+	uchar    next_header;                /* extensin o protocolo de transporte       */
+	uchar    hop_limit;                  /* maximo de saltos                          */
+	uchar    IPv6_src[IP6_ADDR_SIZE];    /* direccion IP origen                       */
+	uchar    IPv6_dst[IP6_ADDR_SIZE];    /* direccion IP destino                      */
+} __attribute__(( packed ));
 
-/* transportLayer */
-struct transportLayer
+/* cabecera de extensin IPv6; la de fragmento tiene tamao fijo */
+struct ip6ExtHeader
 {
-	union
-	{
-		struct icmpPacket	*icmp;
-		struct udpPacket	*udp;
-		struct tcpPacket	*tcp;
-			
-		void				*rawPtr;
-	};
-	ui16 data_size; 	/* en bytes */
-	
-	enum eTransportProtocol   type;
-};
+	uchar    next_header;
+	uchar    length;                     /* en unidades de 8 bytes sin contar las primeras, salvo AH */
+} __attribute__(( packed ));
 
-/** icmpPacket **/
-struct icmpPacket 
+struct ip6FragHeader
 {
-   uchar type;         /* tipo de error             	  */
-   uchar code;         /* codigo de error           	  */
-   ui16  checksum;     /* suma de comprobacin   */
-   uchar msg[];        /* informacin adicional     */
-};
+	uchar    next_header;
+	uchar    reserved;
+	ui16     frag;                       /* desplazamiento y bit de ms fragmentos */
+	ui32     ID;
+} __attribute__(( packed ));
 
-/** udpPacket **/
-struct udpPacket
+/* icmp */
+struct icmpHeader 
 {
-   ui16  src_port;      /* puerto de origen          		*/
-   ui16  dst_port;      /* puerto de destino         		*/
-   ui16  length;        /* tamao del mensaje       	*/
-   ui16  checksum;      /* suma de comprobacin      	*/
-   uchar data[];        /* datos                     			*/     
-};
+   uchar type;         /* tipo de error             */
+   uchar code;         /* codigo de error           */
+   ui16  checksum;     /* suma de comprobacin      */
+} __attribute__(( packed ));
 
+/* udp */
+struct udpHeader
+{
+   ui16  src_port;      /* puerto de origen          */
+   ui16  dst_port;      /* puerto de destino         */
+   ui16  length;        /* tamao del mensaje        */
+   ui16  checksum;      /* suma de comprobacin      */
+} __attribute__(( packed ));
 
-/** tcpPacket **/
-struct tcpPacket
+/* tcp */
+#define TCP_HEADER_LEN( tcp ) ( ( (tcp)->data_offset >> 4 ) * 4 )	/* en bytes */
+#define TCP_FIN               0x01
+#define TCP_SYN               0x02
+#define TCP_RST               0x04
+#define TCP_PSH               0x08
+#define TCP_ACK               0x10
+#define TCP_URG               0x20
+
+struct tcpHeader
 {	
 	ui16     src_port;          /* puerto de origen          */
 	ui16     dst_port;          /* puerto de destino         */
 	ui32     seq_num;           /* nmero de secuencia       */ 
 	ui32     ack_num;           /* nmero de acuse de recibo */ 
-	#if __BYTE_ORDER == __LITTLE_ENDIAN
-	unsigned _res1:4;
-	unsigned data_offset:4;     /* Offset de datos en palabras de 32 bits          */
-	unsigned fin_flag:1;        /* cerrar la conexin        */
-	unsigned syn_flag:1;        /* peticion de conexin      */
-	unsigned rst_flag:1;        /* reiniciar conexin        */
-	unsigned psh_flag:1;        /* procesar inmediatamente   */
-	unsigned ack_flag:1;		/* flag de ack */
-	unsigned urg_flag:1;        /* OOB, mensaje urgente      */
-	unsigned _res2:2;
-	#elif __BYTE_ORDER == __BIG_ENDIAN
-	unsigned data_offset:4;     /* Offset de datos en palabras de 32 bits          */
-	unsigned _res1:4;
-	unsigned _res2:2;
-	unsigned urg_flag:1;        /* OOB, mensaje urgente      */
-	unsigned ack_flag:1;		/* flag de ack */
-	unsigned psh_flag:1;        /* procesar inmediatamente   */
-	unsigned rst_flag:1;        /* reiniciar conexin        */
-	unsigned syn_flag:1;        /* peticion de conexin      */
-	unsigned fin_flag:1;        /* cerrar la conexin        */
-	#else
-		#error "Adjust your <bits/endian.h> defines"
-	#endif
+	uchar    data_offset;       /* offset de datos en palabras de 32 bits, en el nibble alto */
+	uchar    flags;             /* TCP_FIN, TCP_SYN...       */
 	ui16     window;            /* tamao de la ventana      */
 	ui16     checksum;          /* suma de comprobacin      */
 	ui16     urg_pos;           /* ltimo byte del msg OBB   */
-	uchar    options[0];        /* Opciones adicionales      */
-	uchar    __padding[0];      /* para alinear              */
-	uchar    data[0];           /* datos                     */
-};
+} __attribute__(( packed ));
 
 /****************************************************/
-/** packet **/
+/** packet **
+ * Descriptor de una trama, del tamao de una lnea de cach. Lo rellena
+ * buildPacket() recorriendo la trama una sola vez contra lo capturado:
+ * cada capa es un desplazamiento desde data, y solo se da si su cabecera
+ * fija cabe entera. Si no, la capa queda en *_UNKNOWN y se marca el error.
+ */
+/* flags */
+#define PKT_F_TRUNCATED       0x01     /* caplen < len, p.ej. por snaplen */
+#define PKT_F_FRAGMENT        0x02     /* fragmento IP, sin cabecera de transporte */
+#define PKT_F_IP_OPTIONS      0x04     /* cabecera IP con opciones o extensiones IPv6 */
+#define PKT_F_VLAN            0x08     /* con etiqueta 802.1Q/802.1ad, vlanId es la exterior */
+#define PKT_F_MPLS            0x10     /* con etiquetas MPLS */
+
+/* errores de las cabeceras, cortas o incoherentes */
+#define PKT_E_SHORT_L2        0x01     /* no cabe la cabecera ethernet */
+#define PKT_E_SHORT_L3        0x02     /* no cabe la cabecera IP */
+#define PKT_E_BAD_L3          0x04     /* versin, tamao de cabecera, longitud total o extensiones imposibles */
+#define PKT_E_SHORT_L4        0x08     /* no cabe la cabecera de transporte */
+#define PKT_E_BAD_L4          0x10     /* data offset de TCP o longitud de UDP imposibles */
+#define PKT_E_BAD_L2          0x20     /* demasiadas etiquetas VLAN/MPLS */
+
+#define VLAN_ID_MASK          0x0fff
+
 struct packet
 {
-	struct dataLinkLayer  dll;
-	struct networkLayer   nl;
-	struct transportLayer tl;
-};
+	const uchar          *data;          /* comienzo de la trama */
+	ui32                  len;           /* bytes en el cable */
+	ui32                  caplen;        /* bytes capturados, menos si hay snaplen */
+	ui32                  wireBytes;     /* bytes en el cable de todos los segmentos */
+	ui32                  payloadLen;    /* datos de transporte segn las cabeceras, capturados o no */
+	ui16                  segments;      /* segmentos en el cable, ms de uno si es un supersegmento GRO/TSO */
+
+	/* desplazamientos desde data, vlidos segn dll, nl y tl */
+	ui16                  l3Offset;
+	ui16                  l4Offset;
+	ui16                  payloadOffset;
+	ui16                  ethertype;     /* en orden de host, el de debajo de las etiquetas */
+	ui16                  vlanId;        /* VLAN exterior si PKT_F_VLAN */
+
+	uchar                 dll;           /* enum eDataLinkProtocol */
+	uchar                 nl;            /* enum eNetworkProtocol */
+	uchar                 tl;            /* enum eTransportProtocol */
+	uchar                 ipProto;       /* protocolo de la cabecera IP */
+	uchar                 tcpFlags;      /* TCP_SYN, TCP_ACK... */
+	uchar                 flags;         /* PKT_F_* */
+	uchar                 errors;        /* PKT_E_* */
+	uchar                 encap;         /* enum eEncapsulation; si no es ENCAP_NONE, las capas son las de dentro del tnel */
+
+	/* 5-tupla, en orden de red; las direcciones IPv6 no caben y se leen de
+	   la cabecera con PKT_IP6() */
+	ui32                  srcAddr;       /* solo IPv4 */
+	ui32                  dstAddr;
+	ui16                  srcPort;
+	ui16                  dstPort;
+	ui32                  tunnelId;      /* VNI de VXLAN/GENEVE o clave GRE */
+	ui32                  flowHash;      /* buildFlowHash(), igual en los dos sentidos */
+} __attribute__(( aligned( 64 )));
+
+/* acceso a las cabeceras; solo si la capa correspondiente es conocida */
+#define PKT_ETH( p )          ( (const struct ethHeader *)  ( (p)->data ))
+#define PKT_SLL( p )          ( (const struct sllHeader *)  ( (p)->data ))
+#define PKT_SLL2( p )         ( (const struct sll2Header *) ( (p)->data ))
+#define PKT_IP( p )           ( (const struct ipHeader *)   ( (p)->data + (p)->l3Offset ))
+#define PKT_IP6( p )          ( (const struct ip6Header *)  ( (p)->data + (p)->l3Offset ))
+#define PKT_ICMP( p )         ( (const struct icmpHeader *) ( (p)->data + (p)->l4Offset ))
+#define PKT_UDP( p )          ( (const struct udpHeader *)  ( (p)->data + (p)->l4Offset ))
+#define PKT_TCP( p )          ( (const struct tcpHeader *)  ( (p)->data + (p)->l4Offset ))
+#define PKT_PAYLOAD( p )      ( (p)->data + (p)->payloadOffset )
+
+/* datos de transporte que de verdad tenemos en memoria */
+#define PKT_CAPTURED_PAYLOAD( p ) \
+	( (p)->payloadOffset >= (p)->caplen ? 0 : \
+	  (p)->caplen - (p)->payloadOffset < (p)->payloadLen ? (p)->caplen - (p)->payloadOffset : (p)->payloadLen )
 	 
 
 #endif  // _PACKETSTRUCT_H_
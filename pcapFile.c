@@ -0,0 +1,476 @@
+/****************************************************************************
+ * Module:  pcapFile.c
+ *
+ ****************************************************************************/
+#include "pcapFile.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/** defines ******************************************************************/
+#define PCAP_MAGIC_USEC			0xa1b2c3d4
+#define PCAP_MAGIC_NSEC			0xa1b23c4d
+#define PCAP_FILE_HDR_LEN		24
+#define PCAP_RECORD_HDR_LEN		16
+
+#define PCAPNG_SHB				0x0a0d0d0a		/* Section Header Block */
+#define PCAPNG_IDB				0x00000001		/* Interface Description Block */
+#define PCAPNG_PB				0x00000002		/* Packet Block (obsoleto) */
+#define PCAPNG_SPB				0x00000003		/* Simple Packet Block */
+#define PCAPNG_EPB				0x00000006		/* Enhanced Packet Block */
+#define PCAPNG_BYTE_ORDER		0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL		9				/* if_tsresol */
+#define PCAPNG_DEFAULT_TSRESOL	6				/* microsegundos */
+
+#define PCAP_MAX_SLEEP_NS		100000000ULL	/* no dormimos ms de 100 ms seguidos */
+
+/** private interface ********************************************************/
+static ui16 rd16( const struct pcapFile *pf, const uchar *p );
+static ui32 rd32( const struct pcapFile *pf, const uchar *p );
+static ui64 monotonicTime();
+static ui64 ngTimestamp( const struct pcapFile *pf, ui32 ifId, ui32 high, ui32 low );
+static int  openClassic( struct pcapFile *pf );
+static int  openNg( struct pcapFile *pf );
+static void readInterface( struct pcapFile *pf, const uchar *body, ui32 bodyLen );
+static int  nextClassic( struct pcapFile *pf, struct frame *f, ui64 *next );
+static int  nextNg( struct pcapFile *pf, struct frame *f, ui64 *next );
+static int  isDue( struct pcapFile *pf, ui64 ts, ui64 *wait );
+
+/** public interface *********************************************************/
+struct pcapFile *	pcapOpen( const char *path, float speed );
+void				pcapClose( struct pcapFile *pf );
+int					pcapReadBurst( struct pcapFile *pf, struct frame *frames, int maxFrames );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * rd16()
+ *---------------------------------------------------------------------------*/
+static ui16 rd16( const struct pcapFile *pf, const uchar *p )
+{
+	ui16  v;
+
+	memcpy( &v, p, sizeof( v ));
+	return  pf->bSwapped ? __builtin_bswap16( v ) : v;
+}
+
+/*-----------------------------------------------------------------------------
+ * rd32()
+ *---------------------------------------------------------------------------*/
+static ui32 rd32( const struct pcapFile *pf, const uchar *p )
+{
+	ui32  v;
+
+	memcpy( &v, p, sizeof( v ));
+	return  pf->bSwapped ? __builtin_bswap32( v ) : v;
+}
+
+/*-----------------------------------------------------------------------------
+ * monotonicTime()
+ *---------------------------------------------------------------------------*/
+static ui64 monotonicTime()
+{
+	struct timespec  ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return  (ui64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*-----------------------------------------------------------------------------
+ * ngTimestamp()
+ *---------------------------------------------------------------------------*/
+static ui64 ngTimestamp( const struct pcapFile *pf, ui32 ifId, ui32 high, ui32 low )
+{
+	ui64   ts = ((ui64)high << 32) | low;
+	uchar  resol, i;
+	ui64   unit;
+
+	resol = ifId < pf->interfaceCount ? pf->interfaces[ifId].tsResol : PCAPNG_DEFAULT_TSRESOL;
+
+	/* con el bit alto a uno la resolucin es 2^-n, si no 10^-n */
+	if( resol & 0x80 )
+	{
+		resol &= 0x7f;
+		if( resol > 63 )
+			return  0;
+		return  ( ts >> resol ) * 1000000000ULL +
+				((( ts & (( 1ULL << resol ) - 1 )) * 1000000000ULL ) >> resol );
+	}
+
+	for( unit = 1, i = resol; i < 9; i++ )
+		unit *= 10;
+	if( resol <= 9 )
+		return  ts * unit;
+
+	for( unit = 1, i = 9; i < resol  &&  i < 28; i++ )
+		unit *= 10;
+	return  ts / unit;
+}
+
+/*-----------------------------------------------------------------------------
+ * openClassic()
+ *---------------------------------------------------------------------------*/
+static int openClassic( struct pcapFile *pf )
+{
+	ui32  magic;
+
+	memcpy( &magic, pf->data, sizeof( magic ));
+	pf->bSwapped = ( magic == __builtin_bswap32( PCAP_MAGIC_USEC )  ||
+					 magic == __builtin_bswap32( PCAP_MAGIC_NSEC ));
+	magic = rd32( pf, pf->data );
+
+	if( magic == PCAP_MAGIC_USEC )
+		pf->tsUnit = 1000;
+	else if( magic == PCAP_MAGIC_NSEC )
+		pf->tsUnit = 1;
+	else
+		return -1;
+
+	if( pf->size < PCAP_FILE_HDR_LEN )
+		return -1;
+
+	/* el tipo de enlace ocupa los 16 bits bajos, el resto son flags FCS */
+	pf->linkType = rd32( pf, pf->data + 20 ) & 0xffff;
+	pf->offset   = PCAP_FILE_HDR_LEN;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * openNg()
+ *---------------------------------------------------------------------------*/
+static int openNg( struct pcapFile *pf )
+{
+	ui64  offset;
+	ui32  type, len;
+
+	pf->bNg = TRUE;
+
+	/* el tipo de enlace de la captura es el de la primera interfaz */
+	for( offset = 0; offset + 12 <= pf->size; offset += len )
+	{
+		if( rd32( pf, pf->data + offset ) == PCAPNG_SHB )
+			pf->bSwapped = ( *(ui32 *)( pf->data + offset + 8 ) != PCAPNG_BYTE_ORDER );
+
+		type = rd32( pf, pf->data + offset );
+		len  = rd32( pf, pf->data + offset + 4 );
+		if( len < 12  ||  ( len & 3 )  ||  offset + len > pf->size )
+			break;
+
+		if( type == PCAPNG_IDB  &&  len >= 20 )
+		{
+			pf->linkType = rd16( pf, pf->data + offset + 8 );
+			pf->offset   = 0;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*-----------------------------------------------------------------------------
+ * readInterface()
+ *---------------------------------------------------------------------------*/
+static void readInterface( struct pcapFile *pf, const uchar *body, ui32 bodyLen )
+{
+	struct pcapInterface  *ifc;
+	ui32                   pos;
+	ui16                   code, len;
+
+	if( pf->interfaceCount == PCAP_MAX_INTERFACES )
+		return;
+
+	ifc = &pf->interfaces[ pf->interfaceCount++ ];
+	ifc->linkType = rd16( pf, body );
+	ifc->tsResol  = PCAPNG_DEFAULT_TSRESOL;
+
+	/* recorremos las opciones buscando la resolucin de las marcas de tiempo */
+	for( pos = 8; pos + 4 <= bodyLen; pos += 4 + (( len + 3 ) & ~3 ))
+	{
+		code = rd16( pf, body + pos );
+		len  = rd16( pf, body + pos + 2 );
+		if( code == 0  ||  pos + 4 + len > bodyLen )
+			break;
+		if( code == PCAPNG_OPT_TSRESOL  &&  len == 1 )
+			ifc->tsResol = body[ pos + 4 ];
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * nextClassic()
+ *---------------------------------------------------------------------------*/
+static int nextClassic( struct pcapFile *pf, struct frame *f, ui64 *next )
+{
+	const uchar  *rec = pf->data + pf->offset;
+	ui32          caplen;
+
+	if( pf->offset + PCAP_RECORD_HDR_LEN > pf->size )
+		return FALSE;
+
+	/* un registro truncado al final del fichero es el fin de la captura */
+	caplen = rd32( pf, rec + 8 );
+	if( pf->offset + PCAP_RECORD_HDR_LEN + caplen > pf->size )
+		return FALSE;
+
+	f->data   = rec + PCAP_RECORD_HDR_LEN;
+	f->caplen = caplen;
+	f->len    = rd32( pf, rec + 12 );
+	if( f->len < f->caplen )
+		f->len = f->caplen;		/* un fichero corrupto no puede dar menos cable que captura */
+	f->tstamp = (ui64)rd32( pf, rec ) * 1000000000ULL + (ui64)rd32( pf, rec + 4 ) * pf->tsUnit;
+
+	*next = pf->offset + PCAP_RECORD_HDR_LEN + caplen;
+	return TRUE;
+}
+
+/*-----------------------------------------------------------------------------
+ * nextNg()
+ *---------------------------------------------------------------------------*/
+static int nextNg( struct pcapFile *pf, struct frame *f, ui64 *next )
+{
+	const uchar  *blk;
+	ui32          type, len, ifId, caplen;
+
+	/* saltamos los bloques que no son paquetes, procesando los de control */
+	while( pf->offset + 12 <= pf->size )
+	{
+		blk = pf->data + pf->offset;
+
+		if( rd32( pf, blk ) == PCAPNG_SHB )
+		{
+			/* cada seccin puede tener otro orden de bytes y sus propias interfaces */
+			pf->bSwapped       = ( *(ui32 *)( blk + 8 ) != PCAPNG_BYTE_ORDER );
+			pf->interfaceCount = 0;
+		}
+
+		type = rd32( pf, blk );
+		len  = rd32( pf, blk + 4 );
+		if( len < 12  ||  ( len & 3 )  ||  pf->offset + len > pf->size )
+			return FALSE;
+		*next = pf->offset + len;
+
+		switch( type )
+		{
+			case PCAPNG_IDB:
+				if( len >= 20 )
+					readInterface( pf, blk + 8, len - 12 );
+				break;
+
+			case PCAPNG_EPB:
+				if( len < 32 )
+					break;
+				ifId   = rd32( pf, blk + 8 );
+				caplen = rd32( pf, blk + 20 );
+				if( caplen > len - 32 )
+					break;
+				f->data   = blk + 28;
+				f->caplen = caplen;
+				f->len    = rd32( pf, blk + 24 );
+				if( f->len < f->caplen )
+					f->len = f->caplen;
+				f->tstamp = ngTimestamp( pf, ifId, rd32( pf, blk + 12 ), rd32( pf, blk + 16 ));
+				if( ifId < pf->interfaceCount  &&  pf->interfaces[ifId].linkType == pf->linkType )
+					return TRUE;
+				break;
+
+			case PCAPNG_SPB:
+				if( len < 16 )
+					break;
+				/* no lleva longitud capturada, es la original recortada al bloque */
+				f->data   = blk + 12;
+				f->len    = rd32( pf, blk + 8 );
+				f->caplen = f->len < len - 16 ? f->len : len - 16;
+				f->tstamp = 0;
+				if( pf->interfaceCount > 0  &&  pf->interfaces[0].linkType == pf->linkType )
+					return TRUE;
+				break;
+
+			case PCAPNG_PB:
+				if( len < 32 )
+					break;
+				ifId   = rd16( pf, blk + 8 );
+				caplen = rd32( pf, blk + 20 );
+				if( caplen > len - 32 )
+					break;
+				f->data   = blk + 28;
+				f->caplen = caplen;
+				f->len    = rd32( pf, blk + 24 );
+				if( f->len < f->caplen )
+					f->len = f->caplen;
+				f->tstamp = ngTimestamp( pf, ifId, rd32( pf, blk + 12 ), rd32( pf, blk + 16 ));
+				if( ifId < pf->interfaceCount  &&  pf->interfaces[ifId].linkType == pf->linkType )
+					return TRUE;
+				break;
+		}
+
+		pf->offset = *next;
+	}
+
+	return FALSE;
+}
+
+/*-----------------------------------------------------------------------------
+ * isDue()
+ *---------------------------------------------------------------------------*/
+static int isDue( struct pcapFile *pf, ui64 ts, ui64 *wait )
+{
+	ui64  now, due;
+
+	if( pf->speed <= 0 )
+		return TRUE;
+
+	now = monotonicTime();
+
+	/* el primer registro marca el origen de tiempos de la reproduccin */
+	if( !pf->bStarted )
+	{
+		pf->bStarted  = TRUE;
+		pf->firstTs   = ts;
+		pf->startTime = now;
+	}
+
+	due = pf->startTime;
+	if( ts > pf->firstTs )
+		due += (ui64)(( ts - pf->firstTs ) / pf->speed );
+
+	if( now >= due )
+		return TRUE;
+
+	*wait = due - now;
+	return FALSE;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * pcapOpen()
+ *---------------------------------------------------------------------------*/
+struct pcapFile * pcapOpen( const char *path, float speed )
+{
+	struct pcapFile  *pf;
+	struct stat       st;
+	int               fd, res;
+
+	assert( path != NULL );
+
+	fd = open( path, O_RDONLY );
+	if( fd < 0 )
+	{
+		printf( "%s: %s\n", path, strerror( errno ));
+		return NULL;
+	}
+	if( fstat( fd, &st ) < 0  ||  st.st_size < 4 )
+	{
+		printf( "%s: not a capture file\n", path );
+		close( fd );
+		return NULL;
+	}
+
+	pf = calloc( 1, sizeof( *pf ));
+	if( pf == NULL )
+	{
+		close( fd );
+		return NULL;
+	}
+	pf->size  = st.st_size;
+	pf->speed = speed;
+
+	/* lo leemos directamente de la cach de pginas, sin copias */
+	pf->data = mmap( NULL, pf->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if( pf->data == MAP_FAILED )
+	{
+		printf( "mmap %s: %s\n", path, strerror( errno ));
+		pf->data = NULL;
+		pcapClose( pf );
+		return NULL;
+	}
+	madvise( pf->data, pf->size, MADV_SEQUENTIAL );
+
+	if( *(ui32 *)pf->data == PCAPNG_SHB )
+		res = openNg( pf );
+	else
+		res = openClassic( pf );
+
+	if( res == -1 )
+	{
+		printf( "%s: unknown or damaged capture file format\n", path );
+		pcapClose( pf );
+		return NULL;
+	}
+
+	return pf;
+}
+
+/*-----------------------------------------------------------------------------
+ * pcapClose()
+ *---------------------------------------------------------------------------*/
+void pcapClose( struct pcapFile *pf )
+{
+	if( pf == NULL )
+		return;
+
+	if( pf->data != NULL )
+		munmap( pf->data, pf->size );
+	free( pf );
+}
+
+/*-----------------------------------------------------------------------------
+ * pcapReadBurst()
+ *---------------------------------------------------------------------------*/
+int pcapReadBurst( struct pcapFile *pf, struct frame *frames, int maxFrames )
+{
+	struct timespec  ts;
+	ui64             next, wait;
+	uchar            bSlept = FALSE;
+	int              n = 0, found;
+
+	assert( pf     != NULL );
+	assert( frames != NULL );
+
+	while( n < maxFrames  &&  !pf->bEof )
+	{
+		found = pf->bNg ? nextNg( pf, &frames[n], &next ) : nextClassic( pf, &frames[n], &next );
+		if( !found )
+		{
+			pf->bEof = TRUE;
+			break;
+		}
+
+		/* si todava no le toca, entregamos lo que tenemos o esperamos un poco */
+		if( !isDue( pf, frames[n].tstamp, &wait ))
+		{
+			if( n > 0  ||  bSlept )
+				break;
+			if( wait > PCAP_MAX_SLEEP_NS )
+				wait = PCAP_MAX_SLEEP_NS;
+			ts.tv_sec  = wait / 1000000000ULL;
+			ts.tv_nsec = wait % 1000000000ULL;
+			nanosleep( &ts, NULL );
+			bSlept = TRUE;
+			continue;
+		}
+
+		/* en un fichero no sabemos si la trama era un supersegmento */
+		frames[n].gsoSize = 0;
+		frames[n].bVlan   = FALSE;
+		pf->offset = next;
+		__atomic_store_n( &pf->records, pf->records + 1, __ATOMIC_RELAXED );	/* lo lee la interfaz */
+		n++;
+	}
+
+	return n;
+}
+
+/****************************************************************************
+ * End of pcapFile.c
+ ****************************************************************************/
@@ -0,0 +1,74 @@
+/****************************************************************************
+ * Module:  pcapFile
+ *
+ ****************************************************************************/
+#ifndef _PCAPFILE_H_
+#define _PCAPFILE_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define PCAP_MAX_INTERFACES		16		/* interfaces pcapng que recordamos */
+#define PCAP_LINKTYPE_NULL		0		/* loopback de BSD, familia en orden del host */
+#define PCAP_LINKTYPE_ETHERNET	1		/* LINKTYPE_ETHERNET */
+#define PCAP_LINKTYPE_RAW		101		/* IPv4 o IPv6 sin enlace */
+#define PCAP_LINKTYPE_LOOP		108		/* loopback de OpenBSD, familia en orden de red */
+#define PCAP_LINKTYPE_LINUX_SLL	113		/* Linux cooked */
+#define PCAP_LINKTYPE_IPV4		228
+#define PCAP_LINKTYPE_IPV6		229
+#define PCAP_LINKTYPE_LINUX_SLL2 276
+
+/** forward declarations *****************************************************/
+struct frame;
+
+/** public types *************************************************************/
+/*******
+ * pcapInterface
+ *******/
+struct pcapInterface
+{
+	ui16				 linkType;
+	uchar				 tsResol;		/* if_tsresol de pcapng */
+};
+
+/*******
+ * pcapFile
+ *******/
+struct pcapFile
+{
+	uchar				*data;			/* fichero completo mapeado en memoria */
+	ui64				 size;
+	ui64				 offset;		/* siguiente registro */
+
+	uchar				 bNg;			/* TRUE si es pcapng */
+	uchar				 bSwapped;		/* orden de bytes distinto al nuestro */
+	uchar				 bEof;
+
+	/* pcap clsico */
+	ui16				 linkType;
+	ui32				 tsUnit;		/* nanosegundos por unidad de la fraccin */
+
+	/* pcapng */
+	struct pcapInterface interfaces[ PCAP_MAX_INTERFACES ];
+	ui32				 interfaceCount;
+
+	/* reproduccin */
+	float				 speed;			/* 0 = lo ms rpido posible, 1 = tiempo original */
+	uchar				 bStarted;
+	ui64				 firstTs;		/* marca de tiempo del primer registro */
+	ui64				 startTime;		/* hora a la que lo reproducimos */
+
+	ui64				 records;		/* registros ledos */
+};
+
+/** public interface *********************************************************/
+struct pcapFile *	pcapOpen( const char *path, float speed );
+void				pcapClose( struct pcapFile *pf );
+
+int					pcapReadBurst( struct pcapFile *pf, struct frame *frames, int maxFrames );
+
+
+#endif  /* _PCAPFILE_H_ */
+/****************************************************************************
+ * End of pcapFile.h
+ ****************************************************************************/
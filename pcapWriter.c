@@ -0,0 +1,413 @@
+/****************************************************************************
+ * Module:  pcapWriter.c
+ *
+ ****************************************************************************/
+#include "pcapWriter.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <assert.h>
+#include <sys/uio.h>
+
+/** defines ******************************************************************/
+#define PW_MAGIC_NSEC			0xa1b23c4d		/* pcap con marcas de tiempo en nanosegundos */
+#define PW_SNAPLEN				262144
+#define PW_ALIGN				4096
+
+/** private types ************************************************************/
+/*******
+ * pcapFileHeader
+ *******/
+struct pcapFileHeader
+{
+	ui32	magic;
+	ui16	versionMajor;
+	ui16	versionMinor;
+	ui32	thisZone;
+	ui32	sigFigs;
+	ui32	snapLen;
+	ui32	linkType;
+};
+
+/*******
+ * pcapRecordHeader
+ *******/
+struct pcapRecordHeader
+{
+	ui32	sec;
+	ui32	nsec;
+	ui32	caplen;
+	ui32	len;
+};
+
+/** private interface ********************************************************/
+static void   setError( struct pcapWriter *pw, int error );
+static int    openFile( struct pcapWriter *pw );
+static void   queueBuffer( struct pcapWriter *pw, int idx );
+static int    writeBuffers( struct pcapWriter *pw, const int *idx, int count );
+static void * writerThread( void *arg );
+
+/** public interface *********************************************************/
+struct pcapWriter *	pwOpen( const char *path, ui64 rotateSize, ui32 rotateSecs, ui32 snaplen, ui32 linkType );
+void				pwClose( struct pcapWriter *pw );
+void				pwWriteBurst( struct pcapWriter *pw, const struct frame *frames, int count );
+void				pwGetStats( struct pcapWriter *pw, struct pwStats *st );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * setError()
+ *---------------------------------------------------------------------------*/
+static void setError( struct pcapWriter *pw, int error )
+{
+	pthread_mutex_lock( &pw->lock );
+	pw->stats.error = error;
+	pthread_mutex_unlock( &pw->lock );
+}
+
+/*-----------------------------------------------------------------------------
+ * openFile()
+ *---------------------------------------------------------------------------*/
+static int openFile( struct pcapWriter *pw )
+{
+	struct pcapFileHeader  hdr;
+	char                   name[ PATH_MAX ];
+
+	/* si rotamos, cada fichero lleva un nmero de secuencia */
+	if( pw->rotateSize == 0  &&  pw->rotateSecs == 0 )
+		snprintf( name, sizeof( name ), "%s", pw->path );
+	else
+		snprintf( name, sizeof( name ), "%s.%u", pw->path, pw->fileIndex );
+	pw->fileIndex++;
+
+	pw->fd = open( name, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+	if( pw->fd < 0 )
+	{
+		setError( pw, errno );
+		return -1;
+	}
+
+	memset( &hdr, 0, sizeof( hdr ));
+	hdr.magic        = PW_MAGIC_NSEC;
+	hdr.versionMajor = 2;
+	hdr.versionMinor = 4;
+	hdr.snapLen      = pw->snaplen;
+	hdr.linkType     = pw->linkType;
+	if( write( pw->fd, &hdr, sizeof( hdr )) != sizeof( hdr ))
+	{
+		setError( pw, errno );
+		close( pw->fd );
+		pw->fd = -1;
+		return -1;
+	}
+
+	pw->fileSize  = sizeof( hdr );
+	pw->fileStart = time( NULL );
+
+	pthread_mutex_lock( &pw->lock );
+	pw->stats.bytes += sizeof( hdr );
+	pw->stats.files++;
+	pthread_mutex_unlock( &pw->lock );
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * queueBuffer()
+ *---------------------------------------------------------------------------*/
+static void queueBuffer( struct pcapWriter *pw, int idx )
+{
+	/* con el cerrojo cogido: lo pasamos a la cola del hilo de escritura */
+	pw->fullList[ ( pw->fullHead + pw->fullCount ) % PW_BUFFER_COUNT ] = idx;
+	pw->fullCount++;
+	pthread_cond_signal( &pw->cond );
+}
+
+/*-----------------------------------------------------------------------------
+ * writeBuffers()
+ *---------------------------------------------------------------------------*/
+static int writeBuffers( struct pcapWriter *pw, const int *idx, int count )
+{
+	struct iovec  iov[ PW_BUFFER_COUNT ], *cur;
+	ssize_t       res;
+	ui64          total = 0;
+	int           i, left;
+
+	/* solo rotamos entre buffers, as ningn registro queda partido */
+	if( pw->fd >= 0  &&
+		(( pw->rotateSize != 0  &&  pw->fileSize >= pw->rotateSize )  ||
+		 ( pw->rotateSecs != 0  &&  (ui64)time( NULL ) >= pw->fileStart + pw->rotateSecs )))
+	{
+		close( pw->fd );
+		pw->fd = -1;
+		if( openFile( pw ) == -1 )
+			return -1;
+	}
+	if( pw->fd < 0 )
+		return -1;
+
+	for( i = 0; i < count; i++ )
+	{
+		iov[i].iov_base = pw->buffers[ idx[i] ].data;
+		iov[i].iov_len  = pw->buffers[ idx[i] ].used;
+		total += iov[i].iov_len;
+	}
+
+	/* todos los buffers pendientes con una sola llamada, salvo escrituras parciales */
+	cur  = iov;
+	left = count;
+	while( left > 0 )
+	{
+		res = writev( pw->fd, cur, left );
+		if( res < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			setError( pw, errno );
+			return -1;
+		}
+
+		while( left > 0  &&  (size_t)res >= cur->iov_len )
+		{
+			res -= cur->iov_len;
+			cur++;
+			left--;
+		}
+		if( left > 0 )
+		{
+			cur->iov_base  = (uchar *)cur->iov_base + res;
+			cur->iov_len  -= res;
+		}
+	}
+
+	pw->fileSize += total;
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * writerThread()
+ *---------------------------------------------------------------------------*/
+static void * writerThread( void *arg )
+{
+	struct pcapWriter  *pw = arg;
+	struct timespec     deadline;
+	int                 idx[ PW_BUFFER_COUNT ];
+	int                 i, count, res;
+	ui64                records, bytes;
+
+	pthread_mutex_lock( &pw->lock );
+	for( ;; )
+	{
+		/* si no se llena nada, cada cierto tiempo vaciamos el buffer a medias */
+		while( pw->fullCount == 0  &&  !pw->bQuit )
+		{
+			clock_gettime( CLOCK_REALTIME, &deadline );
+			deadline.tv_sec += PW_FLUSH_PERIOD;
+			if( pthread_cond_timedwait( &pw->cond, &pw->lock, &deadline ) == ETIMEDOUT  &&
+				pw->cur >= 0  &&  pw->buffers[ pw->cur ].used > 0 )
+			{
+				queueBuffer( pw, pw->cur );
+				pw->cur = -1;
+			}
+		}
+		if( pw->fullCount == 0 )
+			break;
+
+		/* nos llevamos todos los buffers llenos de una vez */
+		count = pw->fullCount;
+		for( i = 0, bytes = 0; i < count; i++ )
+		{
+			idx[i] = pw->fullList[ ( pw->fullHead + i ) % PW_BUFFER_COUNT ];
+			bytes += pw->buffers[ idx[i] ].used;
+		}
+		pw->fullHead  = ( pw->fullHead + count ) % PW_BUFFER_COUNT;
+		pw->fullCount = 0;
+
+		/* el disco se toca sin el cerrojo, la captura sigue llenando otros buffers */
+		pthread_mutex_unlock( &pw->lock );
+		res = writeBuffers( pw, idx, count );
+		pthread_mutex_lock( &pw->lock );
+
+		for( i = 0, records = 0; i < count; i++ )
+		{
+			records += pw->buffers[ idx[i] ].records;
+			pw->buffers[ idx[i] ].used    = 0;
+			pw->buffers[ idx[i] ].records = 0;
+			pw->freeList[ pw->freeCount++ ] = idx[i];
+		}
+		if( res == 0 )
+		{
+			pw->stats.records += records;
+			pw->stats.bytes   += bytes;
+		}
+		else
+			pw->stats.drops   += records;
+	}
+	pthread_mutex_unlock( &pw->lock );
+
+	return NULL;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * pwOpen()
+ *---------------------------------------------------------------------------*/
+struct pcapWriter * pwOpen( const char *path, ui64 rotateSize, ui32 rotateSecs, ui32 snaplen, ui32 linkType )
+{
+	struct pcapWriter  *pw;
+	int                 i;
+
+	assert( path != NULL );
+
+	pw = calloc( 1, sizeof( *pw ));
+	if( pw == NULL )
+		return NULL;
+	pw->path       = path;
+	pw->rotateSize = rotateSize;
+	pw->rotateSecs = rotateSecs;
+	pw->snaplen    = snaplen != 0 ? snaplen : PW_SNAPLEN;
+	pw->linkType   = linkType;
+	pw->fd         = -1;
+	pw->cur        = -1;
+	pthread_mutex_init( &pw->lock, NULL );
+	pthread_cond_init( &pw->cond, NULL );
+
+	/* buffers alineados a pgina, reservados de antemano */
+	for( i = 0; i < PW_BUFFER_COUNT; i++ )
+	{
+		if( posix_memalign( (void **)&pw->buffers[i].data, PW_ALIGN, PW_BUFFER_SIZE ) != 0 )
+		{
+			pwClose( pw );
+			return NULL;
+		}
+		pw->freeList[ pw->freeCount++ ] = i;
+	}
+
+	/* abrimos ya el primer fichero para poder avisar de los errores */
+	if( openFile( pw ) == -1 )
+	{
+		printf( "%s: %s\n", path, strerror( pw->stats.error ));
+		pwClose( pw );
+		return NULL;
+	}
+
+	if( pthread_create( &pw->thread, NULL, writerThread, pw ) != 0 )
+	{
+		pwClose( pw );
+		return NULL;
+	}
+	pw->bRunning = TRUE;
+
+	return pw;
+}
+
+/*-----------------------------------------------------------------------------
+ * pwClose()
+ *---------------------------------------------------------------------------*/
+void pwClose( struct pcapWriter *pw )
+{
+	int  i;
+
+	if( pw == NULL )
+		return;
+
+	/* escribimos lo que quede pendiente antes de terminar */
+	if( pw->bRunning )
+	{
+		pthread_mutex_lock( &pw->lock );
+		if( pw->cur >= 0  &&  pw->buffers[ pw->cur ].used > 0 )
+			queueBuffer( pw, pw->cur );
+		pw->cur   = -1;
+		pw->bQuit = TRUE;
+		pthread_cond_signal( &pw->cond );
+		pthread_mutex_unlock( &pw->lock );
+
+		pthread_join( pw->thread, NULL );
+	}
+	pthread_cond_destroy( &pw->cond );
+	pthread_mutex_destroy( &pw->lock );
+
+	if( pw->fd >= 0 )
+		close( pw->fd );
+	for( i = 0; i < PW_BUFFER_COUNT; i++ )
+		free( pw->buffers[i].data );
+	free( pw );
+}
+
+/*-----------------------------------------------------------------------------
+ * pwWriteBurst()
+ *---------------------------------------------------------------------------*/
+void pwWriteBurst( struct pcapWriter *pw, const struct frame *frames, int count )
+{
+	struct pcapRecordHeader  rec;
+	struct pwBuffer         *buf;
+	ui32                     recLen;
+	int                      i;
+
+	assert( pw     != NULL );
+	assert( frames != NULL );
+
+	if( count == 0 )
+		return;
+
+	/* un solo cerrojo por rfaga, la copia a memoria es lo nico que hacemos aqu */
+	pthread_mutex_lock( &pw->lock );
+	for( i = 0; i < count; i++ )
+	{
+		recLen = sizeof( rec ) + frames[i].caplen;
+
+		/* si no cabe, el buffer actual pasa al hilo de escritura */
+		if( pw->cur >= 0  &&  pw->buffers[ pw->cur ].used + recLen > PW_BUFFER_SIZE )
+		{
+			queueBuffer( pw, pw->cur );
+			pw->cur = -1;
+		}
+		if( pw->cur < 0 )
+		{
+			/* si el disco no da abasto perdemos la trama, nunca bloqueamos la captura */
+			if( pw->freeCount == 0  ||  recLen > PW_BUFFER_SIZE )
+			{
+				pw->stats.drops++;
+				continue;
+			}
+			pw->cur = pw->freeList[ --pw->freeCount ];
+		}
+
+		rec.sec    = frames[i].tstamp / 1000000000ULL;
+		rec.nsec   = frames[i].tstamp % 1000000000ULL;
+		rec.caplen = frames[i].caplen;
+		rec.len    = frames[i].len;
+
+		buf = &pw->buffers[ pw->cur ];
+		memcpy( buf->data + buf->used, &rec, sizeof( rec ));
+		memcpy( buf->data + buf->used + sizeof( rec ), frames[i].data, frames[i].caplen );
+		buf->used += recLen;
+		buf->records++;
+	}
+	pthread_mutex_unlock( &pw->lock );
+}
+
+/*-----------------------------------------------------------------------------
+ * pwGetStats()
+ *---------------------------------------------------------------------------*/
+void pwGetStats( struct pcapWriter *pw, struct pwStats *st )
+{
+	assert( pw != NULL );
+	assert( st != NULL );
+
+	pthread_mutex_lock( &pw->lock );
+	*st = pw->stats;
+	pthread_mutex_unlock( &pw->lock );
+}
+
+/****************************************************************************
+ * End of pcapWriter.c
+ ****************************************************************************/
@@ -0,0 +1,86 @@
+/****************************************************************************
+ * Module:  pcapWriter
+ *
+ ****************************************************************************/
+#ifndef _PCAPWRITER_H_
+#define _PCAPWRITER_H_
+
+#include <pthread.h>
+#include "types.h"
+
+/** defines ******************************************************************/
+#define PW_BUFFER_SIZE			(1 << 20)	/* 1 MB por buffer de escritura */
+#define PW_BUFFER_COUNT			16			/* buffers en vuelo entre captura y disco */
+#define PW_FLUSH_PERIOD			1			/* segundos mximos que un registro espera en memoria */
+
+/** forward declarations *****************************************************/
+struct frame;
+
+/** public types *************************************************************/
+/*******
+ * pwStats
+ *******/
+struct pwStats
+{
+	ui64				 bytes;			/* bytes escritos en disco */
+	ui64				 records;		/* tramas escritas */
+	ui64				 drops;			/* tramas perdidas por no tener buffer libre */
+	ui32				 files;			/* ficheros abiertos */
+	int					 error;			/* errno de la ltima escritura fallida */
+};
+
+/*******
+ * pwBuffer
+ *******/
+struct pwBuffer
+{
+	uchar				*data;			/* alineado a pgina */
+	ui32				 used;
+	ui32				 records;		/* tramas que contiene */
+};
+
+/*******
+ * pcapWriter
+ *******/
+struct pcapWriter
+{
+	pthread_t			 thread;		/* hilo que escribe en disco */
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	uchar				 bRunning;		/* el hilo est arrancado */
+	uchar				 bQuit;
+
+	struct pwBuffer		 buffers[ PW_BUFFER_COUNT ];
+	int					 freeList[ PW_BUFFER_COUNT ];	/* buffers libres */
+	int					 freeCount;
+	int					 fullList[ PW_BUFFER_COUNT ];	/* buffers llenos, por orden */
+	int					 fullHead;
+	int					 fullCount;
+	int					 cur;			/* buffer que estamos llenando, -1 si ninguno */
+
+	/* ficheros */
+	const char			*path;
+	ui64				 rotateSize;	/* bytes por fichero, 0 = sin lmite */
+	ui32				 rotateSecs;	/* segundos por fichero, 0 = sin lmite */
+	ui32				 snaplen;		/* bytes por trama que anunciamos en la cabecera */
+	ui32				 linkType;		/* el de las tramas capturadas */
+	int					 fd;
+	ui32				 fileIndex;
+	ui64				 fileSize;
+	ui64				 fileStart;
+
+	struct pwStats		 stats;
+};
+
+/** public interface *********************************************************/
+struct pcapWriter *	pwOpen( const char *path, ui64 rotateSize, ui32 rotateSecs, ui32 snaplen, ui32 linkType );
+void				pwClose( struct pcapWriter *pw );
+
+void				pwWriteBurst( struct pcapWriter *pw, const struct frame *frames, int count );
+void				pwGetStats( struct pcapWriter *pw, struct pwStats *st );
+
+
+#endif  /* _PCAPWRITER_H_ */
+/****************************************************************************
+ * End of pcapWriter.h
+ ****************************************************************************/
@@ -0,0 +1,292 @@
+/****************************************************************************
+ * Module:  slabArena.c
+ *
+ ****************************************************************************/
+#include "slabArena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+/** private interface ********************************************************/
+static struct slabHeader * header( struct slabClass *c, ui32 idx );
+static int reserveMemory( struct slabArena *a, ui64 reserve );
+
+/** public interface *********************************************************/
+struct slabArena *	slabCreate( ui64 reserve );
+void				slabDestroy( struct slabArena *a );
+int					slabAddClass( struct slabArena *a, ui32 objectSize );
+ui32				slabClassSize( ui32 objectSize );
+slabHandle			slabAlloc( struct slabArena *a, int cls, void **object );
+void				slabFree( struct slabArena *a, slabHandle h );
+void *				slabGet( struct slabArena *a, slabHandle h );
+void				slabGetStats( const struct slabArena *a, struct slabStats *stats );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * header()
+ *---------------------------------------------------------------------------*/
+struct slabHeader * header( struct slabClass *c, ui32 idx )
+{
+	return (struct slabHeader *)( c->slabs[ idx >> c->slabShift ] + ( (size_t)( idx & c->slabMask ) << c->slotShift ));
+}
+
+/*-----------------------------------------------------------------------------
+ * reserveMemory()
+ *---------------------------------------------------------------------------*/
+int reserveMemory( struct slabArena *a, ui64 reserve )
+{
+	/* primero pginas enormes de verdad; solo sale bien si el sistema tiene
+	   reservadas bastantes (vm.nr_hugepages), y entonces ya son nuestras */
+	a->map = mmap( NULL, reserve, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+	if( a->map != MAP_FAILED )
+	{
+		a->mapSize    = reserve;
+		a->base       = a->map;
+		a->reserved   = reserve;
+		a->bHugePages = TRUE;
+		return 0;
+	}
+
+	/* si no, memoria normal que solo ocupa al tocarla, alineada a losa para
+	   que el kernel pueda juntar cada losa en una pgina enorme transparente */
+	a->mapSize = reserve + SLAB_SIZE;
+	a->map     = mmap( NULL, a->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+	if( a->map == MAP_FAILED )
+	{
+		printf( "slabCreate: cannot reserve %llu bytes: %s\n", (unsigned long long)reserve, strerror( errno ));
+		return -1;
+	}
+	a->base       = (uchar *)( ( (size_t)a->map + SLAB_SIZE - 1 ) & ~( (size_t)SLAB_SIZE - 1 ));
+	a->reserved   = reserve;
+	a->bHugePages = FALSE;
+	madvise( a->base, reserve, MADV_HUGEPAGE );
+
+	return 0;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * slabCreate()
+ *---------------------------------------------------------------------------*/
+struct slabArena * slabCreate( ui64 reserve )
+{
+	struct slabArena  *a;
+
+	a = calloc( 1, sizeof( *a ));
+	if( a == NULL )
+		return NULL;
+
+	/* en losas enteras */
+	reserve = ( reserve + SLAB_SIZE - 1 ) & ~( (ui64)SLAB_SIZE - 1 );
+	if( reserve == 0  ||  reserveMemory( a, reserve ) == -1 )
+	{
+		free( a );
+		return NULL;
+	}
+
+	return a;
+}
+
+/*-----------------------------------------------------------------------------
+ * slabDestroy()
+ *---------------------------------------------------------------------------*/
+void slabDestroy( struct slabArena *a )
+{
+	ui32  i;
+
+	if( a == NULL )
+		return;
+
+	for( i = 0; i < a->classCount; i++ )
+		free( a->classes[i].slabs );
+	munmap( a->map, a->mapSize );
+	free( a );
+}
+
+/*-----------------------------------------------------------------------------
+ * slabAddClass()
+ *---------------------------------------------------------------------------*/
+int slabAddClass( struct slabArena *a, ui32 objectSize )
+{
+	struct slabClass  *c;
+	ui32               slotSize, i;
+	ui64               objects;
+
+	assert( a != NULL );
+
+	/* dos tipos del mismo tamao comparten clase */
+	slotSize = slabClassSize( objectSize );
+	if( slotSize > SLAB_MAX_OBJECT )
+	{
+		printf( "slabAddClass: objects of %u bytes are too big\n", objectSize );
+		return -1;
+	}
+	for( i = 0; i < a->classCount; i++ )
+		if( a->classes[i].slotSize == slotSize )
+			return i;
+	if( a->classCount == SLAB_MAX_CLASSES )
+	{
+		printf( "slabAddClass: no more than %d classes\n", SLAB_MAX_CLASSES );
+		return -1;
+	}
+
+	c = &a->classes[ a->classCount ];
+	memset( c, 0, sizeof( *c ));
+	c->slotSize  = slotSize;
+	for( c->slotShift = 0; ( 1U << c->slotShift ) < slotSize; c->slotShift++ )
+		;
+	for( c->slabShift = 0; ( SLAB_SIZE / slotSize ) >> ( c->slabShift + 1 ) != 0; c->slabShift++ )
+		;
+	c->slabMask  = ( 1 << c->slabShift ) - 1;
+	c->freeList  = SLAB_NIL;
+
+	/* la tabla de losas se reserva ya para lo que quepa en la arena */
+	objects = a->reserved / slotSize;
+	if( objects > SLAB_MAX_OBJECTS )
+		objects = SLAB_MAX_OBJECTS;
+	c->maxSlabs = ( objects + c->slabMask ) >> c->slabShift;
+	c->slabs    = calloc( c->maxSlabs, sizeof( uchar * ));
+	if( c->slabs == NULL )
+		return -1;
+
+	return a->classCount++;
+}
+
+/*-----------------------------------------------------------------------------
+ * slabClassSize()
+ *---------------------------------------------------------------------------*/
+ui32 slabClassSize( ui32 objectSize )
+{
+	ui32  slotSize;
+
+	/* la potencia de dos en la que cabe el objeto con su cabecera; sirve
+	   para calcular cunto reservar antes de crear la arena */
+	for( slotSize = SLAB_MIN_OBJECT; slotSize < objectSize + sizeof( struct slabHeader ); slotSize *= 2 )
+		;
+
+	return slotSize;
+}
+
+/*-----------------------------------------------------------------------------
+ * slabAlloc()
+ *---------------------------------------------------------------------------*/
+slabHandle slabAlloc( struct slabArena *a, int cls, void **object )
+{
+	struct slabClass   *c;
+	struct slabHeader  *h;
+	ui32                idx;
+
+	assert( a != NULL  &&  cls >= 0  &&  (ui32)cls < a->classCount );
+	c = &a->classes[ cls ];
+
+	/* lo ltimo devuelto es lo primero que se reutiliza, an estar en cach */
+	if( c->freeList != SLAB_NIL )
+	{
+		idx         = c->freeList;
+		h           = header( c, idx );
+		c->freeList = h->nextFree;
+	}
+	else
+	{
+		/* se estrena un objeto; si empieza losa, se corta de la reserva */
+		idx = c->next;
+		if(( idx >> c->slabShift ) == c->slabCount )
+		{
+			if( c->slabCount == c->maxSlabs  ||  a->carved + SLAB_SIZE > a->reserved )
+				return SLAB_NO_HANDLE;
+			c->slabs[ c->slabCount++ ] = a->base + a->carved;
+			a->carved += SLAB_SIZE;
+		}
+		c->next++;
+		h             = header( c, idx );
+		h->generation = 1;
+	}
+
+	h->nextFree = SLAB_NIL;
+	c->live++;
+	*object = h + 1;
+
+	return SLAB_HANDLE( h->generation, cls, idx );
+}
+
+/*-----------------------------------------------------------------------------
+ * slabFree()
+ *---------------------------------------------------------------------------*/
+void slabFree( struct slabArena *a, slabHandle handle )
+{
+	struct slabClass   *c;
+	struct slabHeader  *h;
+	ui32                idx = SLAB_HANDLE_INDEX( handle );
+
+	if( slabGet( a, handle ) == NULL )
+	{
+		assert( FALSE );		/* doble liberacin o manejador ajeno */
+		return;
+	}
+
+	c = &a->classes[ SLAB_HANDLE_CLASS( handle )];
+	h = header( c, idx );
+
+	/* con la generacin nueva los manejadores que hubiera dejan de valer;
+	   la 0 no se usa para que ningn manejador valga SLAB_NO_HANDLE */
+	if( ++h->generation == 0 )
+		h->generation = 1;
+	h->nextFree = c->freeList;
+	c->freeList = idx;
+	c->live--;
+}
+
+/*-----------------------------------------------------------------------------
+ * slabGet()
+ *---------------------------------------------------------------------------*/
+void * slabGet( struct slabArena *a, slabHandle handle )
+{
+	struct slabClass   *c;
+	struct slabHeader  *h;
+	ui32                cls = SLAB_HANDLE_CLASS( handle ), idx = SLAB_HANDLE_INDEX( handle );
+
+	assert( a != NULL );
+
+	if( cls >= a->classCount )
+		return NULL;
+	c = &a->classes[ cls ];
+	if( idx >= c->next )
+		return NULL;
+
+	h = header( c, idx );
+	if( h->generation != SLAB_HANDLE_GEN( handle ))
+		return NULL;
+
+	return h + 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * slabGetStats()
+ *---------------------------------------------------------------------------*/
+void slabGetStats( const struct slabArena *a, struct slabStats *stats )
+{
+	ui32  i;
+
+	assert( a != NULL  &&  stats != NULL );
+
+	memset( stats, 0, sizeof( *stats ));
+	stats->reserved   = a->reserved;
+	stats->committed  = a->carved;
+	stats->bHugePages = a->bHugePages;
+	for( i = 0; i < a->classCount; i++ )
+	{
+		stats->live += a->classes[i].live;
+		stats->used += (ui64)a->classes[i].live * a->classes[i].slotSize;
+	}
+}
+
+/****************************************************************************
+ * End of slabArena.c
+ ****************************************************************************/
@@ -0,0 +1,114 @@
+/****************************************************************************
+ * Module:  slabArena
+ *
+ ****************************************************************************/
+#ifndef _SLABARENA_H_
+#define _SLABARENA_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define SLAB_SIZE				( 2 << 20 )		/* una pgina enorme de x86 */
+#define SLAB_MAX_CLASSES		8
+#define SLAB_MIN_OBJECT			64				/* clases de 64 a 8 KB, en potencias de dos */
+#define SLAB_MAX_OBJECT			( 8 << 10 )
+#define SLAB_INDEX_BITS			24
+#define SLAB_MAX_OBJECTS		( 1 << SLAB_INDEX_BITS )	/* por clase */
+#define SLAB_NIL				0xffffffff
+#define SLAB_NO_HANDLE			0				/* ningn objeto vivo tiene este */
+
+/* un manejador lleva la generacin del objeto cuando se dio: si se libera
+   y el hueco se reutiliza, los manejadores viejos dejan de valer */
+#define SLAB_HANDLE( gen, cls, idx )	( (ui64)(gen) << 32 | (ui64)(cls) << SLAB_INDEX_BITS | (idx) )
+#define SLAB_HANDLE_GEN( h )			( (ui32)( (h) >> 32 ))
+#define SLAB_HANDLE_CLASS( h )			( (ui32)( (h) >> SLAB_INDEX_BITS ) & 0xff )
+#define SLAB_HANDLE_INDEX( h )			( (ui32)(h) & ( SLAB_MAX_OBJECTS - 1 ))
+
+/* objeto idx de una clase, sin comprobar nada: para quien ya sabe que vive;
+   quien lo usa mucho guarda el puntero a la clase, que no se mueve */
+#define SLAB_OBJECT( c, idx ) \
+	( (void *)( (c)->slabs[ (idx) >> (c)->slabShift ] + \
+				( (size_t)( (idx) & (c)->slabMask ) << (c)->slotShift ) + sizeof( struct slabHeader )))
+#define SLAB_AT( a, cls, idx )		SLAB_OBJECT( &(a)->classes[cls], idx )
+
+/** public types *************************************************************/
+typedef ui64  slabHandle;
+
+/*******
+ * slabHeader
+ *
+ * Delante de cada objeto. La generacin cambia cada vez que se libera.
+ *******/
+struct slabHeader
+{
+	ui32				 generation;
+	ui32				 nextFree;		/* siguiente de la lista de libres de su clase */
+};
+
+/*******
+ * slabClass
+ *******/
+struct slabClass
+{
+	ui32				 slotSize;		/* potencia de dos, cabecera incluida */
+	ui32				 slotShift;		/* slotSize = 1 << slotShift */
+	ui32				 slabShift;		/* objetos por losa = 1 << slabShift */
+	ui32				 slabMask;
+	uchar			   **slabs;			/* losas de la clase, por orden */
+	ui32				 slabCount;
+	ui32				 maxSlabs;
+	ui32				 freeList;		/* primer objeto libre, SLAB_NIL si hay que estrenar */
+	ui32				 next;			/* primer objeto nunca usado */
+	ui32				 live;			/* objetos dados y no devueltos */
+};
+
+/*******
+ * slabArena
+ *
+ * Una sola reserva de memoria virtual, con pginas enormes si el sistema
+ * las tiene, que se reparte en losas de SLAB_SIZE segn las piden las
+ * clases. Lo devuelto va a la lista libre de su clase y no vuelve nunca
+ * al sistema: tras crear la arena, dar y liberar objetos no llama a malloc.
+ * Sin cerrojos propios, como la tabla que la usa.
+ *******/
+struct slabArena
+{
+	void				*map;			/* lo que devolvi mmap() */
+	ui64				 mapSize;
+	uchar				*base;			/* alineado a SLAB_SIZE */
+	ui64				 reserved;		/* bytes utilizables desde base */
+	ui64				 carved;		/* bytes ya repartidos en losas */
+	uchar				 bHugePages;	/* TRUE si la reserva es de pginas enormes */
+
+	struct slabClass	 classes[ SLAB_MAX_CLASSES ];
+	ui32				 classCount;
+};
+
+/*******
+ * slabStats
+ *******/
+struct slabStats
+{
+	ui64				 reserved;		/* memoria virtual de la arena */
+	ui64				 committed;		/* repartida en losas */
+	ui64				 used;			/* en objetos vivos, cabeceras incluidas */
+	ui32				 live;			/* objetos vivos de todas las clases */
+	uchar				 bHugePages;
+};
+
+/** public interface *********************************************************/
+struct slabArena *	slabCreate( ui64 reserve );
+void				slabDestroy( struct slabArena *a );
+int					slabAddClass( struct slabArena *a, ui32 objectSize );
+ui32				slabClassSize( ui32 objectSize );
+
+slabHandle			slabAlloc( struct slabArena *a, int cls, void **object );
+void				slabFree( struct slabArena *a, slabHandle h );
+void *				slabGet( struct slabArena *a, slabHandle h );
+void				slabGetStats( const struct slabArena *a, struct slabStats *stats );
+
+
+#endif  /* _SLABARENA_H_ */
+/****************************************************************************
+ * End of slabArena.h
+ ****************************************************************************/
@@ -1,6 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <linux/if_ether.h>
 #include <arpa/inet.h>
@@ -9,64 +17,504 @@
 
 #include "packetStruct.h"
 #include "packetBuilder.h"
+#include "capture.h"
+#include "pcapWriter.h"
+#include "bpfFilter.h"
+#include "devConfig.h"
 #include "ui.h"
 #include "connections.h"
+#include "flowRecords.h"
+
+/** defines ******************************************************************/
+#define REFRESH_PERIOD_MS		250		/* periodo de repintado de la pantalla */
+#define MAX_BURSTS_PER_WAKEUP	64		/* rafagas maximas por despertar, para no dejar sin teclado al usuario */
+#define MAX_EVENTS				4
+#define MAX_WORKERS				16		/* hilos de captura maximos */
+#define WORKER_POLL_MS			100		/* cada cuanto miran los hilos si hay que salir */
+
+/** types ********************************************************************/
+/*******
+ * worker
+ *******/
+struct worker
+{
+	pthread_t				 thread;
+	int						 index;						/* posicin en la lista, y su cola de registros */
+	struct capture			 cap;						/* socket propio del hilo */
+	struct connectionTable	*table;						/* conexiones vistas por este hilo */
+	struct frame			 frames[ CAP_MAX_BURST ];
+	struct packet			 packets[ CAP_MAX_BURST ];
+	ui64					 times[ CAP_MAX_BURST ];	/* hora de cada trama */
+	ui64					 startTime;					/* duracin de la captura */
+	ui64					 endTime;
+	ui64					 lastTime;					/* hora de la ltima rfaga con tramas */
+};
+
+/*******
+ * writerConfig
+ *******/
+struct writerConfig
+{
+	const char			*file;			/* fichero pcap de salida, NULL si no grabamos */
+	ui64				 rotateSize;	/* bytes por fichero */
+	ui32				 rotateSecs;	/* segundos por fichero */
+	const char			*records;		/* registros de conexiones, NULL si no se guardan */
+};
+
+/*******
+ * workerSet
+ *******/
+struct workerSet
+{
+	struct worker		*workers;
+	int					 count;
+	ui32				 snaplen;		/* los filtros nuevos tambin recortan */
+	ui32				 linkType;		/* y se compilan para el mismo enlace */
+};
+
+/** private data *************************************************************/
+static uchar  bQuit = FALSE;	/* lo pone el hilo de la interfaz, lo leen los de captura */
+static struct pcapWriter  *writer = NULL;	/* grabacin a disco, compartida por los hilos */
+static struct flowRecords *records = NULL;	/* registros de las conexiones que salen de las tablas */
+
+/************
+* usage()
+***********/
+void usage()
+{
+	printf( "sniffer [options] <interface>|any\n" );
+	printf( "sniffer [options] -r <file>\n" );
+	printf( "  link types: Ethernet, Linux cooked (SLL/SLL2), loopback and raw IP;\n" );
+	printf( "  \"any\" captures every interface in cooked mode (packet and mmap engines)\n" );
+	printf( "  -e, --engine=packet|mmap|xdp|uring\n" );
+	printf( "                                capture engine (default mmap, or packet if the ring cannot\n" );
+	printf( "                                be set up; asking for mmap or its geometry never falls back)\n" );
+	printf( "      --block-size=BYTES        ring block size (default %d)\n", CAP_DEFAULT_BLOCK_SIZE );
+	printf( "      --blocks=N                ring block count (default %d)\n", CAP_DEFAULT_BLOCK_COUNT );
+	printf( "      --frame-size=BYTES        ring frame size (default %d)\n", CAP_DEFAULT_FRAME_SIZE );
+	printf( "  -q, --queue=N                 AF_XDP interface queue (default 0); while capturing, all\n" );
+	printf( "                                traffic on that queue goes to the sniffer, not to the host stack\n" );
+	printf( "  -b, --burst=N                 frames per recvmmsg() call (default %d, max %d)\n", CAP_DEFAULT_BURST, CAP_MAX_BURST );
+	printf( "  -r, --read=FILE               replay a pcap or pcapng file instead of capturing\n" );
+	printf( "      --speed=F                 replay speed: 0 as fast as possible (default), 1 original timing,\n" );
+	printf( "                                other values scale the original timing\n" );
+	printf( "  -f, --filter=EXPR             kernel filter: host, net, port, proto, tcp, udp, icmp, ip, arp,\n" );
+	printf( "                                src/dst, and/or/not and parentheses\n" );
+	printf( "  -s, --snaplen=BYTES           capture only the first BYTES of each frame (e.g. 96 or 128)\n" );
+	printf( "  -w, --write=FILE              record captured frames to a pcap file\n" );
+	printf( "      --rotate-size=MB          start a new file every MB megabytes (files are FILE.N)\n" );
+	printf( "      --rotate-time=SECS        start a new file every SECS seconds (files are FILE.N)\n" );
+	printf( "  -W, --workers=N               capture threads, flows spread with PACKET_FANOUT (default 1, max %d)\n", MAX_WORKERS );
+	printf( "      --tunnels=outer|inner     track GRE/VXLAN/GENEVE traffic by its outer or inner flows (default outer)\n" );
+	printf( "      --max-flows=N             connections tracked per thread (default %d, max %d)\n", CNT_DEFAULT_CONNECTIONS, CNT_MAX_CONNECTIONS );
+	printf( "      --flow-records=FILE       write a CSV line for every connection that expires, closes or is reset\n" );
+	printf( "      --frag-memory=KB          memory cap for IPv4 fragment tracking, split among the threads\n" );
+	printf( "                                (default %d per thread)\n", FRAG_DEFAULT_MEMORY >> 10 );
+	printf( "      --classifier=auto|scalar|sse|avx2\n" );
+	printf( "                                burst classifier implementation (default auto)\n" );
+	exit (1);
+}
 
 /************
 * processCommandLine()
 ***********/
-void processCommandLine( int argc, char *argv[], char **device )
+void processCommandLine( int argc, char *argv[], struct captureConfig *cfg, struct writerConfig *wcfg,
+						 const char **filterExpr, int *workerCount )
 {
-	if( argc != 2 ) /*comprobamos los argumentos*/
+	static struct option  longOptions[] =
+	{
+		{ "engine",     required_argument, NULL, 'e' },
+		{ "block-size", required_argument, NULL, 'B' },
+		{ "blocks",     required_argument, NULL, 'N' },
+		{ "frame-size", required_argument, NULL, 'F' },
+		{ "burst",      required_argument, NULL, 'b' },
+		{ "queue",      required_argument, NULL, 'q' },
+		{ "workers",    required_argument, NULL, 'W' },
+		{ "read",       required_argument, NULL, 'r' },
+		{ "speed",      required_argument, NULL, 'S' },
+		{ "write",      required_argument, NULL, 'w' },
+		{ "filter",     required_argument, NULL, 'f' },
+		{ "snaplen",    required_argument, NULL, 's' },
+		{ "rotate-size",required_argument, NULL, 'C' },
+		{ "rotate-time",required_argument, NULL, 'G' },
+		{ "classifier", required_argument, NULL, 'K' },
+		{ "tunnels",    required_argument, NULL, 'T' },
+		{ "frag-memory",required_argument, NULL, 'M' },
+		{ "max-flows",  required_argument, NULL, 'X' },
+		{ "flow-records",required_argument, NULL, 'R' },
+		{ NULL,         0,                 NULL,  0  }
+	};
+	enum eClassifier  classifier;
+	ui32              fragMemory = 0;
+	int               opt;
+	
+	/* valores por defecto */
+	memset( cfg, 0, sizeof( *cfg ));
+	cfg->engine     = CE_MMAP;
+	cfg->blockSize  = CAP_DEFAULT_BLOCK_SIZE;
+	cfg->blockCount = CAP_DEFAULT_BLOCK_COUNT;
+	cfg->frameSize  = CAP_DEFAULT_FRAME_SIZE;
+	cfg->burst      = CAP_DEFAULT_BURST;
+	*workerCount    = 1;
+	*filterExpr     = "";
+	memset( wcfg, 0, sizeof( *wcfg ));
+	
+	while(( opt = getopt_long( argc, argv, "e:b:q:W:r:w:f:s:", longOptions, NULL )) != -1 )
+	{
+		switch( opt )
+		{
+			case 'e':
+				if( strcmp( optarg, "packet" ) == 0 )
+					cfg->engine = CE_PACKET;
+				else if( strcmp( optarg, "mmap" ) == 0 )
+				{
+					cfg->engine        = CE_MMAP;
+					cfg->bRingRequired = TRUE;
+				}
+				else if( strcmp( optarg, "xdp" ) == 0 )
+					cfg->engine = CE_XDP;
+				else if( strcmp( optarg, "uring" ) == 0 )
+					cfg->engine = CE_URING;
+				else
+					usage();
+				break;
+			case 'B':	cfg->blockSize  = strtoul( optarg, NULL, 0 );	cfg->bRingRequired = TRUE;	break;
+			case 'N':	cfg->blockCount = strtoul( optarg, NULL, 0 );	cfg->bRingRequired = TRUE;	break;
+			case 'F':	cfg->frameSize  = strtoul( optarg, NULL, 0 );	cfg->bRingRequired = TRUE;	break;
+			case 'b':	cfg->burst      = strtoul( optarg, NULL, 0 );	break;
+			case 'q':	cfg->queue      = strtoul( optarg, NULL, 0 );	break;
+			case 'W':	*workerCount    = atoi( optarg );				break;
+			case 'r':	cfg->file       = optarg;						break;
+			case 'S':	cfg->speed      = atof( optarg );				break;
+			case 'w':	wcfg->file      = optarg;						break;
+			case 'f':	*filterExpr     = optarg;						break;
+			case 's':	cfg->snaplen    = strtoul( optarg, NULL, 0 );	break;
+			case 'C':	wcfg->rotateSize = strtoull( optarg, NULL, 0 ) << 20;	break;
+			case 'G':	wcfg->rotateSecs = strtoul( optarg, NULL, 0 );	break;
+			case 'K':
+				if( strcmp( optarg, "auto" ) == 0 )
+					classifier = CLS_AUTO;
+				else if( strcmp( optarg, "scalar" ) == 0 )
+					classifier = CLS_SCALAR;
+				else if( strcmp( optarg, "sse" ) == 0 )
+					classifier = CLS_SSE;
+				else if( strcmp( optarg, "avx2" ) == 0 )
+					classifier = CLS_AVX2;
+				else
+					usage();
+				if( buildSetClassifier( classifier ) != 0 )
+					exit( 1 );
+				break;
+			case 'T':
+				if( strcmp( optarg, "outer" ) == 0 )
+					cfg->bInnerTunnels = FALSE;
+				else if( strcmp( optarg, "inner" ) == 0 )
+					cfg->bInnerTunnels = TRUE;
+				else
+					usage();
+				buildSetTunnelMode( cfg->bInnerTunnels );
+				break;
+			case 'M':	fragMemory      = strtoul( optarg, NULL, 0 ) << 10;	break;
+			case 'X':
+				if( cntSetMaxConnections( strtoul( optarg, NULL, 0 )) != 0 )
+					exit( 1 );
+				break;
+			case 'R':	wcfg->records   = optarg;						break;
+			default:	usage();										break;
+		}
+	}
+	
+	if( *workerCount < 1  ||  *workerCount > MAX_WORKERS  ||  cfg->speed < 0 )
+		usage();
+	
+	/* el tope de fragmentos es de todo el programa: se reparte entre los hilos */
+	if( fragMemory != 0  &&  cntSetFragmentMemory( fragMemory / *workerCount ) != 0 )
+		exit( 1 );
+	
+	/* un fichero se reproduce en un solo hilo y sin interfaz */
+	if( cfg->file != NULL )
 	{
-		printf("sniffer <interface>\n");
-		exit (1);
+		if( optind != argc  ||  *workerCount != 1 )
+			usage();
+		cfg->engine = CE_FILE;
+		cfg->device = cfg->file;
+		return;
 	}
 	
-	*device = argv[1];
+	if( optind != argc - 1 ) /*comprobamos los argumentos*/
+		usage();
+	
+	cfg->device = argv[optind];
 }
 
 /************
 * initSniffer()
 ***********/
-int initSniffer( const char *device )
+void initSniffer( struct worker *workers, int workerCount, struct captureConfig *cfg )
 {
-	int  sd;
+	int  i;
+	
+	/* un solo socket no necesita grupo de reparto */
+	if( workerCount > 1 )
+		cfg->fanoutGroup = ( getpid() & 0xffff ) | 1;
 	
-	sd = socket (PF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-	if (sd < 0)
+	for( i = 0; i < workerCount; i++ )
 	{
-		printf ("socket err: %s");
-		exit (1);
+		/* con AF_XDP cada hilo atiende una cola de la interfaz */
+		if( capOpen( &workers[i].cap, cfg, i > 0 ? &workers[0].cap : NULL ) == -1 )
+			exit (1);
+		cfg->queue++;
+		
+		workers[i].index = i;
+		workers[i].table = cntCreateTable();
+		if( workers[i].table == NULL )
+			exit (1);
 	}
-    
-	setPromisc( device, sd, ON );  //ponemos el interface de red en modo cachondo :)
 	
-	return  sd;
+	/* "any" no es una interfaz de verdad, no tiene modo promiscuo */
+	if( cfg->engine != CE_FILE  &&  strcmp( cfg->device, CAP_ANY_DEVICE ) != 0 )
+		setPromisc( cfg->device, workers[0].cap.ctlSd, ON );  //ponemos el interface de red en modo cachondo :)
 }
 
 /************
 * endSniffer()
 ***********/
-void endSniffer( const char *device, int sd )
+void endSniffer( const char *device, struct worker *workers, int workerCount )
 {
-	setPromisc( device, sd, OFF );  //quitamos el interface de red en modo cachondo :)
+	int  i;
+	
+	if( workers[0].cap.engine != CE_FILE  &&  strcmp( device, CAP_ANY_DEVICE ) != 0 )
+		setPromisc( device, workers[0].cap.ctlSd, OFF );  //quitamos el interface de red en modo cachondo :)
 	
-	close( sd );
+	/* el primero es el dueo del programa XDP, lo cerramos el ltimo */
+	for( i = workerCount - 1; i >= 0; i-- )
+	{
+		capClose( &workers[i].cap );
+		cntDestroyTable( workers[i].table );
+	}
 }
 
 /************
 * readPacket()
 ***********/
-int readPacket( int sd, char *buffer, int bufferSize, struct packet *p )
+int readPacket( struct worker *w )
 {
-	int  bytes_read;
+	int  n;
 	
-	bytes_read = recvfrom ( sd, buffer, bufferSize, MSG_DONTWAIT, 0, 0 );
-	if( bytes_read > 0 )
-		buildPacket( buffer, p );
+	/* leemos una rafaga de tramas, en el caso del anillo se analizan en el sitio */
+	n = capReadBurst( &w->cap, w->frames, CAP_MAX_BURST );
+	buildPacketBurst( w->frames, w->packets, n );
 	
-	return bytes_read;
+	return n;
+}
+
+/************
+* burstTime()
+***********/
+ui64 burstTime( struct worker *w, int n )
+{
+	ui64  now;
+	int   i;
+	
+	/* la hora de la ltima trama, que al reproducir es la del fichero */
+	if( n > 0  &&  w->frames[n - 1].tstamp != 0 )
+		now = w->lastTime = w->frames[n - 1].tstamp;
+	/* un fichero solo tiene su reloj: sin tramas la hora no avanza, o al
+	   llegar al final caducara todo de golpe; los bloques pcapng sin marca
+	   de tiempo se quedan con la anterior */
+	else if( w->cap.engine == CE_FILE  &&  w->lastTime != 0 )
+		now = w->lastTime;
+	else
+		now = capGetTime();
+	
+	/* y la de cada trama para el anlisis TCP, la de la rfaga si no trae */
+	for( i = 0; i < n; i++ )
+		w->times[i] = w->frames[i].tstamp != 0 ? w->frames[i].tstamp : now;
+	
+	return now;
+}
+
+/************
+* drainCapture()
+***********/
+void drainCapture( struct worker *w )
+{
+	ui64  now;
+	int   n, bursts;
+	
+	/* vaciamos el socket a rafagas mientras haya paquetes */
+	for( bursts = 0; bursts < MAX_BURSTS_PER_WAKEUP; bursts++ )
+	{
+		n   = readPacket( w );
+		now = burstTime( w, n );
+		uiProcessBurst( w->table, w->packets, w->times, n, now );
+		
+		/* la grabacion solo copia a memoria, el disco lo toca su propio hilo */
+		if( writer != NULL )
+			pwWriteBurst( writer, w->frames, n );
+		
+		/* devolvemos los bloques procesados al kernel */
+		capReleaseBurst( &w->cap );
+		
+		if( n == 0 )
+			break;
+	}
+}
+
+/************
+* captureThread()
+***********/
+void * captureThread( void *arg )
+{
+	struct worker      *w = arg;
+	struct epoll_event  ev;
+	int                 ep;
+	
+	/* un fichero no tiene nada por lo que esperar, lo leemos hasta el final */
+	if( w->cap.engine == CE_FILE )
+	{
+		w->startTime = capGetTime();
+		while( __atomic_load_n( &bQuit, __ATOMIC_RELAXED ) == FALSE  &&  !w->cap.bEof )
+			drainCapture( w );
+		w->endTime = capGetTime();
+		return NULL;
+	}
+	
+	w->startTime = capGetTime();
+	
+	/* io_uring no necesita epoll: la misma llamada relanza el recv, espera
+	   los completados y hace de temporizador para ver si hay que salir */
+	if( w->cap.engine == CE_URING )
+	{
+		while( __atomic_load_n( &bQuit, __ATOMIC_RELAXED ) == FALSE )
+		{
+			if( capWait( &w->cap, WORKER_POLL_MS ) == -1 )
+				break;
+			drainCapture( w );
+		}
+		w->endTime = capGetTime();
+		return NULL;
+	}
+	
+	ep = epoll_create1( 0 );
+	if( ep < 0 )
+		return NULL;
+	
+	memset( &ev, 0, sizeof( ev ));
+	ev.events  = EPOLLIN;
+	ev.data.fd = w->cap.sd;
+	if( epoll_ctl( ep, EPOLL_CTL_ADD, w->cap.sd, &ev ) < 0 )
+	{
+		close( ep );
+		return NULL;
+	}
+	
+	/* cada hilo duerme sobre su socket, con un tope para ver si hay que salir */
+	while( __atomic_load_n( &bQuit, __ATOMIC_RELAXED ) == FALSE )
+	{
+		if( epoll_wait( ep, &ev, 1, WORKER_POLL_MS ) > 0 )
+			drainCapture( w );
+		else
+			/* sin trfico las conexiones tambin caducan */
+			uiProcessBurst( w->table, w->packets, NULL, 0, capGetTime() );
+	}
+	w->endTime = capGetTime();
+	
+	close( ep );
+	return NULL;
+}
+
+/************
+* collectStatistics()
+***********/
+void collectStatistics( struct worker *workers, int workerCount, struct captureStats *total )
+{
+	int  i;
+	
+	/* sumamos los contadores de todos los sockets; tramas y llamadas las
+	   escribe cada hilo de captura mientras tanto */
+	memset( total, 0, sizeof( *total ));
+	for( i = 0; i < workerCount; i++ )
+	{
+		capUpdateStats( &workers[i].cap );
+		total->packets += workers[i].cap.stats.packets;
+		total->drops   += workers[i].cap.stats.drops;
+		total->freezes += workers[i].cap.stats.freezes;
+		total->frames  += __atomic_load_n( &workers[i].cap.stats.frames, __ATOMIC_RELAXED );
+		total->reads   += __atomic_load_n( &workers[i].cap.stats.reads,  __ATOMIC_RELAXED );
+	}
+}
+
+/************
+* recordFlow()
+***********/
+void recordFlow( void *ctx, struct connectionTable *t, const struct connection *c, enum eExpireReason reason )
+{
+	struct worker  *w = ctx;
+	
+	frWrite( records, w->index, t, c, reason );
+}
+
+/************
+* applyFilter()
+***********/
+int applyFilter( void *ctx, const char *expr, char *err, int errLen )
+{
+	static struct bpfProgram  prog;
+	struct workerSet         *set = ctx;
+	int                       i;
+	
+	if( bpfCompile( expr, set->snaplen, set->linkType, &prog, err, errLen ) == -1 )
+		return -1;
+	
+	/* cada socket cambia de filtro sin cerrarse, no se pierde ninguna trama */
+	for( i = 0; i < set->count; i++ )
+	{
+		if( capSetFilter( &set->workers[i].cap, prog.len > 1 || set->snaplen ? &prog : NULL ) == -1 )
+		{
+			snprintf( err, errLen, "cannot attach filter" );
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+/************
+* initEventLoop()
+***********/
+int initEventLoop( int *timerFd )
+{
+	struct epoll_event  ev;
+	struct itimerspec   period;
+	int                 ep;
+	
+	ep = epoll_create1( 0 );
+	if( ep < 0 )
+		return -1;
+	
+	/* temporizador de refresco de la pantalla */
+	*timerFd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+	if( *timerFd < 0 )
+		return -1;
+	
+	period.it_interval.tv_sec  = 0;
+	period.it_interval.tv_nsec = REFRESH_PERIOD_MS * 1000000L;
+	period.it_value            = period.it_interval;
+	if( timerfd_settime( *timerFd, 0, &period, NULL ) < 0 )
+		return -1;
+	
+	/* el hilo principal solo espera por el teclado y el temporizador */
+	memset( &ev, 0, sizeof( ev ));
+	ev.events  = EPOLLIN;
+	ev.data.fd = STDIN_FILENO;
+	if( epoll_ctl( ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev ) < 0 )
+		return -1;
+	ev.data.fd = *timerFd;
+	if( epoll_ctl( ep, EPOLL_CTL_ADD, *timerFd, &ev ) < 0 )
+		return -1;
+	
+	return ep;
 }
 
 /********
@@ -74,54 +522,223 @@ int readPacket( int sd, char *buffer, int bufferSize, struct packet *p )
  ********/
 int main( int argc, char *argv[] )
 {
-	struct packet  p;
-	char          *device;
-	int			   sd;
-	char 		   buffer[2000];
-	int			   bytes_read = 0;
+	static struct bpfProgram filter;
+	struct captureConfig    cfg;
+	struct workerSet        workerSet;
+	const char             *filterExpr;
+	char                    filterErr[ 128 ];
+	struct writerConfig     wcfg;
+	struct pwStats          wstats;
+	ui64                    lastBytes = 0;
+	struct worker          *workers;
+	struct connectionTable *tables[ MAX_WORKERS ];
+	struct captureStats     stats;
+	struct epoll_event      events[ MAX_EVENTS ];
+	int			            i, n;
+	int                     ep, timerFd, workerCount;
+	ui64                    expirations, recordCount, recordDrops;
+	int                     recordError;
+	time_t                  lastStats = 0;
+	
 	
+	/* procesamos la lnea de comandos */
+	processCommandLine( argc, argv, &cfg, &wcfg, &filterExpr, &workerCount );
 	
-	/* comprobamos que el usuario es root */
-	if( getuid() )
+	/* comprobamos que el usuario es root, salvo para leer ficheros */
+	if( cfg.engine != CE_FILE  &&  getuid() )
 	{
 	    printf( "You must be root to run this program\n" );
 	    exit(1);	
 	}
 	
-	/* procesamos la lnea de comandos */
-	processCommandLine( argc, argv, &device );
+	/* el tipo de enlace decide el decodificador y cmo se compila el filtro */
+	if( capProbeLink( &cfg ) == -1  ||  buildSetLinkType( cfg.linkType ) == -1 )
+		exit(1);
+	
+	/* compilamos el filtro antes de abrir nada */
+	if( bpfCompile( filterExpr, cfg.snaplen, cfg.filterLinkType, &filter, filterErr, sizeof( filterErr )) == -1 )
+	{
+		printf( "Filter error: %s\n", filterErr );
+		exit(1);
+	}
+	/* con snaplen hace falta el programa aunque no filtre: es quien recorta */
+	if( filter.len > 1  ||  cfg.snaplen != 0 )
+		cfg.filter = &filter;
 	
-	/* inicializamos el gestor de conexiones */
-	cntInitConnections();
+	/* un socket y un gestor de conexiones por hilo de captura */
+	workers = calloc( workerCount, sizeof( struct worker ));
+	if( workers == NULL )
+		exit(1);
 	
 	/* inicializamos el sniffer */
-	sd = initSniffer( device );
+	initSniffer( workers, workerCount, &cfg );
+	
+	/* abrimos la grabacin antes de arrancar la captura */
+	if( wcfg.file != NULL )
+	{
+		writer = pwOpen( wcfg.file, wcfg.rotateSize, wcfg.rotateSecs, cfg.snaplen, cfg.linkType );
+		if( writer == NULL )
+			exit(1);
+	}
+	
+	/* las conexiones que caducan, se cierran o se borran dejan su registro */
+	if( wcfg.records != NULL )
+	{
+		records = frOpen( wcfg.records, workerCount );
+		if( records == NULL )
+			exit(1);
+		for( i = 0; i < workerCount; i++ )
+			cntSetRecordHandler( workers[i].table, recordFlow, &workers[i] );
+	}
 	
-	/* inicializamos la interfaz de usuario */
-	if( uiInit() == -1 )
+	/* inicializamos la interfaz de usuario, que muestra todas las tablas juntas */
+	for( i = 0; i < workerCount; i++ )
+		tables[i] = workers[i].table;
+	if( uiInit( tables, workerCount ) == -1 )
 	{
 		printf( "Error inicializando la interfaz de usuario\n" );
 		exit(1);
 	}
+	
+	/* el filtro se puede cambiar desde la interfaz */
+	workerSet.workers = workers;
+	workerSet.count   = workerCount;
+	workerSet.snaplen = cfg.snaplen;
+	workerSet.linkType = cfg.filterLinkType;
+	uiSetFilterHandler( applyFilter, &workerSet, filterExpr );
 		
-	/* bucle principal */
-	for(;;)
+	/* preparamos el bucle de eventos */
+	ep = initEventLoop( &timerFd );
+	if( ep < 0 )
 	{
-		/* actualizamos interfaz de usuario */
-		if( uiUpdate() == FALSE )
-			break;
+		uiEnd();
+		printf( "Error inicializando el bucle de eventos: %s\n", strerror( errno ));
+		exit(1);
+	}
+	
+	/* arrancamos los hilos de captura */
+	for( i = 0; i < workerCount; i++ )
+	{
+		if( pthread_create( &workers[i].thread, NULL, captureThread, &workers[i] ) != 0 )
+		{
+			uiEnd();
+			printf( "Error creando los hilos de captura\n" );
+			exit(1);
+		}
+	}
 		
-		/* si ha llegado un paquete, lo procesamos en la interfaz de usuario, por ahora */
-		if( bytes_read > 0 )
-			uiProcessPacket( &p );
-		/* refrescamos la interfaz de usuario */
-		uiRefresh();
+	/* bucle principal, dormimos hasta que haya algo que hacer */
+	while( bQuit == FALSE )
+	{
+		n = epoll_wait( ep, events, MAX_EVENTS, -1 );
+		if( n < 0 )
+		{
+			/* las curses nos interrumpen con SIGWINCH */
+			if( errno == EINTR )
+				continue;
+			break;
+		}
 		
-		/* leemos un paquete si hay */
-		bytes_read = readPacket( sd, buffer, 2000, &p );
+		for( i = 0; i < n; i++ )
+		{
+			/* actualizamos interfaz de usuario */
+			if( events[i].data.fd == STDIN_FILENO )
+			{
+				if( uiUpdate() == FALSE )
+					__atomic_store_n( &bQuit, TRUE, __ATOMIC_RELAXED );
+				uiRefresh();
+			}
+			
+			/* toca repintar */
+			else if( events[i].data.fd == timerFd )
+			{
+				read( timerFd, &expirations, sizeof( expirations ));
+				
+				/* una vez por segundo recogemos los contadores del kernel */
+				if( time( NULL ) != lastStats )
+				{
+					lastStats = time( NULL );
+					collectStatistics( workers, workerCount, &stats );
+					uiSetCaptureStatistics( &stats );
+					
+					if( writer != NULL )
+					{
+						pwGetStats( writer, &wstats );
+						uiSetWriterStatistics( &wstats, wstats.bytes - lastBytes );
+						lastBytes = wstats.bytes;
+					}
+				}
+				
+				/* refrescamos la interfaz de usuario */
+				uiRefresh();
+			}
+		}
 	}
 	
+	/* esperamos a que terminen los hilos de captura */
+	__atomic_store_n( &bQuit, TRUE, __ATOMIC_RELAXED );
+	for( i = 0; i < workerCount; i++ )
+		pthread_join( workers[i].thread, NULL );
+	
+	close( timerFd );
+	close( ep );
+	
 	/* salimos de la aplicacin */
 	uiEnd();
-	endSniffer( device, sd );
+	
+	/* vaciamos la grabacin una vez parados los hilos de captura */
+	if( writer != NULL )
+	{
+		pwClose( writer );
+		writer = NULL;
+	}
+	
+	/* las que siguen vivas tambin dejan su registro */
+	if( records != NULL )
+	{
+		frSetLossless( records );
+		for( i = 0; i < workerCount; i++ )
+			cntExportConnections( workers[i].table, EXPIRE_END );
+		frFlush( records );
+		recordCount = frGetCount( records );
+		recordDrops = frGetDrops( records );
+		recordError = frGetError( records );
+		if( frClose( records ) == -1  &&  recordError == 0 )
+			recordError = errno;
+		records = NULL;
+		
+		/* con el disco lleno el fichero queda cortado: no lo damos por bueno */
+		if( recordError != 0 )
+			printf( "cannot write flow records to %s: %s", wcfg.records, strerror( recordError ));
+		else
+			printf( "%llu flow records written to %s", (unsigned long long)recordCount, wcfg.records );
+		if( recordDrops > 0 )
+			printf( " (%llu lost with the queue full)", (unsigned long long)recordDrops );
+		printf( "\n" );
+	}
+	
+	/* con un fichero sabemos exactamente cunto hemos tardado en procesarlo */
+	if( cfg.engine == CE_FILE  &&  workers[0].endTime > workers[0].startTime )
+	{
+		collectStatistics( workers, workerCount, &stats );
+		printf( "%u packets in %.3f s (%.0f packets/s, %s classifier)%s\n", stats.packets,
+				( workers[0].endTime - workers[0].startTime ) / 1e9,
+				stats.packets * 1e9 / ( workers[0].endTime - workers[0].startTime ),
+				buildGetClassifierName(),
+				workers[0].cap.bEof ? "" : ", interrupted" );
+	}
+	
+	/* en vivo, lo que ha visto el kernel y cuntas tramas sacamos por llamada */
+	else if( workers[0].endTime > workers[0].startTime )
+	{
+		collectStatistics( workers, workerCount, &stats );
+		printf( "%u packets in %.3f s, %u dropped by the kernel", stats.packets,
+				( workers[0].endTime - workers[0].startTime ) / 1e9, stats.drops );
+		if( stats.reads > 0 )
+			printf( ", %.1f frames per call", (double)stats.frames / (double)stats.reads );
+		printf( "\n" );
+	}
+	
+	endSniffer( cfg.device, workers, workerCount );
+	free( workers );
 }
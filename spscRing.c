@@ -0,0 +1,162 @@
+/****************************************************************************
+ * Module:  spscRing.c
+ *
+ ****************************************************************************/
+#include "spscRing.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/** public interface *********************************************************/
+struct spscRing *	ringCreate( ui32 count, ui32 elemSize );
+void				ringDestroy( struct spscRing *r );
+void *				ringReserve( struct spscRing *r );
+void				ringCommit( struct spscRing *r );
+const void *		ringPeek( struct spscRing *r );
+void				ringRelease( struct spscRing *r );
+ui32				ringOccupancy( const struct spscRing *r );
+ui32				ringSize( const struct spscRing *r );
+ui64				ringOverflows( const struct spscRing *r );
+
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * ringCreate()
+ *---------------------------------------------------------------------------*/
+struct spscRing * ringCreate( ui32 count, ui32 elemSize )
+{
+	struct spscRing  *r;
+
+	/* con una potencia de dos el ndice se calcula con una mscara */
+	if( count < 2  ||  ( count & ( count - 1 )) != 0  ||  elemSize == 0 )
+	{
+		printf( "ringCreate: count must be a power of two\n" );
+		return NULL;
+	}
+
+	if( posix_memalign( (void **)&r, RING_CACHE_LINE, sizeof( *r )) != 0 )
+		return NULL;
+	memset( r, 0, sizeof( *r ));
+
+	/* cada elemento empieza en su propia lnea de cach */
+	r->elemSize = ( elemSize + RING_CACHE_LINE - 1 ) & ~( RING_CACHE_LINE - 1 );
+	r->mask     = count - 1;
+	if( posix_memalign( (void **)&r->slots, RING_CACHE_LINE, (size_t)count * r->elemSize ) != 0 )
+	{
+		free( r );
+		return NULL;
+	}
+
+	return r;
+}
+
+/*-----------------------------------------------------------------------------
+ * ringDestroy()
+ *---------------------------------------------------------------------------*/
+void ringDestroy( struct spscRing *r )
+{
+	if( r == NULL )
+		return;
+
+	free( r->slots );
+	free( r );
+}
+
+/*-----------------------------------------------------------------------------
+ * ringReserve()
+ *---------------------------------------------------------------------------*/
+void * ringReserve( struct spscRing *r )
+{
+	assert( r != NULL );
+
+	/* solo volvemos a leer el ndice del consumidor si parece que est llena */
+	if( r->head - r->cachedTail > r->mask )
+	{
+		r->cachedTail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+		if( r->head - r->cachedTail > r->mask )
+		{
+			/* el productor no espera nunca: el elemento se pierde y se cuenta */
+			__atomic_store_n( &r->overflows, r->overflows + 1, __ATOMIC_RELAXED );
+			return NULL;
+		}
+	}
+
+	return r->slots + (size_t)( r->head & r->mask ) * r->elemSize;
+}
+
+/*-----------------------------------------------------------------------------
+ * ringCommit()
+ *---------------------------------------------------------------------------*/
+void ringCommit( struct spscRing *r )
+{
+	assert( r != NULL );
+
+	/* publica el elemento rellenado tras ringReserve() */
+	__atomic_store_n( &r->head, r->head + 1, __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------------------------
+ * ringPeek()
+ *---------------------------------------------------------------------------*/
+const void * ringPeek( struct spscRing *r )
+{
+	assert( r != NULL );
+
+	if( r->tail == r->cachedHead )
+	{
+		r->cachedHead = __atomic_load_n( &r->head, __ATOMIC_ACQUIRE );
+		if( r->tail == r->cachedHead )
+			return NULL;
+	}
+
+	return r->slots + (size_t)( r->tail & r->mask ) * r->elemSize;
+}
+
+/*-----------------------------------------------------------------------------
+ * ringRelease()
+ *---------------------------------------------------------------------------*/
+void ringRelease( struct spscRing *r )
+{
+	assert( r != NULL );
+
+	/* devuelve al productor el elemento obtenido con ringPeek() */
+	__atomic_store_n( &r->tail, r->tail + 1, __ATOMIC_RELEASE );
+}
+
+/*-----------------------------------------------------------------------------
+ * ringOccupancy()
+ *---------------------------------------------------------------------------*/
+ui32 ringOccupancy( const struct spscRing *r )
+{
+	assert( r != NULL );
+
+	/* aproximada: se puede leer desde cualquiera de los dos lados */
+	return __atomic_load_n( &r->head, __ATOMIC_RELAXED ) - __atomic_load_n( &r->tail, __ATOMIC_RELAXED );
+}
+
+/*-----------------------------------------------------------------------------
+ * ringSize()
+ *---------------------------------------------------------------------------*/
+ui32 ringSize( const struct spscRing *r )
+{
+	assert( r != NULL );
+
+	return r->mask + 1;
+}
+
+/*-----------------------------------------------------------------------------
+ * ringOverflows()
+ *---------------------------------------------------------------------------*/
+ui64 ringOverflows( const struct spscRing *r )
+{
+	assert( r != NULL );
+
+	return __atomic_load_n( &r->overflows, __ATOMIC_RELAXED );
+}
+
+/****************************************************************************
+ * End of spscRing.c
+ ****************************************************************************/
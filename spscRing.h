@@ -0,0 +1,55 @@
+/****************************************************************************
+ * Module:  spscRing
+ *
+ ****************************************************************************/
+#ifndef _SPSCRING_H_
+#define _SPSCRING_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define RING_CACHE_LINE			64
+
+/** public types *************************************************************/
+/*******
+ * spscRing
+ *
+ * Cola sin cerrojos de un solo productor y un solo consumidor. Cada lado
+ * escribe solo su ndice, en su propia lnea de cach, y guarda una copia
+ * del ndice del otro para no leerlo en cada operacin.
+ *******/
+struct spscRing
+{
+	/* lado del productor */
+	ui32				 head __attribute__(( aligned( RING_CACHE_LINE )));
+	ui32				 cachedTail;
+	ui64				 overflows;		/* elementos perdidos por cola llena */
+
+	/* lado del consumidor */
+	ui32				 tail __attribute__(( aligned( RING_CACHE_LINE )));
+	ui32				 cachedHead;
+
+	/* fijo desde ringCreate() */
+	ui32				 mask __attribute__(( aligned( RING_CACHE_LINE )));
+	ui32				 elemSize;
+	uchar				*slots;
+};
+
+/** public interface *********************************************************/
+struct spscRing *	ringCreate( ui32 count, ui32 elemSize );
+void				ringDestroy( struct spscRing *r );
+
+void *				ringReserve( struct spscRing *r );
+void				ringCommit( struct spscRing *r );
+const void *		ringPeek( struct spscRing *r );
+void				ringRelease( struct spscRing *r );
+
+ui32				ringOccupancy( const struct spscRing *r );
+ui32				ringSize( const struct spscRing *r );
+ui64				ringOverflows( const struct spscRing *r );
+
+
+#endif  /* _SPSCRING_H_ */
+/****************************************************************************
+ * End of spscRing.h
+ ****************************************************************************/
@@ -0,0 +1,339 @@
+/****************************************************************************
+ * Module:  timerWheel.c
+ *
+ ****************************************************************************/
+#include "timerWheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/** defines ******************************************************************/
+#define TW_SPAN					( 1ULL << ( TW_SLOT_BITS * TW_LEVELS ))	/* ticks que cubre la rueda */
+#define TW_HEAD( tw, level, slot )	( (tw)->capacity + (level) * TW_SLOTS + (slot) )
+
+/** private types ************************************************************/
+/*******
+ * twNode
+ *
+ * Enlaces de una lista circular. Los capacity primeros son los temporizadores
+ * y detrs van las cabeceras de cada hueco, as quitar uno de su lista no
+ * necesita saber en qu hueco est.
+ *******/
+struct twNode
+{
+	ui32				 next;			/* TW_NIL si el temporizador no est en la rueda */
+	ui32				 prev;
+};
+
+/*******
+ * timerWheel
+ *
+ * Rueda jerrquica de TW_LEVELS niveles de TW_SLOTS huecos. El nivel 0 va de
+ * tick en tick; los de arriba se vuelcan al de abajo cuando el nivel 0 da la
+ * vuelta, as cada temporizador se mueve como mucho TW_LEVELS veces y
+ * avanzar un tick no depende de cuntos haya programados.
+ *******/
+struct timerWheel
+{
+	struct twNode		*nodes;
+	ui64				*expires;		/* tick de vencimiento de cada temporizador */
+	ui32				 capacity;
+	ui64				 current;		/* ltimo tick procesado */
+	uchar				 bStarted;		/* current ya tiene una hora de verdad */
+};
+
+/** private interface ********************************************************/
+static void linkNode( struct timerWheel *tw, ui32 head, ui32 id );
+static void unlinkNode( struct timerWheel *tw, ui32 id );
+static void insert( struct timerWheel *tw, ui32 id );
+static ui32 detach( struct timerWheel *tw, ui32 head );
+static void cascade( struct timerWheel *tw, ui32 level, ui32 slot );
+static ui32 fire( struct timerWheel *tw, ui32 head, ui64 now, twExpireFn fn, void *ctx );
+
+/** public interface *********************************************************/
+struct timerWheel *	twCreate( ui32 capacity );
+void				twDestroy( struct timerWheel *tw );
+void				twReset( struct timerWheel *tw );
+void				twSchedule( struct timerWheel *tw, ui32 id, ui64 expires );
+void				twCancel( struct timerWheel *tw, ui32 id );
+ui32				twAdvance( struct timerWheel *tw, ui64 now, twExpireFn fn, void *ctx );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * linkNode()
+ *---------------------------------------------------------------------------*/
+void linkNode( struct timerWheel *tw, ui32 head, ui32 id )
+{
+	struct twNode  *h = &tw->nodes[ head ];
+
+	/* al final de la lista, el orden dentro de un hueco no importa */
+	tw->nodes[ id ].next      = head;
+	tw->nodes[ id ].prev      = h->prev;
+	tw->nodes[ h->prev ].next = id;
+	h->prev                   = id;
+}
+
+/*-----------------------------------------------------------------------------
+ * unlinkNode()
+ *---------------------------------------------------------------------------*/
+void unlinkNode( struct timerWheel *tw, ui32 id )
+{
+	struct twNode  *n = &tw->nodes[ id ];
+
+	tw->nodes[ n->prev ].next = n->next;
+	tw->nodes[ n->next ].prev = n->prev;
+	n->next = TW_NIL;
+}
+
+/*-----------------------------------------------------------------------------
+ * insert()
+ *---------------------------------------------------------------------------*/
+void insert( struct timerWheel *tw, ui32 id )
+{
+	ui64  expires = tw->expires[ id ];
+	ui64  delta   = expires - tw->current;
+	ui32  level;
+
+	/* el nivel es el primero en el que cabe la distancia; lo que no cabe en
+	   la rueda se deja en el ltimo hueco y se recoloca al volcarlo */
+	if( delta >= TW_SPAN )
+		expires = tw->current + TW_SPAN - 1;
+	for( level = 0; level < TW_LEVELS - 1  &&  delta >= ( 1ULL << ( TW_SLOT_BITS * ( level + 1 ))); level++ )
+		;
+
+	linkNode( tw, TW_HEAD( tw, level, ( expires >> ( TW_SLOT_BITS * level )) & ( TW_SLOTS - 1 )), id );
+}
+
+/*-----------------------------------------------------------------------------
+ * detach()
+ *---------------------------------------------------------------------------*/
+ui32 detach( struct timerWheel *tw, ui32 head )
+{
+	struct twNode  *h = &tw->nodes[ head ];
+	ui32            first;
+
+	/* se lleva la lista entera y deja el hueco vaco; la lista suelta acaba
+	   en TW_NIL para poder recorrerla mientras se vuelve a llenar la rueda */
+	if( h->next == head )
+		return TW_NIL;
+
+	first = h->next;
+	tw->nodes[ h->prev ].next = TW_NIL;
+	h->next = head;
+	h->prev = head;
+
+	return first;
+}
+
+/*-----------------------------------------------------------------------------
+ * cascade()
+ *---------------------------------------------------------------------------*/
+void cascade( struct timerWheel *tw, ui32 level, ui32 slot )
+{
+	ui32  id, next;
+
+	/* con current ya en el tick de la vuelta, cada uno baja al nivel que le toca */
+	for( id = detach( tw, TW_HEAD( tw, level, slot )); id != TW_NIL; id = next )
+	{
+		next = tw->nodes[ id ].next;
+		insert( tw, id );
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * fire()
+ *---------------------------------------------------------------------------*/
+ui32 fire( struct timerWheel *tw, ui32 head, ui64 now, twExpireFn fn, void *ctx )
+{
+	ui32  id, next, count = 0;
+	ui64  again;
+
+	for( id = detach( tw, head ); id != TW_NIL; id = next )
+	{
+		next = tw->nodes[ id ].next;
+		tw->nodes[ id ].next = TW_NIL;
+
+		/* los que an no han vencido (el hueco se comparte al volcar todo de
+		   golpe) vuelven a la rueda sin molestar a nadie */
+		if( tw->expires[ id ] > tw->current )
+		{
+			insert( tw, id );
+			continue;
+		}
+
+		count++;
+		again = fn( ctx, id, now );
+		if( again != 0 )
+			twSchedule( tw, id, again );
+	}
+
+	return count;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * twCreate()
+ *---------------------------------------------------------------------------*/
+struct timerWheel * twCreate( ui32 capacity )
+{
+	struct timerWheel  *tw;
+
+	if( capacity == 0  ||  capacity > TW_NIL - TW_LEVELS * TW_SLOTS )
+	{
+		printf( "twCreate: invalid capacity %u\n", capacity );
+		return NULL;
+	}
+
+	tw = calloc( 1, sizeof( *tw ));
+	if( tw == NULL )
+		return NULL;
+
+	tw->capacity = capacity;
+	tw->nodes    = malloc( ( (size_t)capacity + TW_LEVELS * TW_SLOTS ) * sizeof( struct twNode ));
+	tw->expires  = malloc( (size_t)capacity * sizeof( ui64 ));
+	if( tw->nodes == NULL  ||  tw->expires == NULL )
+	{
+		twDestroy( tw );
+		return NULL;
+	}
+
+	twReset( tw );
+	return tw;
+}
+
+/*-----------------------------------------------------------------------------
+ * twDestroy()
+ *---------------------------------------------------------------------------*/
+void twDestroy( struct timerWheel *tw )
+{
+	if( tw == NULL )
+		return;
+
+	free( tw->nodes );
+	free( tw->expires );
+	free( tw );
+}
+
+/*-----------------------------------------------------------------------------
+ * twReset()
+ *---------------------------------------------------------------------------*/
+void twReset( struct timerWheel *tw )
+{
+	ui32  i;
+
+	assert( tw != NULL );
+
+	for( i = 0; i < tw->capacity; i++ )
+		tw->nodes[ i ].next = TW_NIL;
+	for( i = tw->capacity; i < tw->capacity + TW_LEVELS * TW_SLOTS; i++ )
+	{
+		tw->nodes[ i ].next = i;
+		tw->nodes[ i ].prev = i;
+	}
+
+	tw->current  = 0;
+	tw->bStarted = FALSE;
+}
+
+/*-----------------------------------------------------------------------------
+ * twSchedule()
+ *---------------------------------------------------------------------------*/
+void twSchedule( struct timerWheel *tw, ui32 id, ui64 expires )
+{
+	ui64  tick;
+
+	assert( tw != NULL  &&  id < tw->capacity );
+
+	/* redondeando hacia arriba nunca vence antes de tiempo */
+	tick = ( expires + TW_TICK_NS - 1 ) / TW_TICK_NS;
+
+	/* sin hora todava, la primera que nos dan pone la rueda en marcha */
+	if( !tw->bStarted )
+	{
+		tw->current  = tick - 1;
+		tw->bStarted = TRUE;
+	}
+
+	/* lo que ya ha vencido sale en el siguiente tick */
+	if( tick <= tw->current )
+		tick = tw->current + 1;
+
+	if( tw->nodes[ id ].next != TW_NIL )
+		unlinkNode( tw, id );
+	tw->expires[ id ] = tick;
+	insert( tw, id );
+}
+
+/*-----------------------------------------------------------------------------
+ * twCancel()
+ *---------------------------------------------------------------------------*/
+void twCancel( struct timerWheel *tw, ui32 id )
+{
+	assert( tw != NULL  &&  id < tw->capacity );
+
+	if( tw->nodes[ id ].next != TW_NIL )
+		unlinkNode( tw, id );
+}
+
+/*-----------------------------------------------------------------------------
+ * twAdvance()
+ *---------------------------------------------------------------------------*/
+ui32 twAdvance( struct timerWheel *tw, ui64 now, twExpireFn fn, void *ctx )
+{
+	ui64  tick, target;
+	ui32  level, slot, count = 0;
+
+	assert( tw != NULL  &&  fn != NULL );
+
+	target = now / TW_TICK_NS;
+	if( !tw->bStarted )
+	{
+		tw->current  = target;
+		tw->bStarted = TRUE;
+		return 0;
+	}
+
+	/* la hora no va hacia atrs: al reproducir, un fichero desordenado no
+	   hace nada hasta que se pasa del ltimo tick */
+	if( target <= tw->current )
+		return 0;
+
+	/* un salto mayor que la rueda la vaca entera de una vez: todo lo que
+	   estaba dentro vence o se recoloca respecto a la hora nueva */
+	if( target - tw->current >= TW_SPAN )
+	{
+		tw->current = target;
+		for( level = 0; level < TW_LEVELS; level++ )
+			for( slot = 0; slot < TW_SLOTS; slot++ )
+				count += fire( tw, TW_HEAD( tw, level, slot ), now, fn, ctx );
+		return count;
+	}
+
+	for( tick = tw->current + 1; tick <= target; tick++ )
+	{
+		tw->current = tick;
+
+		/* al dar la vuelta el nivel 0, se vuelcan los de arriba, el ms alto primero */
+		if(( tick & ( TW_SLOTS - 1 )) == 0 )
+		{
+			for( level = TW_LEVELS - 1; level > 0; level-- )
+			{
+				if(( tick & (( 1ULL << ( TW_SLOT_BITS * level )) - 1 )) == 0 )
+					cascade( tw, level, ( tick >> ( TW_SLOT_BITS * level )) & ( TW_SLOTS - 1 ));
+			}
+		}
+
+		count += fire( tw, TW_HEAD( tw, 0, tick & ( TW_SLOTS - 1 )), now, fn, ctx );
+	}
+
+	return count;
+}
+
+/****************************************************************************
+ * End of timerWheel.c
+ ****************************************************************************/
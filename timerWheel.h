@@ -0,0 +1,42 @@
+/****************************************************************************
+ * Module:  timerWheel
+ *
+ ****************************************************************************/
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define TW_LEVELS				3			/* 64 s, 68 min y 72 h por nivel */
+#define TW_SLOT_BITS			6
+#define TW_SLOTS				( 1 << TW_SLOT_BITS )
+#define TW_TICK_NS				1000000000ULL	/* resolucin: un segundo */
+#define TW_NIL					0xffffffff		/* ndice que no apunta a nada */
+
+/** forward declarations *****************************************************/
+struct timerWheel;
+
+/** public types *************************************************************/
+/*******
+ * twExpireFn
+ *
+ * Se llama con cada temporizador vencido, ya fuera de la rueda. Si devuelve
+ * una hora distinta de 0 el temporizador se vuelve a programar para entonces.
+ *******/
+typedef ui64 (*twExpireFn)( void *ctx, ui32 id, ui64 now );
+
+/** public interface *********************************************************/
+struct timerWheel *	twCreate( ui32 capacity );
+void				twDestroy( struct timerWheel *tw );
+void				twReset( struct timerWheel *tw );
+
+void				twSchedule( struct timerWheel *tw, ui32 id, ui64 expires );
+void				twCancel( struct timerWheel *tw, ui32 id );
+ui32				twAdvance( struct timerWheel *tw, ui64 now, twExpireFn fn, void *ctx );
+
+
+#endif  /* _TIMERWHEEL_H_ */
+/****************************************************************************
+ * End of timerWheel.h
+ ****************************************************************************/
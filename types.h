@@ -32,6 +32,7 @@
 typedef unsigned char 		uchar;
 typedef unsigned short int	ui16;
 typedef unsigned int		ui32;
+typedef unsigned long long	ui64;
 
 
 #endif		/* _TYPES_H_ */
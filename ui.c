@@ -5,12 +5,23 @@
 #include "ui.h"
 #include "packetStruct.h"
 #include "connections.h"
+#include "capture.h"
+#include "pcapWriter.h"
+#include "packetBuilder.h"
+#include "spscRing.h"
+#include <stdlib.h>
+#include <string.h>
 #include <curses.h>
 #include <menu.h>
+#include <pthread.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <time.h>
 
 /** defines ******************************************************************/
 #define MAX_DUMPED_DATA		8192
+#define UI_RING_EVENTS		1024		/* eventos en vuelo por hilo de captura */
+#define UI_EVENT_DATA		1536		/* bytes de la trama que viajan con el evento */
 
 /** private types ************************************************************/
 enum uiState
@@ -22,6 +33,29 @@ enum uiState
 	UI_MAX
 };
 
+/*******
+ * uiEvent
+ *
+ * Paquete de la conexin que se est mirando, copiado por el hilo de
+ * captura para que la interfaz lo muestre cuando pueda.
+ *******/
+struct uiEvent
+{
+	cntHandle			 connection;	/* conexin a la que pertenece */
+	ui32				 len;			/* bytes en el cable */
+	ui32				 caplen;		/* bytes copiados en data */
+	uchar				 data[ UI_EVENT_DATA ];
+};
+
+/*******
+ * uiFeed
+ *******/
+struct uiFeed
+{
+	struct spscRing		*ring;			/* hilo de captura -> interfaz */
+	cntHandle			 watch;			/* conexin mostrada de esta tabla, CNT_NO_HANDLE si ninguna */
+};
+
 /** private interface ********************************************************/
 static int  initCurses();
 static int  endCurses();
@@ -30,33 +64,63 @@ static void startFilterState();
 static void startDumpState();
 static void dumpPacketData( struct packet *p, struct connection *c );
 static void filterPacketData( struct packet *p, struct connection *c );
+static void showPacket( struct packet *p, struct connection *activeCnt );
+static ui32 getConnectionsCount();
+static struct connection * getConnection( ui32 idx, struct connectionTable **table );
+static void followSelection();
+static void lockTables();
+static void unlockTables();
 	
 static const char * getAppName( enum eApplicationProtocol ap );
 static const char * getTransportName( enum eTransportProtocol tp );
 static const char * getNetworkName( enum eNetworkProtocol np );
+static const char * getEncapName( enum eEncapsulation encap );
+static const char * getTcpStateName( enum eTcpState state );
+static const char * formatScaled( double value, char *buffer, int size );
 
-static void printDLL( const struct dataLinkLayer *dll );
-static void printEthernetII( const struct ethernetII *ethII );
-static void printNL( const struct networkLayer *nl );
-static void printIP( const struct ipPacket *ip );
-static void printTL( const struct transportLayer *tl );
-static void printICMP( const struct icmpPacket *icmp );
-static void printUDPOptions( const struct udpPacket *udp );	
-static void printTCPOptions( const struct tcpPacket *tcp, ui16 total_len );
-static void printTCPData (const struct tcpPacket *tcp, ui16 total_len);
-static void printUDPData (const struct udpPacket *udp);	
+static void printDLL( const struct packet *p );
+static void printEthernetII( const struct packet *p );
+static void printCooked( const struct packet *p );
+static void printNL( const struct packet *p );
+static void printIP( const struct packet *p );
+static void printIP6( const struct packet *p );
+static void printTL( const struct packet *p );
+static void printICMP( const struct packet *p );
+static void printUDPOptions( const struct packet *p );	
+static void printTCPOptions( const struct packet *p );
+static void printTCPData( const struct packet *p );
+static void printUDPData( const struct packet *p );	
+static void printErrors( const struct packet *p );
 
 static void drawStatisticsWndFrame();
 static void drawMainWndFrame();
+static void drawFlowStatistics();
 static void drawConnections();
-static void drawConnectionStatistics( struct connection *c );
+static void drawConnectionStatistics( struct connectionTable *t, struct connection *c );
+static void drawRateStatistics( struct connectionTable *t, struct connection *c );
+static void drawTcpStatistics( struct connection *c );
+static const char * formatRtt( ui32 us, char *buffer, int size );
+static void drawCaptureStatistics();
+static void drawWriterStatistics();
+static void drawTunnelStatistics();
+static void drawFragmentStatistics();
+static void promptFilter();
+static void drawRingStatistics();
+static struct uiFeed * getFeed( struct connectionTable *t );
+static void updateWatch();
+static void drainEvents();
 
 /** public interface *********************************************************/
-int		uiInit();
+int		uiInit( struct connectionTable **tables, int count );
 int		uiEnd();
 int		uiUpdate();
-void	uiProcessPacket( struct packet *p );
+void	uiProcessPacket( struct connectionTable *t, struct packet *p, ui64 now );
+void	uiProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, int count, ui64 now );
 void	uiRefresh();
+void	uiSetCaptureStatistics( const struct captureStats *st );
+void	uiSetWriterStatistics( const struct pwStats *st, ui64 bytesPerSec );
+void	uiSetFilterHandler( int (*handler)( void *ctx, const char *expr, char *err, int errLen ),
+							void *ctx, const char *current );
 
 /** private data *************************************************************/
 static int	   		 termWidth, termHeight;		/* tamao de la terminal */
@@ -65,7 +129,23 @@ static WINDOW 		*statisticsWnd      = NULL; /* ventana de estadisticas */
 static WINDOW 		*mainWndFrame       = NULL;	/* ventana de conexiones */
 static WINDOW 		*statisticsWndFrame = NULL;	/* ventana de estadisticas */
 static int     		 curConnection;				/* conexin actualmente seleccionada */
+static cntHandle	 curHandle;					/* la misma, para seguirla si cambia de posicin */
+static struct connectionTable *curTable;		/* tabla de curHandle */
 static enum uiState	 state;						/* estado actual de la interfaz de usuario */
+static struct captureStats captureStats;			/* contadores del kernel */
+static struct pwStats writerStats;				/* contadores de la grabacin */
+static ui64			 writerRate;				/* bytes por segundo a disco */
+static uchar		 bWriting;					/* hay grabacin en curso */
+static int		   (*filterHandler)( void *ctx, const char *expr, char *err, int errLen ) = NULL;
+static void			*filterCtx;
+static char			 filterExpr[ 128 ];			/* filtro activo */
+static char			 filterError[ 128 ];		/* error del ltimo filtro introducido */
+static uchar		 bConnectionsDirty;			/* hay que repintar las conexiones */
+static struct connectionTable **tables;			/* tablas de conexiones, una por hilo de captura */
+static struct uiFeed *feeds;					/* una cola por tabla */
+static ui32			 ringBacklog;				/* eventos pendientes en el ltimo refresco */
+static int			 tableCount;
+static pthread_mutex_t uiLock = PTHREAD_MUTEX_INITIALIZER;	/* las curses no son reentrantes */
 
 /* color configuration */
 static int  NORMAL = 1, SELECTION = 2;
@@ -160,9 +240,12 @@ static void startDumpState()
 ***********/
 static void dumpPacketData( struct packet *p, struct connection *c )
 {
-	printDLL( &p->dll );
-	printNL( &p->nl );
-	printTL( &p->tl );
+	printDLL( p );
+	if( p->encap != ENCAP_NONE )
+		wprintw( mainWnd, "Tunnel: %s %u, inner layers follow\n", getEncapName( p->encap ), p->tunnelId );
+	printNL( p );
+	printTL( p );
+	printErrors( p );
 }
 
 /************
@@ -177,10 +260,11 @@ static void filterPacketData( struct packet *p, struct connection *c )
 	assert( p != NULL );
 	assert( c != NULL );
 	
-	if( p->tl.type == TT_TCP )
+	if( p->tl == TT_TCP )
 	{
-		dataPtr  = ((uchar *)(p->tl.tcp)) + p->tl.tcp->data_offset * 4;
-		dataSize = p->tl.data_size - ( p->tl.tcp->data_offset * 4 );
+		/* solo los datos que de verdad se capturaron */
+		dataPtr  = (void *)PKT_PAYLOAD( p );
+		dataSize = PKT_CAPTURED_PAYLOAD( p );
 		
 		if( c->ap_protocol == AP_MSN )
 		{
@@ -191,8 +275,117 @@ static void filterPacketData( struct packet *p, struct connection *c )
 			}
 		}
 		else
-			printTCPData( p->tl.tcp, p->tl.data_size );		
+			printTCPData( p );		
+	}
+}
+
+/************
+* showPacket()
+***********/
+static void showPacket( struct packet *p, struct connection *activeCnt )
+{
+	/* procesamos el paquete de la conexin activa segn el estado actual */
+	switch( state )
+	{
+		case UI_CONNECTIONS:
+			break;
+		case UI_FILTER:
+			/* lo filtramos para obtener los datos */
+			filterPacketData( p, activeCnt );
+			break;
+		case UI_DUMP:
+			/* lo filtramos para obtener los datos */
+			dumpPacketData( p, activeCnt );
+			break;
+	}
+}
+
+/************
+* getConnectionsCount()
+***********/
+static ui32 getConnectionsCount()
+{
+	ui32  count = 0;
+	int   i;
+	
+	/* la vista es la suma de las tablas de todos los hilos */
+	for( i = 0; i < tableCount; i++ )
+		count += cntGetConnectionsCount( tables[i] );
+	
+	return  count;
+}
+
+/************
+* followSelection()
+***********/
+static void followSelection()
+{
+	struct connection  *cnt;
+	int                 i, idx, offset = 0;
+	
+	/* las posiciones cambian al caducar otras: si la seleccionada sigue
+	   viva, la seleccin va a donde est ahora */
+	if( curHandle != CNT_NO_HANDLE )
+	{
+		for( i = 0; i < tableCount  &&  tables[i] != curTable; i++ )
+			offset += cntGetConnectionsCount( tables[i] );
+		idx = i < tableCount ? cntGetIndex( curTable, curHandle ) : -1;
+		if( idx >= 0 )
+			curConnection = offset + idx;
+	}
+	
+	/* si ha caducado, se queda en su sitio o sube a la ltima que queda */
+	if( curConnection >= (int)getConnectionsCount()  &&  getConnectionsCount() > 0 )
+		curConnection = getConnectionsCount() - 1;
+	
+	cnt       = getConnectionsCount() > 0 ? getConnection( curConnection, &curTable ) : NULL;
+	curHandle = cnt != NULL ? cnt->handle : CNT_NO_HANDLE;
+}
+
+/************
+* getConnection()
+***********/
+static struct connection * getConnection( ui32 idx, struct connectionTable **table )
+{
+	ui32  count;
+	int   i;
+	
+	/* buscamos a qu tabla corresponde el ndice de la vista */
+	for( i = 0; i < tableCount; i++ )
+	{
+		count = cntGetConnectionsCount( tables[i] );
+		if( idx < count )
+		{
+			*table = tables[i];
+			return  cntGetConnection( tables[i], idx );
+		}
+		idx -= count;
 	}
+	
+	*table = NULL;
+	return  NULL;
+}
+
+/************
+* lockTables()
+***********/
+static void lockTables()
+{
+	int  i;
+	
+	for( i = 0; i < tableCount; i++ )
+		cntLock( tables[i] );
+}
+
+/************
+* unlockTables()
+***********/
+static void unlockTables()
+{
+	int  i;
+	
+	for( i = tableCount - 1; i >= 0; i-- )
+		cntUnlock( tables[i] );
 }
 
 /************
@@ -240,6 +433,7 @@ static const char * getNetworkName( enum eNetworkProtocol np )
 		"IP",
 		"ARP",
 		"IPX",
+		"IPv6",
 		
 		"UNKNOWN"
 	};
@@ -247,18 +441,97 @@ static const char * getNetworkName( enum eNetworkProtocol np )
 	return  networkProtocolNames[np];
 }
 
+/************
+* getEncapName()
+***********/
+static const char * getEncapName( enum eEncapsulation encap )
+{
+	static const char encapNames[ENCAP_COUNT][8] =
+	{
+		"",
+		"gre",
+		"vxlan",
+		"geneve"
+	};
+	
+	return  encapNames[encap];
+}
+
+/************
+* getTcpStateName()
+***********/
+static const char * getTcpStateName( enum eTcpState state )
+{
+	static const char stateNames[][12] =
+	{
+		"",
+		"SYN_SENT",
+		"SYN_RECV",
+		"ESTABLISHED",
+		"FIN_WAIT",
+		"CLOSED"
+	};
+	
+	return  stateNames[state];
+}
+
+/************
+* formatScaled()
+***********/
+static const char * formatScaled( double value, char *buffer, int size )
+{
+	static const char  prefixes[] = " KMGTP";
+	int                i;
+	
+	/* con prefijo decimal y una cifra decimal, para que quepa en poco sitio;
+	   sin prefijo solo llevan decimal los caudales de menos de 10 */
+	for( i = 0; value >= 1000.0  &&  prefixes[i + 1] != '\0'; i++ )
+		value /= 1000.0;
+	if( i == 0 )
+		snprintf( buffer, size, value < 10.0  &&  value != (ui64)value ? "%.1f" : "%.0f", value );
+	else
+		snprintf( buffer, size, "%.1f%c", value, prefixes[i] );
+	
+	return  buffer;
+}
+
+/************
+* formatRtt()
+***********/
+static const char * formatRtt( ui32 us, char *buffer, int size )
+{
+	/* en milisegundos, o un guion si an no hay muestra */
+	if( us == 0 )
+		snprintf( buffer, size, "-" );
+	else
+		snprintf( buffer, size, "%.1fms", us / 1000.0 );
+	
+	return  buffer;
+}
+
 /******
  * printDLL()
  *******/
-static void printDLL( const struct dataLinkLayer *dll )
+static void printDLL( const struct packet *p )
 {
-	assert( dll != NULL );
+	assert( p != NULL );
 	
-	switch( dll->type )
+	switch( p->dll )
 	{
 		case DLL_ETHERNET_II:
 			wprintw( mainWnd,  "struct dataLinkLayer: Ethernet II frame.\n" );
-			printEthernetII( dll->ethII );
+			printEthernetII( p );
+			break;
+		case DLL_LINUX_SLL:
+		case DLL_LINUX_SLL2:
+			wprintw( mainWnd,  "struct dataLinkLayer: Linux cooked frame.\n" );
+			printCooked( p );
+			break;
+		case DLL_LOOPBACK:
+			wprintw( mainWnd,  "struct dataLinkLayer: BSD loopback frame.\n" );
+			break;
+		case DLL_RAW_IP:
+			wprintw( mainWnd,  "struct dataLinkLayer: raw IP, no link header.\n" );
 			break;
 		case DLL_UNKNOWN:
 			wprintw( mainWnd,  "struct dataLinkLayer: Unknow frame type.\n");
@@ -272,27 +545,66 @@ static void printDLL( const struct dataLinkLayer *dll )
 /******
  * printEthernetII()
  *******/
-static void printEthernetII( const struct ethernetII *ethII )
+static void printEthernetII( const struct packet *p )
 {
+	const struct ethHeader  *ethII = PKT_ETH( p );
+	
 	wprintw( mainWnd,  "Source MAC address:  %02X:%02X:%02X:%02X:%02X:%02X\n", ethII->src_eth[0], ethII->src_eth[1], ethII->src_eth[2],
 															  ethII->src_eth[3], ethII->src_eth[4], ethII->src_eth[5] );
 	wprintw( mainWnd,  "Destination MAC address: %02X:%02X:%02X:%02X:%02X:%02X\n", ethII->dst_eth[0], ethII->dst_eth[1], ethII->dst_eth[2],
 																  ethII->dst_eth[3], ethII->dst_eth[4], ethII->dst_eth[5] );
 	wprintw( mainWnd,  "Frame type: 0x%X\n", ntohs( ethII->ethertype ));
+	if( p->flags & PKT_F_VLAN )
+		wprintw( mainWnd,  "VLAN: %d\n", p->vlanId );
+	if( p->flags & ( PKT_F_VLAN | PKT_F_MPLS ))
+		wprintw( mainWnd,  "Inner type: 0x%X\n", p->ethertype );
+}
+
+/******
+ * printCooked()
+ *******/
+static void printCooked( const struct packet *p )
+{
+	static const char *types[] = { "to us", "broadcast", "multicast", "to another host", "outgoing" };
+	const uchar       *addr;
+	int                i, halen, pkttype, hatype;
+	
+	/* las dos versiones llevan lo mismo en otro orden */
+	if( p->dll == DLL_LINUX_SLL )
+	{
+		pkttype = ntohs( PKT_SLL( p )->pkttype );
+		hatype  = ntohs( PKT_SLL( p )->hatype );
+		halen   = ntohs( PKT_SLL( p )->halen );
+		addr    = PKT_SLL( p )->addr;
+	}
+	else
+	{
+		pkttype = PKT_SLL2( p )->pkttype;
+		hatype  = ntohs( PKT_SLL2( p )->hatype );
+		halen   = PKT_SLL2( p )->halen;
+		addr    = PKT_SLL2( p )->addr;
+		wprintw( mainWnd,  "Interface index: %u\n", ntohl( PKT_SLL2( p )->ifindex ));
+	}
+	
+	wprintw( mainWnd,  "Packet type: %s\n", pkttype < 5 ? types[pkttype] : "?" );
+	wprintw( mainWnd,  "Link type: %d  Source address:", hatype );
+	for( i = 0; i < halen  &&  i < SLL_ADDR_SIZE; i++ )
+		wprintw( mainWnd,  "%s%02X", i == 0 ? " " : ":", addr[i] );
+	wprintw( mainWnd,  "\nFrame type: 0x%X\n", p->ethertype );
 }
 
 /********
  * printNL()
  ********/
-static void printNL( const struct networkLayer *nl )
+static void printNL( const struct packet *p )
 {
-	assert( nl != NULL );
+	assert( p != NULL );
 	
-	switch( nl->type )
+	switch( p->nl )
 	{
 		case NT_IP:
 			wprintw( mainWnd,  "Network Layer: IP packet\n" );
-			printIP( nl->ip );
+			printIP( p );
 			break;
 		case NT_ARP:
 			wprintw( mainWnd,  "Network Layer: ARP packet\n" );
@@ -300,6 +612,10 @@ static void printNL( const struct networkLayer *nl )
 		case NT_IPX:
 			wprintw( mainWnd,  "Network Layer: IPX packet\n" );
 			break;
+		case NT_IPV6:
+			wprintw( mainWnd,  "Network Layer: IPv6 packet\n" );
+			printIP6( p );
+			break;
 		case NT_UNKNOWN:
 			wprintw( mainWnd,  "Network Layer: Unknown packet\n");
 			break;
@@ -312,44 +628,62 @@ static void printNL( const struct networkLayer *nl )
 /********
  * printIP()
  ********/
-static void printIP( const struct ipPacket *ip )
+static void printIP( const struct packet *p )
 {
+	const struct ipHeader  *ip = PKT_IP( p );
+	
 	wprintw( mainWnd,  "Direccin origen : %d.%d.%d.%d\n", ip->IPv4_src[0], ip->IPv4_src[1], ip->IPv4_src[2], ip->IPv4_src[3] );
 	wprintw( mainWnd,  "Direccin destino: %d.%d.%d.%d\n", ip->IPv4_dst[0], ip->IPv4_dst[1], ip->IPv4_dst[2], ip->IPv4_dst[3] );
 	
 	
-	//wprintw( mainWnd,  "Version: %d\n", ip->version );
-	wprintw( mainWnd,  "Header length: %d\n", ip->header_len );
+	//wprintw( mainWnd,  "Version: %d\n", IP_VERSION( ip ));
+	wprintw( mainWnd,  "Header length: %d\n", IP_HEADER_LEN( ip ) / 4 );
 	//wprintw( mainWnd,  "TOS: %s\n", ip->serve_type );
 	wprintw( mainWnd,  "Packet length: %d\n", ntohs(ip->packet_len ));
 	//wprintw( mainWnd,  "ID: %d\n", ip->ID );
-	//wprintw( mainWnd,  "FragOffset: %d\n", ip->frag_offset );
+	//wprintw( mainWnd,  "FragOffset: %d\n", ntohs( ip->frag ) & IP_FRAG_OFFSET );
 	//wprintw( mainWnd,  "protocol: %d\n", ip->protocol );
 	//wprintw( mainWnd,  "checksum: %d\n", ip->hdr_chksum );
 	
 }
 
+/********
+ * printIP6()
+ ********/
+static void printIP6( const struct packet *p )
+{
+	const struct ip6Header  *ip6 = PKT_IP6( p );
+	char                     address[ INET6_ADDRSTRLEN ];
+	
+	inet_ntop( AF_INET6, ip6->IPv6_src, address, sizeof( address ));
+	wprintw( mainWnd,  "Direccin origen : %s\n", address );
+	inet_ntop( AF_INET6, ip6->IPv6_dst, address, sizeof( address ));
+	wprintw( mainWnd,  "Direccin destino: %s\n", address );
+	wprintw( mainWnd,  "Payload length: %d\n", ntohs( ip6->payload_len ));
+	wprintw( mainWnd,  "Next header: %d\n", p->ipProto );
+}
+
 /********
  * printTL()
  ********/
-static void printTL( const struct transportLayer *tl )
+static void printTL( const struct packet *p )
 {
-	assert( tl != NULL );
+	assert( p != NULL );
 	
-	switch( tl->type )
+	switch( p->tl )
 	{
 		case TT_ICMP:
 			wprintw( mainWnd,  "Transport Layer: ICMP packet\n" );
-			printICMP( tl->icmp );
+			printICMP( p );
 			break;
 		case TT_UDP:
 			wprintw( mainWnd,  "Transport Layer: UDP packet\n" );
-			printUDPOptions( tl->udp );
+			printUDPOptions( p );
 			break;
 		case TT_TCP:
 			wprintw( mainWnd,  "Transport Layer: TCP packet\n" );
-			printTCPOptions (tl->tcp, tl->data_size);
-			printTCPData( tl->tcp, tl->data_size );
+			printTCPOptions( p );
+			printTCPData( p );
 			break;
 		case TT_UNKNOWN:
 			wprintw( mainWnd,  "Transport Layer: Unknown packet\n" );
@@ -363,16 +697,20 @@ static void printTL( const struct transportLayer *tl )
 /********
  * printICMP()
  ********/
-static void printICMP( const struct icmpPacket *icmp )
+static void printICMP( const struct packet *p )
 {
+	const struct icmpHeader  *icmp = PKT_ICMP( p );
+	
 	wprintw( mainWnd,  "Type: %d  Code: %d  Checksum: %d\n", icmp->type, icmp->code, ntohs( icmp->checksum ));
 }
 
 /********
  * printUDPOptions()
  ********/
-static void printUDPOptions( const struct udpPacket *udp )
+static void printUDPOptions( const struct packet *p )
 {
+	const struct udpHeader  *udp = PKT_UDP( p );
+	
 	wprintw( mainWnd,  "Source port: %d  Destination port: %d\n", ntohs( udp->src_port ), ntohs( udp->dst_port ));
 	wprintw( mainWnd,  "Length: %d  Checksum: %d\n", ntohs( udp->length ), ntohs( udp->checksum ));
 }
@@ -380,58 +718,67 @@ static void printUDPOptions( const struct udpPacket *udp )
 /********
  * printTCPOptions()
  ********/
-static void printTCPOptions ( const struct tcpPacket *tcp, ui16 total_len )
+static void printTCPOptions( const struct packet *p )
 {
-	ui16 data_size;
-	data_size = total_len - (tcp->data_offset*4);
+	const struct tcpHeader  *tcp = PKT_TCP( p );
+	
 	wprintw( mainWnd,  "Source port: %d  Destination port: %d\n", ntohs( tcp->src_port ), ntohs( tcp->dst_port ));
 	
 	wprintw( mainWnd,  "Sequence number: %u\n", ntohl(tcp->seq_num ));
 	wprintw( mainWnd,  "ACK number: %u\n", ntohl( tcp->ack_num ));
-	wprintw( mainWnd,  "Data offset: %d\n", tcp->data_offset );
-	wprintw( mainWnd,  "Data_size: %u\n", data_size);
+	wprintw( mainWnd,  "Data offset: %d\n", TCP_HEADER_LEN( tcp ) / 4 );
+	wprintw( mainWnd,  "Data_size: %u\n", p->payloadLen );
 }
 
 /****************
 *printTCPData()
 ****************/
-static void printTCPData( const struct tcpPacket *tcp, ui16 total_len )
+static void printTCPData( const struct packet *p )
 {
-	char  msg[2048];
-	//FILE *fp;
-	//fp = fopen( "log", "aw" );
-	//assert( fp );
+	const uchar  *data = PKT_PAYLOAD( p );
+	ui32          data_size, i;
 	
-	ui16 data_size,i; 
-	data_size = total_len - (tcp->data_offset*4);
+	/* con snaplen puede faltar parte de los datos */
+	data_size = PKT_CAPTURED_PAYLOAD( p );
 	for( i = 0; i< data_size; i++ )
-		waddch( mainWnd,  *(((uchar *)(tcp) + tcp->data_offset * 4) + i) );
+		waddch( mainWnd,  data[i] );
 	waddch (mainWnd, '\n');
-		//putc( *(((uchar *)(tcp) + tcp->data_offset * 4) + i) , fp );
-	
-	//fclose( fp );
-	/*
-	strncpy( msg, ((uchar*)(tcp) + tcp->data_offset * 4), data_size );
-	msg[data_size] = '\0';
-	wprintw( mainWnd, "%s", msg );
-	
-	fp = fopen( "log2", "aw" );
-	assert( fp );
-	
-	fprintf( fp,"%s", msg );
+}
+
+/***************
+*printUDPData()
+****************/
+static void printUDPData( const struct packet *p )
+{
+	const uchar  *data = PKT_PAYLOAD( p );
+	ui32          data_size, i;
 	
-	fclose( fp );
-	*/
+	data_size = PKT_CAPTURED_PAYLOAD( p );
+	for (i = 0; i < data_size;i++)
+		wprintw( mainWnd, "%c", data[i] );
 }
 
 /***************
-*printUDPData() //---------------------------HAY QUE TESTEARLO!!!
+*printErrors()
 ****************/
-static void printUDPData (const struct udpPacket *udp)
+static void printErrors( const struct packet *p )
 {
-	ui16 i,data_offset =8;
-	for (i = 0; i < udp->length;i++)
-		wprintw( mainWnd, "%c", *(((uchar *)(udp) + data_offset) + 1));
+	if( p->flags & PKT_F_TRUNCATED )
+		wprintw( mainWnd, "Capturados %u de %u bytes\n", p->caplen, p->len );
+	if( p->flags & PKT_F_FRAGMENT )
+		wprintw( mainWnd, "Fragmento IP\n" );
+	
+	/* cabeceras cortadas o incoherentes: el anlisis se par ah */
+	if( p->errors == 0 )
+		return;
+	wprintw( mainWnd, "Cabecera mal formada:" );
+	if( p->errors & PKT_E_SHORT_L2 )	wprintw( mainWnd, " enlace corta" );
+	if( p->errors & PKT_E_BAD_L2 )		wprintw( mainWnd, " demasiadas etiquetas" );
+	if( p->errors & PKT_E_SHORT_L3 )	wprintw( mainWnd, " red corta" );
+	if( p->errors & PKT_E_BAD_L3 )		wprintw( mainWnd, " red incorrecta" );
+	if( p->errors & PKT_E_SHORT_L4 )	wprintw( mainWnd, " transporte corta" );
+	if( p->errors & PKT_E_BAD_L4 )		wprintw( mainWnd, " transporte incorrecta" );
+	waddch( mainWnd, '\n' );
 }
 
 /***************
@@ -449,6 +796,50 @@ static void drawStatisticsWndFrame()
 	wmove( statisticsWndFrame, 0, 2 );
 	
 	wprintw( statisticsWndFrame, "= Estadsticas =" );
+	
+	/* filtro activo, o el error del ltimo que se intent poner */
+	if( filterError[0] != '\0' )
+		wprintw( statisticsWndFrame, " = Error en el filtro: %.50s =", filterError );
+	else if( filterExpr[0] != '\0' )
+		wprintw( statisticsWndFrame, " = Filtro: %.55s =", filterExpr );
+}
+
+/***************
+*promptFilter()
+****************/
+static void promptFilter()
+{
+	char  expr[ sizeof( filterExpr ) ];
+	
+	if( filterHandler == NULL )
+		return;
+	
+	/* pedimos la expresin en el borde inferior de las estadsticas */
+	wmove( statisticsWndFrame, getmaxy( statisticsWndFrame ) - 1, 2 );
+	wclrtoeol( statisticsWndFrame );
+	wprintw( statisticsWndFrame, "Filtro: " );
+	wrefresh( statisticsWndFrame );
+	
+	/* mientras escribe el usuario la captura sigue en sus hilos */
+	echo();
+	curs_set( TRUE );
+	nodelay( stdscr, FALSE );
+	if( wgetnstr( statisticsWndFrame, expr, sizeof( expr ) - 1 ) == ERR )
+		expr[0] = '\0';
+	nodelay( stdscr, TRUE );
+	curs_set( FALSE );
+	noecho();
+	
+	/* si no compila se queda el filtro anterior */
+	filterError[0] = '\0';
+	if( filterHandler( filterCtx, expr, filterError, sizeof( filterError )) == 0 )
+		strcpy( filterExpr, expr );
+	
+	drawStatisticsWndFrame();
+	drawCaptureStatistics();
+	drawWriterStatistics();
+	drawFragmentStatistics();
+	drawTunnelStatistics();
 }
 
 /***************
@@ -465,7 +856,7 @@ static void drawMainWndFrame()
 	box( mainWndFrame, ACS_VLINE, ACS_HLINE );
 	
 	/* obtenemos el nmero de conexiones actualmente en el gestor */
-	connectionsCount = cntGetConnectionsCount();
+	connectionsCount = getConnectionsCount();
 	
 	/* nos posicionamos en la esquina superior izquierda y escribimos el nmero de conexiones */
 	wmove( mainWndFrame, 0, 2 );
@@ -493,28 +884,66 @@ static void drawMainWndFrame()
 		wattrset( mainWndFrame, COLOR_PAIR( NORMAL ));
 }
 
+/***************
+*drawFlowStatistics()
+****************/
+static void drawFlowStatistics()
+{
+	struct cntStats  st, total;
+	int              i;
+	
+	/* las tablas ya estn bloqueadas por quien nos llama */
+	memset( &total, 0, sizeof( total ));
+	for( i = 0; i < tableCount; i++ )
+	{
+		cntGetStats( tables[i], &st );
+		total.active   += st.active;
+		total.capacity += st.capacity;
+		total.expired  += st.expired;
+		total.full     += st.full;
+		total.memoryUsed      += st.memoryUsed;
+		total.memoryCommitted += st.memoryCommitted;
+		total.bHugePages      |= st.bHugePages;
+	}
+	
+	/* en el borde de abajo del marco de las conexiones */
+	wmove( mainWndFrame, getmaxy( mainWndFrame ) - 1, 2 );
+	wprintw( mainWndFrame, "= Flujos: %u/%u  %llu caducados  %llu sin sitio  %.1f/%.1f MB%s =",
+						   total.active, total.capacity, (unsigned long long)total.expired,
+						   (unsigned long long)total.full, total.memoryUsed / 1048576.0,
+						   total.memoryCommitted / 1048576.0, total.bHugePages ? " huge" : "" );
+}
+
 /***************
 *drawConnections()
 ****************/
 static void drawConnections()
 {
+	char src[ 64 ], dst[ 64 ], tag[ 40 ], rate[ 16 ];
 	int  i, connectionsCount;
 	struct connection *cnt;
+	struct connectionTable *cntTable;
+	struct cntRates rates;
+	
+	/* los hilos de captura no pueden tocar las tablas mientras pintamos */
+	lockTables();
 		
 	/* actualizamos la ventana marco */
 	drawMainWndFrame();
+	drawFlowStatistics();
 	
 	/* borramos la ventana */
 	werase( mainWnd );
 			
 	/* obtenemos el nmero de conexiones actualmente en el gestor */
-	connectionsCount = cntGetConnectionsCount();
+	followSelection();
+	connectionsCount = getConnectionsCount();
 	
-	/* por cada conexin en el gestor */
-	for( i = 0; i < connectionsCount; i++ )
+	/* por cada conexin en el gestor que quepa en la ventana */
+	for( i = 0; i < connectionsCount  &&  2 + i < getmaxy( mainWnd ); i++ )
 	{
 		/* obtenemos un puntero a la conexin */
-		cnt = cntGetConnection( i );
+		cnt = getConnection( i, &cntTable );
 		
 		/* nos movemos a su linea para pintarla */
 		wmove( mainWnd, 2 + i, 2 );
@@ -525,13 +954,30 @@ static void drawConnections()
 			wattrset( mainWnd, COLOR_PAIR( SELECTION ));
 		
 		/* pintamos la informacin de la conexin */
-		wprintw( mainWnd, "%d.%d.%d.%d:%d <-> %d.%d.%d.%d:%d",
-						   cnt->src_addr[0], cnt->src_addr[1], cnt->src_addr[2], cnt->src_addr[3], ntohs( cnt->src_port ),
-						   cnt->dst_addr[0], cnt->dst_addr[1], cnt->dst_addr[2], cnt->dst_addr[3], ntohs( cnt->dst_port ) );
+		cntFormatEndpoint( cntTable, cnt, FALSE, src, sizeof( src ));
+		cntFormatEndpoint( cntTable, cnt, TRUE,  dst, sizeof( dst ));
+		wprintw( mainWnd, "%s <-> %s", src, dst );
 		wmove( mainWnd, 2 + i, termWidth - 25 - 2 );
 		wprintw( mainWnd, "%7s %7s %7s", getAppName( cnt->ap_protocol ), 
 										 getTransportName( cnt->tp_protocol ), 
 										 getNetworkName( cnt->nt_protocol ));
+		/* caudal del ltimo segundo, y a su izquierda tnel y VLAN */
+		cntGetRates( cntTable, cnt, &rates );
+		if( rates.bitsPerSec[0] >= 1.0 )
+		{
+			wmove( mainWnd, 2 + i, termWidth - 25 - 2 - 11 );
+			wprintw( mainWnd, "%7sb/s", formatScaled( rates.bitsPerSec[0], rate, sizeof( rate )));
+		}
+		tag[0] = '\0';
+		if( cnt->key.encap != ENCAP_NONE )
+			snprintf( tag, sizeof( tag ), "%s %u ", getEncapName( cnt->key.encap ), cnt->key.tunnel );
+		if( cnt->key.vlan != 0 )
+			snprintf( tag + strlen( tag ), sizeof( tag ) - strlen( tag ), "vlan %4d ", cnt->key.vlan );
+		if( tag[0] != '\0' )
+		{
+			wmove( mainWnd, 2 + i, termWidth - 25 - 2 - 11 - strlen( tag ));
+			wprintw( mainWnd, "%s", tag );
+		}
 		
 		/* si hemos pintado ya la conexin activa */ 
 		if( i == curConnection )
@@ -540,29 +986,281 @@ static void drawConnections()
 	}
 	
 	/* obtenemos un puntero a la conexin seleccionada */
-	if( cntGetConnectionsCount() > 0 )
+	cnt = getConnectionsCount() > 0 ? getConnection( curConnection, &cntTable ) : NULL;
+	if( cnt != NULL )
 	{
-		cnt = cntGetConnection( curConnection );
-		if( cnt != NULL )
-		{
-			/* dibujamos las estadsticas de la conexin seleccionada */	
-			drawConnectionStatistics( cnt );
-		}
+		/* dibujamos las estadsticas de la conexin seleccionada */	
+		drawConnectionStatistics( cntTable, cnt );
 	}
+	drawRateStatistics( cntTable, cnt );
+	
+	unlockTables();
 }
 
 /************
 * drawConnectionStatistics()
 ***********/
-static void drawConnectionStatistics( struct connection *c )
+static void drawConnectionStatistics( struct connectionTable *t, struct connection *c )
 {
-	assert( c != NULL );
+	char  packets[2][ 16 ], bytes[2][ 16 ];
+	
+	assert( t != NULL  &&  c != NULL );
 	
 	/* borramos la ventana */
 	werase( statisticsWnd );
 	
+	/* cada sentido por separado: -> el del primer paquete, <- el contrario */
 	wmove( statisticsWnd, 0, 0 );
-	wprintw( statisticsWnd, "TX: %d", c->packetsCount );
+	wprintw( statisticsWnd, "-> %sp %sB  <- %sp %sB",
+							formatScaled( c->dirPackets[ CNT_DIR_FORWARD ], packets[0], sizeof( packets[0] )),
+							formatScaled( c->dirBytes[ CNT_DIR_FORWARD ], bytes[0], sizeof( bytes[0] )),
+							formatScaled( c->dirPackets[ CNT_DIR_REVERSE ], packets[1], sizeof( packets[1] )),
+							formatScaled( c->dirBytes[ CNT_DIR_REVERSE ], bytes[1], sizeof( bytes[1] )));
+	if( c->tcpState != TCPS_NONE )
+		wprintw( statisticsWnd, "  %s", getTcpStateName( c->tcpState ));
+	drawTcpStatistics( c );
+	
+	drawRingStatistics();
+	drawCaptureStatistics();
+	drawWriterStatistics();
+	drawFragmentStatistics();
+	drawTunnelStatistics();
+}
+
+/************
+* drawTcpStatistics()
+***********/
+static void drawTcpStatistics( struct connection *c )
+{
+	const struct cntTcpStats  *st = &c->tcp;
+	char                       rtt[3][ 16 ];
+	
+	if( c->tp_protocol != TT_TCP )
+		return;
+	
+	/* anlisis TCP en la segunda linea; cada par es ida/vuelta, como arriba */
+	wmove( statisticsWnd, 1, 0 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "RTT %s  -> %s <- %s  Retx %u/%u  Desord %u/%u  ACKdup %u/%u  Vent0 %u/%u",
+							formatRtt( st->handshakeRtt, rtt[0], sizeof( rtt[0] )),
+							formatRtt( st->rtt[ CNT_DIR_FORWARD ], rtt[1], sizeof( rtt[1] )),
+							formatRtt( st->rtt[ CNT_DIR_REVERSE ], rtt[2], sizeof( rtt[2] )),
+							st->retransmissions[ CNT_DIR_FORWARD ], st->retransmissions[ CNT_DIR_REVERSE ],
+							st->outOfOrder[ CNT_DIR_FORWARD ], st->outOfOrder[ CNT_DIR_REVERSE ],
+							st->dupAcks[ CNT_DIR_FORWARD ], st->dupAcks[ CNT_DIR_REVERSE ],
+							st->zeroWindows[ CNT_DIR_FORWARD ], st->zeroWindows[ CNT_DIR_REVERSE ] );
+}
+
+/************
+* drawRateStatistics()
+***********/
+static void drawRateStatistics( struct connectionTable *t, struct connection *c )
+{
+	static const char  windows[ CNT_RATE_WINDOWS ][4] = { "1s", "10s", "60s" };
+	struct cntRates    rates;
+	char               bits[ 16 ], packets[ 16 ];
+	int                row, w;
+	
+	/* el caudal de la seleccionada va en el borde de abajo de las
+	   estadsticas; sin seleccin solo queda el borde */
+	row = getmaxy( statisticsWndFrame ) - 1;
+	mvwhline( statisticsWndFrame, row, 1, ACS_HLINE, getmaxx( statisticsWndFrame ) - 2 );
+	if( c == NULL )
+		return;
+	
+	cntGetRates( t, c, &rates );
+	wmove( statisticsWndFrame, row, 2 );
+	wprintw( statisticsWndFrame, "=" );
+	for( w = 0; w < CNT_RATE_WINDOWS; w++ )
+		wprintw( statisticsWndFrame, " %s %sb/s %sp/s ", windows[w],
+									 formatScaled( rates.bitsPerSec[w], bits, sizeof( bits )),
+									 formatScaled( rates.packetsPerSec[w], packets, sizeof( packets )));
+	wprintw( statisticsWndFrame, "=" );
+}
+
+/************
+* drawCaptureStatistics()
+***********/
+static void drawCaptureStatistics()
+{
+	/* contadores del kernel en la tercera linea */
+	wmove( statisticsWnd, 2, 0 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "Kernel: %u paquetes  %u descartados  %u congelaciones",
+							captureStats.packets, captureStats.drops, captureStats.freezes );
+	
+	/* media de paquetes por llamada al sistema, solo si el motor las hace */
+	if( captureStats.reads > 0 )
+		wprintw( statisticsWnd, "  %.1f paq/llamada",
+								(double)captureStats.frames / (double)captureStats.reads );
+}
+
+/************
+* drawWriterStatistics()
+***********/
+static void drawWriterStatistics()
+{
+	if( !bWriting )
+		return;
+	
+	/* grabacin a disco en la cuarta linea */
+	wmove( statisticsWnd, 3, 0 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "Disco: %.2f MB/s  %llu tramas  %llu descartadas  %u ficheros",
+							(double)writerRate / ( 1 << 20 ), writerStats.records,
+							writerStats.drops, writerStats.files );
+	if( writerStats.error != 0 )
+		wprintw( statisticsWnd, "  %s", strerror( writerStats.error ));
+}
+
+/************
+* drawTunnelStatistics()
+***********/
+static void drawTunnelStatistics()
+{
+	ui64  decap[ ENCAP_COUNT ] = { 0 };
+	int   i, e;
+	
+	/* las tablas ya estn bloqueadas por quien nos llama */
+	for( i = 0; i < tableCount; i++ )
+		for( e = ENCAP_GRE; e < ENCAP_COUNT; e++ )
+			decap[e] += cntGetDecapsulated( tables[i], e );
+	if( decap[ENCAP_GRE] + decap[ENCAP_VXLAN] + decap[ENCAP_GENEVE] == 0 )
+		return;
+	
+	/* paquetes sacados de tneles, en la cuarta linea a la derecha */
+	wmove( statisticsWnd, 3, ( termWidth - 2 ) / 2 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "Tuneles: GRE %llu  VXLAN %llu  GENEVE %llu",
+							(unsigned long long)decap[ENCAP_GRE], (unsigned long long)decap[ENCAP_VXLAN],
+							(unsigned long long)decap[ENCAP_GENEVE] );
+}
+
+/************
+* drawFragmentStatistics()
+***********/
+static void drawFragmentStatistics()
+{
+	struct fragStats  st, total;
+	int               i, row;
+	
+	/* las tablas ya estn bloqueadas por quien nos llama */
+	memset( &total, 0, sizeof( total ));
+	for( i = 0; i < tableCount; i++ )
+	{
+		cntGetFragmentStats( tables[i], &st );
+		total.inUse     += st.inUse;
+		total.capacity  += st.capacity;
+		total.completed += st.completed;
+		total.timeouts  += st.timeouts;
+		total.evictions += st.evictions;
+	}
+	if( total.inUse + total.completed + total.timeouts + total.evictions == 0 )
+		return;
+	
+	/* en la cuarta linea, antes que los tneles que van a su derecha; si
+	   graba a disco, en la quinta si la ventana la tiene */
+	row = bWriting ? 4 : 3;
+	if( row >= getmaxy( statisticsWnd ))
+		return;
+	wmove( statisticsWnd, row, 0 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "Fragmentos: %u/%u  %llu caducados  %llu expulsados",
+							total.inUse, total.capacity, (unsigned long long)total.timeouts,
+							(unsigned long long)total.evictions );
+}
+
+/************
+* drawRingStatistics()
+***********/
+static void drawRingStatistics()
+{
+	ui32  size = 0;
+	int   i;
+	ui64  overflows = 0;
+	
+	/* ocupacin de las colas de los hilos de captura, en la primera linea a la derecha */
+	for( i = 0; i < tableCount; i++ )
+	{
+		size      += ringSize( feeds[i].ring );
+		overflows += ringOverflows( feeds[i].ring );
+	}
+	
+	wmove( statisticsWnd, 0, ( termWidth - 2 ) / 2 );
+	wclrtoeol( statisticsWnd );
+	wprintw( statisticsWnd, "Cola: %u/%u  %llu desbordes", ringBacklog, size, (unsigned long long)overflows );
+}
+
+/************
+* getFeed()
+***********/
+static struct uiFeed * getFeed( struct connectionTable *t )
+{
+	int  i;
+	
+	for( i = 0; i < tableCount; i++ )
+		if( tables[i] == t )
+			return  &feeds[i];
+	
+	return  NULL;
+}
+
+/************
+* updateWatch()
+***********/
+static void updateWatch()
+{
+	struct connection      *activeCnt = NULL;
+	struct connectionTable *activeTable = NULL;
+	int  i;
+	
+	/* los hilos de captura solo copian los paquetes de la conexin que se ve */
+	lockTables();
+	if( state != UI_CONNECTIONS  &&  getConnectionsCount() > 0 )
+		activeCnt = getConnection( curConnection, &activeTable );
+	for( i = 0; i < tableCount; i++ )
+		__atomic_store_n( &feeds[i].watch, tables[i] == activeTable ? activeCnt->handle : CNT_NO_HANDLE, __ATOMIC_RELAXED );
+	unlockTables();
+}
+
+/************
+* drainEvents()
+***********/
+static void drainEvents()
+{
+	const struct uiEvent   *ev;
+	struct packet           p;
+	struct connection       activeCnt, *cnt = NULL;
+	struct connectionTable *activeTable = NULL;
+	int  i;
+	
+	/* con las tablas cerradas solo se copia la conexin que se ve: decodificar
+	   y pintar va sin cierre, o los hilos de captura esperaran a curses */
+	lockTables();
+	if( getConnectionsCount() > 0 )
+		cnt = getConnection( curConnection, &activeTable );
+	if( cnt != NULL )
+		activeCnt = *cnt;
+	unlockTables();
+	
+	/* vaciamos las colas a nuestro ritmo; la seleccin puede haber cambiado
+	   desde que se encolaron, as que solo se pinta lo de la copia, y el
+	   manejador no confunde una que ya caduc con la que ocupe su memoria */
+	ringBacklog = 0;
+	for( i = 0; i < tableCount; i++ )
+	{
+		/* lo que se ha acumulado desde el refresco anterior */
+		ringBacklog += ringOccupancy( feeds[i].ring );
+		while(( ev = ringPeek( feeds[i].ring )) != NULL )
+		{
+			if( cnt != NULL  &&  tables[i] == activeTable  &&  ev->connection == activeCnt.handle )
+			{
+				buildPacket( ev->data, ev->caplen, ev->len, &p );
+				showPacket( &p, &activeCnt );
+			}
+			ringRelease( feeds[i].ring );
+		}
+	}
 }
 
 /*****************************************************************************
@@ -571,8 +1269,28 @@ static void drawConnectionStatistics( struct connection *c )
 /************
 * uiInit()
 ***********/
-int uiInit()
+int uiInit( struct connectionTable **connectionTables, int count )
 {
+	int  i;
+	
+	assert( connectionTables != NULL );
+	assert( count > 0 );
+	
+	/* tablas de conexiones que vamos a mostrar */
+	tables     = connectionTables;
+	tableCount = count;
+	
+	/* una cola sin cerrojos entre cada hilo de captura y la interfaz */
+	feeds = calloc( count, sizeof( struct uiFeed ));
+	if( feeds == NULL )
+		return  -1;
+	for( i = 0; i < count; i++ )
+	{
+		feeds[i].ring = ringCreate( UI_RING_EVENTS, sizeof( struct uiEvent ));
+		if( feeds[i].ring == NULL )
+			return  -1;
+	}
+	
 	/* inicilaizamos las n-curses */
 	if( initCurses() == -1 )
 	{
@@ -581,7 +1299,12 @@ int uiInit()
 	
 	/* calculamos el alto de cada ventana */
 	int mainWndHeight        = (int)((float)(termHeight) * 0.8f);
-	int statisticsWndHeight  = termHeight - mainWndHeight;
+	int statisticsWndHeight;
+	
+	/* las estadsticas necesitan al menos cuatro lineas ms el marco */
+	if( termHeight - mainWndHeight < 6 )
+		mainWndHeight = termHeight - 6;
+	statisticsWndHeight = termHeight - mainWndHeight;
 	
 	/* creamos las dos ventanas marco */
 	mainWndFrame = subwin( stdscr, mainWndHeight, termWidth, 0, 0 );
@@ -618,6 +1341,7 @@ int uiInit()
 	
 	/* seleccin de conexin */
 	curConnection    = 0;
+	curHandle        = CNT_NO_HANDLE;
 	
 	/* estado de la interfaz de usuario */
 	startConnectionsState();
@@ -630,6 +1354,17 @@ int uiInit()
 ***********/
 int	uiEnd()
 {
+	int  i;
+	
+	/* los hilos de captura ya han terminado, nadie ms escribe en las colas */
+	if( feeds != NULL )
+	{
+		for( i = 0; i < tableCount; i++ )
+			ringDestroy( feeds[i].ring );
+		free( feeds );
+		feeds = NULL;
+	}
+	
 	/* liberamos la memoria de las ventanas */
 	if( mainWnd != NULL )
 	{
@@ -664,14 +1399,19 @@ int	uiEnd()
 ***********/
 int uiUpdate()
 {
-	int  ch;
+	int  ch, i;
+	
+	pthread_mutex_lock( &uiLock );
 	
 	/* si tenemos teclas que procesar */
 	while( (ch = getch()) != ERR )
 	{
 		/* salida */
 		if( ch == 'q' )
-		  return  FALSE;
+		{
+			pthread_mutex_unlock( &uiLock );
+			return  FALSE;
+		}
 		
 		/* visor de conexiones */
 		if( ch == 'c' )
@@ -682,6 +1422,9 @@ int uiUpdate()
 		/* visor de datos formateados */
 		if( ch == 'f' )
 			startFilterState();
+		/* cambio del filtro del kernel */
+		if( ch == '/' )
+			promptFilter();
 	
 		/* proceso de teclado dependiente del estado */
 		switch( state )
@@ -693,19 +1436,27 @@ int uiUpdate()
 				if( ch == KEY_UP    &&  curConnection > 0 )
 				{
 					curConnection--;
+					curHandle = CNT_NO_HANDLE;
 					drawConnections();
 				}
 				/* movimiento abajo */
-				if( ch == KEY_DOWN	&&  curConnection < cntGetConnectionsCount()-1 )
+				if( ch == KEY_DOWN	&&  curConnection < getConnectionsCount()-1 )
 				{
 					curConnection++;
+					curHandle = CNT_NO_HANDLE;
 					drawConnections();
 				}
 				/* refrescar las conexiones */
 				if (ch == 'r' )
 				{
 					curConnection = 0;
-					cntInitConnections();
+					curHandle     = CNT_NO_HANDLE;
+					for( i = 0; i < tableCount; i++ )
+					{
+						cntLock( tables[i] );
+						cntInitConnections( tables[i] );
+						cntUnlock( tables[i] );
+					}
 					drawConnections();
 				}
 				break;
@@ -713,49 +1464,63 @@ int uiUpdate()
 		}
 	}
 	
+	pthread_mutex_unlock( &uiLock );
+	
 	return  TRUE;
 }
 
 /************
 * uiProcessPacket()
 ***********/
-void uiProcessPacket( struct packet *p )
+void uiProcessPacket( struct connectionTable *t, struct packet *p, ui64 now )
 {
-	struct connection *packetCnt;
-	struct connection *activeCnt;
-		
 	assert( p != NULL );
 	
-	/* procesamos paquete */
-	packetCnt = cntProcessPacket( p );
+	uiProcessBurst( t, p, NULL, 1, now );
+}
+
+/************
+* uiProcessBurst()
+***********/
+void uiProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, int count, ui64 now )
+{
+	cntHandle          packetCnts[ CAP_MAX_BURST ];
+	cntHandle          watch;
+	struct uiFeed     *feed;
+	struct uiEvent    *ev;
+	int  i;
+	
+	assert( t       != NULL );
+	assert( packets != NULL );
+	assert( count <= CAP_MAX_BURST );
+	
+	/* procesamos toda la rfaga en el gestor de conexiones del hilo */
+	cntLock( t );
+	cntProcessBurst( t, packets, times, packetCnts, count, now );
+	cntUnlock( t );
 	
-	/* si se ha procesado correctamente */
-	if( packetCnt != NULL  && cntGetConnectionsCount() > 0 )
+	/* aqu no se toca ninguna curses: los paquetes de la conexin que se est
+	   viendo van a la cola y la interfaz los pinta en su refresco; si la cola
+	   est llena se pierden y se cuentan, pero la captura no espera nunca */
+	feed  = getFeed( t );
+	watch = feed != NULL ? __atomic_load_n( &feed->watch, __ATOMIC_RELAXED ) : CNT_NO_HANDLE;
+	for( i = 0; watch != CNT_NO_HANDLE  &&  i < count; i++ )
 	{
-		/* si el paquete pertenece a la conexin activa */
-		activeCnt = cntGetConnection( curConnection );
-		if( activeCnt == packetCnt )
-		{
-			/* procesamos el paquete segn el estado actual */
-			switch( state )
-			{
-				case UI_CONNECTIONS:
-					break;
-				case UI_FILTER:
-					/* lo filtramos para obtener los datos */
-					filterPacketData( p, activeCnt );
-					break;
-				case UI_DUMP:
-					/* lo filtramos para obtener los datos */
-					dumpPacketData( p, activeCnt );
-					break;
-			}
-		}
+		if( packetCnts[i] != watch )
+			continue;
+		ev = ringReserve( feed->ring );
+		if( ev == NULL )
+			continue;
+		ev->connection = watch;
+		ev->len        = packets[i].len;
+		ev->caplen     = packets[i].caplen < UI_EVENT_DATA ? packets[i].caplen : UI_EVENT_DATA;
+		memcpy( ev->data, packets[i].data, ev->caplen );
+		ringCommit( feed->ring );
 	}
 	
-	/* si estamos en el estado de conexiones, actualizamos su representacin */
-	if( state == UI_CONNECTIONS )
-		drawConnections();
+	/* las conexiones se repintan en el siguiente refresco, no en cada paquete */
+	if( count > 0 )
+		__atomic_store_n( &bConnectionsDirty, TRUE, __ATOMIC_RELAXED );
 }
 
 /************
@@ -763,12 +1528,79 @@ void uiProcessPacket( struct packet *p )
 ***********/
 void uiRefresh()
 {
+	static time_t  lastSecond;
+	uchar          bDirty;
+	
+	pthread_mutex_lock( &uiLock );
+	
+	/* pintamos lo que hayan dejado los hilos de captura */
+	updateWatch();
+	drainEvents();
+	
+	/* si estamos en el estado de conexiones, actualizamos su representacin;
+	   tambin cada segundo sin trfico, para que se vea bajar el caudal */
+	bDirty = __atomic_exchange_n( &bConnectionsDirty, FALSE, __ATOMIC_RELAXED );
+	if( time( NULL ) != lastSecond )
+	{
+		lastSecond = time( NULL );
+		bDirty     = TRUE;
+	}
+	if( state == UI_CONNECTIONS  &&  bDirty == TRUE )
+		drawConnections();
+	drawRingStatistics();
+	
 	wnoutrefresh( mainWndFrame );
 	wnoutrefresh( statisticsWndFrame );
 	wnoutrefresh( mainWnd );
 	wnoutrefresh( statisticsWnd );
 		
 	doupdate();
+	
+	pthread_mutex_unlock( &uiLock );
+}
+
+/************
+* uiSetCaptureStatistics()
+***********/
+void uiSetCaptureStatistics( const struct captureStats *st )
+{
+	assert( st != NULL );
+	
+	pthread_mutex_lock( &uiLock );
+	captureStats = *st;
+	drawCaptureStatistics();
+	pthread_mutex_unlock( &uiLock );
+}
+
+/************
+* uiSetWriterStatistics()
+***********/
+void uiSetWriterStatistics( const struct pwStats *st, ui64 bytesPerSec )
+{
+	assert( st != NULL );
+	
+	pthread_mutex_lock( &uiLock );
+	writerStats = *st;
+	writerRate  = bytesPerSec;
+	bWriting    = TRUE;
+	drawWriterStatistics();
+	pthread_mutex_unlock( &uiLock );
+}
+
+/************
+* uiSetFilterHandler()
+***********/
+void uiSetFilterHandler( int (*handler)( void *ctx, const char *expr, char *err, int errLen ),
+						 void *ctx, const char *current )
+{
+	assert( handler != NULL );
+	
+	pthread_mutex_lock( &uiLock );
+	filterHandler = handler;
+	filterCtx     = ctx;
+	snprintf( filterExpr, sizeof( filterExpr ), "%s", current != NULL ? current : "" );
+	drawStatisticsWndFrame();
+	pthread_mutex_unlock( &uiLock );
 }
 
 /****************************************************************************
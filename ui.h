@@ -5,15 +5,25 @@
 #ifndef _UI_H_
 #define _UI_H_
 
+#include "types.h"
+
 /** forward declarations *****************************************************/
 struct packet;
+struct captureStats;
+struct connectionTable;
+struct pwStats;
 
 /** public interface *********************************************************/
-int		uiInit();
+int		uiInit( struct connectionTable **tables, int count );
 int		uiEnd();
 int		uiUpdate();
-void	uiProcessPacket( struct packet *p );
+void	uiProcessPacket( struct connectionTable *t, struct packet *p, ui64 now );
+void	uiProcessBurst( struct connectionTable *t, struct packet *packets, const ui64 *times, int count, ui64 now );
 void	uiRefresh();
+void	uiSetCaptureStatistics( const struct captureStats *st );
+void	uiSetWriterStatistics( const struct pwStats *st, ui64 bytesPerSec );
+void	uiSetFilterHandler( int (*handler)( void *ctx, const char *expr, char *err, int errLen ),
+							void *ctx, const char *current );
 	
 
 #endif  /* _UI_H_ */
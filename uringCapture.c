@@ -0,0 +1,447 @@
+/****************************************************************************
+ * Module:  uringCapture.c
+ *
+ ****************************************************************************/
+#include "uringCapture.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/if_packet.h>
+
+/** defines ******************************************************************/
+#define URING_BGID				0		/* grupo de buffers del recvmsg */
+#define URING_RECV				1		/* user_data del recvmsg multishot */
+
+/** private interface ********************************************************/
+static int  sysSetup( ui32 entries, struct io_uring_params *p );
+static int  sysEnter( int fd, ui32 toSubmit, ui32 minComplete, ui32 flags, void *arg, size_t argSize );
+static int  sysRegister( int fd, ui32 opcode, void *arg, ui32 nrArgs );
+static int  mapRings( struct uringSocket *u, const struct io_uring_params *p );
+static int  setupBuffers( struct uringSocket *u );
+static void armRecv( struct uringSocket *u );
+static ui32 getCompletions( struct uringSocket *u );
+
+/** public interface *********************************************************/
+struct uringSocket *	uringOpen( int sd, ui32 bufferCount, ui32 bufferSize );
+void					uringClose( struct uringSocket *u );
+int						uringWait( struct uringSocket *u, int timeoutMs );
+int						uringReadBurst( struct uringSocket *u, struct frame *frames, int maxFrames );
+void					uringReleaseBurst( struct uringSocket *u );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * sysSetup()
+ *---------------------------------------------------------------------------*/
+static int sysSetup( ui32 entries, struct io_uring_params *p )
+{
+	return  syscall( __NR_io_uring_setup, entries, p );
+}
+
+/*-----------------------------------------------------------------------------
+ * sysEnter()
+ *---------------------------------------------------------------------------*/
+static int sysEnter( int fd, ui32 toSubmit, ui32 minComplete, ui32 flags, void *arg, size_t argSize )
+{
+	return  syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize );
+}
+
+/*-----------------------------------------------------------------------------
+ * sysRegister()
+ *---------------------------------------------------------------------------*/
+static int sysRegister( int fd, ui32 opcode, void *arg, ui32 nrArgs )
+{
+	return  syscall( __NR_io_uring_register, fd, opcode, arg, nrArgs );
+}
+
+/*-----------------------------------------------------------------------------
+ * mapRings()
+ *---------------------------------------------------------------------------*/
+static int mapRings( struct uringSocket *u, const struct io_uring_params *p )
+{
+	/* las colas de envo y de completados, y el array de SQEs */
+	u->sqMapSize = p->sq_off.array + p->sq_entries * sizeof( ui32 );
+	u->cqMapSize = p->cq_off.cqes + p->cq_entries * sizeof( struct io_uring_cqe );
+
+	/* los kernels modernos mapean las dos colas juntas */
+	if( p->features & IORING_FEAT_SINGLE_MMAP )
+	{
+		if( u->cqMapSize > u->sqMapSize )
+			u->sqMapSize = u->cqMapSize;
+		u->cqMapSize = u->sqMapSize;
+	}
+
+	u->sqMap = mmap( NULL, u->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					 u->fd, IORING_OFF_SQ_RING );
+	if( u->sqMap == MAP_FAILED )
+	{
+		u->sqMap = NULL;
+		printf( "io_uring mmap err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	if( p->features & IORING_FEAT_SINGLE_MMAP )
+		u->cqMap = u->sqMap;
+	else
+	{
+		u->cqMap = mmap( NULL, u->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						 u->fd, IORING_OFF_CQ_RING );
+		if( u->cqMap == MAP_FAILED )
+		{
+			u->cqMap = NULL;
+			printf( "io_uring mmap err: %s\n", strerror( errno ));
+			return -1;
+		}
+	}
+
+	u->sqesSize = p->sq_entries * sizeof( struct io_uring_sqe );
+	u->sqes     = mmap( NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						u->fd, IORING_OFF_SQES );
+	if( u->sqes == MAP_FAILED )
+	{
+		u->sqes = NULL;
+		printf( "io_uring mmap err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	u->sqHead  = (ui32 *)( (uchar *)u->sqMap + p->sq_off.head );
+	u->sqTail  = (ui32 *)( (uchar *)u->sqMap + p->sq_off.tail );
+	u->sqMask  = (ui32 *)( (uchar *)u->sqMap + p->sq_off.ring_mask );
+	u->sqArray = (ui32 *)( (uchar *)u->sqMap + p->sq_off.array );
+	u->cqHead  = (ui32 *)( (uchar *)u->cqMap + p->cq_off.head );
+	u->cqTail  = (ui32 *)( (uchar *)u->cqMap + p->cq_off.tail );
+	u->cqMask  = (ui32 *)( (uchar *)u->cqMap + p->cq_off.ring_mask );
+	u->cqes    = (struct io_uring_cqe *)( (uchar *)u->cqMap + p->cq_off.cqes );
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * setupBuffers()
+ *---------------------------------------------------------------------------*/
+static int setupBuffers( struct uringSocket *u )
+{
+	struct io_uring_buf_reg  reg;
+	ui32                     i;
+
+	/* el anillo de buffers provistos tiene que estar alineado a pgina */
+	u->bufRingSize = u->bufferCount * sizeof( struct io_uring_buf );
+	u->bufRing     = mmap( NULL, u->bufRingSize, PROT_READ | PROT_WRITE,
+						   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+	if( u->bufRing == MAP_FAILED )
+	{
+		u->bufRing = NULL;
+		printf( "not enough memory for the buffer ring\n" );
+		return -1;
+	}
+
+	u->buffers = mmap( NULL, (size_t)u->bufferCount * u->slotSize, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+	u->pending = calloc( u->bufferCount, sizeof( ui16 ));
+	if( u->buffers == MAP_FAILED  ||  u->pending == NULL )
+	{
+		if( u->buffers == MAP_FAILED )
+			u->buffers = NULL;
+		printf( "not enough memory for %u receive buffers\n", u->bufferCount );
+		return -1;
+	}
+
+	memset( &reg, 0, sizeof( reg ));
+	reg.ring_addr    = (ui64)(unsigned long)u->bufRing;
+	reg.ring_entries = u->bufferCount;
+	reg.bgid         = URING_BGID;
+	if( sysRegister( u->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+	{
+		printf( "IORING_REGISTER_PBUF_RING err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	/* al principio todos los buffers son del kernel */
+	for( i = 0; i < u->bufferCount; i++ )
+	{
+		u->bufRing->bufs[i].addr = (ui64)(unsigned long)( u->buffers + (size_t)i * u->slotSize );
+		u->bufRing->bufs[i].len  = u->slotSize;
+		u->bufRing->bufs[i].bid  = i;
+	}
+	u->bufTail = u->bufferCount;
+	__atomic_store_n( &u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE );
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * armRecv()
+ *---------------------------------------------------------------------------*/
+static void armRecv( struct uringSocket *u )
+{
+	struct io_uring_sqe  *sqe;
+	ui32                  tail, idx;
+
+	/* un solo recvmsg multishot produce un completado por trama hasta que
+	   se queda sin buffers; MSG_TRUNC devuelve la longitud real de la trama.
+	   Es recvmsg y no recv para que llegue el cmsg PACKET_AUXDATA con la
+	   VLAN que quit la tarjeta */
+	tail = *u->sqTail;
+	idx  = tail & *u->sqMask;
+	sqe  = &u->sqes[idx];
+	memset( sqe, 0, sizeof( *sqe ));
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd        = u->sd;
+	sqe->addr      = (ui64)(unsigned long)u->msg;
+	sqe->len       = 1;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->msg_flags = MSG_TRUNC;
+	sqe->user_data = URING_RECV;
+
+	u->sqArray[idx] = idx;
+	__atomic_store_n( u->sqTail, tail + 1, __ATOMIC_RELEASE );
+	u->bArmed = TRUE;
+}
+
+/*-----------------------------------------------------------------------------
+ * getCompletions()
+ *---------------------------------------------------------------------------*/
+static ui32 getCompletions( struct uringSocket *u )
+{
+	return  __atomic_load_n( u->cqTail, __ATOMIC_ACQUIRE ) - *u->cqHead;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * uringOpen()
+ *---------------------------------------------------------------------------*/
+struct uringSocket * uringOpen( int sd, ui32 bufferCount, ui32 bufferSize )
+{
+	struct uringSocket      *u;
+	struct io_uring_params   p;
+
+	/* el anillo de buffers exige una potencia de dos y bid cabe en 16 bits */
+	if( bufferCount == 0  ||  ( bufferCount & ( bufferCount - 1 )) != 0  ||  bufferCount > 32768 )
+	{
+		printf( "io_uring buffer count must be a power of two up to 32768\n" );
+		return NULL;
+	}
+
+	u = calloc( 1, sizeof( *u ));
+	if( u == NULL )
+		return NULL;
+	u->sd          = sd;
+	u->bufferCount = bufferCount;
+	u->bufferSize  = bufferSize;
+
+	/* cada buffer lleva delante la cabecera del recvmsg multishot y el
+	   cmsg, sin direccin; el msghdr solo sirve para decir sus tamaos */
+	u->prefixSize  = sizeof( struct io_uring_recvmsg_out ) + CMSG_SPACE( sizeof( struct tpacket_auxdata ));
+	u->slotSize    = u->prefixSize + bufferSize;
+	u->msg         = calloc( 1, sizeof( struct msghdr ));
+	if( u->msg == NULL )
+	{
+		free( u );
+		return NULL;
+	}
+	u->msg->msg_controllen = CMSG_SPACE( sizeof( struct tpacket_auxdata ));
+
+	/* con tantos completados como buffers la cola nunca se desborda */
+	memset( &p, 0, sizeof( p ));
+	p.flags      = IORING_SETUP_CQSIZE;
+	p.cq_entries = bufferCount;
+	u->fd = sysSetup( URING_SQ_ENTRIES, &p );
+	if( u->fd < 0 )
+	{
+		printf( "io_uring_setup err: %s\n", strerror( errno ));
+		free( u->msg );
+		free( u );
+		return NULL;
+	}
+	if(( p.features & IORING_FEAT_EXT_ARG ) == 0 )
+	{
+		printf( "io_uring without IORING_FEAT_EXT_ARG, kernel too old\n" );
+		uringClose( u );
+		return NULL;
+	}
+
+	if( mapRings( u, &p ) == -1  ||  setupBuffers( u ) == -1 )
+	{
+		uringClose( u );
+		return NULL;
+	}
+
+	return u;
+}
+
+/*-----------------------------------------------------------------------------
+ * uringClose()
+ *---------------------------------------------------------------------------*/
+void uringClose( struct uringSocket *u )
+{
+	if( u == NULL )
+		return;
+
+	/* al cerrar el anillo se cancela el recvmsg y se libera el grupo de buffers */
+	if( u->fd >= 0 )
+		close( u->fd );
+
+	if( u->sqes != NULL )
+		munmap( u->sqes, u->sqesSize );
+	if( u->cqMap != NULL  &&  u->cqMap != u->sqMap )
+		munmap( u->cqMap, u->cqMapSize );
+	if( u->sqMap != NULL )
+		munmap( u->sqMap, u->sqMapSize );
+	if( u->bufRing != NULL )
+		munmap( u->bufRing, u->bufRingSize );
+	if( u->buffers != NULL )
+		munmap( u->buffers, (size_t)u->bufferCount * u->slotSize );
+	free( u->pending );
+	free( u->msg );
+	free( u );
+}
+
+/*-----------------------------------------------------------------------------
+ * uringWait()
+ *---------------------------------------------------------------------------*/
+int uringWait( struct uringSocket *u, int timeoutMs )
+{
+	struct io_uring_getevents_arg  arg;
+	struct __kernel_timespec       ts;
+	ui32                           toSubmit;
+	int                            ret;
+
+	assert( u != NULL );
+
+	/* el recvmsg se para si se acaban los buffers, lo volvemos a lanzar */
+	if( !u->bArmed )
+		armRecv( u );
+
+	/* si ya hay completados y nada que enviar, no hace falta entrar al kernel */
+	toSubmit = *u->sqTail - __atomic_load_n( u->sqHead, __ATOMIC_ACQUIRE );
+	if( toSubmit == 0  &&  getCompletions( u ) > 0 )
+		return 0;
+
+	/* enviamos y esperamos en la misma llamada, con el tope de tiempo del hilo */
+	memset( &arg, 0, sizeof( arg ));
+	ts.tv_sec      = timeoutMs / 1000;
+	ts.tv_nsec     = ( timeoutMs % 1000 ) * 1000000L;
+	arg.sigmask_sz = _NSIG / 8;
+	arg.ts         = (ui64)(unsigned long)&ts;
+
+	u->enters++;
+	ret = sysEnter( u->fd, toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof( arg ));
+	if( ret < 0  &&  errno != ETIME  &&  errno != EINTR  &&  errno != EBUSY )
+	{
+		printf( "io_uring_enter err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * uringReadBurst()
+ *---------------------------------------------------------------------------*/
+int uringReadBurst( struct uringSocket *u, struct frame *frames, int maxFrames )
+{
+	struct io_uring_cqe         *cqe;
+	struct io_uring_recvmsg_out *out;
+	struct msghdr                msg;
+	uchar                       *buffer;
+	ui32                         head, tail, bid;
+	ui64                         now;
+	int                          n = 0;
+
+	assert( u      != NULL );
+	assert( frames != NULL );
+
+	/* leemos los completados directamente de la memoria compartida */
+	head = *u->cqHead;
+	tail = __atomic_load_n( u->cqTail, __ATOMIC_ACQUIRE );
+	if( head == tail )
+		return 0;
+
+	/* una sola marca de tiempo para toda la rafaga */
+	now = capGetTime();
+	while( head != tail  &&  n < maxFrames )
+	{
+		cqe = &u->cqes[ head & *u->cqMask ];
+		head++;
+
+		/* sin IORING_CQE_F_MORE el recvmsg ha terminado y hay que relanzarlo */
+		if(( cqe->flags & IORING_CQE_F_MORE ) == 0 )
+			u->bArmed = FALSE;
+
+		if( cqe->res <= 0  ||  ( cqe->flags & IORING_CQE_F_BUFFER ) == 0 )
+		{
+			if( cqe->res == -ENOBUFS )
+				u->noBuffers++;
+			continue;
+		}
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		u->pending[ u->pendingCount++ ] = bid;
+
+		/* cabecera, cmsg y trama; payloadlen es la longitud real aunque no
+		   quepa, lo copiado es lo que sobra de res */
+		buffer = u->buffers + (size_t)bid * u->slotSize;
+		out    = (struct io_uring_recvmsg_out *)buffer;
+		if( (ui32)cqe->res < u->prefixSize )
+			continue;
+
+		frames[n].data   = buffer + u->prefixSize;
+		frames[n].caplen = (ui32)cqe->res - u->prefixSize;
+		frames[n].len    = out->payloadlen;
+		frames[n].tstamp = now;
+		frames[n].gsoSize = 0;
+
+		memset( &msg, 0, sizeof( msg ));
+		msg.msg_control    = buffer + sizeof( *out );
+		msg.msg_controllen = out->controllen;
+		capReadAuxData( &msg, &frames[n] );
+		n++;
+	}
+	__atomic_store_n( u->cqHead, head, __ATOMIC_RELEASE );
+
+	return n;
+}
+
+/*-----------------------------------------------------------------------------
+ * uringReleaseBurst()
+ *---------------------------------------------------------------------------*/
+void uringReleaseBurst( struct uringSocket *u )
+{
+	struct io_uring_buf  *buf;
+	ui32                  i, mask = u->bufferCount - 1;
+
+	assert( u != NULL );
+
+	if( u->pendingCount == 0 )
+		return;
+
+	/* devolvemos al kernel los buffers de la rfaga ya procesada */
+	for( i = 0; i < u->pendingCount; i++ )
+	{
+		buf       = &u->bufRing->bufs[ u->bufTail & mask ];
+		buf->addr = (ui64)(unsigned long)( u->buffers + (size_t)u->pending[i] * u->slotSize );
+		buf->len  = u->slotSize;
+		buf->bid  = u->pending[i];
+		u->bufTail++;
+	}
+	u->pendingCount = 0;
+	__atomic_store_n( &u->bufRing->tail, u->bufTail, __ATOMIC_RELEASE );
+}
+
+/****************************************************************************
+ * End of uringCapture.c
+ ****************************************************************************/
@@ -0,0 +1,79 @@
+/****************************************************************************
+ * Module:  uringCapture
+ *
+ ****************************************************************************/
+#ifndef _URINGCAPTURE_H_
+#define _URINGCAPTURE_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define URING_DEFAULT_BUFFERS		4096	/* buffers del anillo de buffers provistos */
+#define URING_MIN_BUFFERS			64		/* aunque sean supersegmentos de 256 KB */
+#define URING_SQ_ENTRIES			8		/* solo enviamos el recvmsg multishot */
+
+/** forward declarations *****************************************************/
+struct frame;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+struct msghdr;
+
+/** public types *************************************************************/
+/*******
+ * uringSocket
+ *******/
+struct uringSocket
+{
+	int					 fd;			/* io_uring */
+	int					 sd;			/* socket PF_PACKET del que recibimos */
+	uchar				 bArmed;		/* hay un recvmsg multishot en marcha */
+	struct msghdr		*msg;			/* solo dice cunto sitio dejar al cmsg */
+
+	/* cola de envo */
+	void				*sqMap;
+	ui32				 sqMapSize;
+	ui32				*sqHead;
+	ui32				*sqTail;
+	ui32				*sqMask;
+	ui32				*sqArray;
+	struct io_uring_sqe	*sqes;
+	ui32				 sqesSize;
+
+	/* cola de completados */
+	void				*cqMap;			/* igual que sqMap con IORING_FEAT_SINGLE_MMAP */
+	ui32				 cqMapSize;
+	ui32				*cqHead;
+	ui32				*cqTail;
+	ui32				*cqMask;
+	struct io_uring_cqe	*cqes;
+
+	/* buffers provistos: el kernel elige uno por trama */
+	struct io_uring_buf_ring *bufRing;
+	ui32				 bufRingSize;
+	uchar				*buffers;
+	ui32				 bufferCount;
+	ui32				 bufferSize;	/* bytes de trama que caben en cada buffer */
+	ui32				 prefixSize;	/* delante, io_uring_recvmsg_out y el cmsg */
+	ui32				 slotSize;		/* prefixSize + bufferSize */
+	ui16				 bufTail;		/* nuestra copia del productor del anillo */
+	ui16				*pending;		/* buffers de la rfaga an sin devolver */
+	ui32				 pendingCount;
+
+	ui64				 enters;		/* llamadas a io_uring_enter() */
+	ui64				 noBuffers;		/* veces que el recv se par por falta de buffers */
+};
+
+/** public interface *********************************************************/
+struct uringSocket *	uringOpen( int sd, ui32 bufferCount, ui32 bufferSize );
+void					uringClose( struct uringSocket *u );
+
+int						uringWait( struct uringSocket *u, int timeoutMs );
+int						uringReadBurst( struct uringSocket *u, struct frame *frames, int maxFrames );
+void					uringReleaseBurst( struct uringSocket *u );
+
+
+#endif  /* _URINGCAPTURE_H_ */
+/****************************************************************************
+ * End of uringCapture.h
+ ****************************************************************************/
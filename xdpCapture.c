@@ -0,0 +1,472 @@
+/****************************************************************************
+ * Module:  xdpCapture.c
+ *
+ ****************************************************************************/
+#include "xdpCapture.h"
+#include "capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#ifndef AF_XDP
+#define AF_XDP		44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP		283
+#endif
+
+/** defines ******************************************************************/
+#define XDP_MAX_QUEUES			64		/* entradas de la XSKMAP */
+#define XDP_COMP_RING_SIZE		64		/* no transmitimos, basta con uno pequeo */
+#define XDP_RX_QUEUE_OFFSET		16		/* offsetof( struct xdp_md, rx_queue_index ) */
+
+/** private interface ********************************************************/
+static int  sysBpf( int cmd, union bpf_attr *attr );
+static int  setupUmem( struct xdpSocket *xsk );
+static int  mapRing( struct xdpSocket *xsk, struct xdpRing *ring, const struct xdp_ring_offset *off,
+					 ui32 entries, ui32 descSize, off_t pgoff );
+static void unmapRing( struct xdpRing *ring );
+static int  loadProgram( struct xdpSocket *xsk );
+static int  attachProgram( struct xdpSocket *xsk, int ifindex );
+
+/** public interface *********************************************************/
+struct xdpSocket *	xdpOpen( const char *device, ui32 queue, ui32 frameCount, const struct xdpSocket *master );
+void				xdpClose( struct xdpSocket *xsk );
+int					xdpReadBurst( struct xdpSocket *xsk, struct frame *frames, int maxFrames );
+void				xdpReleaseBurst( struct xdpSocket *xsk );
+void				xdpUpdateStats( struct xdpSocket *xsk, struct captureStats *st );
+
+/*****************************************************************************
+ * Private interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * sysBpf()
+ *---------------------------------------------------------------------------*/
+static int sysBpf( int cmd, union bpf_attr *attr )
+{
+	return  syscall( __NR_bpf, cmd, attr, sizeof( *attr ));
+}
+
+/*-----------------------------------------------------------------------------
+ * setupUmem()
+ *---------------------------------------------------------------------------*/
+static int setupUmem( struct xdpSocket *xsk )
+{
+	struct xdp_umem_reg  reg;
+	ui32                 compSize = XDP_COMP_RING_SIZE;
+
+	/* la UMEM es una zona de tramas de tamao fijo compartida con el kernel */
+	xsk->umemSize = xsk->frameCount * XDP_FRAME_SIZE;
+	xsk->umem     = mmap( NULL, xsk->umemSize, PROT_READ | PROT_WRITE,
+						  MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0 );
+	if( xsk->umem == MAP_FAILED )
+	{
+		xsk->umem = NULL;
+		printf( "UMEM mmap err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	memset( &reg, 0, sizeof( reg ));
+	reg.addr       = (ui64)(unsigned long)xsk->umem;
+	reg.len        = xsk->umemSize;
+	reg.chunk_size = XDP_FRAME_SIZE;
+	reg.headroom   = 0;
+	if( setsockopt( xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof( reg )) < 0 )
+	{
+		printf( "XDP_UMEM_REG err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	/* el anillo de relleno puede contener todas las tramas de la UMEM */
+	if( setsockopt( xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &xsk->frameCount, sizeof( ui32 )) < 0  ||
+		setsockopt( xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &compSize, sizeof( ui32 )) < 0  ||
+		setsockopt( xsk->fd, SOL_XDP, XDP_RX_RING, &xsk->frameCount, sizeof( ui32 )) < 0 )
+	{
+		printf( "XDP ring setup err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * mapRing()
+ *---------------------------------------------------------------------------*/
+static int mapRing( struct xdpSocket *xsk, struct xdpRing *ring, const struct xdp_ring_offset *off,
+					ui32 entries, ui32 descSize, off_t pgoff )
+{
+	ring->mapSize = off->desc + entries * descSize;
+	ring->map     = mmap( NULL, ring->mapSize, PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff );
+	if( ring->map == MAP_FAILED )
+	{
+		ring->map = NULL;
+		printf( "XDP ring mmap err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	ring->producer = (ui32 *)( (uchar *)ring->map + off->producer );
+	ring->consumer = (ui32 *)( (uchar *)ring->map + off->consumer );
+	ring->flags    = (ui32 *)( (uchar *)ring->map + off->flags );
+	ring->desc     = (uchar *)ring->map + off->desc;
+	ring->mask     = entries - 1;
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * unmapRing()
+ *---------------------------------------------------------------------------*/
+static void unmapRing( struct xdpRing *ring )
+{
+	if( ring->map != NULL )
+	{
+		munmap( ring->map, ring->mapSize );
+		ring->map = NULL;
+	}
+}
+
+/*-----------------------------------------------------------------------------
+ * loadProgram()
+ *---------------------------------------------------------------------------*/
+static int loadProgram( struct xdpSocket *xsk )
+{
+	union bpf_attr  attr;
+	/* return bpf_redirect_map( &xsks, ctx->rx_queue_index, XDP_PASS ); */
+	struct bpf_insn prog[] =
+	{
+		{ BPF_LDX | BPF_MEM | BPF_W,    BPF_REG_2, BPF_REG_1,         XDP_RX_QUEUE_OFFSET, 0 },
+		{ BPF_LD  | BPF_DW  | BPF_IMM,  BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsk->mapFd },
+		{ 0,                            0,         0,                 0, 0 },
+		{ BPF_ALU64 | BPF_MOV | BPF_K,  BPF_REG_3, 0,                 0, XDP_PASS },
+		{ BPF_JMP | BPF_CALL,           0,         0,                 0, BPF_FUNC_redirect_map },
+		{ BPF_JMP | BPF_EXIT,           0,         0,                 0, 0 },
+	};
+
+	/* XSKMAP: cola de recepcion -> socket AF_XDP */
+	memset( &attr, 0, sizeof( attr ));
+	attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size    = sizeof( ui32 );
+	attr.value_size  = sizeof( ui32 );
+	attr.max_entries = XDP_MAX_QUEUES;
+	strncpy( attr.map_name, "sniffer_xsks", sizeof( attr.map_name ) - 1 );
+	xsk->mapFd = sysBpf( BPF_MAP_CREATE, &attr );
+	if( xsk->mapFd < 0 )
+	{
+		printf( "XSKMAP create err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	prog[1].imm = xsk->mapFd;
+
+	memset( &attr, 0, sizeof( attr ));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insn_cnt  = sizeof( prog ) / sizeof( prog[0] );
+	attr.insns     = (ui64)(unsigned long)prog;
+	attr.license   = (ui64)(unsigned long)"GPL";
+	strncpy( attr.prog_name, "sniffer_xdp", sizeof( attr.prog_name ) - 1 );
+	xsk->progFd = sysBpf( BPF_PROG_LOAD, &attr );
+	if( xsk->progFd < 0 )
+	{
+		printf( "XDP program load err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*-----------------------------------------------------------------------------
+ * attachProgram()
+ *---------------------------------------------------------------------------*/
+static int attachProgram( struct xdpSocket *xsk, int ifindex )
+{
+	union bpf_attr  attr;
+
+	/* primero intentamos el modo nativo del driver */
+	memset( &attr, 0, sizeof( attr ));
+	attr.link_create.prog_fd        = xsk->progFd;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type    = BPF_XDP;
+	attr.link_create.flags          = XDP_FLAGS_DRV_MODE;
+	xsk->linkFd = sysBpf( BPF_LINK_CREATE, &attr );
+	if( xsk->linkFd >= 0 )
+		return 0;
+
+	/* si el driver no tiene XDP nativo usamos el modo generico (SKB), que vale en veth */
+	attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+	xsk->linkFd = sysBpf( BPF_LINK_CREATE, &attr );
+	if( xsk->linkFd < 0 )
+	{
+		printf( "XDP attach err: %s\n", strerror( errno ));
+		return -1;
+	}
+
+	xsk->bGeneric = TRUE;
+	return 0;
+}
+
+/*****************************************************************************
+ * Public interface implementation
+ *****************************************************************************/
+/*-----------------------------------------------------------------------------
+ * xdpOpen()
+ *---------------------------------------------------------------------------*/
+struct xdpSocket * xdpOpen( const char *device, ui32 queue, ui32 frameCount, const struct xdpSocket *master )
+{
+	struct xdpSocket        *xsk;
+	struct xdp_mmap_offsets  off;
+	struct sockaddr_xdp      sxdp;
+	struct rlimit            rlim = { RLIM_INFINITY, RLIM_INFINITY };
+	union bpf_attr           attr;
+	socklen_t                len = sizeof( off );
+	ui64                    *fillDesc;
+	ui32                     i;
+	int                      ifindex;
+
+	assert( device != NULL );
+
+	/* los anillos tienen que ser potencia de dos */
+	if( frameCount == 0  ||  ( frameCount & ( frameCount - 1 )) != 0 )
+	{
+		printf( "XDP frame count must be a power of two\n" );
+		return NULL;
+	}
+	if( queue >= XDP_MAX_QUEUES )
+	{
+		printf( "XDP queue must be lower than %d\n", XDP_MAX_QUEUES );
+		return NULL;
+	}
+
+	ifindex = if_nametoindex( device );
+	if( ifindex == 0 )
+	{
+		printf( "unknown interface %s\n", device );
+		return NULL;
+	}
+
+	xsk = calloc( 1, sizeof( *xsk ));
+	if( xsk == NULL )
+		return NULL;
+	xsk->fd         = -1;
+	xsk->mapFd      = -1;
+	xsk->progFd     = -1;
+	xsk->linkFd     = -1;
+	xsk->frameCount = frameCount;
+
+	/* en kernels antiguos (antes de 5.11) la UMEM y los mapas cuentan contra
+	   RLIMIT_MEMLOCK; en los nuevos no hace falta, as que solo se avisa y
+	   el fallo de bpf() o de la UMEM ya no queda sin explicar */
+	if( setrlimit( RLIMIT_MEMLOCK, &rlim ) < 0 )
+		printf( "cannot raise RLIMIT_MEMLOCK: %s (older kernels may then fail to create the UMEM or the XDP map)\n",
+				strerror( errno ));
+
+	xsk->fd = socket( AF_XDP, SOCK_RAW, 0 );
+	if( xsk->fd < 0 )
+	{
+		printf( "AF_XDP socket err: %s\n", strerror( errno ));
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	if( setupUmem( xsk ) == -1 )
+	{
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	if( getsockopt( xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len ) < 0 )
+	{
+		printf( "XDP_MMAP_OFFSETS err: %s\n", strerror( errno ));
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	if( mapRing( xsk, &xsk->rx, &off.rx, frameCount, sizeof( struct xdp_desc ), XDP_PGOFF_RX_RING ) == -1  ||
+		mapRing( xsk, &xsk->fill, &off.fr, frameCount, sizeof( ui64 ), XDP_UMEM_PGOFF_FILL_RING ) == -1  ||
+		mapRing( xsk, &xsk->comp, &off.cr, XDP_COMP_RING_SIZE, sizeof( ui64 ), XDP_UMEM_PGOFF_COMPLETION_RING ) == -1 )
+	{
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	/* damos al kernel todas las tramas de la UMEM */
+	fillDesc = xsk->fill.desc;
+	for( i = 0; i < frameCount; i++ )
+		fillDesc[i] = (ui64)i * XDP_FRAME_SIZE;
+	__atomic_store_n( xsk->fill.producer, frameCount, __ATOMIC_RELEASE );
+
+	/* atamos el socket a la cola de la interfaz */
+	memset( &sxdp, 0, sizeof( sxdp ));
+	sxdp.sxdp_family   = AF_XDP;
+	sxdp.sxdp_flags    = XDP_USE_NEED_WAKEUP;
+	sxdp.sxdp_ifindex  = ifindex;
+	sxdp.sxdp_queue_id = queue;
+	if( bind( xsk->fd, (struct sockaddr *)&sxdp, sizeof( sxdp )) < 0 )
+	{
+		printf( "AF_XDP bind err: %s\n", strerror( errno ));
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	/* el resto de colas comparten el programa y la XSKMAP del primer socket */
+	if( master != NULL )
+	{
+		xsk->mapFd = dup( master->mapFd );
+		if( xsk->mapFd < 0 )
+		{
+			xdpClose( xsk );
+			return NULL;
+		}
+	}
+	/* cargamos el programa que redirige la cola a nuestro socket */
+	else if( loadProgram( xsk ) == -1  ||  attachProgram( xsk, ifindex ) == -1 )
+	{
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	memset( &attr, 0, sizeof( attr ));
+	attr.map_fd = xsk->mapFd;
+	attr.key    = (ui64)(unsigned long)&queue;
+	attr.value  = (ui64)(unsigned long)&xsk->fd;
+	attr.flags  = BPF_ANY;
+	if( sysBpf( BPF_MAP_UPDATE_ELEM, &attr ) < 0 )
+	{
+		printf( "XSKMAP update err: %s\n", strerror( errno ));
+		xdpClose( xsk );
+		return NULL;
+	}
+
+	return xsk;
+}
+
+/*-----------------------------------------------------------------------------
+ * xdpClose()
+ *---------------------------------------------------------------------------*/
+void xdpClose( struct xdpSocket *xsk )
+{
+	if( xsk == NULL )
+		return;
+
+	/* al cerrar el enlace se desengancha el programa de la interfaz */
+	if( xsk->linkFd >= 0 )
+		close( xsk->linkFd );
+	if( xsk->progFd >= 0 )
+		close( xsk->progFd );
+	if( xsk->mapFd >= 0 )
+		close( xsk->mapFd );
+
+	unmapRing( &xsk->rx );
+	unmapRing( &xsk->fill );
+	unmapRing( &xsk->comp );
+
+	if( xsk->fd >= 0 )
+		close( xsk->fd );
+	if( xsk->umem != NULL )
+		munmap( xsk->umem, xsk->umemSize );
+
+	free( xsk );
+}
+
+/*-----------------------------------------------------------------------------
+ * xdpReadBurst()
+ *---------------------------------------------------------------------------*/
+int xdpReadBurst( struct xdpSocket *xsk, struct frame *frames, int maxFrames )
+{
+	struct xdp_desc  *desc;
+	ui32              prod, avail;
+	ui64              now;
+	int               i, n;
+
+	assert( xsk != NULL );
+
+	prod  = __atomic_load_n( xsk->rx.producer, __ATOMIC_ACQUIRE );
+	avail = prod - xsk->rxCached;
+	n     = avail < (ui32)maxFrames ? (int)avail : maxFrames;
+
+	/* las tramas se leen directamente de la UMEM, con una marca de tiempo por rfaga */
+	now = n > 0 ? capGetTime() : 0;
+	for( i = 0; i < n; i++ )
+	{
+		desc = (struct xdp_desc *)xsk->rx.desc + (( xsk->rxCached + i ) & xsk->rx.mask );
+
+		frames[i].data   = xsk->umem + desc->addr;
+		frames[i].caplen = desc->len;
+		frames[i].len    = desc->len;
+		frames[i].tstamp = now;
+		frames[i].gsoSize = 0;
+		frames[i].bVlan   = FALSE;
+	}
+
+	__atomic_store_n( &xsk->rxCached, xsk->rxCached + n, __ATOMIC_RELAXED );	/* lo lee la interfaz */
+	xsk->pending  += n;
+
+	return n;
+}
+
+/*-----------------------------------------------------------------------------
+ * xdpReleaseBurst()
+ *---------------------------------------------------------------------------*/
+void xdpReleaseBurst( struct xdpSocket *xsk )
+{
+	struct xdp_desc  *desc;
+	ui64             *fillDesc = xsk->fill.desc;
+	ui32              cons, fillProd, i;
+
+	assert( xsk != NULL );
+
+	if( xsk->pending == 0 )
+		return;
+
+	/* devolvemos las tramas de la rfaga al anillo de relleno */
+	cons     = xsk->rxCached - xsk->pending;
+	fillProd = *xsk->fill.producer;
+	for( i = 0; i < xsk->pending; i++ )
+	{
+		desc = (struct xdp_desc *)xsk->rx.desc + (( cons + i ) & xsk->rx.mask );
+		fillDesc[( fillProd + i ) & xsk->fill.mask] = desc->addr & ~(ui64)( XDP_FRAME_SIZE - 1 );
+	}
+
+	__atomic_store_n( xsk->fill.producer, fillProd + xsk->pending, __ATOMIC_RELEASE );
+	__atomic_store_n( xsk->rx.consumer, xsk->rxCached, __ATOMIC_RELEASE );
+	xsk->pending = 0;
+
+	/* si el kernel se quedo sin tramas libres hay que despertarlo */
+	if( __atomic_load_n( xsk->fill.flags, __ATOMIC_ACQUIRE ) & XDP_RING_NEED_WAKEUP )
+		recvfrom( xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL );
+}
+
+/*-----------------------------------------------------------------------------
+ * xdpUpdateStats()
+ *---------------------------------------------------------------------------*/
+void xdpUpdateStats( struct xdpSocket *xsk, struct captureStats *st )
+{
+	struct xdp_statistics  xst;
+	socklen_t              len = sizeof( xst );
+
+	assert( xsk != NULL );
+	assert( st  != NULL );
+
+	/* al contrario que PACKET_STATISTICS, estos contadores no se ponen a cero */
+	if( getsockopt( xsk->fd, SOL_XDP, XDP_STATISTICS, &xst, &len ) < 0 )
+		return;
+
+	st->drops   = xst.rx_dropped + xst.rx_ring_full + xst.rx_invalid_descs;
+	st->freezes = xst.rx_fill_ring_empty_descs;
+	st->packets = __atomic_load_n( &xsk->rxCached, __ATOMIC_RELAXED ) + st->drops;
+}
+
+/****************************************************************************
+ * End of xdpCapture.c
+ ****************************************************************************/
@@ -0,0 +1,69 @@
+/****************************************************************************
+ * Module:  xdpCapture
+ *
+ ****************************************************************************/
+#ifndef _XDPCAPTURE_H_
+#define _XDPCAPTURE_H_
+
+#include "types.h"
+
+/** defines ******************************************************************/
+#define XDP_DEFAULT_FRAME_COUNT		4096	/* tramas de la UMEM */
+#define XDP_FRAME_SIZE				2048	/* tamao de cada trama de la UMEM */
+
+/** forward declarations *****************************************************/
+struct frame;
+struct captureStats;
+
+/** public types *************************************************************/
+/*******
+ * xdpRing
+ *******/
+struct xdpRing
+{
+	ui32				*producer;		/* ndices compartidos con el kernel */
+	ui32				*consumer;
+	ui32				*flags;
+	void				*desc;			/* descriptores (xdp_desc o direcciones de la UMEM) */
+	ui32				 mask;
+	void				*map;			/* zona mapeada */
+	ui32				 mapSize;
+};
+
+/*******
+ * xdpSocket
+ *******/
+struct xdpSocket
+{
+	int					 fd;			/* socket AF_XDP */
+	int					 mapFd;			/* XSKMAP con los sockets por cola */
+	int					 progFd;		/* programa XDP que redirige a la XSKMAP */
+	int					 linkFd;		/* enlace del programa a la interfaz */
+	uchar				 bGeneric;		/* TRUE si funcionamos en modo SKB (genrico) */
+
+	uchar				*umem;			/* zona de tramas compartida con el kernel */
+	ui32				 umemSize;
+	ui32				 frameCount;
+
+	struct xdpRing		 rx;			/* tramas recibidas */
+	struct xdpRing		 fill;			/* tramas libres que damos al kernel */
+	struct xdpRing		 comp;			/* completadas (no transmitimos, pero es obligatoria) */
+
+	ui32				 rxCached;		/* consumidor local del anillo rx */
+	ui32				 pending;		/* tramas de la rfaga an sin devolver */
+};
+
+/** public interface *********************************************************/
+struct xdpSocket *	xdpOpen( const char *device, ui32 queue, ui32 frameCount, const struct xdpSocket *master );
+void				xdpClose( struct xdpSocket *xsk );
+
+int					xdpReadBurst( struct xdpSocket *xsk, struct frame *frames, int maxFrames );
+void				xdpReleaseBurst( struct xdpSocket *xsk );
+
+void				xdpUpdateStats( struct xdpSocket *xsk, struct captureStats *st );
+
+
+#endif  /* _XDPCAPTURE_H_ */
+/****************************************************************************
+ * End of xdpCapture.h
+ ****************************************************************************/